@@ -29,11 +29,19 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <glib.h>
 
 
 #include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
 #include "lib/bluetooth/sdp.h"
 #include "lib/uuid.h"
 #include "lib/mgmt.h"
@@ -47,8 +55,11 @@
 
 #define IO_CAPABILITY_NOINPUTNOOUTPUT   0x03
 
+/* Output is binary frames rather than text lines, see cmd_binary() */
+static int bin_mode;
+
 #ifdef BLUEPY_DEBUG
-#define DBG(fmt, ...) do {printf("# %s() :" fmt "\n", __FUNCTION__, ##__VA_ARGS__); fflush(stdout); \
+#define DBG(fmt, ...) do {if (!bin_mode) {printf("# %s() :" fmt "\n", __FUNCTION__, ##__VA_ARGS__); fflush(stdout);} \
     } while(0)
 #else
 #ifdef BLUEPY_DEBUG_FILE_LOG
@@ -67,16 +78,9 @@ static void try_open(void) {
 #endif
 #endif
 
-static GIOChannel *iochannel = NULL;
-static GAttrib *attrib = NULL;
 static GMainLoop *event_loop;
 
-static gchar *opt_src = NULL;
-static gchar *opt_dst = NULL;
-static gchar *opt_dst_type = NULL;
-static gchar *opt_sec_level = NULL;
 static const int opt_psm = 0;
-static int opt_mtu = 0;
 static int start;
 static int end;
 
@@ -84,24 +88,65 @@ static uint16_t mgmt_ind = MGMT_INDEX_NONE;
 static struct mgmt *mgmt_master = NULL;
 
 struct characteristic_data {
+    struct conn *conn;
     uint16_t orig_start;
     uint16_t start;
     uint16_t end;
     bt_uuid_t uuid;
 };
 
+/* An unfiltered char or desc discovery, whose results are cached */
+struct discovery {
+    struct conn *conn;
+    uint16_t start;
+    uint16_t end;
+};
+
 static void cmd_help(int argcp, char **argvp);
 
-static enum state {
+enum state {
     STATE_DISCONNECTED=0,
     STATE_CONNECTING=1,
     STATE_CONNECTED=2,
-    STATE_SCANNING=3,
-} conn_state;
+};
+
+/*
+ * One peripheral connection. A command applies to connection 0 unless it
+ * is prefixed with "@<conn>", and every response about a connection
+ * carries its number in a "conn" field. Slots are never freed, so a late
+ * callback for a closed connection still points at valid memory.
+ */
+#define MAX_CONNS   64
+
+struct gatt_cache;
+
+static struct conn {
+    int id;
+    enum state state;
+    GIOChannel *io;
+    GAttrib *attrib;
+    gchar *src;
+    gchar *dst;
+    gchar *dst_type;
+    gchar *sec_level;
+    int mtu;
+    struct gatt_cache *cache;
+    gboolean no_read_multi;     /* the peer refused a Read Multiple */
+} conns[MAX_CONNS];
+
+/* The connection the current command applies to */
+static struct conn *cur;
+
+static bool scanning;
+
+/* Directory of the GATT discovery cache, NULL when there is none */
+static gchar *cache_dir;
+static unsigned int cache_hits, cache_misses;
 
 
 static const char 
   *tag_RESPONSE  = "rsp",
+  *tag_CONN      = "conn",
   *tag_ERRCODE   = "code",
   *tag_HANDLE    = "hnd",
   *tag_UUID      = "uuid",
@@ -117,7 +162,44 @@ static const char
   *tag_ADDR       = "addr",
   *tag_TYPE       = "type",
   *tag_RSSI       = "rssi",
-  *tag_FLAG       = "flag";
+  *tag_FLAG       = "flag",
+  *tag_PATH       = "path",
+  *tag_HITS       = "hits",
+  *tag_MISSES     = "misses",
+  *tag_INCL_HANDLE = "ihnd",
+  *tag_INCL_START = "istart",
+  *tag_INCL_END   = "iend",
+  *tag_INCL_UUID  = "iuuid",
+  *tag_CHAR_UUID  = "cuuid",
+  *tag_DESC_HANDLE = "dhnd",
+  *tag_DESC_UUID  = "duuid",
+  *tag_SEQ        = "seq",
+  *tag_DROPPED    = "drop",
+  *tag_SIZE       = "size",
+  *tag_MS         = "ms",
+  *tag_MAX        = "max",
+  *tag_COUNT      = "cnt",
+  *tag_RECEIVED   = "rcvd",
+  *tag_SENT       = "sent",
+  *tag_DEVICES    = "devs",
+  *tag_INTERVAL   = "intvl",
+  *tag_WINDOW     = "win",
+  *tag_DUP_FILTER = "dupf",
+  *tag_POLICY     = "policy",
+  *tag_DUTY       = "duty",
+  *tag_RATE       = "rate",
+  *tag_FIELDS     = "fields",
+  *tag_AD_FLAGS   = "adflags",
+  *tag_NAME       = "name",
+  *tag_NAME_SHORT = "nshort",
+  *tag_TX_POWER   = "txp",
+  *tag_APPEARANCE = "appear",
+  *tag_SERVICE    = "svc",
+  *tag_SOLICIT    = "sol",
+  *tag_SVC_DATA_UUID = "sdu",
+  *tag_SVC_DATA   = "sdd",
+  *tag_MFR        = "mfr",
+  *tag_MFR_DATA   = "mfd";
 
 static const char
   *rsp_ERROR     = "err",
@@ -127,9 +209,18 @@ static const char
   *rsp_DISCOVERY = "find",
   *rsp_DESCRIPTORS = "desc",
   *rsp_READ      = "rd",
+  *rsp_READ_MULTI = "rdm",
   *rsp_WRITE     = "wr",
   *rsp_MGMT      = "mgmt",
-  *rsp_SCAN      = "scan";
+  *rsp_SCAN      = "scan",
+  *rsp_BINARY    = "bin",
+  *rsp_CACHE     = "cache",
+  *rsp_DATABASE  = "db",
+  *rsp_STREAM    = "stream",
+  *rsp_NOTIFY_BATCH = "nbat",
+  *rsp_SCAN_FILTER = "scanfilter",
+  *rsp_LESCAN    = "lescan",
+  *rsp_SCAN_FIELDS = "scanfields";
 
 static const char
   *err_CONN_FAIL = "connfail",
@@ -139,6 +230,7 @@ static const char
   *err_BAD_CMD   = "badcmd",
   *err_BAD_PARAM = "badparam",
   *err_BAD_STATE = "badstate",
+  *err_NO_CONN   = "noconn",
   *err_BUSY      = "busy",
   *err_NO_MGMT   = "nomgmt",
   *err_SUCCESS   = "success";
@@ -149,49 +241,264 @@ static const char
   *st_CONNECTED    = "conn",
   *st_SCANNING    = "scan";
 
+/*
+ * Binary output
+ *
+ * After the "bin" command a response is one frame instead of one line:
+ *
+ *   frame := length:u32 field*       length counts the fields
+ *   field := kind:u8 taglen:u8 tag value
+ *   value := u32                     kind 'h'
+ *          | len:u16 bytes           kinds '$', '\'' and 'b'
+ *
+ * All integers are little-endian. The kinds and tags are those of the
+ * text protocol, so a frame decodes to the same fields as a line. Data is
+ * sent as raw bytes rather than hex.
+ *
+ * The small fields of a frame are gathered in bin_buf; larger data is
+ * referenced where it is, and the frame goes out with one writev(). So
+ * the data given to send_bytes() and send_data() must stay valid until
+ * resp_end(): free or reuse it only after the response is sent. Strings
+ * are copied, so send_sym() and send_str() may be given any buffer.
+ */
+#define BIN_SEGS        32
+#define BIN_REF_MIN     32
+
+static struct bin_seg {
+    const uint8_t *ext;         /* data referenced, or NULL for bin_buf */
+    size_t off;                 /* offset in bin_buf */
+    size_t len;
+} bin_segs[BIN_SEGS];
+static int bin_nsegs;
+static uint8_t *bin_buf;
+static size_t bin_len, bin_size;
+static size_t bin_frame_len;
+
+static void bin_put(const void *p, size_t n)
+{
+    struct bin_seg *s = &bin_segs[bin_nsegs - 1];
+
+    if (bin_len + n > bin_size) {
+        bin_size = MAX(bin_size * 2, bin_len + n);
+        bin_buf = g_realloc(bin_buf, bin_size);
+    }
+    memcpy(bin_buf + bin_len, p, n);
+    bin_len += n;
+    bin_frame_len += n;
+
+    if (s->ext) {
+        s++;
+        s->ext = NULL;
+        s->off = bin_len - n;
+        s->len = 0;
+        bin_nsegs++;
+    }
+    s->len += n;
+}
+
+/*
+ * Large data is left where it is until the frame is written, by bin_end()
+ * from resp_end(); p must not be freed or changed before then.
+ */
+static void bin_ref(const void *p, size_t n)
+{
+    struct bin_seg *s;
+
+    if (n < BIN_REF_MIN || bin_nsegs > BIN_SEGS - 2) {
+        bin_put(p, n);
+        return;
+    }
+    s = &bin_segs[bin_nsegs++];
+    s->ext = p;
+    s->off = 0;
+    s->len = n;
+    bin_frame_len += n;
+}
+
+static void bin_field(char kind, const char *tag)
+{
+    uint8_t hdr[2];
+
+    hdr[0] = kind;
+    hdr[1] = strlen(tag);
+    bin_put(hdr, sizeof(hdr));
+    bin_put(tag, hdr[1]);
+}
+
+static void bin_value(char kind, const char *tag, const void *val, size_t len)
+{
+    uint8_t le[2];
+
+    len = MIN(len, 0xFFFF);
+    bin_field(kind, tag);
+    bt_put_le16(len, le);
+    bin_put(le, sizeof(le));
+    /* Strings are often formatted on the stack, so only bytes are kept */
+    if (kind == 'b')
+        bin_ref(val, len);
+    else
+        bin_put(val, len);
+}
+
+static void bin_begin(void)
+{
+    uint8_t len[4] = { 0 };
+
+    bin_len = 0;
+    bin_nsegs = 1;
+    bin_segs[0].ext = NULL;
+    bin_segs[0].off = 0;
+    bin_segs[0].len = 0;
+    bin_put(len, sizeof(len));
+    bin_frame_len = 0;
+}
+
+static void bin_end(void)
+{
+    struct iovec iov[BIN_SEGS];
+    struct iovec *v = iov;
+    int i, n = bin_nsegs;
+    ssize_t w;
+
+    bt_put_le32(bin_frame_len, bin_buf);
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = bin_segs[i].ext ? (void *)bin_segs[i].ext :
+                                            bin_buf + bin_segs[i].off;
+        iov[i].iov_len = bin_segs[i].len;
+    }
+
+    while (n > 0) {
+        w = writev(STDOUT_FILENO, v, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            DBG("writev failed: %s", strerror(errno));
+            return;
+        }
+        while (n > 0 && (size_t)w >= v->iov_len) {
+            w -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (uint8_t *)v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+}
+
+static void stream_flush(gboolean wait);
+
 static void resp_begin(const char *rsptype)
 {
+  /*
+   * Notifications queued before this response go first. The response is
+   * written blocking anyway, so this waits for stdout too.
+   */
+  stream_flush(TRUE);
+
+  if (bin_mode) {
+    bin_begin();
+    bin_value('$', tag_RESPONSE, rsptype, strlen(rsptype));
+    return;
+  }
   printf("%s=$%s", tag_RESPONSE, rsptype);
 }
 
 static void send_sym(const char *tag, const char *val)
 {
+  if (bin_mode) {
+    bin_value('$', tag, val, strlen(val));
+    return;
+  }
   printf(" %s=$%s", tag, val);
 }
 
 static void send_uint(const char *tag, unsigned int val)
 {
+  if (bin_mode) {
+    uint8_t le[4];
+
+    bt_put_le32(val, le);
+    bin_field('h', tag);
+    bin_put(le, sizeof(le));
+    return;
+  }
   printf(" %s=h%X", tag, val);
 }
 
 static void send_str(const char *tag, const char *val)
 {
+  if (bin_mode) {
+    if (!val)
+      val = "";
+    bin_value('\'', tag, val, strlen(val));
+    return;
+  }
   //!!FIXME
   printf(" %s='%s", tag, val);
 }
 
-static void send_data(const unsigned char *val, size_t len)
+static void send_bytes(const char *tag, const unsigned char *val, size_t len)
 {
-  printf(" %s=b", tag_DATA);
+  if (bin_mode) {
+    bin_value('b', tag, val, len);
+    return;
+  }
+  printf(" %s=b", tag);
   while ( len-- > 0 )
     printf("%02X", *val++);
 }
 
+static void send_data(const unsigned char *val, size_t len)
+{
+  send_bytes(tag_DATA, val, len);
+}
+
 static void send_addr(const struct mgmt_addr_info *addr)
 {
     const uint8_t *val = addr->bdaddr.b;
-    printf(" %s=b", tag_ADDR);
     int len = 6;
-    /* Human-readable byte order is reverse of bdaddr.b */
-    while ( len-- > 0 )
-        printf("%02X", val[len]);
+
+    if (bin_mode) {
+        uint8_t be[6];
+
+        /* Human-readable byte order is reverse of bdaddr.b */
+        while ( len-- > 0 )
+            be[5 - len] = val[len];
+        bin_value('b', tag_ADDR, be, sizeof(be));
+    } else {
+        printf(" %s=b", tag_ADDR);
+        /* Human-readable byte order is reverse of bdaddr.b */
+        while ( len-- > 0 )
+            printf("%02X", val[len]);
+    }
 
     send_uint(tag_TYPE, addr->type);
 }
 
 static void resp_end()
 {
+  if (bin_mode) {
+    bin_end();
+    return;
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+/* A comment line for humans; bluepy skips them, binary mode drops them */
+static void resp_comment(const char *fmt, ...)
+{
+  va_list ap;
+
+  if (bin_mode)
+    return;
+  va_start(ap, fmt);
+  printf("# ");
+  vprintf(fmt, ap);
   printf("\n");
+  va_end(ap);
   fflush(stdout);
 }
 
@@ -209,1146 +516,3949 @@ static void resp_mgmt(const char *errcode)
   resp_end();
 }
 
-static void cmd_status(int argcp, char **argvp)
+static void conn_begin(const struct conn *conn, const char *rsptype)
+{
+  resp_begin(rsptype);
+  send_uint(tag_CONN, conn->id);
+}
+
+static void conn_error(const struct conn *conn, const char *errcode)
+{
+  conn_begin(conn, rsp_ERROR);
+  send_sym(tag_ERRCODE, errcode);
+  resp_end();
+}
+
+/*
+ * Notification streaming, for "stream"
+ *
+ * Notifications are queued instead of sent one response each, and go out
+ * together as one "nbat" response when stream_size bytes are queued, or
+ * stream_ms after the first. Each batch has the sequence number of its
+ * first notification, counting all since streaming began, and the number
+ * dropped so far: when the reader falls behind, the batch stays queued
+ * rather than block every connection, and notifications that would take
+ * the queue past stream_max are dropped. Indications are not queued.
+ * Any other response first flushes the queue, waiting for the reader if
+ * it must, so nothing is sent out of order.
+ */
+#define STREAM_REC_HDR  5       /* conn:u8 handle:u16 len:u16, then data */
+
+static GByteArray *stream_q;    /* NULL when not streaming */
+static guint stream_size, stream_ms, stream_max;
+static guint stream_timer;
+static unsigned int stream_seq, stream_first, stream_dropped;
+static gboolean stream_busy;
+
+static void stream_flush(gboolean wait)
+{
+    struct pollfd pfd = { .fd = STDOUT_FILENO, .events = POLLOUT };
+    guint pos, n;
+
+    if (!stream_q || stream_q->len == 0 || stream_busy)
+        return;
+    if (!wait && poll(&pfd, 1, 0) == 0)
+        return;
+
+    stream_busy = TRUE;
+    resp_begin(rsp_NOTIFY_BATCH);
+    send_uint(tag_SEQ, stream_first);
+    send_uint(tag_DROPPED, stream_dropped);
+    for (pos = 0; pos < stream_q->len; pos += STREAM_REC_HDR + n) {
+        const uint8_t *rec = stream_q->data + pos;
+
+        n = bt_get_le16(rec + 3);
+        send_uint(tag_CONN, rec[0]);
+        send_uint(tag_HANDLE, bt_get_le16(rec + 1));
+        send_data(rec + STREAM_REC_HDR, n);
+    }
+    resp_end();
+    g_byte_array_set_size(stream_q, 0);
+    stream_busy = FALSE;
+
+    if (stream_timer) {
+        g_source_remove(stream_timer);
+        stream_timer = 0;
+    }
+}
+
+static gboolean stream_timeout(gpointer user_data)
+{
+    stream_timer = 0;
+    stream_flush(FALSE);
+    if (stream_q->len > 0)
+        stream_timer = g_timeout_add(stream_ms, stream_timeout, NULL);
+    return FALSE;
+}
+
+static void stream_put(const struct conn *conn, uint16_t handle,
+                       const uint8_t *val, size_t len)
+{
+    uint8_t hdr[STREAM_REC_HDR];
+
+    if (stream_q->len + sizeof(hdr) + len > stream_max) {
+        stream_seq++;
+        stream_dropped++;
+        return;
+    }
+    if (stream_q->len == 0)
+        stream_first = stream_seq;
+    stream_seq++;
+
+    hdr[0] = conn->id;
+    bt_put_le16(handle, hdr + 1);
+    bt_put_le16(len, hdr + 3);
+    g_byte_array_append(stream_q, hdr, sizeof(hdr));
+    g_byte_array_append(stream_q, val, len);
+
+    if (stream_q->len >= stream_size)
+        stream_flush(FALSE);
+    if (stream_q->len > 0 && !stream_timer)
+        stream_timer = g_timeout_add(stream_ms, stream_timeout, NULL);
+}
+
+static void conn_status(const struct conn *conn)
 {
-  resp_begin(rsp_STATUS);
-  switch(conn_state)
+  conn_begin(conn, rsp_STATUS);
+  switch(conn->state)
   {
     case STATE_CONNECTING:
       send_sym(tag_CONNSTATE, st_CONNECTING);
-      send_str(tag_DEVICE, opt_dst);
+      send_str(tag_DEVICE, conn->dst);
       break;
 
     case STATE_CONNECTED:
       send_sym(tag_CONNSTATE, st_CONNECTED);
-      send_str(tag_DEVICE, opt_dst);
-      break;
-
-    case STATE_SCANNING:
-      send_sym(tag_CONNSTATE, st_SCANNING);
-      send_str(tag_DEVICE, opt_dst);
+      send_str(tag_DEVICE, conn->dst);
       break;
 
     default:
-      send_sym(tag_CONNSTATE, st_DISCONNECTED);
+      send_sym(tag_CONNSTATE, scanning ? st_SCANNING : st_DISCONNECTED);
       break;
   }
 
-  send_uint(tag_MTU, opt_mtu);
-  send_str(tag_SEC_LEVEL, opt_sec_level);
+  send_uint(tag_MTU, conn->mtu);
+  send_str(tag_SEC_LEVEL, conn->sec_level);
   resp_end();
 }
 
-static void set_state(enum state st)
+static void cmd_status(int argcp, char **argvp)
 {
-    conn_state = st;
-    cmd_status(0, NULL);
+  conn_status(cur);
 }
 
-static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static void set_state(struct conn *conn, enum state st)
 {
-    uint8_t *opdu;
-    uint8_t evt;
-    uint16_t handle, olen;
-    size_t plen;
+    conn->state = st;
+    conn_status(conn);
+}
 
-    evt = pdu[0];
+static struct conn *conn_by_io(GIOChannel *io)
+{
+    int i;
 
-    if ( evt != ATT_OP_HANDLE_NOTIFY && evt != ATT_OP_HANDLE_IND )
-    {
-        printf("#Invalid opcode %02X in event handler??\n", evt);
-        return;
-    }
+    for (i = 0; i < MAX_CONNS; i++)
+        if (conns[i].io == io)
+            return &conns[i];
+    return NULL;
+}
 
-    assert( len >= 3 );
-    handle = bt_get_le16(&pdu[1]);
+/*
+ * GATT discovery cache
+ *
+ * With a cache directory set (the "cache" command), the services,
+ * characteristics and descriptors discovered on a peer are kept in
+ * <dir>/<address>.gatt, and discovery commands that the stored table
+ * covers are answered from it with no ATT traffic. The Database Hash is
+ * read on connection, before the state goes to "conn"; an entry whose
+ * hash differs is dropped. Peers without a Database Hash are trusted to
+ * indicate Service Changed, which is enabled on reconnection and drops
+ * the entry too.
+ *
+ * The file is little-endian:
+ *
+ *   "BPGC" version:u8 flags:u8 hash[16]
+ *   n:u16 { start:u16 end:u16 uuid[16] }                  services
+ *   n:u16 { start:u16 end:u16 }                           ranges searched
+ *   n:u16 { handle:u16 props:u8 vhnd:u16 uuid[16] }        for these chars
+ *   n:u16 { start:u16 end:u16 }                           ranges searched
+ *   n:u16 { handle:u16 uuid[16] }                         for these descs
+ *   n:u16 { handle:u16 start:u16 end:u16 uuid[16] }       includes
+ *
+ * UUIDs are 128-bit and big-endian, as bt_uuid_t holds them. Included
+ * services are only looked for, and kept, by "discall".
+ */
+#define CACHE_MAGIC         "BPGC"
+#define CACHE_VERSION       2
+#define CACHE_HAVE_HASH     0x01
+#define CACHE_HAVE_SVCS     0x02
+#define CACHE_HAVE_INCLS    0x04
 
-    resp_begin( evt==ATT_OP_HANDLE_NOTIFY ? rsp_NOTIFY : rsp_IND );
-    send_uint( tag_HANDLE, handle );
-    send_data( pdu+3, len-3 );
-    resp_end();
+#define GATT_DB_HASH_UUID   0x2B2A
 
-    if (evt == ATT_OP_HANDLE_NOTIFY)
-        return;
+/*
+ * The UUIDs are kept as text too, since binary frames refer to the
+ * strings sent until the frame is written.
+ */
+struct cache_svc {
+    uint16_t start;
+    uint16_t end;
+    uint8_t uuid[16];
+    char str[MAX_LEN_UUID_STR + 1];
+};
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_confirmation(opdu, plen);
+struct cache_chr {
+    uint16_t handle;
+    uint16_t vhnd;
+    uint8_t props;
+    uint8_t uuid[16];
+    char str[MAX_LEN_UUID_STR + 1];
+};
 
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
-}
+struct cache_dsc {
+    uint16_t handle;
+    uint8_t uuid[16];
+    char str[MAX_LEN_UUID_STR + 1];
+};
 
-static void gatts_find_info_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
-{
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t starting_handle, olen;
-    size_t plen;
+struct cache_incl {
+    uint16_t handle;
+    uint16_t start;
+    uint16_t end;
+    uint8_t uuid[16];
+    char str[MAX_LEN_UUID_STR + 1];
+};
 
-    assert( len == 5 );
-    opcode = pdu[0];
-    starting_handle = bt_get_le16(&pdu[1]);
-    /* ending_handle = bt_get_le16(&pdu[3]); */
+struct cache_range {
+    uint16_t start;
+    uint16_t end;
+};
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
-}
+struct gatt_cache {
+    gchar *path;
+    gboolean have_hash;
+    uint8_t hash[16];
+    gboolean have_svcs;
+    GArray *svcs;           /* struct cache_svc, by start */
+    GArray *chr_ranges;     /* struct cache_range, merged */
+    GArray *chrs;           /* struct cache_chr, by handle */
+    GArray *dsc_ranges;
+    GArray *dscs;           /* struct cache_dsc, by handle */
+    gboolean have_incls;
+    GArray *incls;          /* struct cache_incl */
+};
 
-static void gatts_find_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+/* A table for dst, or with dst NULL one that is never saved */
+static struct gatt_cache *cache_new(const char *dst)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t starting_handle, olen;
-    size_t plen;
+    struct gatt_cache *c = g_new0(struct gatt_cache, 1);
+    gchar *name, *p;
+
+    if (dst) {
+        /* The address is a file name; a unix socket path is flattened */
+        name = g_strdup_printf("%s.gatt", dst);
+        for (p = name; *p; p++)
+            if (*p == '/')
+                *p = '_';
+        c->path = g_build_filename(cache_dir, name, NULL);
+        g_free(name);
+    }
 
-    assert( len >= 7 );
-    opcode = pdu[0];
-    starting_handle = bt_get_le16(&pdu[1]);
-    /* ending_handle = bt_get_le16(&pdu[3]); */
-    /* att_type = bt_get_le16(&pdu[5]); */
+    c->svcs = g_array_new(FALSE, FALSE, sizeof(struct cache_svc));
+    c->chr_ranges = g_array_new(FALSE, FALSE, sizeof(struct cache_range));
+    c->chrs = g_array_new(FALSE, FALSE, sizeof(struct cache_chr));
+    c->dsc_ranges = g_array_new(FALSE, FALSE, sizeof(struct cache_range));
+    c->dscs = g_array_new(FALSE, FALSE, sizeof(struct cache_dsc));
+    c->incls = g_array_new(FALSE, FALSE, sizeof(struct cache_incl));
+    return c;
+}
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+static void cache_clear(struct gatt_cache *c)
+{
+    c->have_svcs = FALSE;
+    g_array_set_size(c->svcs, 0);
+    g_array_set_size(c->chr_ranges, 0);
+    g_array_set_size(c->chrs, 0);
+    g_array_set_size(c->dsc_ranges, 0);
+    g_array_set_size(c->dscs, 0);
+    c->have_incls = FALSE;
+    g_array_set_size(c->incls, 0);
 }
 
-static void gatts_read_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static void cache_free(struct gatt_cache *c)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t starting_handle, olen;
-    size_t plen;
+    if (!c)
+        return;
+    g_array_free(c->svcs, TRUE);
+    g_array_free(c->chr_ranges, TRUE);
+    g_array_free(c->chrs, TRUE);
+    g_array_free(c->dsc_ranges, TRUE);
+    g_array_free(c->dscs, TRUE);
+    g_array_free(c->incls, TRUE);
+    g_free(c->path);
+    g_free(c);
+}
 
-    assert( len == 7 || len == 21 );
-    opcode = pdu[0];
-    starting_handle = bt_get_le16(&pdu[1]);
-    /* ending_handle = bt_get_le16(&pdu[3]); */
-    if (len == 7) {
-        /* att_type = bt_get_le16(&pdu[5]); */
-    }
+static void cache_uuid_from_str(const char *str, uint8_t *out)
+{
+    bt_uuid_t uuid, uuid128;
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+    memset(out, 0, 16);
+    if (bt_string_to_uuid(&uuid, str) < 0)
+        return;
+    bt_uuid_to_uuid128(&uuid, &uuid128);
+    memcpy(out, &uuid128.value.u128, 16);
 }
 
-static void gatts_read_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static void cache_uuid_to_str(const uint8_t *in, char *str, size_t n)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t handle, olen;
-    size_t plen;
+    bt_uuid_t uuid;
 
-    assert( len == 3 );
-    opcode = pdu[0];
-    handle = bt_get_le16(&pdu[1]);
+    uuid.type = BT_UUID128;
+    memcpy(&uuid.value.u128, in, 16);
+    bt_uuid_to_string(&uuid, str, n);
+}
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+static int cache_uuid_is16(const uint8_t *in, uint16_t uuid16)
+{
+    bt_uuid_t uuid, uuid128;
+
+    bt_uuid16_create(&uuid, uuid16);
+    bt_uuid_to_uuid128(&uuid, &uuid128);
+    return memcmp(in, &uuid128.value.u128, 16) == 0;
 }
 
-static void gatts_read_blob_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+/* Adds start..end to a list of searched ranges, merging neighbours */
+static void cache_range_add(GArray *ranges, uint16_t start, uint16_t end)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t handle, olen;
-    size_t plen;
+    struct cache_range r = { start, end };
+    guint i = 0;
 
-    assert( len == 5 );
-    opcode = pdu[0];
-    handle = bt_get_le16(&pdu[1]);
-    /* offset = bt_get_le16(&pdu[3]); */
+    while (i < ranges->len) {
+        struct cache_range *o = &g_array_index(ranges, struct cache_range, i);
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        if ((uint32_t) o->end + 1 < r.start || (uint32_t) r.end + 1 < o->start) {
+            i++;
+            continue;
+        }
+        r.start = MIN(r.start, o->start);
+        r.end = MAX(r.end, o->end);
+        g_array_remove_index(ranges, i);
+    }
+
+    for (i = 0; i < ranges->len; i++)
+        if (g_array_index(ranges, struct cache_range, i).start > r.start)
+            break;
+    g_array_insert_val(ranges, i, r);
 }
 
-static void gatts_read_multi_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static gboolean cache_range_covers(GArray *ranges, uint16_t start, uint16_t end)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t handle1, olen;
-    size_t plen;
+    guint i;
 
-    assert( len >= 5 );
-    opcode = pdu[0];
-    handle1 = bt_get_le16(&pdu[1]);
-    /* handle2 = bt_get_le16(&pdu[3]); */
+    for (i = 0; i < ranges->len; i++) {
+        struct cache_range *o = &g_array_index(ranges, struct cache_range, i);
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, handle1, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        if (o->start <= start && end <= o->end)
+            return TRUE;
+    }
+    return FALSE;
 }
 
-static void gatts_read_by_group_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static void put16(GByteArray *b, uint16_t v)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t starting_handle, olen;
-    size_t plen;
+    uint8_t le[2];
 
-    assert( len >= 7 );
-    opcode = pdu[0];
-    starting_handle = bt_get_le16(&pdu[1]);
-    /* ending_handle = bt_get_le16(&pdu[3]); */
-    /* att_group_type = bt_get_le16(&pdu[5]); */
-
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+    bt_put_le16(v, le);
+    g_byte_array_append(b, le, sizeof(le));
 }
 
-static void gatts_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static void cache_save(struct gatt_cache *c)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t handle, olen;
-    size_t plen;
+    GByteArray *b;
+    GError *gerr = NULL;
+    uint8_t hdr[2];
+    guint i;
 
-    assert( len >= 3 );
-    opcode = pdu[0];
-    handle = bt_get_le16(&pdu[1]);
+    if (!c->path)
+        return;
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
-}
+    b = g_byte_array_new();
+    g_byte_array_append(b, (const guint8 *) CACHE_MAGIC, 4);
+    hdr[0] = CACHE_VERSION;
+    hdr[1] = (c->have_hash ? CACHE_HAVE_HASH : 0) |
+                (c->have_svcs ? CACHE_HAVE_SVCS : 0) |
+                (c->have_incls ? CACHE_HAVE_INCLS : 0);
+    g_byte_array_append(b, hdr, sizeof(hdr));
+    g_byte_array_append(b, c->hash, sizeof(c->hash));
+
+    put16(b, c->svcs->len);
+    for (i = 0; i < c->svcs->len; i++) {
+        struct cache_svc *s = &g_array_index(c->svcs, struct cache_svc, i);
+
+        put16(b, s->start);
+        put16(b, s->end);
+        g_byte_array_append(b, s->uuid, 16);
+    }
 
-static void gatts_write_cmd(const uint8_t *pdu, uint16_t len, gpointer user_data)
-{
-    assert( len >= 3 );
-    /* opcode = pdu[0]; */
-    /* handle = bt_get_le16(&pdu[1]); */
-}
+    put16(b, c->chr_ranges->len);
+    for (i = 0; i < c->chr_ranges->len; i++) {
+        struct cache_range *r = &g_array_index(c->chr_ranges, struct cache_range, i);
 
-static void gatts_signed_write_cmd(const uint8_t *pdu, uint16_t len, gpointer user_data)
-{
-    assert( len >= 15 );
-    /* opcode = pdu[0]; */
-    /* handle = bt_get_le16(&pdu[1]); */
+        put16(b, r->start);
+        put16(b, r->end);
+    }
+    put16(b, c->chrs->len);
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
+
+        put16(b, ch->handle);
+        g_byte_array_append(b, &ch->props, 1);
+        put16(b, ch->vhnd);
+        g_byte_array_append(b, ch->uuid, 16);
+    }
+
+    put16(b, c->dsc_ranges->len);
+    for (i = 0; i < c->dsc_ranges->len; i++) {
+        struct cache_range *r = &g_array_index(c->dsc_ranges, struct cache_range, i);
+
+        put16(b, r->start);
+        put16(b, r->end);
+    }
+    put16(b, c->dscs->len);
+    for (i = 0; i < c->dscs->len; i++) {
+        struct cache_dsc *d = &g_array_index(c->dscs, struct cache_dsc, i);
+
+        put16(b, d->handle);
+        g_byte_array_append(b, d->uuid, 16);
+    }
+
+    put16(b, c->incls->len);
+    for (i = 0; i < c->incls->len; i++) {
+        struct cache_incl *in = &g_array_index(c->incls, struct cache_incl, i);
+
+        put16(b, in->handle);
+        put16(b, in->start);
+        put16(b, in->end);
+        g_byte_array_append(b, in->uuid, 16);
+    }
+
+    /* Written to a temporary file and renamed, so never half there */
+    if (!g_file_set_contents(c->path, (const gchar *) b->data, b->len, &gerr)) {
+        DBG("cache %s: %s", c->path, gerr->message);
+        g_error_free(gerr);
+    }
+    g_byte_array_free(b, TRUE);
 }
 
-static void gatts_prep_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
-{
-    uint8_t *opdu;
-    uint8_t opcode, handle;
-    uint16_t olen;
-    size_t plen;
+struct cache_reader {
+    const uint8_t *p;
+    size_t left;
+};
 
-    assert( len >= 5 );
-    opcode = pdu[0];
-    handle = bt_get_le16(&pdu[1]);
-    /* offset = bt_get_le16(&pdu[3]); */
+static const uint8_t *get_bytes(struct cache_reader *r, size_t n)
+{
+    const uint8_t *p = r->p;
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+    if (r->left < n)
+        return NULL;
+    r->p += n;
+    r->left -= n;
+    return p;
 }
 
-static void gatts_exec_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+static int get16(struct cache_reader *r, uint16_t *v)
 {
-    uint8_t *opdu;
-    uint8_t opcode;
-    uint16_t olen;
-    size_t plen;
+    const uint8_t *p = get_bytes(r, 2);
 
-    assert( len == 5 );
-    opcode = pdu[0];
-    /* flags = pdu[1]; */
+    if (!p)
+        return -1;
+    *v = bt_get_le16(p);
+    return 0;
+}
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
-    olen = enc_error_resp(opcode, 0, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
-    if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+static int get_ranges(struct cache_reader *r, GArray *ranges)
+{
+    uint16_t n;
+    struct cache_range cr;
+
+    if (get16(r, &n) < 0)
+        return -1;
+    while (n--) {
+        if (get16(r, &cr.start) < 0 || get16(r, &cr.end) < 0)
+            return -1;
+        g_array_append_val(ranges, cr);
+    }
+    return 0;
 }
 
-static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
+/* Reads the stored entry; FALSE, with the table empty, if there is none */
+static gboolean cache_load(struct gatt_cache *c)
 {
-    uint16_t mtu;
-    uint16_t cid;
-    GError *gerr = NULL;
+    struct cache_reader r;
+    const uint8_t *p;
+    gchar *data;
+    gsize len;
+    uint16_t n;
 
-    DBG("io = %p, err = %p", io, err);
-    if (err) {
-        DBG("err = %s", err->message);
-        set_state(STATE_DISCONNECTED);
-        resp_error(err_CONN_FAIL);
-        printf("# Connect error: %s\n", err->message);
-        return;
+    if (!g_file_get_contents(c->path, &data, &len, NULL))
+        return FALSE;
+
+    r.p = (const uint8_t *) data;
+    r.left = len;
+
+    p = get_bytes(&r, 6);
+    if (!p || memcmp(p, CACHE_MAGIC, 4) || p[4] != CACHE_VERSION)
+        goto bad;
+    c->have_hash = !!(p[5] & CACHE_HAVE_HASH);
+    c->have_svcs = !!(p[5] & CACHE_HAVE_SVCS);
+    c->have_incls = !!(p[5] & CACHE_HAVE_INCLS);
+    p = get_bytes(&r, 16);
+    if (!p)
+        goto bad;
+    memcpy(c->hash, p, 16);
+
+    if (get16(&r, &n) < 0)
+        goto bad;
+    while (n--) {
+        struct cache_svc s;
+
+        if (get16(&r, &s.start) < 0 || get16(&r, &s.end) < 0 ||
+                !(p = get_bytes(&r, 16)))
+            goto bad;
+        memcpy(s.uuid, p, 16);
+        cache_uuid_to_str(s.uuid, s.str, sizeof(s.str));
+        g_array_append_val(c->svcs, s);
     }
 
-    bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &mtu,
-                BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
+    if (get_ranges(&r, c->chr_ranges) < 0 || get16(&r, &n) < 0)
+        goto bad;
+    while (n--) {
+        struct cache_chr ch;
+
+        if (get16(&r, &ch.handle) < 0 || !(p = get_bytes(&r, 1)))
+            goto bad;
+        ch.props = *p;
+        if (get16(&r, &ch.vhnd) < 0 || !(p = get_bytes(&r, 16)))
+            goto bad;
+        memcpy(ch.uuid, p, 16);
+        cache_uuid_to_str(ch.uuid, ch.str, sizeof(ch.str));
+        g_array_append_val(c->chrs, ch);
+    }
 
-    if (gerr) {
-        printf("# Can't detect MTU, using default");
-        g_error_free(gerr);
-        mtu = ATT_DEFAULT_LE_MTU;
+    if (get_ranges(&r, c->dsc_ranges) < 0 || get16(&r, &n) < 0)
+        goto bad;
+    while (n--) {
+        struct cache_dsc d;
+
+        if (get16(&r, &d.handle) < 0 || !(p = get_bytes(&r, 16)))
+            goto bad;
+        memcpy(d.uuid, p, 16);
+        cache_uuid_to_str(d.uuid, d.str, sizeof(d.str));
+        g_array_append_val(c->dscs, d);
     }
-    else if (cid == ATT_CID)
-        mtu = ATT_DEFAULT_LE_MTU;
 
-    attrib = g_attrib_new(iochannel, mtu);
+    if (get16(&r, &n) < 0)
+        goto bad;
+    while (n--) {
+        struct cache_incl in;
+
+        if (get16(&r, &in.handle) < 0 || get16(&r, &in.start) < 0 ||
+                get16(&r, &in.end) < 0 || !(p = get_bytes(&r, 16)))
+            goto bad;
+        memcpy(in.uuid, p, 16);
+        cache_uuid_to_str(in.uuid, in.str, sizeof(in.str));
+        g_array_append_val(c->incls, in);
+    }
 
-    g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
-                        events_handler, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES,
-                        events_handler, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_FIND_INFO_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_find_info_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_FIND_BY_TYPE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_find_by_type_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_READ_BY_TYPE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_by_type_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_READ_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_READ_BLOB_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_blob_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_READ_MULTI_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_multi_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_READ_BY_GROUP_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_by_group_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_WRITE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_write_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_WRITE_CMD, GATTRIB_ALL_HANDLES,
-                      gatts_write_cmd, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_SIGNED_WRITE_CMD, GATTRIB_ALL_HANDLES,
-                      gatts_signed_write_cmd, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_PREP_WRITE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_prep_write_req, attrib, NULL);
-    g_attrib_register(attrib, ATT_OP_EXEC_WRITE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_exec_write_req, attrib, NULL);
+    if (r.left)
+        goto bad;
+    g_free(data);
+    return TRUE;
 
-    set_state(STATE_CONNECTED);
+bad:
+    DBG("cache %s: bad file", c->path);
+    g_free(data);
+    cache_clear(c);
+    return FALSE;
 }
 
-static void disconnect_io()
+static void cache_drop(struct gatt_cache *c)
 {
-    if (conn_state == STATE_DISCONNECTED)
-        return;
-
-    g_attrib_unref(attrib);
-    attrib = NULL;
-    opt_mtu = 0;
-
-    g_io_channel_shutdown(iochannel, FALSE, NULL);
-    g_io_channel_unref(iochannel);
-    iochannel = NULL;
-
-    set_state(STATE_DISCONNECTED);
+    cache_clear(c);
+    unlink(c->path);
 }
 
-static void primary_all_cb(uint8_t status, GSList *services, void *user_data)
+static void cache_put_svcs(struct gatt_cache *c, GSList *services)
 {
     GSList *l;
 
-    if (status) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
-    }
-
-    resp_begin(rsp_DISCOVERY);
+    g_array_set_size(c->svcs, 0);
     for (l = services; l; l = l->next) {
         struct gatt_primary *prim = l->data;
-        send_uint(tag_RANGE_START, prim->range.start);
-        send_uint(tag_RANGE_END, prim->range.end);
-        send_str(tag_UUID, prim->uuid);
-    }
-    resp_end();
+        struct cache_svc s;
 
+        s.start = prim->range.start;
+        s.end = prim->range.end;
+        cache_uuid_from_str(prim->uuid, s.uuid);
+        cache_uuid_to_str(s.uuid, s.str, sizeof(s.str));
+        g_array_append_val(c->svcs, s);
+    }
+    c->have_svcs = TRUE;
+    cache_save(c);
 }
 
-static void primary_by_uuid_cb(uint8_t status, GSList *ranges, void *user_data)
+static void cache_put_chrs(struct gatt_cache *c, uint16_t start, uint16_t end,
+                            GSList *characteristics)
 {
     GSList *l;
+    guint i;
 
-    if (status) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
-    }
+    for (i = 0; i < c->chrs->len; )
+        if (start <= g_array_index(c->chrs, struct cache_chr, i).handle &&
+                g_array_index(c->chrs, struct cache_chr, i).handle <= end)
+            g_array_remove_index(c->chrs, i);
+        else
+            i++;
 
-    resp_begin(rsp_DISCOVERY);
-    for (l = ranges; l; l = l->next) {
-        struct att_range *range = l->data;
-        send_uint(tag_RANGE_START, range->start);
-        send_uint(tag_RANGE_END, range->end);
+    for (l = characteristics; l; l = l->next) {
+        struct gatt_char *chars = l->data;
+        struct cache_chr ch;
+
+        ch.handle = chars->handle;
+        ch.props = chars->properties;
+        ch.vhnd = chars->value_handle;
+        cache_uuid_from_str(chars->uuid, ch.uuid);
+        cache_uuid_to_str(ch.uuid, ch.str, sizeof(ch.str));
+
+        for (i = 0; i < c->chrs->len; i++)
+            if (g_array_index(c->chrs, struct cache_chr, i).handle > ch.handle)
+                break;
+        g_array_insert_val(c->chrs, i, ch);
     }
-    resp_end();
+    cache_range_add(c->chr_ranges, start, end);
+    cache_save(c);
 }
 
-static void included_cb(uint8_t status, GSList *includes, void *user_data)
+static void cache_put_dscs(struct gatt_cache *c, uint16_t start, uint16_t end,
+                            GSList *descriptors)
 {
     GSList *l;
+    guint i;
 
-    if (status) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
+    for (i = 0; i < c->dscs->len; )
+        if (start <= g_array_index(c->dscs, struct cache_dsc, i).handle &&
+                g_array_index(c->dscs, struct cache_dsc, i).handle <= end)
+            g_array_remove_index(c->dscs, i);
+        else
+            i++;
+
+    for (l = descriptors; l; l = l->next) {
+        struct gatt_desc *desc = l->data;
+        struct cache_dsc d;
+
+        d.handle = desc->handle;
+        cache_uuid_from_str(desc->uuid, d.uuid);
+        cache_uuid_to_str(d.uuid, d.str, sizeof(d.str));
+
+        for (i = 0; i < c->dscs->len; i++)
+            if (g_array_index(c->dscs, struct cache_dsc, i).handle > d.handle)
+                break;
+        g_array_insert_val(c->dscs, i, d);
     }
+    cache_range_add(c->dsc_ranges, start, end);
+    cache_save(c);
+}
+
+static void cache_put_incls(struct gatt_cache *c, GSList *includes)
+{
+    GSList *l;
 
-    resp_begin(rsp_DISCOVERY);
+    g_array_set_size(c->incls, 0);
     for (l = includes; l; l = l->next) {
         struct gatt_included *incl = l->data;
-        send_uint(tag_HANDLE, incl->handle);
-        send_uint(tag_RANGE_START, incl->range.start);
-        send_uint(tag_RANGE_END,   incl->range.end);
-        send_str(tag_UUID, incl->uuid);
+        struct cache_incl in;
+
+        in.handle = incl->handle;
+        in.start = incl->range.start;
+        in.end = incl->range.end;
+        cache_uuid_from_str(incl->uuid, in.uuid);
+        cache_uuid_to_str(in.uuid, in.str, sizeof(in.str));
+        g_array_append_val(c->incls, in);
     }
-    resp_end();
+    c->have_incls = TRUE;
+    cache_save(c);
 }
 
-static void char_cb(uint8_t status, GSList *characteristics, void *user_data)
+/*
+ * The cache_send_ functions answer a discovery command from the cache,
+ * with the same response the ATT exchange would have given, and return
+ * FALSE if it does not cover the request.
+ */
+static gboolean cache_send_svcs(struct conn *conn, const bt_uuid_t *filter)
 {
-    GSList *l;
+    struct gatt_cache *c = conn->cache;
+    bt_uuid_t uuid128;
+    guint i;
 
-    if (status) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
+    if (!c || conn->state != STATE_CONNECTED)
+        return FALSE;
+    if (!c->have_svcs) {
+        cache_misses++;
+        return FALSE;
     }
+    cache_hits++;
 
-    resp_begin(rsp_DISCOVERY);
-    for (l = characteristics; l; l = l->next) {
-        struct gatt_char *chars = l->data;
-        send_uint(tag_HANDLE, chars->handle);
-        send_uint(tag_PROPERTIES, chars->properties);
-        send_uint(tag_VALUE_HANDLE, chars->value_handle);
-        send_str(tag_UUID, chars->uuid);
+    if (filter)
+        bt_uuid_to_uuid128(filter, &uuid128);
+
+    conn_begin(conn, rsp_DISCOVERY);
+    for (i = 0; i < c->svcs->len; i++) {
+        struct cache_svc *s = &g_array_index(c->svcs, struct cache_svc, i);
+
+        if (filter && memcmp(s->uuid, &uuid128.value.u128, 16))
+            continue;
+        send_uint(tag_RANGE_START, s->start);
+        send_uint(tag_RANGE_END, s->end);
+        if (!filter)
+            send_str(tag_UUID, s->str);
     }
     resp_end();
+    return TRUE;
 }
 
-static void char_desc_cb(uint8_t status, GSList *descriptors, void *user_data)
+static gboolean cache_send_chrs(struct conn *conn, uint16_t start, uint16_t end,
+                                const bt_uuid_t *filter)
 {
-    GSList *l;
+    struct gatt_cache *c = conn->cache;
+    bt_uuid_t uuid128;
+    guint i, n = 0;
 
-    if (status != 0) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
+    if (!c || conn->state != STATE_CONNECTED)
+        return FALSE;
+    if (!cache_range_covers(c->chr_ranges, start, end)) {
+        cache_misses++;
+        return FALSE;
     }
-
-    resp_begin(rsp_DESCRIPTORS);
-    for (l = descriptors; l != NULL; l = l->next) {
-        struct gatt_desc *desc = (struct gatt_desc *)l->data;
-        send_uint(tag_HANDLE, desc->handle);
-                send_str (tag_UUID, desc->uuid);
+    cache_hits++;
+
+    if (filter)
+        bt_uuid_to_uuid128(filter, &uuid128);
+
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
+
+        if (ch->handle < start || ch->handle > end ||
+                (filter && memcmp(ch->uuid, &uuid128.value.u128, 16)))
+            continue;
+        if (n++ == 0)
+            conn_begin(conn, rsp_DISCOVERY);
+        send_uint(tag_HANDLE, ch->handle);
+        send_uint(tag_PROPERTIES, ch->props);
+        send_uint(tag_VALUE_HANDLE, ch->vhnd);
+        send_str(tag_UUID, ch->str);
     }
+
+    /* As for Attribute Not Found from the peer */
+    if (n == 0)
+        conn_error(conn, err_COMM_ERR);
+    else
         resp_end();
+    return TRUE;
 }
 
-static void char_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
-                            gpointer user_data)
+static gboolean cache_send_dscs(struct conn *conn, uint16_t start, uint16_t end)
 {
-    uint8_t value[plen];
-    ssize_t vlen;
+    struct gatt_cache *c = conn->cache;
+    guint i, n = 0;
 
-    if (status != 0) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
+    if (!c || conn->state != STATE_CONNECTED)
+        return FALSE;
+    if (!cache_range_covers(c->dsc_ranges, start, end)) {
+        cache_misses++;
+        return FALSE;
     }
+    cache_hits++;
 
-    vlen = dec_read_resp(pdu, plen, value, sizeof(value));
-    if (vlen < 0) {
-        resp_error(err_COMM_ERR);
-        return;
+    for (i = 0; i < c->dscs->len; i++) {
+        struct cache_dsc *d = &g_array_index(c->dscs, struct cache_dsc, i);
+
+        if (d->handle < start || d->handle > end)
+            continue;
+        if (n++ == 0)
+            conn_begin(conn, rsp_DESCRIPTORS);
+        send_uint(tag_HANDLE, d->handle);
+        send_str(tag_UUID, d->str);
     }
 
-    resp_begin(rsp_READ);
-    send_data(value, vlen);
-    resp_end();
+    if (n == 0)
+        conn_error(conn, err_COMM_ERR);
+    else
+        resp_end();
+    return TRUE;
 }
 
-static void char_read_by_uuid_cb(guint8 status, const guint8 *pdu,
-                    guint16 plen, gpointer user_data)
+/* Value handle of Service Changed, or 0 if it is not in the table */
+static uint16_t cache_sc_handle(struct gatt_cache *c)
 {
-    struct characteristic_data *char_data = user_data;
-    struct att_data_list *list;
-    int i;
+    guint i;
 
-    if (status == ATT_ECODE_ATTR_NOT_FOUND &&
-                char_data->start != char_data->orig_start)
-    {
-        printf("# TODO case in char_read_by_uuid_cb\n");
-        goto done;
-    }
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
 
-    if (status != 0) {
-        resp_error(err_COMM_ERR); // Todo: status
-        goto done;
+        if (cache_uuid_is16(ch->uuid, GATT_CHARAC_SERVICE_CHANGED))
+            return ch->vhnd;
     }
+    return 0;
+}
 
-    list = dec_read_by_type_resp(pdu, plen);
-
-    resp_begin(rsp_READ);
-    if (list == NULL)
-        goto nolist;
+/* Last handle of the characteristic whose value is at vhnd */
+static uint16_t cache_char_end(struct gatt_cache *c, uint16_t vhnd)
+{
+    uint16_t end = 0xffff;
+    guint i;
 
-    for (i = 0; i < list->num; i++) {
-        uint8_t *value = list->data[i];
+    for (i = 0; i < c->svcs->len; i++) {
+        struct cache_svc *s = &g_array_index(c->svcs, struct cache_svc, i);
 
-        char_data->start = bt_get_le16(value) + 1;
+        if (s->start <= vhnd && vhnd <= s->end)
+            end = s->end;
+    }
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
 
-        send_uint(tag_HANDLE, bt_get_le16(value));
-                send_data(value+2, list->len-2); // All the same length??
+        if (ch->handle > vhnd) {
+            end = MIN(end, ch->handle - 1);
+            break;
+        }
     }
+    return end;
+}
 
-    att_data_list_free(list);
-nolist:
-    resp_end();
+/* Client Characteristic Configuration in vhnd + 1..end, or 0 */
+static uint16_t cache_cccd_handle(struct gatt_cache *c, uint16_t vhnd,
+                                    uint16_t end)
+{
+    guint i;
 
-done:
-    g_free(char_data);
+    for (i = 0; i < c->dscs->len; i++) {
+        struct cache_dsc *d = &g_array_index(c->dscs, struct cache_dsc, i);
+
+        if (d->handle <= vhnd)
+            continue;
+        if (d->handle > end || cache_uuid_is16(d->uuid, GATT_CHARAC_UUID) ||
+                cache_uuid_is16(d->uuid, GATT_PRIM_SVC_UUID) ||
+                cache_uuid_is16(d->uuid, GATT_SND_SVC_UUID))
+            break;
+        if (cache_uuid_is16(d->uuid, GATT_CLIENT_CHARAC_CFG_UUID))
+            return d->handle;
+    }
+    return 0;
 }
 
-static void cmd_exit(int argcp, char **argvp)
+static void cache_sc_subscribe(struct conn *conn);
+
+/* bt_att drops a request sent with no callback, so this one is empty */
+static void cache_sc_write_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                                gpointer user_data)
 {
-    g_main_loop_quit(event_loop);
+    if (status)
+        DBG("Service Changed CCCD write: %s", att_ecode2str(status));
 }
 
-static gboolean channel_watcher(GIOChannel *chan, GIOCondition cond,
-                gpointer user_data)
+static void cache_sc_desc_cb(uint8_t status, GSList *descriptors,
+                                void *user_data)
 {
-    DBG("chan = %p", chan);
+    struct discovery *disc = user_data;
 
-    // in case of quick disconnection/reconnection, do not mix them
-    if (chan == iochannel)
-        disconnect_io();
-
-    return FALSE;
+    if ((status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND) && disc->conn->cache) {
+        cache_put_dscs(disc->conn->cache, disc->start, disc->end, descriptors);
+        cache_sc_subscribe(disc->conn);
+    }
+    g_free(disc);
 }
 
-static void cmd_connect(int argcp, char **argvp)
+/*
+ * Ask to be told if the cached table goes out of date, finding the
+ * Service Changed CCCD first if that was never asked for.
+ */
+static void cache_sc_subscribe(struct conn *conn)
 {
-    GError *gerr = NULL;
-    if (conn_state != STATE_DISCONNECTED)
+    struct gatt_cache *c = conn->cache;
+    struct discovery *disc;
+    uint16_t sc, end, cccd;
+    uint8_t ind[2];
+
+    sc = cache_sc_handle(c);
+    if (!sc)
         return;
 
-    if (argcp > 1) {
-        g_free(opt_dst);
-        opt_dst = g_strdup(argvp[1]);
+    end = cache_char_end(c, sc);
+    if (end == sc)
+        return;
 
-        g_free(opt_dst_type);
-        if (argcp > 2)
-            opt_dst_type = g_strdup(argvp[2]);
-        else
-            opt_dst_type = g_strdup("public");
-        g_free(opt_src);
-        if (argcp > 3) {
-            opt_src = g_strdup(argvp[3]);
-        } else {
-            opt_src = NULL;
-        }
+    if (!cache_range_covers(c->dsc_ranges, sc + 1, end)) {
+        disc = g_new(struct discovery, 1);
+        disc->conn = conn;
+        disc->start = sc + 1;
+        disc->end = end;
+        gatt_discover_desc(conn->attrib, disc->start, disc->end, NULL,
+                            cache_sc_desc_cb, disc);
+        return;
+    }
+
+    cccd = cache_cccd_handle(c, sc, end);
+    if (!cccd)
+        return;
+
+    bt_put_le16(GATT_CLIENT_CHARAC_CFG_IND_BIT, ind);
+    gatt_write_char(conn->attrib, cccd, ind, sizeof(ind),
+                    cache_sc_write_cb, NULL);
+}
+
+static void cache_hash_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct conn *conn = user_data;
+    struct gatt_cache *c = conn->cache;
+    struct att_data_list *list = NULL;
+    gboolean have_hash = FALSE;
+    uint8_t hash[16];
+
+    if (!c || conn->state != STATE_CONNECTING)
+        return;
+
+    if (status == 0)
+        list = dec_read_by_type_resp(pdu, plen);
+    if (list && list->num > 0 && list->len == 2 + sizeof(hash)) {
+        memcpy(hash, list->data[0] + 2, sizeof(hash));
+        have_hash = TRUE;
+    }
+    if (list)
+        att_data_list_free(list);
+
+    if (!cache_load(c) || c->have_hash != have_hash ||
+            (have_hash && memcmp(c->hash, hash, sizeof(hash)))) {
+        cache_drop(c);
+        c->have_hash = have_hash;
+        if (have_hash)
+            memcpy(c->hash, hash, sizeof(hash));
+        set_state(conn, STATE_CONNECTED);
+        return;
+    }
+
+    set_state(conn, STATE_CONNECTED);
+    cache_sc_subscribe(conn);
+}
+
+/*
+ * Opens the cache entry for a new connection, and reads the Database
+ * Hash to check it; the connection is reported when that is done.
+ */
+static void cache_open(struct conn *conn)
+{
+    bt_uuid_t uuid;
+
+    conn->cache = cache_new(conn->dst);
+    bt_uuid16_create(&uuid, GATT_DB_HASH_UUID);
+    if (!gatt_read_char_by_uuid(conn->attrib, 0x0001, 0xffff, &uuid,
+                                cache_hash_cb, conn))
+        cache_hash_cb(ATT_ECODE_UNLIKELY, NULL, 0, conn);
+}
+
+static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t evt;
+    uint16_t handle, olen;
+    size_t plen;
+
+    evt = pdu[0];
+
+    if ( evt != ATT_OP_HANDLE_NOTIFY && evt != ATT_OP_HANDLE_IND )
+    {
+        resp_comment("Invalid opcode %02X in event handler??", evt);
+        return;
+    }
+
+    assert( len >= 3 );
+    handle = bt_get_le16(&pdu[1]);
+
+    if (evt == ATT_OP_HANDLE_NOTIFY && stream_q) {
+        stream_put(conn, handle, pdu + 3, len - 3);
+        return;
+    }
+
+    conn_begin( conn, evt==ATT_OP_HANDLE_NOTIFY ? rsp_NOTIFY : rsp_IND );
+    send_uint( tag_HANDLE, handle );
+    send_data( pdu+3, len-3 );
+    resp_end();
+
+    if (evt == ATT_OP_HANDLE_NOTIFY)
+        return;
+
+    if (conn->cache && handle == cache_sc_handle(conn->cache)) {
+        cache_drop(conn->cache);
+        resp_comment("Service Changed, GATT cache dropped");
+    }
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_confirmation(opdu, plen);
+
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_find_info_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t starting_handle, olen;
+    size_t plen;
+
+    assert( len == 5 );
+    opcode = pdu[0];
+    starting_handle = bt_get_le16(&pdu[1]);
+    /* ending_handle = bt_get_le16(&pdu[3]); */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_find_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t starting_handle, olen;
+    size_t plen;
+
+    assert( len >= 7 );
+    opcode = pdu[0];
+    starting_handle = bt_get_le16(&pdu[1]);
+    /* ending_handle = bt_get_le16(&pdu[3]); */
+    /* att_type = bt_get_le16(&pdu[5]); */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_read_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t starting_handle, olen;
+    size_t plen;
+
+    assert( len == 7 || len == 21 );
+    opcode = pdu[0];
+    starting_handle = bt_get_le16(&pdu[1]);
+    /* ending_handle = bt_get_le16(&pdu[3]); */
+    if (len == 7) {
+        /* att_type = bt_get_le16(&pdu[5]); */
+    }
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_read_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t handle, olen;
+    size_t plen;
+
+    assert( len == 3 );
+    opcode = pdu[0];
+    handle = bt_get_le16(&pdu[1]);
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_read_blob_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t handle, olen;
+    size_t plen;
+
+    assert( len == 5 );
+    opcode = pdu[0];
+    handle = bt_get_le16(&pdu[1]);
+    /* offset = bt_get_le16(&pdu[3]); */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_read_multi_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t handle1, olen;
+    size_t plen;
+
+    assert( len >= 5 );
+    opcode = pdu[0];
+    handle1 = bt_get_le16(&pdu[1]);
+    /* handle2 = bt_get_le16(&pdu[3]); */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, handle1, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_read_by_group_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t starting_handle, olen;
+    size_t plen;
+
+    assert( len >= 7 );
+    opcode = pdu[0];
+    starting_handle = bt_get_le16(&pdu[1]);
+    /* ending_handle = bt_get_le16(&pdu[3]); */
+    /* att_group_type = bt_get_le16(&pdu[5]); */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t handle, olen;
+    size_t plen;
+
+    assert( len >= 3 );
+    opcode = pdu[0];
+    handle = bt_get_le16(&pdu[1]);
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_write_cmd(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    assert( len >= 3 );
+    /* opcode = pdu[0]; */
+    /* handle = bt_get_le16(&pdu[1]); */
+}
+
+static void gatts_signed_write_cmd(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    assert( len >= 15 );
+    /* opcode = pdu[0]; */
+    /* handle = bt_get_le16(&pdu[1]); */
+}
+
+static void gatts_prep_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode, handle;
+    uint16_t olen;
+    size_t plen;
+
+    assert( len >= 5 );
+    opcode = pdu[0];
+    handle = bt_get_le16(&pdu[1]);
+    /* offset = bt_get_le16(&pdu[3]); */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void gatts_exec_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t *opdu;
+    uint8_t opcode;
+    uint16_t olen;
+    size_t plen;
+
+    assert( len == 5 );
+    opcode = pdu[0];
+    /* flags = pdu[1]; */
+
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
+    olen = enc_error_resp(opcode, 0, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
+    if (olen > 0)
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
+{
+    struct conn *conn = conn_by_io(io);
+    GAttrib *attrib;
+    uint16_t mtu;
+    uint16_t cid;
+    GError *gerr = NULL;
+
+    DBG("io = %p, err = %p", io, err);
+    if (conn == NULL)
+        return;
+
+    if (err) {
+        DBG("err = %s", err->message);
+        g_io_channel_unref(conn->io);
+        conn->io = NULL;
+        set_state(conn, STATE_DISCONNECTED);
+        conn_error(conn, err_CONN_FAIL);
+        resp_comment("Connect error: %s", err->message);
+        return;
+    }
+
+    bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &mtu,
+                BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
+
+    if (gerr) {
+        resp_comment("Can't detect MTU, using default");
+        g_error_free(gerr);
+        mtu = ATT_DEFAULT_LE_MTU;
+    }
+    else if (cid == ATT_CID)
+        mtu = ATT_DEFAULT_LE_MTU;
+
+    attrib = conn->attrib = g_attrib_new(conn->io, mtu);
+
+    g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
+                        events_handler, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES,
+                        events_handler, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_FIND_INFO_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_find_info_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_FIND_BY_TYPE_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_find_by_type_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_READ_BY_TYPE_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_read_by_type_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_READ_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_read_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_READ_BLOB_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_read_blob_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_READ_MULTI_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_read_multi_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_READ_BY_GROUP_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_read_by_group_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_WRITE_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_write_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_WRITE_CMD, GATTRIB_ALL_HANDLES,
+                      gatts_write_cmd, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_SIGNED_WRITE_CMD, GATTRIB_ALL_HANDLES,
+                      gatts_signed_write_cmd, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_PREP_WRITE_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_prep_write_req, conn, NULL);
+    g_attrib_register(attrib, ATT_OP_EXEC_WRITE_REQ, GATTRIB_ALL_HANDLES,
+                      gatts_exec_write_req, conn, NULL);
+
+    if (cache_dir)
+        cache_open(conn);
+    else
+        set_state(conn, STATE_CONNECTED);
+}
+
+static void disconnect_io(struct conn *conn)
+{
+    if (conn->state == STATE_DISCONNECTED)
+        return;
+
+    g_attrib_unref(conn->attrib);
+    conn->attrib = NULL;
+    conn->mtu = 0;
+
+    cache_free(conn->cache);
+    conn->cache = NULL;
+    conn->no_read_multi = FALSE;
+
+    g_io_channel_shutdown(conn->io, FALSE, NULL);
+    g_io_channel_unref(conn->io);
+    conn->io = NULL;
+
+    set_state(conn, STATE_DISCONNECTED);
+}
+
+static void primary_all_cb(uint8_t status, GSList *services, void *user_data)
+{
+    struct conn *conn = user_data;
+    GSList *l;
+
+    if (status) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    if (conn->cache)
+        cache_put_svcs(conn->cache, services);
+
+    conn_begin(conn, rsp_DISCOVERY);
+    for (l = services; l; l = l->next) {
+        struct gatt_primary *prim = l->data;
+        send_uint(tag_RANGE_START, prim->range.start);
+        send_uint(tag_RANGE_END, prim->range.end);
+        send_str(tag_UUID, prim->uuid);
+    }
+    resp_end();
+
+}
+
+static void primary_by_uuid_cb(uint8_t status, GSList *ranges, void *user_data)
+{
+    struct conn *conn = user_data;
+    GSList *l;
+
+    if (status) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    conn_begin(conn, rsp_DISCOVERY);
+    for (l = ranges; l; l = l->next) {
+        struct att_range *range = l->data;
+        send_uint(tag_RANGE_START, range->start);
+        send_uint(tag_RANGE_END, range->end);
+    }
+    resp_end();
+}
+
+static void included_cb(uint8_t status, GSList *includes, void *user_data)
+{
+    struct conn *conn = user_data;
+    GSList *l;
+
+    if (status) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    conn_begin(conn, rsp_DISCOVERY);
+    for (l = includes; l; l = l->next) {
+        struct gatt_included *incl = l->data;
+        send_uint(tag_HANDLE, incl->handle);
+        send_uint(tag_RANGE_START, incl->range.start);
+        send_uint(tag_RANGE_END,   incl->range.end);
+        send_str(tag_UUID, incl->uuid);
+    }
+    resp_end();
+}
+
+static void char_cb(uint8_t status, GSList *characteristics, void *user_data)
+{
+    struct conn *conn = user_data;
+    GSList *l;
+
+    if (status) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    conn_begin(conn, rsp_DISCOVERY);
+    for (l = characteristics; l; l = l->next) {
+        struct gatt_char *chars = l->data;
+        send_uint(tag_HANDLE, chars->handle);
+        send_uint(tag_PROPERTIES, chars->properties);
+        send_uint(tag_VALUE_HANDLE, chars->value_handle);
+        send_str(tag_UUID, chars->uuid);
+    }
+    resp_end();
+}
+
+/* Attribute Not Found is an answer too: there is nothing in the range */
+static void char_cache_cb(uint8_t status, GSList *characteristics,
+                            void *user_data)
+{
+    struct discovery *disc = user_data;
+
+    if ((status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND) && disc->conn->cache)
+        cache_put_chrs(disc->conn->cache, disc->start, disc->end,
+                        characteristics);
+
+    char_cb(status, characteristics, disc->conn);
+    g_free(disc);
+}
+
+static void char_desc_cb(uint8_t status, GSList *descriptors, void *user_data)
+{
+    struct conn *conn = user_data;
+    GSList *l;
+
+    if (status != 0) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    conn_begin(conn, rsp_DESCRIPTORS);
+    for (l = descriptors; l != NULL; l = l->next) {
+        struct gatt_desc *desc = (struct gatt_desc *)l->data;
+        send_uint(tag_HANDLE, desc->handle);
+                send_str (tag_UUID, desc->uuid);
+    }
+        resp_end();
+}
+
+static void char_desc_cache_cb(uint8_t status, GSList *descriptors,
+                                void *user_data)
+{
+    struct discovery *disc = user_data;
+
+    if ((status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND) && disc->conn->cache)
+        cache_put_dscs(disc->conn->cache, disc->start, disc->end, descriptors);
+
+    char_desc_cb(status, descriptors, disc->conn);
+    g_free(disc);
+}
+
+static void cache_discover(struct conn *conn, uint16_t start, uint16_t end,
+                            gboolean chrs)
+{
+    struct discovery *disc = g_new(struct discovery, 1);
+
+    disc->conn = conn;
+    disc->start = start;
+    disc->end = end;
+    if (chrs)
+        gatt_discover_char(conn->attrib, start, end, NULL, char_cache_cb, disc);
+    else
+        gatt_discover_desc(conn->attrib, start, end, NULL, char_desc_cache_cb,
+                            disc);
+}
+
+/*
+ * Whole database discovery, for "discall"
+ *
+ * The primary services are found first, then the included services and
+ * characteristics, then the descriptors of each characteristic that has
+ * handles to spare after its value. All the requests of a step are queued
+ * together, so bt_att sends each as soon as the one before is answered,
+ * and the table goes out as one response when the last step is done.
+ * Whatever the GATT cache already holds is not asked for again.
+ */
+struct discall {
+    struct conn *conn;
+    struct gatt_cache *db;      /* conn->cache, or a table of our own */
+    gboolean air;               /* anything was not in the cache */
+    gboolean failed;
+    int pending;
+};
+
+struct discall_req {
+    struct discall *d;
+    uint16_t start;
+    uint16_t end;
+};
+
+static void discall_free(struct discall *d)
+{
+    if (d->db != d->conn->cache)
+        cache_free(d->db);
+    g_free(d);
+}
+
+static void discall_send(struct discall *d)
+{
+    struct gatt_cache *c = d->db;
+    guint i, j;
+
+    if (d->conn->cache) {
+        if (d->air)
+            cache_misses++;
+        else
+            cache_hits++;
+    }
+
+    conn_begin(d->conn, rsp_DATABASE);
+    for (i = 0; i < c->svcs->len; i++) {
+        struct cache_svc *s = &g_array_index(c->svcs, struct cache_svc, i);
+
+        send_uint(tag_RANGE_START, s->start);
+        send_uint(tag_RANGE_END, s->end);
+        send_str(tag_UUID, s->str);
+    }
+    for (i = 0; i < c->incls->len; i++) {
+        struct cache_incl *in = &g_array_index(c->incls, struct cache_incl, i);
+
+        send_uint(tag_INCL_HANDLE, in->handle);
+        send_uint(tag_INCL_START, in->start);
+        send_uint(tag_INCL_END, in->end);
+        send_str(tag_INCL_UUID, in->str);
+    }
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
+
+        send_uint(tag_HANDLE, ch->handle);
+        send_uint(tag_PROPERTIES, ch->props);
+        send_uint(tag_VALUE_HANDLE, ch->vhnd);
+        send_str(tag_CHAR_UUID, ch->str);
+    }
+    /* Only the descriptors of each characteristic, as discall_descs() */
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
+        uint16_t end = cache_char_end(c, ch->vhnd);
+
+        for (j = 0; j < c->dscs->len; j++) {
+            struct cache_dsc *dsc = &g_array_index(c->dscs, struct cache_dsc, j);
+
+            if (dsc->handle > ch->vhnd && dsc->handle <= end) {
+                send_uint(tag_DESC_HANDLE, dsc->handle);
+                send_str(tag_DESC_UUID, dsc->str);
+            }
+        }
+    }
+    resp_end();
+    discall_free(d);
+}
+
+/* Called as each request of a step is answered; FALSE until the last */
+static gboolean discall_done(struct discall *d, uint8_t status)
+{
+    if (status && status != ATT_ECODE_ATTR_NOT_FOUND) {
+        DBG("discall: %s", att_ecode2str(status));
+        d->failed = TRUE;
+    }
+    if (--d->pending > 0)
+        return FALSE;
+
+    if (d->failed) {
+        conn_error(d->conn, err_COMM_ERR);
+        discall_free(d);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static struct discall_req *discall_req(struct discall *d, uint16_t start,
+                                        uint16_t end)
+{
+    struct discall_req *req = g_new(struct discall_req, 1);
+
+    req->d = d;
+    req->start = start;
+    req->end = end;
+    d->pending++;
+    d->air = TRUE;
+    return req;
+}
+
+static void discall_desc_cb(uint8_t status, GSList *descriptors,
+                            void *user_data)
+{
+    struct discall_req *req = user_data;
+    struct discall *d = req->d;
+
+    if (status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND)
+        cache_put_dscs(d->db, req->start, req->end, descriptors);
+    g_free(req);
+
+    if (discall_done(d, status))
+        discall_send(d);
+}
+
+static void discall_descs(struct discall *d)
+{
+    struct gatt_cache *c = d->db;
+    struct discall_req *req;
+    guint i;
+
+    for (i = 0; i < c->chrs->len; i++) {
+        struct cache_chr *ch = &g_array_index(c->chrs, struct cache_chr, i);
+        uint16_t end = cache_char_end(c, ch->vhnd);
+
+        if (ch->vhnd >= end ||
+                cache_range_covers(c->dsc_ranges, ch->vhnd + 1, end))
+            continue;
+        req = discall_req(d, ch->vhnd + 1, end);
+        gatt_discover_desc(d->conn->attrib, req->start, req->end, NULL,
+                            discall_desc_cb, req);
+    }
+
+    if (d->pending == 0)
+        discall_send(d);
+}
+
+static void discall_incl_cb(uint8_t status, GSList *includes, void *user_data)
+{
+    struct discall_req *req = user_data;
+    struct discall *d = req->d;
+
+    if (status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND)
+        cache_put_incls(d->db, includes);
+    g_free(req);
+
+    if (discall_done(d, status))
+        discall_descs(d);
+}
+
+static void discall_char_cb(uint8_t status, GSList *characteristics,
+                            void *user_data)
+{
+    struct discall_req *req = user_data;
+    struct discall *d = req->d;
+
+    if (status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND)
+        cache_put_chrs(d->db, req->start, req->end, characteristics);
+    g_free(req);
+
+    if (discall_done(d, status))
+        discall_descs(d);
+}
+
+static void discall_chars(struct discall *d)
+{
+    struct discall_req *req;
+
+    if (!d->db->have_incls) {
+        req = discall_req(d, 0x0001, 0xffff);
+        gatt_find_included(d->conn->attrib, req->start, req->end,
+                            discall_incl_cb, req);
+    }
+    if (!cache_range_covers(d->db->chr_ranges, 0x0001, 0xffff)) {
+        req = discall_req(d, 0x0001, 0xffff);
+        gatt_discover_char(d->conn->attrib, req->start, req->end, NULL,
+                            discall_char_cb, req);
+    }
+
+    if (d->pending == 0)
+        discall_descs(d);
+}
+
+static void discall_svcs_cb(uint8_t status, GSList *services, void *user_data)
+{
+    struct discall_req *req = user_data;
+    struct discall *d = req->d;
+
+    if (status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND)
+        cache_put_svcs(d->db, services);
+    g_free(req);
+
+    if (discall_done(d, status))
+        discall_chars(d);
+}
+
+static void char_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint8_t value[plen];
+    ssize_t vlen;
+
+    if (status != 0) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    vlen = dec_read_resp(pdu, plen, value, sizeof(value));
+    if (vlen < 0) {
+        conn_error(conn, err_COMM_ERR);
+        return;
+    }
+
+    conn_begin(conn, rsp_READ);
+    send_data(value, vlen);
+    resp_end();
+}
+
+/*
+ * Reading several values, for "rdm"
+ *
+ * Each argument is a handle, or handle:length for a value that is always
+ * that long. Runs of such fixed-size values that fit in one response are
+ * read with a Read Multiple request, everything else with a read of its
+ * own, as "rd" does. A run the peer will not read that way, or whose
+ * values were not the sizes given, is read again a value at a time. All
+ * the requests are queued together, so bt_att sends each as soon as the
+ * one before is answered, and the values go out as one response in the
+ * order they were asked for.
+ */
+struct read_multi {
+    struct conn *conn;
+    int num;
+    uint16_t *handles;
+    int *lens;                  /* the fixed length, or 0 if not known */
+    GByteArray **values;
+    uint8_t status;             /* the first error */
+    int pending;
+};
+
+struct read_multi_req {
+    struct read_multi *rm;
+    int first;
+    int num;
+};
+
+static void read_multi_done(struct read_multi *rm, uint8_t status)
+{
+    int i;
+
+    if (status && !rm->status) {
+        DBG("rdm: %s", att_ecode2str(status));
+        rm->status = status;
+    }
+    if (--rm->pending > 0)
+        return;
+
+    if (rm->status) {
+        conn_error(rm->conn, err_COMM_ERR); // Todo: status
+    } else {
+        conn_begin(rm->conn, rsp_READ_MULTI);
+        for (i = 0; i < rm->num; i++) {
+            send_uint(tag_HANDLE, rm->handles[i]);
+            send_data(rm->values[i]->data, rm->values[i]->len);
+        }
+        resp_end();
+    }
+
+    for (i = 0; i < rm->num; i++)
+        g_byte_array_free(rm->values[i], TRUE);
+    g_free(rm->values);
+    g_free(rm->lens);
+    g_free(rm->handles);
+    g_free(rm);
+}
+
+static struct read_multi_req *read_multi_req(struct read_multi *rm, int first,
+                                             int num)
+{
+    struct read_multi_req *req = g_new(struct read_multi_req, 1);
+
+    req->rm = rm;
+    req->first = first;
+    req->num = num;
+    rm->pending++;
+    return req;
+}
+
+static void read_multi_one_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                              gpointer user_data)
+{
+    struct read_multi_req *req = user_data;
+    struct read_multi *rm = req->rm;
+    ssize_t vlen;
+
+    if (status == 0) {
+        vlen = dec_read_resp(pdu, plen, NULL, 0);
+        if (vlen < 0)
+            status = ATT_ECODE_INVALID_PDU;
+        else
+            g_byte_array_append(rm->values[req->first], pdu + 1, vlen);
+    }
+    g_free(req);
+
+    read_multi_done(rm, status);
+}
+
+static void read_multi_one(struct read_multi *rm, int i)
+{
+    gatt_read_char(rm->conn->attrib, rm->handles[i], read_multi_one_cb,
+                   read_multi_req(rm, i, 1));
+}
+
+static void read_multi_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                          gpointer user_data)
+{
+    struct read_multi_req *req = user_data;
+    struct read_multi *rm = req->rm;
+    ssize_t vlen = -1, size = 0;
+    int i;
+
+    for (i = req->first; i < req->first + req->num; i++)
+        size += rm->lens[i];
+    if (status == 0)
+        vlen = dec_read_multi_resp(pdu, plen, NULL, 0);
+
+    if (vlen == size) {
+        for (i = req->first, pdu++; i < req->first + req->num; i++) {
+            g_byte_array_append(rm->values[i], pdu, rm->lens[i]);
+            pdu += rm->lens[i];
+        }
+    } else {
+        if (status == ATT_ECODE_REQ_NOT_SUPP)
+            rm->conn->no_read_multi = TRUE;
+        for (i = req->first; i < req->first + req->num; i++)
+            read_multi_one(rm, i);
+    }
+    g_free(req);
+
+    read_multi_done(rm, 0);
+}
+
+static void read_multi_send(struct read_multi *rm, int first, int num)
+{
+    uint8_t *buf;
+    size_t buflen;
+    guint16 plen;
+
+    buf = g_attrib_get_buffer(rm->conn->attrib, &buflen);
+    plen = enc_read_multi_req(&rm->handles[first], num, buf, buflen);
+    g_attrib_send(rm->conn->attrib, 0, buf, plen, read_multi_cb,
+                  read_multi_req(rm, first, num), NULL);
+}
+
+static void char_read_by_uuid_cb(guint8 status, const guint8 *pdu,
+                    guint16 plen, gpointer user_data)
+{
+    struct characteristic_data *char_data = user_data;
+    struct att_data_list *list;
+    int i;
+
+    if (status == ATT_ECODE_ATTR_NOT_FOUND &&
+                char_data->start != char_data->orig_start)
+    {
+        resp_comment("TODO case in char_read_by_uuid_cb");
+        goto done;
+    }
+
+    if (status != 0) {
+        conn_error(char_data->conn, err_COMM_ERR); // Todo: status
+        goto done;
+    }
+
+    list = dec_read_by_type_resp(pdu, plen);
+
+    conn_begin(char_data->conn, rsp_READ);
+    if (list == NULL)
+        goto nolist;
+
+    for (i = 0; i < list->num; i++) {
+        uint8_t *value = list->data[i];
+
+        char_data->start = bt_get_le16(value) + 1;
+
+        send_uint(tag_HANDLE, bt_get_le16(value));
+                send_data(value+2, list->len-2); // All the same length??
+    }
+
+nolist:
+    resp_end();
+    /* The values are sent from the list, so it goes after the response */
+    if (list)
+        att_data_list_free(list);
+
+done:
+    g_free(char_data);
+}
+
+static void cmd_exit(int argcp, char **argvp)
+{
+    g_main_loop_quit(event_loop);
+}
+
+static gboolean channel_watcher(GIOChannel *chan, GIOCondition cond,
+                gpointer user_data)
+{
+    struct conn *conn = user_data;
+
+    DBG("chan = %p", chan);
+
+    // in case of quick disconnection/reconnection, do not mix them
+    if (chan == conn->io)
+        disconnect_io(conn);
+
+    return FALSE;
+}
+
+/*
+ * Address type "unix" connects to a SOCK_SEQPACKET socket at the path
+ * given as the address, which carries ATT PDUs like the L2CAP channel.
+ * It stands in for a peripheral when testing without a controller.
+ */
+static GIOChannel *unix_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    GIOChannel *io;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        DBG("connect %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    io = g_io_channel_unix_new(fd);
+    g_io_channel_set_close_on_unref(io, TRUE);
+    return io;
+}
+
+static void cmd_connect(int argcp, char **argvp)
+{
+    GError *gerr = NULL;
+    if (cur->state != STATE_DISCONNECTED)
+        return;
+
+    if (argcp > 1) {
+        g_free(cur->dst);
+        cur->dst = g_strdup(argvp[1]);
+
+        g_free(cur->dst_type);
+        if (argcp > 2)
+            cur->dst_type = g_strdup(argvp[2]);
+        else
+            cur->dst_type = g_strdup("public");
+        g_free(cur->src);
+        if (argcp > 3) {
+            cur->src = g_strdup(argvp[3]);
+        } else {
+            cur->src = NULL;
+        }
+    }
+
+    if (cur->dst == NULL) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    set_state(cur, STATE_CONNECTING);
+    if (strcmp(cur->dst_type, "unix") == 0) {
+        cur->io = unix_connect(cur->dst);
+        if (cur->io == NULL) {
+            set_state(cur, STATE_DISCONNECTED);
+            conn_error(cur, err_CONN_FAIL);
+            return;
+        }
+        g_io_add_watch(cur->io, G_IO_HUP, channel_watcher, cur);
+        connect_cb(cur->io, NULL, NULL);
+        return;
+    }
+
+    cur->io = gatt_connect(cur->src, cur->dst, cur->dst_type, cur->sec_level,
+                        opt_psm, cur->mtu, connect_cb, &gerr);
+
+    DBG("gatt_connect returned %p", cur->io);
+    if (cur->io == NULL)
+    {
+        set_state(cur, STATE_DISCONNECTED);
+        g_error_free(gerr);
+        }
+    else
+        g_io_add_watch(cur->io, G_IO_HUP, channel_watcher, cur);
+}
+
+static void cmd_disconnect(int argcp, char **argvp)
+{
+    disconnect_io(cur);
+}
+
+static void cmd_primary(int argcp, char **argvp)
+{
+    bt_uuid_t uuid;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp == 1) {
+        if (!cache_send_svcs(cur, NULL))
+            gatt_discover_primary(cur->attrib, NULL, primary_all_cb, cur);
+        return;
+    }
+
+    if (bt_string_to_uuid(&uuid, argvp[1]) < 0) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    if (cache_send_svcs(cur, &uuid))
+        return;
+
+    gatt_discover_primary(cur->attrib, &uuid, primary_by_uuid_cb, cur);
+}
+
+static int strtohandle(const char *src)
+{
+    char *e;
+    int dst;
+
+    errno = 0;
+    dst = strtoll(src, &e, 16);
+    if (errno != 0 || *e != '\0')
+        return -EINVAL;
+
+    return dst;
+}
+
+static void cmd_included(int argcp, char **argvp)
+{
+    int start = 0x0001;
+    int end = 0xffff;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp > 1) {
+        start = strtohandle(argvp[1]);
+        if (start < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+        end = start;
+    }
+
+    if (argcp > 2) {
+        end = strtohandle(argvp[2]);
+        if (end < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    }
+
+    gatt_find_included(cur->attrib, start, end, included_cb, cur);
+}
+
+static void cmd_char(int argcp, char **argvp)
+{
+    int start = 0x0001;
+    int end = 0xffff;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp > 1) {
+        start = strtohandle(argvp[1]);
+        if (start < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    }
+
+    if (argcp > 2) {
+        end = strtohandle(argvp[2]);
+        if (end < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    }
+
+    if (argcp > 3) {
+        bt_uuid_t uuid;
+
+        if (bt_string_to_uuid(&uuid, argvp[3]) < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+
+        if (!cache_send_chrs(cur, start, end, &uuid))
+            gatt_discover_char(cur->attrib, start, end, &uuid, char_cb, cur);
+        return;
+    }
+
+    if (cache_send_chrs(cur, start, end, NULL))
+        return;
+
+    if (cur->cache)
+        cache_discover(cur, start, end, TRUE);
+    else
+        gatt_discover_char(cur->attrib, start, end, NULL, char_cb, cur);
+}
+
+static void cmd_char_desc(int argcp, char **argvp)
+{
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp > 1) {
+        start = strtohandle(argvp[1]);
+        if (start < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    } else
+        start = 0x0001;
+
+    if (argcp > 2) {
+        end = strtohandle(argvp[2]);
+        if (end < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    } else
+        end = 0xffff;
+
+    if (cache_send_dscs(cur, start, end))
+        return;
+
+    if (cur->cache)
+        cache_discover(cur, start, end, FALSE);
+    else
+        gatt_discover_desc(cur->attrib, start, end, NULL, char_desc_cb, cur);
+}
+
+static void cmd_discover_all(int argcp, char **argvp)
+{
+    struct discall *d;
+    struct discall_req *req;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp > 1) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    d = g_new0(struct discall, 1);
+    d->conn = cur;
+    d->db = cur->cache ? cur->cache : cache_new(NULL);
+
+    if (d->db->have_svcs) {
+        discall_chars(d);
+        return;
+    }
+
+    req = discall_req(d, 0x0001, 0xffff);
+    gatt_discover_primary(cur->attrib, NULL, discall_svcs_cb, req);
+}
+
+static void cmd_read_hnd(int argcp, char **argvp)
+{
+    int handle;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 2) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    handle = strtohandle(argvp[1]);
+    if (handle < 0) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    gatt_read_char(cur->attrib, handle, char_read_cb, cur);
+}
+
+/* "<handle>[:<n>]", both in hex; *n is dflt if not given */
+static int strtohandle_arg(const char *src, int *n, int dflt)
+{
+    char *e;
+    int dst;
+
+    errno = 0;
+    dst = strtoll(src, &e, 16);
+    if (errno != 0 || (*e != '\0' && *e != ':'))
+        return -EINVAL;
+
+    *n = dflt;
+    if (*e == ':') {
+        *n = strtoll(e + 1, &e, 16);
+        if (errno != 0 || *e != '\0' || *n < 0)
+            return -EINVAL;
+    }
+
+    return dst;
+}
+
+static void cmd_read_multi(int argcp, char **argvp)
+{
+    struct read_multi *rm;
+    size_t mtu, size;
+    int first, i;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 2) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    rm = g_new0(struct read_multi, 1);
+    rm->conn = cur;
+    rm->num = argcp - 1;
+    rm->handles = g_new(uint16_t, rm->num);
+    rm->lens = g_new(int, rm->num);
+    rm->values = g_new(GByteArray *, rm->num);
+    for (i = 0; i < rm->num; i++) {
+        int handle = strtohandle_arg(argvp[i + 1], &rm->lens[i], 0);
+
+        if (handle < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            g_free(rm->values);
+            g_free(rm->lens);
+            g_free(rm->handles);
+            g_free(rm);
+            return;
+        }
+        rm->handles[i] = handle;
+        rm->values[i] = g_byte_array_new();
+    }
+
+    /* Held until everything is queued, so nothing completes early */
+    rm->pending = 1;
+    g_attrib_get_buffer(cur->attrib, &mtu);
+    for (first = 0; first < rm->num; first = i) {
+        size = 0;
+        for (i = first; i < rm->num && rm->lens[i] && !cur->no_read_multi;
+                i++) {
+            if (size + rm->lens[i] > mtu - 1 ||
+                    1 + (i - first + 1) * sizeof(uint16_t) > mtu)
+                break;
+            size += rm->lens[i];
+        }
+
+        if (i - first >= 2) {
+            read_multi_send(rm, first, i - first);
+        } else {
+            i = first + 1;
+            read_multi_one(rm, first);
+        }
+    }
+    read_multi_done(rm, 0);
+}
+
+static void cmd_read_uuid(int argcp, char **argvp)
+{
+    struct characteristic_data *char_data;
+    int start = 0x0001;
+    int end = 0xffff;
+    bt_uuid_t uuid;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 2 ||
+        bt_string_to_uuid(&uuid, argvp[1]) < 0) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    if (argcp > 2) {
+        start = strtohandle(argvp[2]);
+        if (start < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    }
+
+    if (argcp > 3) {
+        end = strtohandle(argvp[3]);
+        if (end < 0) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    }
+
+    char_data = g_new(struct characteristic_data, 1);
+    char_data->conn = cur;
+    char_data->orig_start = start;
+    char_data->start = start;
+    char_data->end = end;
+    char_data->uuid = uuid;
+
+    gatt_read_char_by_uuid(cur->attrib, start, end, &char_data->uuid,
+                    char_read_by_uuid_cb, char_data);
+}
+
+static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct conn *conn = user_data;
+
+    if (status != 0) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    if (!dec_write_resp(pdu, plen) && !dec_exec_write_resp(pdu, plen)) {
+        conn_error(conn, err_PROTO_ERR);
+        return;
+    }
+
+    conn_begin(conn, rsp_WRITE);
+    resp_end();
+}
+
+
+/*
+ * Subscribing, for "sub"
+ *
+ * Each argument is a CCCD handle, with ":2" for indications or ":0" to
+ * stop; notifications otherwise. The writes are queued together, as "rdm"
+ * queues its reads, and one "wr" response follows the last of them.
+ */
+struct subscribe {
+    struct conn *conn;
+    uint8_t status;             /* the first error */
+    int pending;
+};
+
+static void subscribe_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                         gpointer user_data)
+{
+    struct subscribe *sub = user_data;
+
+    if (status == 0 && !dec_write_resp(pdu, plen))
+        status = ATT_ECODE_INVALID_PDU;
+    if (status && !sub->status) {
+        DBG("sub: %s", att_ecode2str(status));
+        sub->status = status;
+    }
+    if (--sub->pending > 0)
+        return;
+
+    if (sub->status) {
+        conn_error(sub->conn, err_COMM_ERR); // Todo: status
+    } else {
+        conn_begin(sub->conn, rsp_WRITE);
+        resp_end();
+    }
+    g_free(sub);
+}
+
+static void cmd_subscribe(int argcp, char **argvp)
+{
+    struct subscribe *sub;
+    int handles[argcp], values[argcp];
+    uint8_t value[2];
+    int i;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 2) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    for (i = 1; i < argcp; i++) {
+        handles[i] = strtohandle_arg(argvp[i], &values[i], 0x0001);
+        if (handles[i] <= 0 || values[i] > 0xffff) {
+            conn_error(cur, err_BAD_PARAM);
+            return;
+        }
+    }
+
+    sub = g_new0(struct subscribe, 1);
+    sub->conn = cur;
+    sub->pending = argcp - 1;
+    for (i = 1; i < argcp; i++) {
+        bt_put_le16(values[i], value);
+        if (!gatt_write_char(cur->attrib, handles[i], value, sizeof(value),
+                             subscribe_cb, sub))
+            subscribe_cb(ATT_ECODE_IO, NULL, 0, sub);
+    }
+}
+
+static void cmd_char_write_common(int argcp, char **argvp, int with_response)
+{
+    uint8_t *value;
+    size_t plen;
+    int handle;
+
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 3) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    handle = strtohandle(argvp[1]);
+    if (handle <= 0) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    plen = gatt_attr_data_from_string(argvp[2], &value);
+    if (plen == 0) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
     }
 
-    if (opt_dst == NULL) {
-        resp_error(err_BAD_PARAM);
+    if (with_response)
+        gatt_write_char(cur->attrib, handle, value, plen,
+                    char_write_req_cb, cur);
+    else
+    {
+        gatt_write_cmd(cur->attrib, handle, value, plen, NULL, NULL);
+        conn_begin(cur, rsp_WRITE);
+        resp_end();
+    }
+
+    g_free(value);
+}
+
+static void cmd_char_write(int argcp, char **argvp)
+{
+  cmd_char_write_common(argcp, argvp, 0);
+}
+
+static void cmd_char_write_rsp(int argcp, char **argvp)
+{
+  cmd_char_write_common(argcp, argvp, 1);
+}
+
+static void cmd_sec_level(int argcp, char **argvp)
+{
+    GError *gerr = NULL;
+    BtIOSecLevel sec_level;
+
+    if (argcp < 2) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    if (strcasecmp(argvp[1], "medium") == 0)
+        sec_level = BT_IO_SEC_MEDIUM;
+    else if (strcasecmp(argvp[1], "high") == 0)
+        sec_level = BT_IO_SEC_HIGH;
+    else if (strcasecmp(argvp[1], "low") == 0)
+        sec_level = BT_IO_SEC_LOW;
+    else {
+        conn_error(cur, err_BAD_PARAM);
         return;
     }
 
-    set_state(STATE_CONNECTING);
-    iochannel = gatt_connect(opt_src, opt_dst, opt_dst_type, opt_sec_level,
-                        opt_psm, opt_mtu, connect_cb, &gerr);
+    g_free(cur->sec_level);
+    cur->sec_level = g_strdup(argvp[1]);
 
-    DBG("gatt_connect returned %p", iochannel);
-    if (iochannel == NULL)
-    {
-        set_state(STATE_DISCONNECTED);
+    if (cur->state != STATE_CONNECTED)
+        return;
+
+    assert(!opt_psm);
+
+    bt_io_set(cur->io, &gerr,
+            BT_IO_OPT_SEC_LEVEL, sec_level,
+            BT_IO_OPT_INVALID);
+    if (gerr) {
+        resp_comment("Error: %s", gerr->message);
+        conn_error(cur, err_COMM_ERR);
         g_error_free(gerr);
-        }
+    }
+    else {
+        /* Tell bluepy the security level 
+         * has been changed successfuly */
+        conn_status(cur);
+    }
+}
+
+static void exchange_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint16_t mtu;
+
+    if (status != 0) {
+        conn_error(conn, err_COMM_ERR); // Todo: status
+        return;
+    }
+
+    if (!dec_mtu_resp(pdu, plen, &mtu)) {
+        conn_error(conn, err_PROTO_ERR);
+        return;
+    }
+
+    mtu = MIN(mtu, conn->mtu);
+    /* Set new value for MTU in client */
+    if (g_attrib_set_mtu(conn->attrib, mtu))
+    {
+        conn->mtu = mtu;
+        conn_status(conn);
+    }
     else
-        g_io_add_watch(iochannel, G_IO_HUP, channel_watcher, NULL);
+    {
+        resp_comment("Error exchanging MTU");
+        conn_error(conn, err_COMM_ERR);
+    }
 }
 
-static void cmd_disconnect(int argcp, char **argvp)
+static void cmd_mtu(int argcp, char **argvp)
 {
-    disconnect_io();
+    if (cur->state != STATE_CONNECTED) {
+        conn_error(cur, err_BAD_STATE);
+        return;
+    }
+
+    assert(!opt_psm);
+
+    if (argcp < 2) {
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    if (cur->mtu) {
+        conn_error(cur, err_BAD_STATE);
+        /* Can only set once per connection */
+        return;
+    }
+
+    errno = 0;
+    cur->mtu = strtoll(argvp[1], NULL, 16);
+    if (errno != 0 || cur->mtu < ATT_DEFAULT_LE_MTU) {
+        cur->mtu = 0;
+        conn_error(cur, err_BAD_PARAM);
+        return;
+    }
+
+    gatt_exchange_mtu(cur->attrib, cur->mtu, exchange_mtu_cb, cur);
 }
 
-static void cmd_primary(int argcp, char **argvp)
+static void set_mode_complete(uint8_t status, uint16_t length,
+                    const void *param, void *user_data)
 {
-    bt_uuid_t uuid;
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("status returned error : %s (0x%02x)",
+            mgmt_errstr(status), status);
+        resp_mgmt(err_PROTO_ERR);
+        return;
+    }
+
+    resp_mgmt(err_SUCCESS);
+}
+
+static bool set_mode(uint16_t opcode, char *p_mode)
+{
+    struct mgmt_mode cp;
+    uint8_t val;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return true;
+    }
+
+    if (!memcmp(p_mode, "on", 2))
+        val = 1;
+    else if (!memcmp(p_mode, "off", 3))
+        val = 0;
+    else
+        return false;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.val = val;
+
+    // at this time only index 0 is supported
+    if (mgmt_send(mgmt_master, opcode,
+            mgmt_ind, sizeof(cp), &cp,
+            set_mode_complete, NULL, NULL) == 0) {
+        resp_mgmt(err_SUCCESS);
+    }
+    return true;
+}
 
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
+
+static void cmd_le(int argcp, char **argvp)
+{
+    if (argcp < 2) {
+        resp_mgmt(err_BAD_PARAM);
         return;
     }
 
-    if (argcp == 1) {
-        gatt_discover_primary(attrib, NULL, primary_all_cb, NULL);
+    if (!set_mode(MGMT_OP_SET_LE, argvp[1])) {
+        resp_mgmt(err_BAD_PARAM);
+    }
+}
+
+static void cmd_pairable(int argcp, char **argvp)
+{
+    if (argcp < 2) {
+        resp_mgmt(err_BAD_PARAM);
         return;
     }
 
-    if (bt_string_to_uuid(&uuid, argvp[1]) < 0) {
-        resp_error(err_BAD_PARAM);
+    if (!set_mode(MGMT_OP_SET_BONDABLE, argvp[1])) {
+        resp_mgmt(err_BAD_PARAM);
+    }
+}
+
+static void pair_device_complete(uint8_t status, uint16_t length,
+                    const void *param, void *user_data)
+{
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("status returned error : %s (0x%02x)",
+                mgmt_errstr(status), status);
+        resp_mgmt(err_PROTO_ERR);
         return;
     }
 
-    gatt_discover_primary(attrib, &uuid, primary_by_uuid_cb, NULL);
+    resp_mgmt(err_SUCCESS);
 }
 
-static int strtohandle(const char *src)
+static void cmd_pair(int argcp, char **argvp)
 {
-    char *e;
-    int dst;
+    struct mgmt_cp_pair_device cp;
+    bdaddr_t bdaddr;
+    uint8_t io_cap = IO_CAPABILITY_NOINPUTNOOUTPUT;
+    uint8_t addr_type = BDADDR_LE_RANDOM;
 
-    errno = 0;
-    dst = strtoll(src, &e, 16);
-    if (errno != 0 || *e != '\0')
-        return -EINVAL;
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return;
+    }
+
+    if (cur->state != STATE_CONNECTED) {
+        resp_mgmt(err_BAD_STATE);
+        return;
+    }
+
+    if (str2ba(cur->dst, &bdaddr)) {
+        resp_mgmt(err_NOT_FOUND);
+        return;
+    }
+
+    if (!memcmp(cur->dst_type, "public", 6)) {
+        addr_type = BDADDR_LE_PUBLIC;
+    }
+
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.addr.bdaddr, &bdaddr);
+    cp.addr.type = addr_type;
+    cp.io_cap = io_cap;
+
+    if (mgmt_send(mgmt_master, MGMT_OP_PAIR_DEVICE,
+            mgmt_ind, sizeof(cp), &cp,
+                pair_device_complete, NULL,
+                NULL) == 0) {
+        DBG("mgmt_send(MGMT_OP_PAIR_DEVICE) failed for %s for hci%u", cur->dst, mgmt_ind);
+        resp_mgmt(err_PROTO_ERR);
+        return;
+    }
+}
+
+static void unpair_device_complete(uint8_t status, uint16_t length,
+                    const void *param, void *user_data)
+{
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("status returned error : %s (0x%02x)",
+                mgmt_errstr(status), status);
+        resp_mgmt(err_PROTO_ERR);
+        return;
+    }
+
+    resp_mgmt(err_SUCCESS);
+}
+
+static void cmd_unpair(int argcp, char **argvp)
+{
+    struct mgmt_cp_unpair_device cp;
+    bdaddr_t bdaddr;
+    uint8_t addr_type = BDADDR_LE_RANDOM;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return;
+    }
+
+    if (cur->dst == NULL || str2ba(cur->dst, &bdaddr)) {
+        DBG("str2ba failed");
+        resp_mgmt(err_NOT_FOUND);
+        return;
+    }
+
+    if (!memcmp(cur->dst_type, "public", 6)) {
+        addr_type = BDADDR_LE_PUBLIC;
+    }
+
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.addr.bdaddr, &bdaddr);
+    cp.addr.type = addr_type;
+    cp.disconnect = 1;
+
+    if (mgmt_send(mgmt_master, MGMT_OP_UNPAIR_DEVICE,
+            mgmt_ind, sizeof(cp), &cp,
+            unpair_device_complete, NULL,
+                NULL) == 0) {
+        DBG("mgmt_send(MGMT_OP_UNPAIR_DEVICE) failed for %s for hci%u", cur->dst, mgmt_ind);
+        resp_mgmt(err_PROTO_ERR);
+        return;
+    }
+}
+
+/*
+ * Advertising data parsing
+ *
+ * ad_parse() finds the fields of an advertisement in one pass and without
+ * allocating: they point into the data, which must outlive them. Of the
+ * names, the complete one is kept if given. The scan filter matches on the
+ * fields, and with "scanfields on" they are sent, UUIDs as 128-bit strings,
+ * so that Python need not parse the data itself. They are only sent with
+ * data not among the last two payloads sent for the device, as Python has
+ * the fields of those already.
+ */
+/* AD types, see Core Specification Supplement part A */
+#define EIR_UUID16_SOME     0x02
+#define EIR_UUID16_ALL      0x03
+#define EIR_UUID32_SOME     0x04
+#define EIR_UUID32_ALL      0x05
+#define EIR_UUID128_SOME    0x06
+#define EIR_UUID128_ALL     0x07
+#define EIR_NAME_SHORT      0x08
+#define EIR_NAME_COMPLETE   0x09
+#define EIR_SOLICIT16       0x14
+#define EIR_SOLICIT128      0x15
+#define EIR_SVC_DATA16      0x16
+#define EIR_SOLICIT32       0x1F
+#define EIR_SVC_DATA32      0x20
+#define EIR_SVC_DATA128     0x21
+#define EIR_FLAGS           0x01
+#define EIR_TX_POWER        0x0A
+#define EIR_APPEARANCE      0x19
+#define EIR_MANUFACTURER    0xFF
+
+#define AD_ITEMS_MAX        32
+
+struct ad_item {
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *data;
+};
+
+struct ad_info {
+    int flags;                  /* -1 when absent */
+    int appearance;             /* -1 when absent */
+    gboolean have_tx_power;
+    int8_t tx_power;
+    const uint8_t *name;        /* not NUL-terminated; NULL when absent */
+    uint8_t name_len;
+    gboolean name_short;
+    /* UUID lists, service data and manufacturer data, in order */
+    unsigned int n_items;
+    struct ad_item items[AD_ITEMS_MAX];
+};
 
-    return dst;
-}
+static gboolean scan_fields;
 
-static void cmd_included(int argcp, char **argvp)
+/*
+ * Step to the next AD structure in eir, from *pos; FALSE at the end or
+ * on a truncated structure.
+ */
+static gboolean eir_next(const uint8_t *eir, size_t len, size_t *pos,
+                            uint8_t *type, const uint8_t **data, size_t *dlen)
 {
-    int start = 0x0001;
-    int end = 0xffff;
-
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
-        return;
+    while (*pos < len) {
+        size_t field_len = eir[*pos];
+
+        if (field_len == 0)             /* padding to the end */
+            return FALSE;
+        if (*pos + 1 + field_len > len)
+            return FALSE;
+
+        *type = eir[*pos + 1];
+        *data = eir + *pos + 2;
+        *dlen = field_len - 1;
+        *pos += 1 + field_len;
+        return TRUE;
     }
+    return FALSE;
+}
 
-    if (argcp > 1) {
-        start = strtohandle(argvp[1]);
-        if (start < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
+static void ad_parse(const uint8_t *eir, size_t len, struct ad_info *ad)
+{
+    size_t pos = 0, dlen;
+    const uint8_t *data;
+    uint8_t type;
+
+    ad->flags = ad->appearance = -1;
+    ad->have_tx_power = FALSE;
+    ad->name = NULL;
+    ad->name_len = 0;
+    ad->name_short = FALSE;
+    ad->n_items = 0;
+
+    while (eir_next(eir, len, &pos, &type, &data, &dlen)) {
+        switch (type) {
+        case EIR_FLAGS:
+            if (dlen >= 1)
+                ad->flags = data[0];
+            break;
+        case EIR_NAME_COMPLETE:
+        case EIR_NAME_SHORT:
+            if (ad->name && !ad->name_short)
+                break;
+            ad->name = data;
+            ad->name_len = dlen;
+            ad->name_short = type == EIR_NAME_SHORT;
+            break;
+        case EIR_TX_POWER:
+            if (dlen >= 1) {
+                ad->have_tx_power = TRUE;
+                ad->tx_power = data[0];
+            }
+            break;
+        case EIR_APPEARANCE:
+            if (dlen >= 2)
+                ad->appearance = bt_get_le16(data);
+            break;
+        case EIR_UUID16_SOME:
+        case EIR_UUID16_ALL:
+        case EIR_UUID32_SOME:
+        case EIR_UUID32_ALL:
+        case EIR_UUID128_SOME:
+        case EIR_UUID128_ALL:
+        case EIR_SOLICIT16:
+        case EIR_SOLICIT32:
+        case EIR_SOLICIT128:
+        case EIR_SVC_DATA16:
+        case EIR_SVC_DATA32:
+        case EIR_SVC_DATA128:
+        case EIR_MANUFACTURER:
+            if (ad->n_items == AD_ITEMS_MAX)
+                break;
+            ad->items[ad->n_items].type = type;
+            ad->items[ad->n_items].len = dlen;
+            ad->items[ad->n_items].data = data;
+            ad->n_items++;
+            break;
         }
-        end = start;
     }
+}
 
-    if (argcp > 2) {
-        end = strtohandle(argvp[2]);
-        if (end < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
-        }
+/* The size of the UUIDs in an item, 0 for manufacturer data */
+static size_t ad_uuid_size(uint8_t type)
+{
+    switch (type) {
+    case EIR_UUID16_SOME:
+    case EIR_UUID16_ALL:
+    case EIR_SOLICIT16:
+    case EIR_SVC_DATA16:
+        return 2;
+    case EIR_UUID32_SOME:
+    case EIR_UUID32_ALL:
+    case EIR_SOLICIT32:
+    case EIR_SVC_DATA32:
+        return 4;
+    case EIR_UUID128_SOME:
+    case EIR_UUID128_ALL:
+    case EIR_SOLICIT128:
+    case EIR_SVC_DATA128:
+        return 16;
     }
+    return 0;
+}
 
-    gatt_find_included(attrib, start, end, included_cb, NULL);
+static gboolean ad_is_svc_data(uint8_t type)
+{
+    return type == EIR_SVC_DATA16 || type == EIR_SVC_DATA32 ||
+           type == EIR_SVC_DATA128;
 }
 
-static void cmd_char(int argcp, char **argvp)
+static gboolean ad_is_solicit(uint8_t type)
 {
-    int start = 0x0001;
-    int end = 0xffff;
+    return type == EIR_SOLICIT16 || type == EIR_SOLICIT32 ||
+           type == EIR_SOLICIT128;
+}
 
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
-        return;
+/* A little-endian UUID of size bytes, as a 128-bit one */
+static void ad_uuid(const uint8_t *data, size_t size, bt_uuid_t *uuid128)
+{
+    bt_uuid_t uuid;
+    uint128_t u128;
+
+    switch (size) {
+    case 2:
+        bt_uuid16_create(&uuid, bt_get_le16(data));
+        break;
+    case 4:
+        bt_uuid32_create(&uuid, bt_get_le32(data));
+        break;
+    default:
+        bswap_128(data, &u128);
+        bt_uuid128_create(&uuid, u128);
+        break;
     }
+    bt_uuid_to_uuid128(&uuid, uuid128);
+}
 
-    if (argcp > 1) {
-        start = strtohandle(argvp[1]);
-        if (start < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
-        }
-    }
+static void send_ad_uuid(const char *tag, const uint8_t *data, size_t size)
+{
+    char str[MAX_LEN_UUID_STR];
+    bt_uuid_t uuid;
 
-    if (argcp > 2) {
-        end = strtohandle(argvp[2]);
-        if (end < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
+    ad_uuid(data, size, &uuid);
+    bt_uuid_to_string(&uuid, str, sizeof(str));
+    send_str(tag, str);
+}
+
+static void send_ad_fields(const struct ad_info *ad)
+{
+    const struct ad_item *it;
+    unsigned int i;
+    size_t size, n;
+
+    if (ad->flags >= 0)
+        send_uint(tag_AD_FLAGS, ad->flags);
+    if (ad->name) {
+        send_bytes(tag_NAME, ad->name, ad->name_len);
+        if (ad->name_short)
+            send_uint(tag_NAME_SHORT, 1);
+    }
+    if (ad->have_tx_power)
+        send_uint(tag_TX_POWER, (uint8_t) ad->tx_power);
+    if (ad->appearance >= 0)
+        send_uint(tag_APPEARANCE, ad->appearance);
+
+    for (i = 0; i < ad->n_items; i++) {
+        it = &ad->items[i];
+        size = ad_uuid_size(it->type);
+
+        if (size == 0) {
+            if (it->len < 2)
+                continue;
+            send_uint(tag_MFR, bt_get_le16(it->data));
+            send_bytes(tag_MFR_DATA, it->data + 2, it->len - 2);
+        } else if (ad_is_svc_data(it->type)) {
+            if (it->len < size)
+                continue;
+            send_ad_uuid(tag_SVC_DATA_UUID, it->data, size);
+            send_bytes(tag_SVC_DATA, it->data + size, it->len - size);
+        } else {
+            for (n = 0; n + size <= it->len; n += size)
+                send_ad_uuid(ad_is_solicit(it->type) ? tag_SOLICIT :
+                             tag_SERVICE, it->data + n, size);
         }
     }
+}
 
-    if (argcp > 3) {
-        bt_uuid_t uuid;
+/*
+ * Scan report filtering, for "scanfilter"
+ *
+ * With a filter set, advertising reports are only sent for devices that
+ * pass every kind of filter given: any of the addresses, any of the
+ * service UUIDs (listed, solicited or with service data), a local name
+ * starting with the prefix, any of the manufacturer IDs, and an RSSI of
+ * at least the threshold. The data filters may be met by different
+ * reports from a device, as when its name is only in the scan response
+ * and its UUIDs only in the advertisement. A device is then reported on
+ * first sight, and within dedup_ms of its last report only if its data
+ * changes or its RSSI moves by rssi_delta or more. Each report carries
+ * the number of reports received from the device. The table of devices
+ * is also kept for "scanfields on" without a filter.
+ */
+#define SCAN_DEVS_MAX       4096
+#define SCAN_DEV_EXPIRE_US  (60 * G_USEC_PER_SEC)
+
+#define SCAN_MATCH_UUID     0x01
+#define SCAN_MATCH_NAME     0x02
+#define SCAN_MATCH_MFR      0x04
+
+struct scan_dev {
+    guint64 key;                /* bdaddr, and address type above it */
+    unsigned int count;
+    unsigned int matched;       /* SCAN_MATCH_* met so far */
+    gint64 seen, reported;
+    int8_t rssi;
+    /*
+     * The last two payloads reported: advertising data and scan response
+     * data arrive as separate reports, and would otherwise each count as
+     * a change of the other.
+     */
+    uint8_t *eir[2];
+    uint16_t eir_len[2];
+};
 
-        if (bt_string_to_uuid(&uuid, argvp[3]) < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
-        }
+static struct scan_filter {
+    gboolean on;
+    GArray *addrs;              /* bdaddr_t */
+    GArray *uuids;              /* bt_uuid_t, BT_UUID128 */
+    gchar *name;
+    GArray *mfrs;               /* uint16_t */
+    gboolean have_rssi;
+    int rssi;
+    unsigned int dedup_ms;
+    unsigned int rssi_delta;    /* 0: RSSI changes alone are not reported */
+    GHashTable *devs;           /* struct scan_dev by key */
+    unsigned int received, sent;
+} scan_filter;
+
+static void scan_dev_free(gpointer data)
+{
+    struct scan_dev *dev = data;
 
-        gatt_discover_char(attrib, start, end, &uuid, char_cb, NULL);
-        return;
-    }
+    g_free(dev->eir[0]);
+    g_free(dev->eir[1]);
+    g_free(dev);
+}
 
-    gatt_discover_char(attrib, start, end, NULL, char_cb, NULL);
+static void scan_filter_clear(struct scan_filter *f)
+{
+    if (f->addrs)
+        g_array_free(f->addrs, TRUE);
+    if (f->uuids)
+        g_array_free(f->uuids, TRUE);
+    if (f->mfrs)
+        g_array_free(f->mfrs, TRUE);
+    if (f->devs)
+        g_hash_table_destroy(f->devs);
+    g_free(f->name);
+    memset(f, 0, sizeof(*f));
 }
 
-static void cmd_char_desc(int argcp, char **argvp)
+static unsigned int scan_filter_wants(const struct scan_filter *f)
 {
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
-        return;
-    }
+    return (f->uuids ? SCAN_MATCH_UUID : 0) |
+           (f->name ? SCAN_MATCH_NAME : 0) |
+           (f->mfrs ? SCAN_MATCH_MFR : 0);
+}
 
-    if (argcp > 1) {
-        start = strtohandle(argvp[1]);
-        if (start < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
-        }
-    } else
-        start = 0x0001;
+static gboolean scan_uuid_match(const struct scan_filter *f,
+                                const uint8_t *data, size_t size)
+{
+    bt_uuid_t uuid128;
+    guint i;
+
+    ad_uuid(data, size, &uuid128);
+    for (i = 0; i < f->uuids->len; i++)
+        if (bt_uuid_cmp(&g_array_index(f->uuids, bt_uuid_t, i),
+                        &uuid128) == 0)
+            return TRUE;
+    return FALSE;
+}
 
-    if (argcp > 2) {
-        end = strtohandle(argvp[2]);
-        if (end < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
+/* The SCAN_MATCH_* data filters that the advertisement meets */
+static unsigned int scan_ad_match(const struct scan_filter *f,
+                                    const struct ad_info *ad)
+{
+    unsigned int want = scan_filter_wants(f);
+    const struct ad_item *it;
+    size_t size, n;
+    unsigned int i;
+    guint j;
+
+    if ((want & SCAN_MATCH_NAME) && ad->name &&
+            ad->name_len >= strlen(f->name) &&
+            memcmp(ad->name, f->name, strlen(f->name)) == 0)
+        want &= ~SCAN_MATCH_NAME;
+
+    for (i = 0; i < ad->n_items; i++) {
+        it = &ad->items[i];
+        size = ad_uuid_size(it->type);
+
+        if (size == 0) {
+            if (!(want & SCAN_MATCH_MFR) || it->len < 2)
+                continue;
+            for (j = 0; j < f->mfrs->len; j++)
+                if (g_array_index(f->mfrs, uint16_t, j) ==
+                        bt_get_le16(it->data))
+                    want &= ~SCAN_MATCH_MFR;
+        } else if (want & SCAN_MATCH_UUID) {
+            /* Service data starts with one UUID */
+            for (n = 0; n + size <= it->len; n += size) {
+                if (scan_uuid_match(f, it->data + n, size))
+                    want &= ~SCAN_MATCH_UUID;
+                if (ad_is_svc_data(it->type))
+                    break;
+            }
         }
-    } else
-        end = 0xffff;
+    }
 
-    gatt_discover_desc(attrib, start, end, NULL, char_desc_cb, NULL);
+    return scan_filter_wants(f) & ~want;
 }
 
-static void cmd_read_hnd(int argcp, char **argvp)
+static gboolean scan_dev_stale(gpointer key, gpointer value, gpointer now)
 {
-    int handle;
+    const struct scan_dev *dev = value;
 
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
-        return;
-    }
+    return *(gint64 *) now - dev->seen > SCAN_DEV_EXPIRE_US;
+}
 
-    if (argcp < 2) {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+static gboolean scan_dev_same_eir(const struct scan_dev *dev,
+                                    const uint8_t *eir, uint16_t len)
+{
+    int i;
 
-    handle = strtohandle(argvp[1]);
-    if (handle < 0) {
-        resp_error(err_BAD_PARAM);
-        return;
+    for (i = 0; i < 2; i++)
+        if (dev->eir[i] && dev->eir_len[i] == len &&
+                memcmp(dev->eir[i], eir, len) == 0)
+            return TRUE;
+    return FALSE;
+}
+
+static struct scan_dev *scan_dev_get(struct scan_filter *f,
+                                        const struct mgmt_addr_info *addr,
+                                        gint64 now)
+{
+    struct scan_dev *dev;
+    guint64 key = 0;
+
+    memcpy(&key, &addr->bdaddr, sizeof(addr->bdaddr));
+    key |= (guint64) addr->type << 48;
+
+    if (!f->devs)
+        f->devs = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                        NULL, scan_dev_free);
+
+    dev = g_hash_table_lookup(f->devs, &key);
+    if (!dev) {
+        if (g_hash_table_size(f->devs) >= SCAN_DEVS_MAX) {
+            g_hash_table_foreach_remove(f->devs, scan_dev_stale, &now);
+            if (g_hash_table_size(f->devs) >= SCAN_DEVS_MAX)
+                g_hash_table_remove_all(f->devs);
+        }
+        dev = g_new0(struct scan_dev, 1);
+        dev->key = key;
+        g_hash_table_insert(f->devs, &dev->key, dev);
     }
 
-    gatt_read_char(attrib, handle, char_read_cb, attrib);
+    dev->seen = now;
+    return dev;
 }
 
-static void cmd_read_uuid(int argcp, char **argvp)
+/*
+ * Whether to report an advertising report; *count is then the number of
+ * reports received from the device, or 0 with no filter set, and *new_eir
+ * whether its data is not among the last two payloads sent for it.
+ */
+static gboolean scan_filter_pass(const struct mgmt_addr_info *addr,
+                                    int8_t rssi, const uint8_t *eir,
+                                    uint16_t eir_len, const struct ad_info *ad,
+                                    unsigned int *count, gboolean *new_eir)
 {
-    struct characteristic_data *char_data;
-    int start = 0x0001;
-    int end = 0xffff;
-    bt_uuid_t uuid;
-
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
-        return;
+    struct scan_filter *f = &scan_filter;
+    struct scan_dev *dev;
+    gint64 now;
+    guint i;
+
+    *count = 0;
+    *new_eir = TRUE;
+    if (!f->on && !scan_fields)
+        return TRUE;
+
+    now = g_get_monotonic_time();
+    if (!f->on) {
+        dev = scan_dev_get(f, addr, now);
+        goto sent;
     }
 
-    if (argcp < 2 ||
-        bt_string_to_uuid(&uuid, argvp[1]) < 0) {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+    f->received++;
 
-    if (argcp > 2) {
-        start = strtohandle(argvp[2]);
-        if (start < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
-        }
+    if (f->have_rssi && rssi < f->rssi)
+        return FALSE;
+
+    if (f->addrs) {
+        for (i = 0; i < f->addrs->len; i++)
+            if (!bacmp(&g_array_index(f->addrs, bdaddr_t, i), &addr->bdaddr))
+                break;
+        if (i == f->addrs->len)
+            return FALSE;
     }
 
-    if (argcp > 3) {
-        end = strtohandle(argvp[3]);
-        if (end < 0) {
-            resp_error(err_BAD_PARAM);
-            return;
-        }
+    dev = scan_dev_get(f, addr, now);
+    dev->count++;
+    *count = dev->count;
+
+    if (dev->matched != scan_filter_wants(f)) {
+        dev->matched |= scan_ad_match(f, ad);
+        if (dev->matched != scan_filter_wants(f))
+            return FALSE;
     }
 
-    char_data = g_new(struct characteristic_data, 1);
-    char_data->orig_start = start;
-    char_data->start = start;
-    char_data->end = end;
-    char_data->uuid = uuid;
+    if (dev->reported &&
+            now - dev->reported < (gint64) f->dedup_ms * 1000 &&
+            (f->rssi_delta == 0 ||
+             (unsigned int) abs(rssi - dev->rssi) < f->rssi_delta) &&
+            scan_dev_same_eir(dev, eir, eir_len))
+        return FALSE;
 
-    gatt_read_char_by_uuid(attrib, start, end, &char_data->uuid,
-                    char_read_by_uuid_cb, char_data);
+    dev->reported = now;
+    dev->rssi = rssi;
+    f->sent++;
+
+sent:
+    *new_eir = !scan_dev_same_eir(dev, eir, eir_len);
+    if (*new_eir) {
+        g_free(dev->eir[1]);
+        dev->eir[1] = dev->eir[0];
+        dev->eir_len[1] = dev->eir_len[0];
+        dev->eir[0] = g_memdup(eir, eir_len);
+        dev->eir_len[0] = eir_len;
+    }
+    return TRUE;
 }
 
-static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
-                            gpointer user_data)
+/* Send an advertising report, unless the scan filter drops it */
+static void scan_report(const struct mgmt_addr_info *addr, int8_t rssi,
+                        uint32_t flags, const uint8_t *eir, uint16_t eir_len)
 {
-    if (status != 0) {
-        resp_error(err_COMM_ERR); // Todo: status
-        return;
+    struct ad_info ad, *fields = NULL;
+    unsigned int count;
+    gboolean new_eir;
+
+    if (scan_filter.on || scan_fields) {
+        ad_parse(eir, eir_len, &ad);
+        fields = &ad;
     }
 
-    if (!dec_write_resp(pdu, plen) && !dec_exec_write_resp(pdu, plen)) {
-        resp_error(err_PROTO_ERR);
+    if (!scan_filter_pass(addr, rssi, eir, eir_len, fields, &count,
+                            &new_eir))
         return;
-    }
 
-    resp_begin(rsp_WRITE);
+    resp_begin(rsp_SCAN);
+    send_addr(addr);
+    send_uint(tag_RSSI, -rssi);
+    send_uint(tag_FLAG, -flags);
+    if (count)
+        send_uint(tag_COUNT, count);
+    if (scan_fields && new_eir)
+        send_ad_fields(fields);
+    if (eir_len)
+        send_data(eir, eir_len);
     resp_end();
 }
 
-
-static void cmd_char_write_common(int argcp, char **argvp, int with_response)
+static void scan_cb(uint8_t status, uint16_t length, const void *param, void *user_data)
 {
-    uint8_t *value;
-    size_t plen;
-    int handle;
-
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("Scan error: %s (0x%02x)", mgmt_errstr(status), status);
+        resp_mgmt(status == MGMT_STATUS_BUSY? err_BUSY : err_PROTO_ERR);
         return;
     }
 
-    if (argcp < 3) {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+    resp_mgmt(err_SUCCESS);
+}
 
-    handle = strtohandle(argvp[1]);
-    if (handle <= 0) {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+// Unlike Bluez, we follow BT 4.0 spec which renammed Device Discovery by Scan
+static void scan(bool start)
+{
+    // mgmt_cp_start_discovery and mgmt_cp_stop_discovery are the same
+    struct mgmt_cp_start_discovery cp = { (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM) };
+    uint16_t opcode = start? MGMT_OP_START_DISCOVERY : MGMT_OP_STOP_DISCOVERY;
 
-    plen = gatt_attr_data_from_string(argvp[2], &value);
-    if (plen == 0) {
-        resp_error(err_BAD_PARAM);
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
         return;
     }
 
-    if (with_response)
-        gatt_write_char(attrib, handle, value, plen,
-                    char_write_req_cb, NULL);
-    else
+    DBG("Scan %s", start? "start" : "stop");
+
+    if (mgmt_send(mgmt_master, opcode, mgmt_ind, sizeof(cp),
+        &cp, scan_cb, NULL, NULL) == 0)
     {
-        gatt_write_cmd(attrib, handle, value, plen, NULL, NULL);
-        resp_begin(rsp_WRITE);
-        resp_end();
+        DBG("mgmt_send(MGMT_OP_%s_DISCOVERY) failed", start? "START" : "STOP");
+        resp_mgmt(err_PROTO_ERR);
+        return;
     }
-
-    g_free(value);
 }
 
-static void cmd_char_write(int argcp, char **argvp)
+/*
+ * Continuous scanning, for "lescan"
+ *
+ * mgmt discovery scans for a fixed time with the kernel's interval and
+ * window, and reports are lost while it is restarted. Instead this sends
+ * the HCI LE scan commands itself on a raw HCI socket, and the scan runs
+ * until "lescan off". The commands are queued and sent one at a time, on
+ * the Command Complete of the one before, so the main loop never waits
+ * for the controller. A SOCK_SEQPACKET socket carrying HCI packets may
+ * stand in for the controller; see tools/simhci.py.
+ */
+#define LESCAN_UNIT_US      625
+#define LESCAN_WL_MAX       32
+
+static struct lescan {
+    GIOChannel *io;
+    guint watch;
+    GByteArray *cmds;           /* HCI command packets still to send */
+    guint cmd_pos;              /* offset of the one awaiting completion */
+    uint8_t active, filter_dup, policy;
+    uint16_t interval, window;  /* units of 625 us */
+    gint64 started, stopped;    /* when "lescan" and "lescan off" were given */
+    gint64 enabled_at;          /* when the scan was last enabled, or 0 */
+    gint64 enabled_us;          /* time enabled before that */
+    unsigned int reports;
+} lescan;
+
+static void lescan_queue(uint16_t ocf, const void *param, uint8_t plen)
 {
-  cmd_char_write_common(argcp, argvp, 0);
-}
+    uint16_t opcode = cmd_opcode_pack(OGF_LE_CTL, ocf);
+    uint8_t hdr[1 + HCI_COMMAND_HDR_SIZE] = { HCI_COMMAND_PKT };
 
-static void cmd_char_write_rsp(int argcp, char **argvp)
-{
-  cmd_char_write_common(argcp, argvp, 1);
+    bt_put_le16(opcode, hdr + 1);
+    hdr[3] = plen;
+    g_byte_array_append(lescan.cmds, hdr, sizeof(hdr));
+    g_byte_array_append(lescan.cmds, param, plen);
 }
 
-static void cmd_sec_level(int argcp, char **argvp)
+static gboolean lescan_send(void)
 {
-    GError *gerr = NULL;
-    BtIOSecLevel sec_level;
-
-    if (argcp < 2) {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+    const uint8_t *pkt = lescan.cmds->data + lescan.cmd_pos;
+    int fd = g_io_channel_unix_get_fd(lescan.io);
 
-    if (strcasecmp(argvp[1], "medium") == 0)
-        sec_level = BT_IO_SEC_MEDIUM;
-    else if (strcasecmp(argvp[1], "high") == 0)
-        sec_level = BT_IO_SEC_HIGH;
-    else if (strcasecmp(argvp[1], "low") == 0)
-        sec_level = BT_IO_SEC_LOW;
-    else {
-        resp_error(err_BAD_PARAM);
-        return;
+    if (write(fd, pkt, 1 + HCI_COMMAND_HDR_SIZE + pkt[3]) < 0) {
+        DBG("HCI command write: %s", strerror(errno));
+        return FALSE;
     }
+    return TRUE;
+}
 
-    g_free(opt_sec_level);
-    opt_sec_level = g_strdup(argvp[1]);
+static void lescan_set_enabled(gboolean on)
+{
+    gint64 now = g_get_monotonic_time();
 
-    if (conn_state != STATE_CONNECTED)
-        return;
+    if (lescan.enabled_at)
+        lescan.enabled_us += now - lescan.enabled_at;
+    lescan.enabled_at = on ? now : 0;
+}
 
-    assert(!opt_psm);
+static void lescan_close(void)
+{
+    if (lescan.watch)
+        g_source_remove(lescan.watch);
+    if (lescan.io)
+        g_io_channel_unref(lescan.io);
+    if (lescan.cmds)
+        g_byte_array_free(lescan.cmds, TRUE);
+    lescan.watch = 0;
+    lescan.io = NULL;
+    lescan.cmds = NULL;
+    lescan_set_enabled(FALSE);
+    if (lescan.started)
+        lescan.stopped = g_get_monotonic_time();
+}
 
-    bt_io_set(iochannel, &gerr,
-            BT_IO_OPT_SEC_LEVEL, sec_level,
-            BT_IO_OPT_INVALID);
-    if (gerr) {
-        printf("# Error: %s\n", gerr->message);
-        resp_error(err_COMM_ERR);
-        g_error_free(gerr);
-    }
-    else {
-        /* Tell bluepy the security level 
-         * has been changed successfuly */
-        cmd_status(0, NULL);
-    }
+static void lescan_resp(void)
+{
+    gint64 now = lescan.stopped ? lescan.stopped : g_get_monotonic_time();
+    gint64 elapsed = lescan.started ? now - lescan.started : 0;
+    gint64 enabled = lescan.enabled_us;
+
+    if (lescan.enabled_at)
+        enabled += g_get_monotonic_time() - lescan.enabled_at;
+
+    resp_begin(rsp_LESCAN);
+    send_sym(tag_TYPE, lescan.active ? "active" : "passive");
+    send_uint(tag_INTERVAL, lescan.interval);
+    send_uint(tag_WINDOW, lescan.window);
+    send_uint(tag_DUP_FILTER, lescan.filter_dup);
+    send_uint(tag_POLICY, lescan.policy);
+    send_uint(tag_MS, elapsed / 1000);
+    send_uint(tag_RECEIVED, lescan.reports);
+    /* Share of the time spent listening, in thousandths */
+    send_uint(tag_DUTY, elapsed && lescan.interval ?
+              enabled * 1000 / elapsed * lescan.window / lescan.interval : 0);
+    send_uint(tag_RATE, elapsed ?
+              (gint64) lescan.reports * G_USEC_PER_SEC / elapsed : 0);
+    resp_end();
 }
 
-static void exchange_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
-                            gpointer user_data)
+static void lescan_adv_report(const uint8_t *p, size_t len)
 {
-    uint16_t mtu;
+    uint8_t num;
 
-    if (status != 0) {
-        resp_error(err_COMM_ERR); // Todo: status
+    if (len < 1)
         return;
-    }
+    num = *p++;
+    len--;
 
-    if (!dec_mtu_resp(pdu, plen, &mtu)) {
-        resp_error(err_PROTO_ERR);
-        return;
-    }
+    while (num-- > 0) {
+        const le_advertising_info *info = (const void *) p;
+        struct mgmt_addr_info addr;
+        uint32_t flags = 0;
+        size_t size;
 
-    mtu = MIN(mtu, opt_mtu);
-    /* Set new value for MTU in client */
-    if (g_attrib_set_mtu(attrib, mtu))
-    {
-        opt_mtu = mtu;
-        cmd_status(0, NULL);
-    }
-    else
-    {
-        printf("# Error exchanging MTU\n");
-        resp_error(err_COMM_ERR);
+        if (len < LE_ADVERTISING_INFO_SIZE + 1)
+            break;
+        size = LE_ADVERTISING_INFO_SIZE + info->length + 1;   /* and RSSI */
+        if (len < size)
+            break;
+
+        bacpy(&addr.bdaddr, &info->bdaddr);
+        addr.type = info->bdaddr_type == LE_RANDOM_ADDRESS ?
+                    BDADDR_LE_RANDOM : BDADDR_LE_PUBLIC;
+        /* ADV_SCAN_IND and ADV_NONCONN_IND */
+        if (info->evt_type == 0x02 || info->evt_type == 0x03)
+            flags = MGMT_DEV_FOUND_NOT_CONNECTABLE;
+
+        lescan.reports++;
+        scan_report(&addr, (int8_t) p[size - 1], flags, info->data,
+                    info->length);
+        p += size;
+        len -= size;
     }
 }
 
-static void cmd_mtu(int argcp, char **argvp)
+/* Command Complete or Status for the queued command at cmd_pos */
+static void lescan_cmd_done(uint16_t opcode, uint8_t status)
 {
-    if (conn_state != STATE_CONNECTED) {
-        resp_error(err_BAD_STATE);
-        return;
-    }
-
-    assert(!opt_psm);
+    const uint8_t *pkt;
 
-    if (argcp < 2) {
-        resp_error(err_BAD_PARAM);
+    if (!lescan.cmds || lescan.cmd_pos >= lescan.cmds->len)
         return;
-    }
-
-    if (opt_mtu) {
-        resp_error(err_BAD_STATE);
-        /* Can only set once per connection */
+    pkt = lescan.cmds->data + lescan.cmd_pos;
+    if (opcode != bt_get_le16(pkt + 1))
+        return;                         /* someone else's */
+
+    /* The first command disables any scan already running, and may
+     * be refused when there is none */
+    if (status && lescan.cmd_pos != 0) {
+        resp_comment("HCI command 0x%04x failed: 0x%02x", opcode, status);
+        resp_error(err_COMM_ERR);
+        lescan_close();
         return;
     }
 
-    errno = 0;
-    opt_mtu = strtoll(argvp[1], NULL, 16);
-    if (errno != 0 || opt_mtu < ATT_DEFAULT_LE_MTU) {
-        resp_error(err_BAD_PARAM);
+    lescan.cmd_pos += 1 + HCI_COMMAND_HDR_SIZE + pkt[3];
+    if (lescan.cmd_pos < lescan.cmds->len) {
+        if (!lescan_send()) {
+            resp_error(err_COMM_ERR);
+            lescan_close();
+        }
         return;
     }
 
-    gatt_exchange_mtu(attrib, opt_mtu, exchange_mtu_cb, NULL);
+    g_byte_array_set_size(lescan.cmds, 0);
+    lescan.cmd_pos = 0;
+    lescan_set_enabled(TRUE);
+    lescan_resp();
 }
 
-static void set_mode_complete(uint8_t status, uint16_t length,
-                    const void *param, void *user_data)
+static gboolean lescan_event(GIOChannel *chan, GIOCondition cond,
+                                gpointer user_data)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("status returned error : %s (0x%02x)",
-            mgmt_errstr(status), status);
-        resp_mgmt(err_PROTO_ERR);
-        return;
+    uint8_t buf[HCI_MAX_EVENT_SIZE + 1 + HCI_EVENT_HDR_SIZE];
+    const evt_le_meta_event *meta;
+    const evt_cmd_complete *cc;
+    const evt_cmd_status *cs;
+    const uint8_t *p;
+    ssize_t len;
+
+    len = read(g_io_channel_unix_get_fd(chan), buf, sizeof(buf));
+    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR) ||
+            (cond & (G_IO_ERR | G_IO_NVAL))) {
+        DBG("HCI socket closed");
+        lescan.watch = 0;
+        lescan_close();
+        resp_error(err_COMM_ERR);
+        return FALSE;
     }
 
-    resp_mgmt(err_SUCCESS);
+    if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT ||
+            len < 1 + HCI_EVENT_HDR_SIZE + buf[2])
+        return TRUE;
+
+    p = buf + 1 + HCI_EVENT_HDR_SIZE;
+    len = buf[2];
+
+    switch (buf[1]) {
+    case EVT_LE_META_EVENT:
+        meta = (const void *) p;
+        if (len >= EVT_LE_META_EVENT_SIZE &&
+                meta->subevent == EVT_LE_ADVERTISING_REPORT)
+            lescan_adv_report(meta->data, len - EVT_LE_META_EVENT_SIZE);
+        break;
+    case EVT_CMD_COMPLETE:
+        cc = (const void *) p;
+        /* The return parameters start with the status */
+        if (len > EVT_CMD_COMPLETE_SIZE)
+            lescan_cmd_done(btohs(cc->opcode), p[EVT_CMD_COMPLETE_SIZE]);
+        break;
+    case EVT_CMD_STATUS:
+        cs = (const void *) p;
+        if (len >= EVT_CMD_STATUS_SIZE && cs->status)
+            lescan_cmd_done(btohs(cs->opcode), cs->status);
+        break;
+    }
+
+    return TRUE;
 }
 
-static bool set_mode(uint16_t opcode, char *p_mode)
+static GIOChannel *lescan_open(const char *path)
 {
-    struct mgmt_mode cp;
-    uint8_t val;
-
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
-        return true;
-    }
-
-    if (!memcmp(p_mode, "on", 2))
-        val = 1;
-    else if (!memcmp(p_mode, "off", 3))
-        val = 0;
-    else
-        return false;
+    struct hci_filter flt;
+    GIOChannel *io;
+    int fd;
 
-    memset(&cp, 0, sizeof(cp));
-    cp.val = val;
+    if (path)
+        return unix_connect(path);
 
-    // at this time only index 0 is supported
-    if (mgmt_send(mgmt_master, opcode,
-            mgmt_ind, sizeof(cp), &cp,
-            set_mode_complete, NULL, NULL) == 0) {
-        resp_mgmt(err_SUCCESS);
+    fd = hci_open_dev(mgmt_ind);
+    if (fd < 0) {
+        DBG("hci_open_dev(%u): %s", mgmt_ind, strerror(errno));
+        return NULL;
     }
-    return true;
-}
 
-
-static void cmd_le(int argcp, char **argvp)
-{
-    if (argcp < 2) {
-        resp_mgmt(err_BAD_PARAM);
-        return;
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+    hci_filter_set_event(EVT_CMD_STATUS, &flt);
+    hci_filter_set_event(EVT_LE_META_EVENT, &flt);
+    if (setsockopt(fd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+        DBG("HCI_FILTER: %s", strerror(errno));
+        hci_close_dev(fd);
+        return NULL;
     }
 
-    if (!set_mode(MGMT_OP_SET_LE, argvp[1])) {
-        resp_mgmt(err_BAD_PARAM);
-    }
+    io = g_io_channel_unix_new(fd);
+    g_io_channel_set_close_on_unref(io, TRUE);
+    return io;
 }
 
-static void cmd_pairable(int argcp, char **argvp)
+/* "lescan off": disable the scan and close the socket at once */
+static void lescan_stop(void)
 {
-    if (argcp < 2) {
-        resp_mgmt(err_BAD_PARAM);
+    le_set_scan_enable_cp enable = { 0, 0 };
+
+    if (!lescan.io)
         return;
-    }
 
-    if (!set_mode(MGMT_OP_SET_BONDABLE, argvp[1])) {
-        resp_mgmt(err_BAD_PARAM);
-    }
+    g_byte_array_set_size(lescan.cmds, 0);
+    lescan.cmd_pos = 0;
+    lescan_queue(OCF_LE_SET_SCAN_ENABLE, &enable, sizeof(enable));
+    lescan_send();
+    lescan_close();
 }
 
-static void pair_device_complete(uint8_t status, uint16_t length,
-                    const void *param, void *user_data)
+static gboolean lescan_ms(const char *val, uint16_t *units)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("status returned error : %s (0x%02x)",
-                mgmt_errstr(status), status);
-        resp_mgmt(err_PROTO_ERR);
-        return;
-    }
+    char *e;
+    double ms;
 
-    resp_mgmt(err_SUCCESS);
+    errno = 0;
+    ms = strtod(val, &e);
+    if (errno != 0 || *e != '\0' || e == val)
+        return FALSE;
+
+    ms = ms * 1000 / LESCAN_UNIT_US + 0.5;
+    /* 2.5 ms to 10.24 s */
+    if (ms < 0x0004 || ms >= 0x4001)
+        return FALSE;
+    *units = ms;
+    return TRUE;
 }
 
-static void cmd_pair(int argcp, char **argvp)
+/*
+ * Scan continuously; "lescan <key>=<value> ...", with type passive or
+ * active, interval and window in ms, dupfilter 0 or 1 to have the
+ * controller drop repeated reports, wl with addresses[/random] to scan
+ * for only (through its white list), and hci with the path of a socket
+ * standing in for the controller. "lescan off" stops; either way, or with
+ * no arguments, report the settings and rates.
+ */
+static void cmd_lescan(int argcp, char **argvp)
 {
-    struct mgmt_cp_pair_device cp;
-    bdaddr_t bdaddr;
-    uint8_t io_cap = IO_CAPABILITY_NOINPUTNOOUTPUT;
-    uint8_t addr_type = BDADDR_LE_RANDOM;
+    le_set_scan_parameters_cp params;
+    le_set_scan_enable_cp enable;
+    le_add_device_to_white_list_cp wl[LESCAN_WL_MAX];
+    const char *path = NULL;
+    gchar **items = NULL;
+    gboolean ok = TRUE;
+    int i, j, nwl = 0;
+    uint8_t active = 0, filter_dup = 0;
+    uint16_t interval = 0x0010, window = 0x0010;
+
+    if (argcp == 2 && strcmp(argvp[1], "off") == 0) {
+        lescan_stop();
+        lescan_resp();
+        return;
+    }
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
+    if (argcp == 1) {
+        lescan_resp();
         return;
     }
 
-    if (conn_state != STATE_CONNECTED) {
-        resp_mgmt(err_BAD_STATE);
+    if (lescan.cmds && lescan.cmds->len) {
+        resp_error(err_BUSY);
         return;
     }
 
-    if (str2ba(opt_dst, &bdaddr)) {
-        resp_mgmt(err_NOT_FOUND);
+    for (i = 1; ok && i < argcp; i++) {
+        const char *arg = argvp[i];
+
+        if (strcmp(arg, "type=passive") == 0) {
+            active = 0;
+        } else if (strcmp(arg, "type=active") == 0) {
+            active = 1;
+        } else if (strncmp(arg, "interval=", 9) == 0) {
+            ok = lescan_ms(arg + 9, &interval);
+        } else if (strncmp(arg, "window=", 7) == 0) {
+            ok = lescan_ms(arg + 7, &window);
+        } else if (strcmp(arg, "dupfilter=0") == 0 ||
+                    strcmp(arg, "dupfilter=1") == 0) {
+            filter_dup = arg[10] - '0';
+        } else if (strncmp(arg, "hci=", 4) == 0) {
+            path = arg + 4;
+        } else if (strncmp(arg, "wl=", 3) == 0) {
+            items = g_strsplit(arg + 3, ",", -1);
+            for (j = 0; ok && items[j]; j++) {
+                char *type = strchr(items[j], '/');
+
+                if (nwl == LESCAN_WL_MAX) {
+                    ok = FALSE;
+                    break;
+                }
+                wl[nwl].bdaddr_type = LE_PUBLIC_ADDRESS;
+                if (type) {
+                    *type++ = '\0';
+                    if (strcmp(type, "random") == 0)
+                        wl[nwl].bdaddr_type = LE_RANDOM_ADDRESS;
+                    else if (strcmp(type, "public"))
+                        ok = FALSE;
+                }
+                ok = ok && bachk(items[j]) >= 0 &&
+                     str2ba(items[j], &wl[nwl].bdaddr) >= 0;
+                nwl++;
+            }
+            ok = ok && j > 0;
+            g_strfreev(items);
+        } else {
+            ok = FALSE;
+        }
+    }
+
+    if (!ok || window > interval) {
+        resp_error(err_BAD_PARAM);
         return;
     }
 
-    if (!memcmp(opt_dst_type, "public", 6)) {
-        addr_type = BDADDR_LE_PUBLIC;
+    if (!lescan.io) {
+        lescan.io = lescan_open(path);
+        if (!lescan.io) {
+            resp_error(path ? err_CONN_FAIL : err_NO_MGMT);
+            return;
+        }
+        lescan.watch = g_io_add_watch(lescan.io,
+                                G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+                                lescan_event, NULL);
+        lescan.cmds = g_byte_array_new();
     }
 
-    memset(&cp, 0, sizeof(cp));
-    bacpy(&cp.addr.bdaddr, &bdaddr);
-    cp.addr.type = addr_type;
-    cp.io_cap = io_cap;
+    lescan.active = active;
+    lescan.interval = interval;
+    lescan.window = window;
+    lescan.filter_dup = filter_dup;
+    lescan.policy = nwl ? 0x01 : 0x00;
+    lescan.started = g_get_monotonic_time();
+    lescan.stopped = 0;
+    lescan.enabled_at = 0;
+    lescan.enabled_us = 0;
+    lescan.reports = 0;
+
+    enable.enable = 0;
+    enable.filter_dup = 0;
+    lescan_queue(OCF_LE_SET_SCAN_ENABLE, &enable, sizeof(enable));
+    if (nwl) {
+        lescan_queue(OCF_LE_CLEAR_WHITE_LIST, NULL, 0);
+        for (i = 0; i < nwl; i++)
+            lescan_queue(OCF_LE_ADD_DEVICE_TO_WHITE_LIST, &wl[i],
+                            sizeof(wl[i]));
+    }
 
-    if (mgmt_send(mgmt_master, MGMT_OP_PAIR_DEVICE,
-            mgmt_ind, sizeof(cp), &cp,
-                pair_device_complete, NULL,
-                NULL) == 0) {
-        DBG("mgmt_send(MGMT_OP_PAIR_DEVICE) failed for %s for hci%u", opt_dst, mgmt_ind);
-        resp_mgmt(err_PROTO_ERR);
-        return;
+    params.type = active;
+    params.interval = htobs(interval);
+    params.window = htobs(window);
+    params.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+    params.filter = lescan.policy;
+    lescan_queue(OCF_LE_SET_SCAN_PARAMETERS, &params, sizeof(params));
+
+    enable.enable = 1;
+    enable.filter_dup = filter_dup;
+    lescan_queue(OCF_LE_SET_SCAN_ENABLE, &enable, sizeof(enable));
+
+    if (!lescan_send()) {
+        lescan_close();
+        resp_error(err_COMM_ERR);
     }
 }
 
-static void unpair_device_complete(uint8_t status, uint16_t length,
-                    const void *param, void *user_data)
+/*
+ * Switch the output to binary frames, see bin_begin(). The reply is the
+ * last text line; commands stay text.
+ */
+static void cmd_binary(int argcp, char **argvp)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("status returned error : %s (0x%02x)",
-                mgmt_errstr(status), status);
-        resp_mgmt(err_PROTO_ERR);
+    if (1 < argcp) {
+        resp_error(err_BAD_PARAM);
         return;
     }
 
-    resp_mgmt(err_SUCCESS);
+    resp_begin(rsp_BINARY);
+    resp_end();
+    bin_mode = 1;
 }
 
-static void cmd_unpair(int argcp, char **argvp)
+/*
+ * Queue notifications and send them in batches; "stream <flush bytes>
+ * [<flush ms> [<max queued bytes>]]", all in hex, or "stream off". Either
+ * way, report the settings and counters.
+ */
+static void cmd_stream(int argcp, char **argvp)
 {
-    struct mgmt_cp_unpair_device cp;
-    bdaddr_t bdaddr;
-    uint8_t addr_type = BDADDR_LE_RANDOM;
+    long long arg[3] = { 0, 20, 0x40000 };
+    char *e;
+    int i;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
+    if (argcp > 4) {
+        resp_error(err_BAD_PARAM);
         return;
     }
 
-    if (str2ba(opt_dst, &bdaddr)) {
-        DBG("str2ba failed");
-        resp_mgmt(err_NOT_FOUND);
-        return;
-    }
+    if (argcp == 2 && strcmp(argvp[1], "off") == 0) {
+        if (stream_q) {
+            stream_flush(TRUE);
+            if (stream_timer)
+                g_source_remove(stream_timer);
+            stream_timer = 0;
+            g_byte_array_free(stream_q, TRUE);
+            stream_q = NULL;
+        }
+    } else if (argcp > 1) {
+        for (i = 1; i < argcp; i++) {
+            errno = 0;
+            arg[i - 1] = strtoll(argvp[i], &e, 16);
+            if (errno != 0 || *e != '\0' || arg[i - 1] < 0 ||
+                    arg[i - 1] > G_MAXINT) {
+                resp_error(err_BAD_PARAM);
+                return;
+            }
+        }
+        if (arg[0] == 0) {
+            resp_error(err_BAD_PARAM);
+            return;
+        }
 
-    if (!memcmp(opt_dst_type, "public", 6)) {
-        addr_type = BDADDR_LE_PUBLIC;
+        stream_size = arg[0];
+        stream_ms = arg[1];
+        /* Room for a full batch and the largest notification after it */
+        stream_max = MAX(arg[2], stream_size + STREAM_REC_HDR +
+                                 ATT_MAX_VALUE_LEN);
+        if (!stream_q) {
+            stream_q = g_byte_array_new();
+            stream_seq = stream_dropped = 0;
+        }
     }
 
-    memset(&cp, 0, sizeof(cp));
-    bacpy(&cp.addr.bdaddr, &bdaddr);
-    cp.addr.type = addr_type;
-    cp.disconnect = 1;
+    resp_begin(rsp_STREAM);
+    send_uint(tag_SIZE, stream_q ? stream_size : 0);
+    send_uint(tag_MS, stream_ms);
+    send_uint(tag_MAX, stream_max);
+    send_uint(tag_SEQ, stream_seq);
+    send_uint(tag_DROPPED, stream_dropped);
+    resp_end();
+}
 
-    if (mgmt_send(mgmt_master, MGMT_OP_UNPAIR_DEVICE,
-            mgmt_ind, sizeof(cp), &cp,
-            unpair_device_complete, NULL,
-                NULL) == 0) {
-        DBG("mgmt_send(MGMT_OP_UNPAIR_DEVICE) failed for %s for hci%u", opt_dst, mgmt_ind);
-        resp_mgmt(err_PROTO_ERR);
+/*
+ * Set the GATT cache directory for connections made from now on, or
+ * "off"; either way, report the directory and the hit counts.
+ */
+static void cmd_cache(int argcp, char **argvp)
+{
+    if (2 < argcp) {
+        resp_error(err_BAD_PARAM);
         return;
     }
+
+    if (argcp == 2) {
+        g_free(cache_dir);
+        cache_dir = NULL;
+        if (strcmp(argvp[1], "off")) {
+            if (g_mkdir_with_parents(argvp[1], 0700) < 0) {
+                resp_comment("Can't create %s: %s", argvp[1], strerror(errno));
+                resp_error(err_BAD_PARAM);
+                return;
+            }
+            cache_dir = g_strdup(argvp[1]);
+        }
+    }
+
+    resp_begin(rsp_CACHE);
+    if (cache_dir)
+        send_str(tag_PATH, cache_dir);
+    send_uint(tag_HITS, cache_hits);
+    send_uint(tag_MISSES, cache_misses);
+    resp_end();
 }
 
-static void scan_cb(uint8_t status, uint16_t length, const void *param, void *user_data)
+static gboolean scan_filter_parse(struct scan_filter *f, const char *arg)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("Scan error: %s (0x%02x)", mgmt_errstr(status), status);
-        resp_mgmt(status == MGMT_STATUS_BUSY? err_BUSY : err_PROTO_ERR);
-        return;
+    const char *val = strchr(arg, '=');
+    gboolean ok;
+    gchar **items;
+    size_t klen;
+    char *e;
+    long n;
+    int i;
+
+    if (!val)
+        return FALSE;
+    klen = val++ - arg;
+
+    if (klen == 4 && strncmp(arg, "name", 4) == 0) {
+        g_free(f->name);
+        f->name = g_strdup(val);
+        return TRUE;
     }
 
-    resp_mgmt(err_SUCCESS);
+    if (klen == 4 && strncmp(arg, "addr", 4) == 0) {
+        items = g_strsplit(val, ",", -1);
+        if (!f->addrs)
+            f->addrs = g_array_new(FALSE, FALSE, sizeof(bdaddr_t));
+        for (i = 0; items[i]; i++) {
+            bdaddr_t ba;
+
+            if (bachk(items[i]) < 0 || str2ba(items[i], &ba) < 0)
+                break;
+            g_array_append_val(f->addrs, ba);
+        }
+    } else if (klen == 4 && strncmp(arg, "uuid", 4) == 0) {
+        items = g_strsplit(val, ",", -1);
+        if (!f->uuids)
+            f->uuids = g_array_new(FALSE, FALSE, sizeof(bt_uuid_t));
+        for (i = 0; items[i]; i++) {
+            bt_uuid_t uuid, uuid128;
+
+            if (bt_string_to_uuid(&uuid, items[i]) < 0)
+                break;
+            bt_uuid_to_uuid128(&uuid, &uuid128);
+            g_array_append_val(f->uuids, uuid128);
+        }
+    } else if (klen == 3 && strncmp(arg, "mfr", 3) == 0) {
+        items = g_strsplit(val, ",", -1);
+        if (!f->mfrs)
+            f->mfrs = g_array_new(FALSE, FALSE, sizeof(uint16_t));
+        for (i = 0; items[i]; i++) {
+            uint16_t id;
+
+            errno = 0;
+            n = strtol(items[i], &e, 0);
+            if (errno != 0 || *e != '\0' || e == items[i] ||
+                    n < 0 || n > 0xffff)
+                break;
+            id = n;
+            g_array_append_val(f->mfrs, id);
+        }
+    } else {
+        errno = 0;
+        n = strtol(val, &e, 0);
+        if (errno != 0 || *e != '\0' || e == val)
+            return FALSE;
+
+        if (klen == 4 && strncmp(arg, "rssi", 4) == 0 &&
+                n >= -128 && n <= 127) {
+            f->have_rssi = TRUE;
+            f->rssi = n;
+        } else if (klen == 5 && strncmp(arg, "dedup", 5) == 0 &&
+                n >= 0 && n <= G_MAXINT) {
+            f->dedup_ms = n;
+        } else if (klen == 9 && strncmp(arg, "rssidelta", 9) == 0 &&
+                n >= 0 && n <= 255) {
+            f->rssi_delta = n;
+        } else {
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    /* Not an empty list, nor one stopped at a bad item */
+    ok = i > 0 && items[i] == NULL;
+    g_strfreev(items);
+    return ok;
 }
 
-// Unlike Bluez, we follow BT 4.0 spec which renammed Device Discovery by Scan
-static void scan(bool start)
+/*
+ * Filter scan reports; "scanfilter <key>=<value> ...", with keys addr,
+ * uuid and mfr taking comma-separated lists, and name, rssi (dBm), dedup
+ * (ms) and rssidelta (dB), or "scanfilter off". Either way, report the
+ * counters since the filter was set.
+ */
+static void cmd_scanfilter(int argcp, char **argvp)
 {
-    // mgmt_cp_start_discovery and mgmt_cp_stop_discovery are the same
-    struct mgmt_cp_start_discovery cp = { (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM) };
-    uint16_t opcode = start? MGMT_OP_START_DISCOVERY : MGMT_OP_STOP_DISCOVERY;
+    struct scan_filter f;
+    int i;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
-        return;
+    if (argcp == 2 && strcmp(argvp[1], "off") == 0) {
+        scan_filter_clear(&scan_filter);
+    } else if (argcp > 1) {
+        memset(&f, 0, sizeof(f));
+        for (i = 1; i < argcp; i++) {
+            if (!scan_filter_parse(&f, argvp[i])) {
+                scan_filter_clear(&f);
+                resp_error(err_BAD_PARAM);
+                return;
+            }
+        }
+
+        scan_filter_clear(&scan_filter);
+        scan_filter = f;
+        scan_filter.on = TRUE;
     }
 
-    DBG("Scan %s", start? "start" : "stop");
+    resp_begin(rsp_SCAN_FILTER);
+    send_uint(tag_MS, scan_filter.dedup_ms);
+    send_uint(tag_RECEIVED, scan_filter.received);
+    send_uint(tag_SENT, scan_filter.sent);
+    send_uint(tag_DEVICES, scan_filter.devs ?
+                            g_hash_table_size(scan_filter.devs) : 0);
+    resp_end();
+}
 
-    if (mgmt_send(mgmt_master, opcode, mgmt_ind, sizeof(cp),
-        &cp, scan_cb, NULL, NULL) == 0)
-    {
-        DBG("mgmt_send(MGMT_OP_%s_DISCOVERY) failed", start? "START" : "STOP");
-        resp_mgmt(err_PROTO_ERR);
+/*
+ * Send the parsed fields of new advertising data with the scan reports,
+ * as well as the data; "scanfields [on | off]". Either forgets the data
+ * sent so far, for a new scan.
+ */
+static void cmd_scanfields(int argcp, char **argvp)
+{
+    if (argcp > 2 || (argcp == 2 && strcmp(argvp[1], "on") &&
+                      strcmp(argvp[1], "off"))) {
+        resp_error(err_BAD_PARAM);
         return;
     }
+
+    if (argcp == 2) {
+        scan_fields = strcmp(argvp[1], "on") == 0;
+        if (scan_filter.devs)
+            g_hash_table_remove_all(scan_filter.devs);
+    }
+
+    resp_begin(rsp_SCAN_FIELDS);
+    send_uint(tag_FIELDS, scan_fields);
+    resp_end();
 }
 
 static void cmd_scanend(int argcp, char **argvp)
@@ -1393,8 +4503,14 @@ static struct {
         "Characteristics Discovery" },
     { "desc",       cmd_char_desc,  "[start hnd] [end hnd]",
         "Characteristics Descriptor Discovery" },
+    { "discall",    cmd_discover_all, "",
+        "Services, includes, characteristics and descriptors at once" },
     { "rd",         cmd_read_hnd,   "<handle>",
         "Characteristics Value/Descriptor Read by handle" },
+    { "rdm",        cmd_read_multi, "<handle>[:<length>] ...",
+        "Characteristics Values/Descriptors Read by handles, in one response" },
+    { "sub",        cmd_subscribe,  "<CCCD handle>[:<value>] ...",
+        "Notifications/indications enabled on each handle" },
     { "rdu",        cmd_read_uuid,  "<UUID> [start hnd] [end hnd]",
         "Characteristics Value/Descriptor Read by UUID" },
     { "wrr",        cmd_char_write_rsp, "<handle> <new value>",
@@ -1417,6 +4533,18 @@ static struct {
         "Start scan" },
     { "scanend",    cmd_scanend,    "",
         "Force scan end" },
+    { "lescan",     cmd_lescan,     "[<key>=<value> ... | off]",
+        "Scan continuously with HCI scan parameters" },
+    { "scanfilter", cmd_scanfilter, "[<key>=<value> ... | off]",
+        "Scan reports filtered and repeats dropped" },
+    { "scanfields", cmd_scanfields, "[on | off]",
+        "Parsed advertising data in scan reports" },
+    { "bin",        cmd_binary,     "",
+        "Binary response frames from now on" },
+    { "stream",     cmd_stream,     "[<flush bytes> [<flush ms> [<max bytes>]] | off]",
+        "Notifications sent in batches" },
+    { "cache",      cmd_cache,      "[directory | off]",
+        "Keep discovery results per device in a directory" },
     { NULL, NULL, NULL}
 };
 
@@ -1425,8 +4553,9 @@ static void cmd_help(int argcp, char **argvp)
     int i;
 
     for (i = 0; commands[i].cmd; i++)
-        printf("#%-15s %-30s %s\n", commands[i].cmd,
+        resp_comment("%-15s %-30s %s", commands[i].cmd,
                 commands[i].params, commands[i].desc);
+    resp_comment("Prefix a command with @<conn> for connections other than 0");
     cmd_status(0, NULL);
 }
 
@@ -1434,24 +4563,38 @@ static void parse_line(char *line_read)
 {
     gchar **argvp;
     int argcp;
-    int i;
+    int i, id = 0, skip = 0;
 
     line_read = g_strstrip(line_read);
 
     if (*line_read == '\0')
         goto done;
 
-    g_shell_parse_argv(line_read, &argcp, &argvp, NULL);
+    if (!g_shell_parse_argv(line_read, &argcp, &argvp, NULL)) {
+        resp_error(err_BAD_CMD);
+        goto done;
+    }
+
+    if (argvp[0][0] == '@') {
+        id = strtohandle(argvp[0] + 1);
+        if (id < 0 || id >= MAX_CONNS || argcp < 2) {
+            resp_error(err_NO_CONN);
+            goto free;
+        }
+        skip = 1;
+    }
+    cur = &conns[id];
 
     for (i = 0; commands[i].cmd; i++)
-        if (strcasecmp(commands[i].cmd, argvp[0]) == 0)
+        if (strcasecmp(commands[i].cmd, argvp[skip]) == 0)
             break;
 
     if (commands[i].cmd)
-        commands[i].func(argcp, argvp);
+        commands[i].func(argcp - skip, argvp + skip);
     else
         resp_error(err_BAD_CMD);
 
+free:
     g_strfreev(argvp);
 
 done:
@@ -1517,7 +4660,10 @@ static void mgmt_scanning(uint16_t index, uint16_t length,
 
     DBG("Scanning (0x%x): %s", ev->type, ev->discovering? "started" : "ended");
 
-    set_state(ev->discovering? STATE_SCANNING : STATE_DISCONNECTED);
+    scanning = ev->discovering;
+    resp_begin(rsp_STATUS);
+    send_sym(tag_CONNSTATE, scanning ? st_SCANNING : st_DISCONNECTED);
+    resp_end();
 }
 
 static void mgmt_device_found(uint16_t index, uint16_t length,
@@ -1527,16 +4673,10 @@ static void mgmt_device_found(uint16_t index, uint16_t length,
     assert(length == sizeof(*ev) + ev->eir_len);
 
     // Result sometimes sent too early
-    if (conn_state != STATE_SCANNING)
+    if (!scanning)
         return;
 
-    resp_begin(rsp_SCAN);
-    send_addr(&ev->addr);
-    send_uint(tag_RSSI, -ev->rssi);
-    send_uint(tag_FLAG, -ev->flags);
-    if (ev->eir_len)
-        send_data(ev->eir, ev->eir_len);
-    resp_end();
+    scan_report(&ev->addr, ev->rssi, ev->flags, ev->eir, ev->eir_len);
 }
 
 static void mgmt_debug(const char *str, void *user_data)
@@ -1580,12 +4720,14 @@ int main(int argc, char *argv[])
 {
     GIOChannel *pchan;
     gint events;
+    int i;
 
-    opt_sec_level = g_strdup("low");
-
-    opt_src = NULL;
-    opt_dst = NULL;
-    opt_dst_type = g_strdup("public");
+    for (i = 0; i < MAX_CONNS; i++) {
+        conns[i].id = i;
+        conns[i].sec_level = g_strdup("low");
+        conns[i].dst_type = g_strdup("public");
+    }
+    cur = &conns[0];
 
     DBG(__FILE__ " built at " __TIME__ " on " __DATE__);
 
@@ -1610,15 +4752,20 @@ int main(int argc, char *argv[])
     g_main_loop_run(event_loop);
 
     DBG("Exiting loop");
-    cmd_disconnect(0, NULL);
+    for (i = 0; i < MAX_CONNS; i++) {
+        disconnect_io(&conns[i]);
+        g_free(conns[i].src);
+        g_free(conns[i].dst);
+        g_free(conns[i].dst_type);
+        g_free(conns[i].sec_level);
+    }
+    g_free(cache_dir);
+    lescan_stop();
+    scan_filter_clear(&scan_filter);
     fflush(stdout);
     g_io_channel_unref(pchan);
     g_main_loop_unref(event_loop);
 
-    g_free(opt_src);
-    g_free(opt_dst);
-    g_free(opt_sec_level);
-
     mgmt_unregister_index(mgmt_master, mgmt_ind);
     mgmt_cancel_index(mgmt_master, mgmt_ind);
     mgmt_unref(mgmt_master);
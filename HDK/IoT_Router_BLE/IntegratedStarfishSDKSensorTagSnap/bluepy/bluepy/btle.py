@@ -12,6 +12,13 @@ import select
 import struct
 
 Debugging = False
+# Have bluepy-helper send binary frames instead of text lines; see the
+# "bin" command in bluepy-helper.c
+BinaryFrames = False
+# Directory in which bluepy-helper keeps the services, characteristics and
+# descriptors found on each device, to skip discovery on reconnection; see
+# the "cache" command in bluepy-helper.c
+GattCacheDir = None
 script_path = os.path.join(os.path.abspath(os.path.dirname(__file__)))
 helperExe = os.path.join(script_path, "bluepy-helper")
 
@@ -227,32 +234,69 @@ class BluepyHelper:
         self._helper = None
         self._poller = None
         self._stderr = None
+        self._binary = False
+        self._rbuf = b''
+        self._rpos = 0
+        self._shared = None     # SharedHelper, if not running our own
+        self.notificationsDropped = 0   # by the helper, when streaming
+        self._conn = 0
+        self._pending = []
         self.delegate = DefaultDelegate()
 
     def withDelegate(self, delegate_):
         self.delegate = delegate_
         return self
 
-    def _startHelper(self,iface=None):
+    def _startHelper(self,iface=None,binary=None):
+        if self._shared is not None:
+            self._shared._attach(self)
+            return
         if self._helper is None:
             DBG("Running ", helperExe)
             self._stderr = open(os.devnull, "w")
             args=[helperExe]
             if iface is not None: args.append(str(iface))
+            self._binary = BinaryFrames if binary is None else binary
+            self._rbuf = b''
+            self._rpos = 0
             self._helper = subprocess.Popen(args,
                                             stdin=subprocess.PIPE,
                                             stdout=subprocess.PIPE,
                                             stderr=self._stderr,
-                                            universal_newlines=True)
+                                            bufsize=0)
             self._poller = select.poll()
             self._poller.register(self._helper.stdout, select.POLLIN)
+            if self._binary and not self._startBinary():
+                # An older helper, carry on with text
+                DBG("Binary frames not supported by helper")
+                self._stopHelper()
+                self._startHelper(iface, False)
+                return
+            if GattCacheDir is not None:
+                self._startCache(GattCacheDir)
+
+    def _startBinary(self):
+        self._writeCmd("bin\n")
+        while True:
+            line = self._readLine(None)
+            DBG("Got:", repr(line))
+            if not line.startswith('#') and line != '\n':
+                return BluepyHelper.parseResp(line)['rsp'][0] == 'bin'
+
+    def _startCache(self, path):
+        self._writeCmd("cache '%s'\n" % path.replace("'", "'\\''"))
+        resp = self._readResp(None)
+        if resp['rsp'][0] != 'cache':
+            DBG("GATT cache not supported by helper")
 
     def _stopHelper(self):
+        if self._shared is not None:
+            self._shared._detach(self)
+            return
         if self._helper is not None:
             DBG("Stopping ", helperExe)
             self._poller.unregister(self._helper.stdout)
-            self._helper.stdin.write("quit\n")
-            self._helper.stdin.flush()
+            self._writeCmd("quit\n")
             self._helper.wait()
             self._helper = None
         if self._stderr is not None:
@@ -263,8 +307,11 @@ class BluepyHelper:
         if self._helper is None:
             raise BTLEException(BTLEException.INTERNAL_ERROR,
                                 "Helper not started (did you call connect()?)")
+        if self._shared is not None:
+            self._shared._writeCmd("@%x %s" % (self._conn, cmd))
+            return
         DBG("Sent: ", cmd)
-        self._helper.stdin.write(cmd)
+        self._helper.stdin.write(cmd.encode('utf-8'))
         self._helper.stdin.flush()
 
     def _mgmtCmd(self, cmd):
@@ -298,52 +345,249 @@ class BluepyHelper:
                 resp[tag].append(val)
         return resp
 
-    def _waitResp(self, wantType, timeout=None):
+    @staticmethod
+    def parseFrame(body, pos=0, end=None):
+        # Fields are kind, tag length, tag, then a u32 for kind 'h', or a
+        # u16 length and the bytes
+        resp = {}
+        if end is None:
+            end = len(body)
+        while pos < end:
+            (kind, taglen) = struct.unpack_from('<BB', body, pos)
+            pos += 2
+            tag = body[pos:pos+taglen].decode('utf-8')
+            pos += taglen
+            if kind == 0x68: # 'h'
+                val = struct.unpack_from('<I', body, pos)[0]
+                pos += 4
+            else:
+                vlen = struct.unpack_from('<H', body, pos)[0]
+                pos += 2
+                val = body[pos:pos+vlen]
+                pos += vlen
+                if kind != 0x62: # 'b'
+                    val = val.decode('utf-8')
+            if tag not in resp:
+                resp[tag] = [val]
+            else:
+                resp[tag].append(val)
+        return resp
+
+    def _readMore(self, timeout):
+        if timeout:
+            fds = self._poller.poll(timeout*1000)
+            if len(fds) == 0:
+                return False
+        data = os.read(self._helper.stdout.fileno(), 65536)
+        if not data:
+            raise BTLEException(BTLEException.INTERNAL_ERROR, "Helper exited")
+        if self._rpos:
+            self._rbuf = self._rbuf[self._rpos:]
+            self._rpos = 0
+        self._rbuf += data
+        return True
+
+    def _readLine(self, timeout):
+        while True:
+            nl = self._rbuf.find(b'\n', self._rpos)
+            if nl >= 0:
+                line = self._rbuf[self._rpos:nl+1].decode('utf-8')
+                self._rpos = nl + 1
+                return line
+            if not self._readMore(timeout):
+                return None
+
+    def _readFrame(self, timeout):
+        while True:
+            avail = len(self._rbuf) - self._rpos
+            if avail >= 4:
+                n = struct.unpack_from('<I', self._rbuf, self._rpos)[0]
+                if avail >= 4 + n:
+                    start = self._rpos + 4
+                    self._rpos = start + n
+                    return BluepyHelper.parseFrame(self._rbuf, start, start + n)
+            if not self._readMore(timeout):
+                return None
+
+    def _readResp(self, timeout):
         while True:
             if self._helper.poll() is not None:
                 raise BTLEException(BTLEException.INTERNAL_ERROR, "Helper exited")
 
-            if timeout:
-                fds = self._poller.poll(timeout*1000)
-                if len(fds) == 0:
+            if self._binary:
+                resp = self._readFrame(timeout)
+                if resp is None:
                     DBG("Select timeout")
                     return None
+                DBG("Got:", resp)
+            else:
+                rv = self._readLine(timeout)
+                if rv is None:
+                    DBG("Select timeout")
+                    return None
+                DBG("Got:", repr(rv))
+                if rv.startswith('#') or rv == '\n':
+                    continue
 
-            rv = self._helper.stdout.readline()
-            DBG("Got:", repr(rv))
-            if rv.startswith('#') or rv == '\n':
-                continue
+                resp = BluepyHelper.parseResp(rv)
 
-            resp = BluepyHelper.parseResp(rv)
             if 'rsp' not in resp:
                 raise BTLEException(BTLEException.INTERNAL_ERROR, "No response type indicator")
+            return resp
 
-            respType = resp['rsp'][0]
-            if respType in wantType:
-                return resp
-            elif respType == 'stat' and resp['state'][0] == 'disc':
-                self._stopHelper()
-                raise BTLEException(BTLEException.DISCONNECTED, "Device disconnected")
-            elif respType == 'err':
-                errcode=resp['code'][0]
-                if errcode=='nomgmt':
-                    raise BTLEException(BTLEException.MGMT_ERROR, "Management not available (permissions problem?)")
-                else:
-                    raise BTLEException(BTLEException.COMM_ERROR, "Error from Bluetooth stack (%s)" % errcode)
-            elif respType == 'scan':
-                # Scan response when we weren't interested. Ignore it
-                continue
+    def _wantResp(self, resp, wantType):
+        respType = resp['rsp'][0]
+        if respType in wantType:
+            return True
+        elif respType == 'stat' and resp['state'][0] == 'disc':
+            self._stopHelper()
+            raise BTLEException(BTLEException.DISCONNECTED, "Device disconnected")
+        elif respType == 'err':
+            errcode=resp['code'][0]
+            if errcode=='nomgmt':
+                raise BTLEException(BTLEException.MGMT_ERROR, "Management not available (permissions problem?)")
             else:
-                raise BTLEException(BTLEException.INTERNAL_ERROR, "Unexpected response (%s)" % respType)
+                raise BTLEException(BTLEException.COMM_ERROR, "Error from Bluetooth stack (%s)" % errcode)
+        elif respType == 'scan':
+            # Scan response when we weren't interested. Ignore it
+            return False
+        else:
+            raise BTLEException(BTLEException.INTERNAL_ERROR, "Unexpected response (%s)" % respType)
+
+    def _waitResp(self, wantType, timeout=None):
+        if self._shared is not None:
+            return self._shared._waitFor(self, wantType, timeout)
+        while True:
+            resp = self._readResp(timeout)
+            if resp is None:
+                return None
+            if self._wantResp(resp, wantType):
+                return resp
 
     def status(self):
         self._writeCmd("stat\n")
         return self._waitResp(['stat'])
 
+    def streamNotifications(self, flushBytes=4096, flushMs=20, maxBytes=0x40000):
+        # Has the helper send notifications in batches, once flushBytes are
+        # waiting or flushMs after the first; flushBytes=None sends each at
+        # once again. Notifications that would leave more than maxBytes
+        # waiting for Python are dropped, and counted in notificationsDropped.
+        if flushBytes is None:
+            self._writeCmd("stream off\n")
+        else:
+            self._writeCmd("stream %X %X %X\n" % (flushBytes, flushMs, maxBytes))
+        return self._getResp('stream')
+
+    def _notifyBatch(self, resp):
+        # The (conn, handle, data) of each notification in an "nbat" response
+        self.notificationsDropped = resp['drop'][0]
+        return zip(resp.get('conn', []), resp.get('hnd', []), resp.get('d', []))
+
+
+class SharedHelper(BluepyHelper):
+    """One bluepy-helper process serving many Peripheral connections"""
+
+    MAX_CONNS = 64
+
+    def __init__(self, iface=None, binary=None):
+        BluepyHelper.__init__(self)
+        self._peripherals = {}  # Indexed by connection number
+        self._startHelper(iface, binary)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        self.close()
+
+    def _attach(self, periph):
+        if periph._helper is not None:
+            return
+        if self._helper is None:
+            raise BTLEException(BTLEException.INTERNAL_ERROR, "Shared helper closed")
+        free = [c for c in range(self.MAX_CONNS) if c not in self._peripherals]
+        if not free:
+            raise BTLEException(BTLEException.INTERNAL_ERROR, "No free connections")
+        periph._conn = free[0]
+        periph._pending = []
+        periph._helper = self._helper
+        self._peripherals[periph._conn] = periph
+
+    def _detach(self, periph):
+        if self._peripherals.get(periph._conn) is periph:
+            del self._peripherals[periph._conn]
+        periph._helper = None
+
+    def _notify(self, conn, hnd, data):
+        periph = self._peripherals.get(conn)
+        if periph is not None and periph.delegate is not None:
+            periph.delegate.handleNotification(hnd, data)
+
+    def _dispatch(self, conn, resp):
+        # A response for a connection other than the one being waited on
+        periph = self._peripherals.get(conn)
+        if periph is None:
+            return
+        if resp['rsp'][0] in ('ntfy', 'ind'):
+            self._notify(conn, resp['hnd'][0], resp['d'][0])
+        else:
+            periph._pending.append(resp)
+
+    def _deliver(self, resp):
+        if resp['rsp'][0] == 'nbat':
+            for (conn, hnd, data) in self._notifyBatch(resp):
+                self._notify(conn, hnd, data)
+        elif 'conn' in resp:
+            self._dispatch(resp['conn'][0], resp)
+
+    def _getResp(self, wantType, timeout=None):
+        # A response for no connection in particular
+        while True:
+            resp = self._readResp(timeout)
+            if resp is None:
+                return None
+            if resp['rsp'][0] == 'nbat' or 'conn' in resp:
+                self._deliver(resp)
+            elif self._wantResp(resp, [wantType]):
+                return resp
+
+    def _waitFor(self, periph, wantType, timeout):
+        while True:
+            if periph._pending:
+                resp = periph._pending.pop(0)
+            else:
+                resp = self._readResp(timeout)
+                if resp is None:
+                    return None
+                if resp['rsp'][0] == 'nbat':
+                    self._deliver(resp)
+                    continue
+                conn = resp.get('conn', [periph._conn])[0]
+                if conn != periph._conn:
+                    self._dispatch(conn, resp)
+                    continue
+            if periph._wantResp(resp, wantType):
+                return resp
+
+    def waitForNotifications(self, timeout):
+        """Passes the next response for any connection to its Peripheral"""
+        resp = self._readResp(timeout)
+        if resp is None:
+            return False
+        self._deliver(resp)
+        return True
+
+    def close(self):
+        for periph in list(self._peripherals.values()):
+            periph.disconnect()
+        self._stopHelper()
+
 
 class Peripheral(BluepyHelper):
-    def __init__(self, deviceAddr=None, addrType=ADDR_TYPE_PUBLIC, iface=None):
+    def __init__(self, deviceAddr=None, addrType=ADDR_TYPE_PUBLIC, iface=None, helper=None):
         BluepyHelper.__init__(self)
+        self._shared = helper
         self._serviceMap = None # Indexed by UUID
         (self.deviceAddr, self.addrType, self.iface) = (None, None, None)
 
@@ -366,12 +610,18 @@ class Peripheral(BluepyHelper):
             wantType = [wantType]
 
         while True:
-            resp = self._waitResp(wantType + ['ntfy', 'ind'], timeout)
+            resp = self._waitResp(wantType + ['ntfy', 'ind', 'nbat'], timeout)
             if resp is None:
                 return None
 
             respType = resp['rsp'][0]
-            if respType == 'ntfy' or respType == 'ind':
+            if respType == 'nbat':
+                for (conn, hnd, data) in self._notifyBatch(resp):
+                    if self.delegate is not None:
+                        self.delegate.handleNotification(hnd, data)
+                if respType not in wantType:
+                    continue
+            elif respType == 'ntfy' or respType == 'ind':
                 hnd = resp['hnd'][0]
                 data = resp['d'][0]
                 if self.delegate is not None:
@@ -433,6 +683,31 @@ class Peripheral(BluepyHelper):
     def getServices(self):
         return self.services
 
+    def discoverAll(self):
+        # One helper command finds every service, characteristic and
+        # descriptor, and fills them in so later calls need no more
+        self._writeCmd("discall\n")
+        rsp = self._getResp('db')
+        self._serviceMap = {}
+        for i in range(len(rsp.get('hstart', []))):
+            svc = Service(self, rsp['uuid'][i], rsp['hstart'][i], rsp['hend'][i])
+            svc.chars = []
+            self._serviceMap[svc.uuid] = svc
+        chars = []
+        for i in range(len(rsp.get('hnd', []))):
+            ch = Characteristic(self, rsp['cuuid'][i], rsp['hnd'][i],
+                                rsp['props'][i], rsp['vhnd'][i])
+            ch.descs = []
+            chars.append(ch)
+            for svc in self._serviceMap.values():
+                if svc.hndStart <= ch.handle <= svc.hndEnd:
+                    svc.chars.append(ch)
+        for i in range(len(rsp.get('dhnd', []))):
+            owner = [ch for ch in chars if ch.valHandle < rsp['dhnd'][i]]
+            if owner:
+                owner[-1].descs.append(Descriptor(self, rsp['duuid'][i], rsp['dhnd'][i]))
+        return self._serviceMap.values()
+
     def getServiceByUUID(self, uuidVal):
         uuid = UUID(uuidVal)
         if self._serviceMap is not None and uuid in self._serviceMap:
@@ -483,6 +758,22 @@ class Peripheral(BluepyHelper):
         resp = self._getResp('rd')
         return resp['d'][0]
 
+    def readCharacteristics(self, handles):
+        # Each entry is a handle, or (handle, length) for a value that is
+        # always that long; those can share a Read Multiple request. Returns
+        # the values in the same order, from one helper command.
+        if not handles:
+            return []
+        args = []
+        for h in handles:
+            if isinstance(h, tuple):
+                args.append("%X:%X" % h)
+            else:
+                args.append("%X" % h)
+        self._writeCmd("rdm %s\n" % " ".join(args))
+        resp = self._getResp('rdm')
+        return resp['d']
+
     def _readCharacteristicByUUID(self, uuid, startHnd, endHnd):
         # Not used at present
         self._writeCmd("rdu %s %X %X\n" % (UUID(uuid), startHnd, endHnd))
@@ -495,6 +786,18 @@ class Peripheral(BluepyHelper):
         self._writeCmd("%s %X %s\n" % (cmd, handle, binascii.b2a_hex(val).decode('utf-8')))
         return self._getResp('wr')
 
+    def subscribe(self, cccdHandles, indication=False):
+        # Enables notifications, or indications, through each Client
+        # Characteristic Configuration descriptor with one helper command
+        return self._setCCCDs(cccdHandles, 2 if indication else 1)
+
+    def unsubscribe(self, cccdHandles):
+        return self._setCCCDs(cccdHandles, 0)
+
+    def _setCCCDs(self, cccdHandles, value):
+        self._writeCmd("sub %s\n" % " ".join("%X:%X" % (h, value) for h in cccdHandles))
+        return self._getResp('wr')
+
     def setSecurityLevel(self, level):
         self._writeCmd("secu %s\n" % level)
         return self._getResp('stat')
@@ -507,13 +810,13 @@ class Peripheral(BluepyHelper):
         return self._getResp('stat')
 
     def waitForNotifications(self, timeout):
-         resp = self._getResp(['ntfy','ind'], timeout)
+         resp = self._getResp(['ntfy','ind','nbat'], timeout)
          return (resp != None)
 
     def __del__(self):
         self.disconnect()
 
-class ScanEntry:
+class ScanEntry(object):
     addrTypes = { 1 : ADDR_TYPE_PUBLIC,
                   2 : ADDR_TYPE_RANDOM
                 }
@@ -549,10 +852,107 @@ class ScanEntry:
         self.rssi = None
         self.connectable = False
         self.rawData = None
-        self.scanData = {}
+        self._scanData = {}
+        self._unparsed = []     # data not yet in _scanData
+        self._recent = []       # the last two different payloads
         self.updateCount = 0
+        self.reportCount = 0
+        self.adFlags = None
+        self.name = None
+        self._nameShort = False
+        self.txPower = None
+        self.appearance = None
+        self.serviceUUIDs = []
+        self.solicitedUUIDs = []
+        self.serviceData = {}
+        self.manufacturerData = {}
+
+    @property
+    def scanData(self):
+        self._parseUnparsed()
+        return self._scanData
+
+    def _parseUnparsed(self):
+        for data in self._unparsed:
+            self._parseData(data)
+        self._unparsed = []
+
+    def _parseData(self, data):
+        isNewData = False
+        while len(data) >= 2:
+            sdlen, sdid = struct.unpack_from('<BB', data)
+            val = data[2 : sdlen + 1]
+            if (sdid not in self._scanData) or (val != self._scanData[sdid]):
+                isNewData = True
+            self._scanData[sdid] = val
+            data = data[sdlen + 1:]
+        return isNewData
+
+    @staticmethod
+    def _adUUID(val):
+        if len(val) == 16:
+            return UUID(binascii.b2a_hex(val[::-1]).decode('utf-8'))
+        return UUID(struct.unpack('<H' if len(val) == 2 else '<I', val)[0])
 
-    def _update(self, resp):
+    def _parseFields(self, data):
+        # The same fields as bluepy-helper's, when it does not send them
+        resp = {}
+        while len(data) >= 2:
+            sdlen, sdid = struct.unpack_from('<BB', data)
+            val = data[2 : sdlen + 1]
+            data = data[sdlen + 1:]
+            if len(val) < sdlen - 1:
+                break
+            if sdid == 1 and val:
+                resp['adflags'] = [bytearray(val)[0]]
+            elif sdid in (8, 9) and not (sdid == 8 and 'name' in resp and 'nshort' not in resp):
+                resp['name'] = [val]
+                if sdid == 8:
+                    resp['nshort'] = [1]
+                else:
+                    resp.pop('nshort', None)
+            elif sdid == 0xA and val:
+                resp['txp'] = [bytearray(val)[0]]
+            elif sdid == 0x19 and len(val) == 2:
+                resp['appear'] = [struct.unpack('<H', val)[0]]
+            elif sdid in (2, 3, 4, 5, 6, 7, 0x14, 0x1F, 0x15):
+                size = {2: 2, 3: 2, 0x14: 2, 4: 4, 5: 4, 0x1F: 4}.get(sdid, 16)
+                resp.setdefault('sol' if sdid >= 0x14 else 'svc', []).extend(
+                    self._adUUID(val[i : i + size])
+                    for i in range(0, len(val) - size + 1, size))
+            elif sdid in (0x16, 0x20, 0x21):
+                size = {0x16: 2, 0x20: 4}.get(sdid, 16)
+                if len(val) >= size:
+                    resp.setdefault('sdu', []).append(self._adUUID(val[:size]))
+                    resp.setdefault('sdd', []).append(val[size:])
+            elif sdid == 0xFF and len(val) >= 2:
+                resp.setdefault('mfr', []).append(struct.unpack('<H', val[:2])[0])
+                resp.setdefault('mfd', []).append(val[2:])
+        self._updateFields(resp)
+
+    def _updateFields(self, resp):
+        # From the fields bluepy-helper parsed out of the data
+        if 'adflags' in resp:
+            self.adFlags = resp['adflags'][0]
+        if 'name' in resp and (self.name is None or self._nameShort
+                               or 'nshort' not in resp):
+            self.name = resp['name'][0].decode('utf-8', 'replace')
+            self._nameShort = 'nshort' in resp
+        if 'txp' in resp:
+            txp = resp['txp'][0]
+            self.txPower = txp - 256 if txp > 127 else txp
+        if 'appear' in resp:
+            self.appearance = resp['appear'][0]
+        for (tag, uuids) in (('svc', self.serviceUUIDs), ('sol', self.solicitedUUIDs)):
+            for u in resp.get(tag, []):
+                u = UUID(u)
+                if u not in uuids:
+                    uuids.append(u)
+        self.serviceData.update(zip([UUID(u) for u in resp.get('sdu', [])],
+                                    resp.get('sdd', [])))
+        self.manufacturerData.update(zip(resp.get('mfr', []), resp.get('mfd', [])))
+
+    def _update(self, resp, fields=False):
         addrType = self.addrTypes.get(resp['type'][0], None)
         if (self.addrType is not None) and (addrType != self.addrType):
             raise BTLEException("Address type changed during scan, for address %s" % self.addr)
@@ -565,16 +965,23 @@ class ScanEntry:
         # Note: bluez is notifying devices twice: once with advertisement data,
         # then with scan response data. Also, the device may update the
         # advertisement or scan data
-        isNewData = False
-        while len(data) >= 2:
-            sdlen, sdid = struct.unpack_from('<BB', data)
-            val = data[2 : sdlen + 1]
-            if (sdid not in self.scanData) or (val != self.scanData[sdid]):
-                isNewData = True
-            self.scanData[sdid] = val
-            data = data[sdlen + 1:]
+        if fields:
+            # The helper sends the fields of data new to it, as it is to us;
+            # leave scanData until asked for
+            isNewData = data not in self._recent
+            if isNewData:
+                self._recent = [data] + self._recent[:1]
+                self._updateFields(resp)
+                self._unparsed.append(data)
+                if len(self._unparsed) > 8:
+                    self._parseUnparsed()
+        else:
+            isNewData = self._parseData(data)
+            if isNewData:
+                self._parseFields(data)
 
         self.updateCount += 1
+        self.reportCount = resp.get('cnt', [self.updateCount])[0]
         return isNewData
         
     def getDescription(self, sdid):
@@ -600,10 +1007,61 @@ class Scanner(BluepyHelper):
         BluepyHelper.__init__(self)
         self.scanned = {}
         self.iface=iface
-    
+        self._filter = None
+        self._fields = True
+        self._lescan = None
+        self._hciSocket = None
+
+    def withFilter(self, addrs=None, uuids=None, namePrefix=None,
+                   manufacturers=None, minRSSI=None, dedupMs=0, rssiDelta=0):
+        '''Has bluepy-helper report only matching devices, and drop repeats'''
+        args = []
+        if addrs:
+            args.append("addr=" + ",".join(addrs))
+        if uuids:
+            args.append("uuid=" + ",".join(str(UUID(u)) for u in uuids))
+        if namePrefix:
+            args.append("'name=%s'" % namePrefix.replace("'", "'\\''"))
+        if manufacturers:
+            args.append("mfr=" + ",".join("0x%04X" % m for m in manufacturers))
+        if minRSSI is not None:
+            args.append("rssi=%d" % minRSSI)
+        if dedupMs:
+            args.append("dedup=%d" % dedupMs)
+        if rssiDelta:
+            args.append("rssidelta=%d" % rssiDelta)
+        self._filter = " ".join(args) if args else None
+        return self
+
+    def withScanParameters(self, active=False, intervalMs=10, windowMs=10,
+                           filterDuplicates=False, whiteList=None, hciSocket=None):
+        '''Scans continuously with these HCI parameters, rather than
+           restarting kernel discovery'''
+        args = ["type=%s" % ("active" if active else "passive"),
+                "interval=%g" % intervalMs, "window=%g" % windowMs,
+                "dupfilter=%d" % (1 if filterDuplicates else 0)]
+        if whiteList:
+            args.append("wl=" + ",".join(
+                a if isinstance(a, str) else "%s/%s" % a for a in whiteList))
+        if hciSocket:
+            args.append("'hci=%s'" % hciSocket.replace("'", "'\\''"))
+        self._lescan = " ".join(args)
+        self._hciSocket = hciSocket
+        return self
+
     def start(self):
         self._startHelper(iface=self.iface)
-        self._mgmtCmd("le on")
+        if self._hciSocket is None:
+            self._mgmtCmd("le on")
+        self._writeCmd("scanfields %s\n" % ("on" if self._fields else "off"))
+        self._waitResp(["scanfields"])
+        if self._filter is not None:
+            self._writeCmd("scanfilter %s\n" % self._filter)
+            self._waitResp(["scanfilter"])
+        if self._lescan is not None:
+            self._writeCmd("lescan %s\n" % self._lescan)
+            self._waitResp(["lescan"])
+            return
         self._writeCmd("scan\n")
         rsp = self._waitResp("mgmt")
         if rsp["code"][0] == "success":
@@ -616,11 +1074,25 @@ class Scanner(BluepyHelper):
             self._mgmtCmd("scan")
 
     def stop(self):
-        self._mgmtCmd("scanend")
+        if self._lescan is not None:
+            self._writeCmd("lescan off\n")
+            self._waitResp(["lescan"])
+        else:
+            self._mgmtCmd("scanend")
         self._stopHelper()
 
+    def scanStats(self):
+        '''Returns (dutyCycle, advertisements per second) of the continuous scan'''
+        self._writeCmd("lescan\n")
+        rsp = self._waitResp(["lescan"])
+        return (rsp['duty'][0] / 1000.0, rsp['rate'][0])
+
     def clear(self):
         self.scanned = {}
+        if self._helper is not None:
+            # The helper only sends the fields of data new to it
+            self._writeCmd("scanfields %s\n" % ("on" if self._fields else "off"))
+            self._waitResp(["scanfields"])
 
     def process(self, timeout=10.0):
         if self._helper is None:
@@ -641,7 +1113,7 @@ class Scanner(BluepyHelper):
             respType = resp['rsp'][0]
             if respType == 'stat':
                 # if scan ended, restart it
-                if resp['state'][0] == 'disc':
+                if resp['state'][0] == 'disc' and self._lescan is None:
                     self._mgmtCmd("scan")
 
             elif respType == 'scan':
@@ -653,7 +1125,7 @@ class Scanner(BluepyHelper):
                 else:
                     dev = ScanEntry(addr, self.iface)
                     self.scanned[addr] = dev
-                isNewData = dev._update(resp)
+                isNewData = dev._update(resp, self._fields)
                 if self.delegate is not None:
                     self.delegate.handleDiscovery(dev, (dev.updateCount <= 1), isNewData)
                  
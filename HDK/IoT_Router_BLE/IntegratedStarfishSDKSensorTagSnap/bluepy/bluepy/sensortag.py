@@ -13,14 +13,17 @@ SENSORTAG_2650 = "CC2650"
 
 class SensorBase:
     # Derived classes should set: svcUUID, ctrlUUID, dataUUID
+    # and dataLen, if the data value is always that many bytes
     sensorOn  = struct.pack("B", 0x01)
     sensorOff = struct.pack("B", 0x00)
+    dataLen = None
 
     def __init__(self, periph):
         self.periph = periph
         self.service = None
         self.ctrl = None
         self.data = None
+        self.prefetched = None
 
     def enable(self):
         if self.service is None:
@@ -33,6 +36,12 @@ class SensorBase:
             self.ctrl.write(self.sensorOn,withResponse=True)
 
     def read(self):
+        return self.readData()
+
+    def readData(self):
+        # The value SensorTag.readSensors() already has, if any
+        if self.prefetched is not None:
+            return self.prefetched
         return self.data.read()
 
     def disable(self):
@@ -47,6 +56,7 @@ def calcPoly(coeffs, x):
 class IRTemperatureSensor(SensorBase):
     svcUUID  = _TI_UUID(0xAA00)
     dataUUID = _TI_UUID(0xAA01)
+    dataLen  = 4
     ctrlUUID = _TI_UUID(0xAA02)
 
     zeroC = 273.15 # Kelvin
@@ -63,7 +73,7 @@ class IRTemperatureSensor(SensorBase):
         '''Returns (ambient_temp, target_temp) in degC'''
 
         # See http://processors.wiki.ti.com/index.php/SensorTag_User_Guide#IR_Temperature_Sensor
-        (rawVobj, rawTamb) = struct.unpack('<hh', self.data.read())
+        (rawVobj, rawTamb) = struct.unpack('<hh', self.readData())
         tAmb = rawTamb / 128.0
         Vobj = 1.5625e-7 * rawVobj
 
@@ -79,6 +89,7 @@ class IRTemperatureSensor(SensorBase):
 class IRTemperatureSensorTMP007(SensorBase):
     svcUUID  = _TI_UUID(0xAA00)
     dataUUID = _TI_UUID(0xAA01)
+    dataLen  = 4
     ctrlUUID = _TI_UUID(0xAA02)
 
     SCALE_LSB = 0.03125;
@@ -89,7 +100,7 @@ class IRTemperatureSensorTMP007(SensorBase):
     def read(self):
         '''Returns (ambient_temp, target_temp) in degC'''
         # http://processors.wiki.ti.com/index.php/CC2650_SensorTag_User's_Guide?keyMatch=CC2650&tisearch=Search-EN
-        (rawTobj, rawTamb) = struct.unpack('<hh', self.data.read())
+        (rawTobj, rawTamb) = struct.unpack('<hh', self.readData())
         tObj = (rawTobj >> 2) * self.SCALE_LSB;
         tAmb = (rawTamb >> 2) * self.SCALE_LSB;
         return (tAmb, tObj)
@@ -97,6 +108,7 @@ class IRTemperatureSensorTMP007(SensorBase):
 class AccelerometerSensor(SensorBase):
     svcUUID  = _TI_UUID(0xAA10)
     dataUUID = _TI_UUID(0xAA11)
+    dataLen  = 3
     ctrlUUID = _TI_UUID(0xAA12)
 
     def __init__(self, periph):
@@ -108,12 +120,13 @@ class AccelerometerSensor(SensorBase):
 
     def read(self):
         '''Returns (x_accel, y_accel, z_accel) in units of g'''
-        x_y_z = struct.unpack('bbb', self.data.read())
+        x_y_z = struct.unpack('bbb', self.readData())
         return tuple([ (val/self.scale) for val in x_y_z ])
 
 class MovementSensorMPU9250(SensorBase):
     svcUUID  = _TI_UUID(0xAA80)
     dataUUID = _TI_UUID(0xAA81)
+    dataLen  = 18
     ctrlUUID = _TI_UUID(0xAA82)
     sensorOn = None
     GYRO_XYZ =  7
@@ -138,7 +151,7 @@ class MovementSensorMPU9250(SensorBase):
         self.ctrl.write( struct.pack("<H", self.ctrlBits) )
 
     def rawRead(self):
-        dval = self.data.read()
+        dval = self.readData()
         return struct.unpack("<hhhhhhhhh", dval)
 
 class AccelerometerSensorMPU9250:
@@ -163,6 +176,7 @@ class AccelerometerSensorMPU9250:
 class HumiditySensor(SensorBase):
     svcUUID  = _TI_UUID(0xAA20)
     dataUUID = _TI_UUID(0xAA21)
+    dataLen  = 4
     ctrlUUID = _TI_UUID(0xAA22)
 
     def __init__(self, periph):
@@ -170,7 +184,7 @@ class HumiditySensor(SensorBase):
 
     def read(self):
         '''Returns (ambient_temp, rel_humidity)'''
-        (rawT, rawH) = struct.unpack('<HH', self.data.read())
+        (rawT, rawH) = struct.unpack('<HH', self.readData())
         temp = -46.85 + 175.72 * (rawT / 65536.0)
         RH = -6.0 + 125.0 * ((rawH & 0xFFFC)/65536.0)
         return (temp, RH)
@@ -178,6 +192,7 @@ class HumiditySensor(SensorBase):
 class HumiditySensorHDC1000(SensorBase):
     svcUUID  = _TI_UUID(0xAA20)
     dataUUID = _TI_UUID(0xAA21)
+    dataLen  = 4
     ctrlUUID = _TI_UUID(0xAA22)
 
     def __init__(self, periph):
@@ -185,7 +200,7 @@ class HumiditySensorHDC1000(SensorBase):
 
     def read(self):
         '''Returns (ambient_temp, rel_humidity)'''
-        (rawT, rawH) = struct.unpack('<HH', self.data.read())
+        (rawT, rawH) = struct.unpack('<HH', self.readData())
         temp = -40.0 + 165.0 * (rawT / 65536.0)
         RH = 100.0 * (rawH/65536.0)
         return (temp, RH)
@@ -193,6 +208,7 @@ class HumiditySensorHDC1000(SensorBase):
 class MagnetometerSensor(SensorBase):
     svcUUID  = _TI_UUID(0xAA30)
     dataUUID = _TI_UUID(0xAA31)
+    dataLen  = 6
     ctrlUUID = _TI_UUID(0xAA32)
 
     def __init__(self, periph):
@@ -200,7 +216,7 @@ class MagnetometerSensor(SensorBase):
 
     def read(self):
         '''Returns (x, y, z) in uT units'''
-        x_y_z = struct.unpack('<hhh', self.data.read())
+        x_y_z = struct.unpack('<hhh', self.readData())
         return tuple([ 1000.0 * (v/32768.0) for v in x_y_z ])
         # Revisit - some absolute calibration is needed
 
@@ -224,6 +240,7 @@ class MagnetometerSensorMPU9250:
 class BarometerSensor(SensorBase):
     svcUUID  = _TI_UUID(0xAA40)
     dataUUID = _TI_UUID(0xAA41)
+    dataLen  = 4
     ctrlUUID = _TI_UUID(0xAA42)
     calUUID  = _TI_UUID(0xAA43)
     sensorOn = None
@@ -247,7 +264,7 @@ class BarometerSensor(SensorBase):
 
     def read(self):
         '''Returns (ambient_temp, pressure_millibars)'''
-        (rawT, rawP) = struct.unpack('<hH', self.data.read())
+        (rawT, rawP) = struct.unpack('<hH', self.readData())
         temp = (self.c1_s * rawT) + self.c2_s
         sens = calcPoly( self.sensPoly, float(rawT) )
         offs = calcPoly( self.offsPoly, float(rawT) )
@@ -257,13 +274,14 @@ class BarometerSensor(SensorBase):
 class BarometerSensorBMP280(SensorBase):
     svcUUID  = _TI_UUID(0xAA40)
     dataUUID = _TI_UUID(0xAA41)
+    dataLen  = 6
     ctrlUUID = _TI_UUID(0xAA42)
 
     def __init__(self, periph):
         SensorBase.__init__(self, periph)
 
     def read(self):
-        (tL,tM,tH,pL,pM,pH) = struct.unpack('<BBBBBB', self.data.read())
+        (tL,tM,tH,pL,pM,pH) = struct.unpack('<BBBBBB', self.readData())
         temp = (tH*65536 + tM*256 + tL) / 100.0
         press = (pH*65536 + pM*256 + pL) / 100.0
         return (temp, press)
@@ -271,6 +289,7 @@ class BarometerSensorBMP280(SensorBase):
 class GyroscopeSensor(SensorBase):
     svcUUID  = _TI_UUID(0xAA50)
     dataUUID = _TI_UUID(0xAA51)
+    dataLen  = 6
     ctrlUUID = _TI_UUID(0xAA52)
     sensorOn = struct.pack("B",0x07)
 
@@ -279,7 +298,7 @@ class GyroscopeSensor(SensorBase):
 
     def read(self):
         '''Returns (x,y,z) rate in deg/sec'''
-        x_y_z = struct.unpack('<hhh', self.data.read())
+        x_y_z = struct.unpack('<hhh', self.readData())
         return tuple([ 250.0 * (v/32768.0) for v in x_y_z ])
 
 class GyroscopeSensorMPU9250:
@@ -318,6 +337,7 @@ class KeypressSensor(SensorBase):
 class OpticalSensorOPT3001(SensorBase):
     svcUUID  = _TI_UUID(0xAA70)
     dataUUID = _TI_UUID(0xAA71)
+    dataLen  = 2
     ctrlUUID = _TI_UUID(0xAA72)
 
     def __init__(self, periph):
@@ -325,7 +345,7 @@ class OpticalSensorOPT3001(SensorBase):
 
     def read(self):
         '''Returns value in lux'''
-        raw = struct.unpack('<h', self.data.read()) [0]
+        raw = struct.unpack('<h', self.readData()) [0]
         m = raw & 0xFFF;
         e = (raw & 0xF000) >> 12;
         return 0.01 * (m << e)
@@ -333,6 +353,7 @@ class OpticalSensorOPT3001(SensorBase):
 class BatterySensor(SensorBase):
     svcUUID  = UUID("0000180f-0000-1000-8000-00805f9b34fb")
     dataUUID = UUID("00002a19-0000-1000-8000-00805f9b34fb")
+    dataLen  = 1
     ctrlUUID = None
     sensorOn = None
 
@@ -341,7 +362,7 @@ class BatterySensor(SensorBase):
 
     def read(self):
         '''Returns the battery level in percent'''
-        val = ord(self.data.read())
+        val = ord(self.readData())
         return val
 
 class SensorTag(Peripheral):
@@ -381,6 +402,51 @@ class SensorTag(Peripheral):
             self.lightmeter = OpticalSensorOPT3001(self)
             self.battery = BatterySensor(self)
 
+    def readSensors(self, sensors):
+        '''Returns read() of each of the (enabled) sensors, in order, with
+        their data values fetched by a single helper command'''
+        # The MPU9250 readings share the data value of one sensor
+        bases = []
+        for s in sensors:
+            base = getattr(s, 'sensor', s)
+            if base not in bases:
+                bases.append(base)
+        values = self.readCharacteristics(
+            [(b.data.valHandle, b.dataLen) if b.dataLen else b.data.valHandle
+             for b in bases])
+        for (b, val) in zip(bases, values):
+            b.prefetched = val
+        try:
+            return [s.read() for s in sensors]
+        finally:
+            for b in bases:
+                b.prefetched = None
+
+    def subscribeSensors(self, sensors):
+        '''Enables notifications of the data of each of the (enabled)
+        sensors with a single helper command'''
+        cccds = []
+        for s in sensors:
+            base = getattr(s, 'sensor', s)
+            cccd = base.data.getDescriptors(forUUID=0x2902)[0].handle
+            if cccd not in cccds:
+                cccds.append(cccd)
+        self.subscribe(cccds)
+
+    def decodeNotification(self, sensors, hnd, data):
+        '''Returns (sensor, read()) of each of the sensors whose data value
+        was notified, from the notification's data'''
+        found = []
+        for s in sensors:
+            base = getattr(s, 'sensor', s)
+            if base.data.valHandle == hnd:
+                base.prefetched = data
+                try:
+                    found.append((s, s.read()))
+                finally:
+                    base.prefetched = None
+        return found
+
 class KeypressDelegate(DefaultDelegate):
     BUTTON_L = 0x02
     BUTTON_R = 0x01
@@ -469,26 +535,33 @@ def main():
     # Some sensors (e.g., temperature, accelerometer) need some time for initialization.
     # Not waiting here after enabling a sensor, the first read value might be empty or incorrect.
     time.sleep(1.0)
+
+    polled = []
+    if arg.temperature or arg.all:
+        polled.append(('Temp', tag.IRtemperature))
+    if arg.humidity or arg.all:
+        polled.append(('Humidity', tag.humidity))
+    if arg.barometer or arg.all:
+        polled.append(('Barometer', tag.barometer))
+    if arg.accelerometer or arg.all:
+        polled.append(('Accelerometer', tag.accelerometer))
+    if arg.magnetometer or arg.all:
+        polled.append(('Magnetometer', tag.magnetometer))
+    if arg.gyroscope or arg.all:
+        polled.append(('Gyroscope', tag.gyroscope))
+    if (arg.light or arg.all) and tag.lightmeter is not None:
+        polled.append(('Light', tag.lightmeter))
+    if arg.battery or arg.all:
+        polled.append(('Battery', tag.battery))
+
     counter=1
     while True:
        f = open(arg.path, 'w')
        f.truncate()
-       if arg.temperature or arg.all:
-           f.write('Temp: ' + str(tag.IRtemperature.read()) + '\n')
-       if arg.humidity or arg.all:
-           f.write('Humidity: ' + str(tag.humidity.read()) + '\n')
-       if arg.barometer or arg.all:
-           f.write('Barometer: ' + str(tag.barometer.read()) + '\n')
-       if arg.accelerometer or arg.all:
-           f.write('Accelerometer: ' + str(tag.accelerometer.read()) + '\n')
-       if arg.magnetometer or arg.all:
-           f.write('Magnetometer: ' + str(tag.magnetometer.read()) + '\n')
-       if arg.gyroscope or arg.all:
-           f.write('Gyroscope: ' + str(tag.gyroscope.read()) + '\n')
-       if (arg.light or arg.all) and tag.lightmeter is not None:
-           f.write('Light: ' + str(tag.lightmeter.read()) + '\n')
-       if arg.battery or arg.all:
-           f.write('Battery: ' + str(tag.battery.read()) + '\n')
+       # All the sensors polled in one round trip
+       values = tag.readSensors([s for (name, s) in polled])
+       for ((name, s), val) in zip(polled, values):
+           f.write(name + ': ' + str(val) + '\n')
        if counter >= arg.count and arg.count != 0:
            f.close()
            break
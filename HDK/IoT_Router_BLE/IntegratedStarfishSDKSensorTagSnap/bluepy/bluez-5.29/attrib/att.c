@@ -716,6 +716,27 @@ uint16_t enc_read_blob_req(uint16_t handle, uint16_t offset, uint8_t *pdu,
 	return 5;
 }
 
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t num, uint8_t *pdu,
+								size_t len)
+{
+	size_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* At least two handles, and the whole set must fit in the MTU */
+	if (num < 2 || len < 1 + num * sizeof(uint16_t))
+		return 0;
+
+	/* Attribute Opcode (1 octet) */
+	pdu[0] = ATT_OP_READ_MULTI_REQ;
+	/* Set Of Handles (4 to (ATT_MTU - 1) octets) */
+	for (i = 0; i < num; i++)
+		put_le16(handles[i], &pdu[1 + i * sizeof(uint16_t)]);
+
+	return 1 + num * sizeof(uint16_t);
+}
+
 uint16_t dec_read_req(const uint8_t *pdu, size_t len, uint16_t *handle)
 {
 	const uint16_t min_len = sizeof(pdu[0]) + sizeof(*handle);
@@ -819,6 +840,27 @@ ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 	return len - 1;
 }
 
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *values,
+								size_t vlen)
+{
+	if (pdu == NULL)
+		return -EINVAL;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_RESP)
+		return -EINVAL;
+
+	if (values == NULL)
+		return len - 1;
+
+	if (vlen < (len - 1))
+		return -ENOBUFS;
+
+	/* Set Of Values: concatenated, so the caller must know each length */
+	memcpy(values, pdu + 1, len - 1);
+
+	return len - 1;
+}
+
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len)
 {
@@ -28,112 +28,330 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/socket.h>
 
 #include "src/shared/util.h"
 #include "src/shared/crypto.h"
 
-#ifndef HAVE_LINUX_IF_ALG_H
-#ifndef HAVE_LINUX_TYPES_H
-typedef uint8_t __u8;
-typedef uint16_t __u16;
-typedef uint32_t __u32;
-#else
-#include <linux/types.h>
+/*
+ * AES-128 encryption in userspace, rather than through AF_ALG sockets,
+ * which cost several system calls for each block and are not available
+ * everywhere.
+ *
+ * The portable version finds the S-box as the inverse in GF(2^8) followed
+ * by the affine map, for eight bytes at a time in a 64-bit word, so that
+ * nothing is looked up in tables by key or data and its timing does not
+ * depend on them. Where the CPU has the AES instructions, those are used.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+	__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
 #endif
 
-struct sockaddr_alg {
-	__u16   salg_family;
-	__u8    salg_type[14];
-	__u32   salg_feat;
-	__u32   salg_mask;
-	__u8    salg_name[64];
+/* Maximum message length that can be passed to aes_cmac */
+#define CMAC_MSG_MAX	80
+
+struct aes_key {
+	uint8_t rk[11][16];
 };
 
-struct af_alg_iv {
-	__u32   ivlen;
-	__u8    iv[0];
+struct aes_ops {
+	const char *name;
+	void (*expand)(const uint8_t key[16], struct aes_key *ks);
+	void (*encrypt)(const struct aes_key *ks, const uint8_t in[16],
+							uint8_t out[16]);
 };
 
-#define ALG_SET_KEY                     1
-#define ALG_SET_IV                      2
-#define ALG_SET_OP                      3
+struct bt_crypto {
+	int ref_count;
+	int urandom;
+	const struct aes_ops *aes;
+};
 
-#define ALG_OP_DECRYPT                  0
-#define ALG_OP_ENCRYPT                  1
+#define BYTES_LSB	0x0101010101010101ULL
 
-#define PF_ALG		38	/* Algorithm sockets.  */
-#define AF_ALG		PF_ALG
-#else
-#include <linux/if_alg.h>
-#endif
+/* Multiply each byte by x in GF(2^8) */
+static inline uint64_t gf_xtime(uint64_t a)
+{
+	return ((a & 0x7f7f7f7f7f7f7f7fULL) << 1) ^
+					(((a >> 7) & BYTES_LSB) * 0x1b);
+}
 
-#ifndef SOL_ALG
-#define SOL_ALG		279
-#endif
+/* Multiply each byte of a by the same byte of b in GF(2^8) */
+static uint64_t gf_mul(uint64_t a, uint64_t b)
+{
+	uint64_t r = 0;
+	int i;
 
-/* Maximum message length that can be passed to aes_cmac */
-#define CMAC_MSG_MAX	80
+	for (i = 0; i < 8; i++) {
+		r ^= a & (((b >> i) & BYTES_LSB) * 0xff);
+		a = gf_xtime(a);
+	}
 
-struct bt_crypto {
-	int ref_count;
-	int ecb_aes;
-	int urandom;
-	int cmac_aes;
+	return r;
+}
+
+/* Square each byte in GF(2^8): bit i becomes x^2i, reduced */
+static uint64_t gf_square(uint64_t a)
+{
+	static const uint8_t x2i[8] = {
+		0x01, 0x04, 0x10, 0x40, 0x1b, 0x6c, 0xab, 0x9a
+	};
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r ^= ((a >> i) & BYTES_LSB) * x2i[i];
+
+	return r;
+}
+
+/* Rotate each byte left by n bits */
+static inline uint64_t rotl_bytes(uint64_t a, int n)
+{
+	return ((a << n) & (((0xff << n) & 0xff) * BYTES_LSB)) |
+			((a >> (8 - n)) & ((0xff >> (8 - n)) * BYTES_LSB));
+}
+
+/* The S-box of each byte: a^254, which is its inverse, then affine */
+static uint64_t sub_bytes8(uint64_t a)
+{
+	uint64_t a2, a3, a12, b;
+
+	a2 = gf_square(a);
+	a3 = gf_mul(a2, a);
+	a12 = gf_square(gf_square(a3));
+	b = gf_mul(a12, a3);		/* a^15 */
+	b = gf_square(gf_square(gf_square(gf_square(b))));	/* a^240 */
+	b = gf_mul(b, a12);
+	b = gf_mul(b, a2);		/* a^254 */
+
+	return b ^ rotl_bytes(b, 1) ^ rotl_bytes(b, 2) ^ rotl_bytes(b, 3) ^
+				rotl_bytes(b, 4) ^ (0x63 * BYTES_LSB);
+}
+
+static void sub_bytes(uint8_t state[16])
+{
+	uint64_t a[2];
+
+	memcpy(a, state, 16);
+	a[0] = sub_bytes8(a[0]);
+	a[1] = sub_bytes8(a[1]);
+	memcpy(state, a, 16);
+}
+
+static inline uint32_t ror32(uint32_t a, int n)
+{
+	return (a >> n) | (a << (32 - n));
+}
+
+/* ShiftRows then MixColumns, with the state in columns of four bytes */
+static void shift_mix(const uint8_t in[16], uint8_t out[16], bool mix)
+{
+	uint8_t col[4];
+	uint32_t a, t;
+	int c, r;
+
+	for (c = 0; c < 4; c++) {
+		for (r = 0; r < 4; r++)
+			col[r] = in[((c + r) % 4) * 4 + r];
+
+		if (!mix) {
+			memcpy(out + c * 4, col, 4);
+			continue;
+		}
+
+		a = get_le32(col);
+		t = ((a & 0x7f7f7f7f) << 1) ^ (((a >> 7) & 0x01010101) * 0x1b);
+		put_le32(t ^ ror32(a ^ t, 8) ^ ror32(a, 16) ^ ror32(a, 24),
+								out + c * 4);
+	}
+}
+
+static inline void xor_block(uint8_t r[16], const uint8_t p[16])
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		r[i] ^= p[i];
+}
+
+static void soft_expand(const uint8_t key[16], struct aes_key *ks)
+{
+	uint8_t rcon = 0x01, w[8] = { 0 };
+	uint64_t sub;
+	int i, j;
+
+	memcpy(ks->rk[0], key, 16);
+
+	for (i = 1; i <= 10; i++) {
+		/* SubWord(RotWord(w)) ^ Rcon, of the last word */
+		for (j = 0; j < 4; j++)
+			w[j] = ks->rk[i - 1][12 + (j + 1) % 4];
+		memcpy(&sub, w, 8);
+		sub = sub_bytes8(sub);
+		memcpy(w, &sub, 8);
+		w[0] ^= rcon;
+		rcon = (rcon << 1) ^ (0x1b & -(rcon >> 7));
+
+		for (j = 0; j < 16; j++) {
+			w[j % 4] ^= ks->rk[i - 1][j];
+			ks->rk[i][j] = w[j % 4];
+		}
+	}
+}
+
+static void soft_encrypt(const struct aes_key *ks, const uint8_t in[16],
+							uint8_t out[16])
+{
+	uint8_t state[16];
+	int i;
+
+	memcpy(state, in, 16);
+	xor_block(state, ks->rk[0]);
+
+	for (i = 1; i <= 10; i++) {
+		sub_bytes(state);
+		shift_mix(state, out, i < 10);
+		memcpy(state, out, 16);
+		xor_block(state, ks->rk[i]);
+	}
+
+	memcpy(out, state, 16);
+}
+
+static const struct aes_ops aes_soft = {
+	.name = "portable",
+	.expand = soft_expand,
+	.encrypt = soft_encrypt,
 };
 
-static int urandom_setup(void)
+#ifdef HAVE_AESNI
+#define AESNI_TARGET	__attribute__((target("aes,sse2")))
+
+static AESNI_TARGET __m128i aesni_round_key(__m128i key, __m128i assist)
 {
-	int fd;
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
 
-	fd = open("/dev/urandom", O_RDONLY);
-	if (fd < 0)
-		return -1;
+	return _mm_xor_si128(key, assist);
+}
 
-	return fd;
+#define AESNI_EXPAND(i, rcon) \
+	k = aesni_round_key(k, _mm_aeskeygenassist_si128(k, rcon)); \
+	_mm_storeu_si128((__m128i *) ks->rk[i], k)
+
+static AESNI_TARGET void aesni_expand(const uint8_t key[16],
+							struct aes_key *ks)
+{
+	__m128i k = _mm_loadu_si128((const __m128i *) key);
+
+	_mm_storeu_si128((__m128i *) ks->rk[0], k);
+	AESNI_EXPAND(1, 0x01);
+	AESNI_EXPAND(2, 0x02);
+	AESNI_EXPAND(3, 0x04);
+	AESNI_EXPAND(4, 0x08);
+	AESNI_EXPAND(5, 0x10);
+	AESNI_EXPAND(6, 0x20);
+	AESNI_EXPAND(7, 0x40);
+	AESNI_EXPAND(8, 0x80);
+	AESNI_EXPAND(9, 0x1b);
+	AESNI_EXPAND(10, 0x36);
 }
 
-static int ecb_aes_setup(void)
+static AESNI_TARGET void aesni_encrypt(const struct aes_key *ks,
+				const uint8_t in[16], uint8_t out[16])
 {
-	struct sockaddr_alg salg;
-	int fd;
+	__m128i b = _mm_loadu_si128((const __m128i *) in);
+	int i;
 
-	fd = socket(PF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
-	if (fd < 0)
-		return -1;
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *) ks->rk[0]));
+	for (i = 1; i < 10; i++)
+		b = _mm_aesenc_si128(b,
+				_mm_loadu_si128((const __m128i *) ks->rk[i]));
+	b = _mm_aesenclast_si128(b,
+				_mm_loadu_si128((const __m128i *) ks->rk[10]));
 
-	memset(&salg, 0, sizeof(salg));
-	salg.salg_family = AF_ALG;
-	strcpy((char *) salg.salg_type, "skcipher");
-	strcpy((char *) salg.salg_name, "ecb(aes)");
+	_mm_storeu_si128((__m128i *) out, b);
+}
 
-	if (bind(fd, (struct sockaddr *) &salg, sizeof(salg)) < 0) {
-		close(fd);
-		return -1;
+static const struct aes_ops aes_ni = {
+	.name = "AES-NI",
+	.expand = aesni_expand,
+	.encrypt = aesni_encrypt,
+};
+#endif
+
+static const struct aes_ops *aes_select(void)
+{
+#ifdef HAVE_AESNI
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES))
+		return &aes_ni;
+#endif
+	return &aes_soft;
+}
+
+/* Double in GF(2^128), for the CMAC subkeys */
+static void cmac_double(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t carry = in[0] >> 7;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+	out[15] = (in[15] << 1) ^ (0x87 & -carry);
+}
+
+/*
+ * AES-CMAC as in RFC 4493, with the most significant octet of key, msg
+ * and mac first.
+ */
+static void cmac(const struct aes_ops *aes, const uint8_t key[16],
+			const uint8_t *msg, size_t msg_len, uint8_t mac[16])
+{
+	struct aes_key ks;
+	uint8_t x[16] = { 0 }, k1[16], k2[16], last[16];
+	size_t n;
+
+	aes->expand(key, &ks);
+
+	/* K1 and K2 from L = AES(key, 0) */
+	aes->encrypt(&ks, x, k1);
+	cmac_double(k1, k1);
+	cmac_double(k1, k2);
+
+	for (n = 0; msg_len - n > 16; n += 16) {
+		xor_block(x, msg + n);
+		aes->encrypt(&ks, x, x);
 	}
 
-	return fd;
+	/* A last block of 16 octets takes K1, else it is padded for K2 */
+	memset(last, 0, 16);
+	memcpy(last, msg + n, msg_len - n);
+	if (msg_len - n == 16) {
+		xor_block(last, k1);
+	} else {
+		last[msg_len - n] = 0x80;
+		xor_block(last, k2);
+	}
+
+	xor_block(x, last);
+	aes->encrypt(&ks, x, mac);
 }
 
-static int cmac_aes_setup(void)
+static int urandom_setup(void)
 {
-	struct sockaddr_alg salg;
 	int fd;
 
-	fd = socket(PF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	fd = open("/dev/urandom", O_RDONLY);
 	if (fd < 0)
 		return -1;
 
-	memset(&salg, 0, sizeof(salg));
-	salg.salg_family = AF_ALG;
-	strcpy((char *) salg.salg_type, "hash");
-	strcpy((char *) salg.salg_name, "cmac(aes)");
-
-	if (bind(fd, (struct sockaddr *) &salg, sizeof(salg)) < 0) {
-		close(fd);
-		return -1;
-	}
-
 	return fd;
 }
 
@@ -145,26 +363,13 @@ struct bt_crypto *bt_crypto_new(void)
 	if (!crypto)
 		return NULL;
 
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
-		free(crypto);
-		return NULL;
-	}
-
 	crypto->urandom = urandom_setup();
 	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
 
-	crypto->cmac_aes = cmac_aes_setup();
-	if (crypto->cmac_aes < 0) {
-		close(crypto->urandom);
-		close(crypto->ecb_aes);
-		free(crypto);
-		return NULL;
-	}
+	crypto->aes = aes_select();
 
 	return bt_crypto_ref(crypto);
 }
@@ -188,8 +393,6 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 		return;
 
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
 
 	free(crypto);
 }
@@ -209,54 +412,6 @@ bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 	return true;
 }
 
-static int alg_new(int fd, const void *keyval, socklen_t keylen)
-{
-	if (setsockopt(fd, SOL_ALG, ALG_SET_KEY, keyval, keylen) < 0)
-		return -1;
-
-	/* FIXME: This should use accept4() with SOCK_CLOEXEC */
-	return accept(fd, NULL, 0);
-}
-
-static bool alg_encrypt(int fd, const void *inbuf, size_t inlen,
-						void *outbuf, size_t outlen)
-{
-	__u32 alg_op = ALG_OP_ENCRYPT;
-	char cbuf[CMSG_SPACE(sizeof(alg_op))];
-	struct cmsghdr *cmsg;
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t len;
-
-	memset(cbuf, 0, sizeof(cbuf));
-	memset(&msg, 0, sizeof(msg));
-
-	msg.msg_control = cbuf;
-	msg.msg_controllen = sizeof(cbuf);
-
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_level = SOL_ALG;
-	cmsg->cmsg_type = ALG_SET_OP;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(alg_op));
-	memcpy(CMSG_DATA(cmsg), &alg_op, sizeof(alg_op));
-
-	iov.iov_base = (void *) inbuf;
-	iov.iov_len = inlen;
-
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-
-	len = sendmsg(fd, &msg, 0);
-	if (len < 0)
-		return false;
-
-	len = read(fd, outbuf, outlen);
-	if (len < 0)
-		return false;
-
-	return true;
-}
-
 static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 {
 	int i;
@@ -269,8 +424,6 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12])
 {
-	int fd;
-	int len;
 	uint8_t tmp[16], out[16];
 	uint16_t msg_len = m_len + sizeof(uint32_t);
 	uint8_t msg[msg_len];
@@ -288,26 +441,10 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
 	/* Swap msg before signing */
 	swap_buf(msg, msg_s, msg_len);
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	close(fd);
+	cmac(crypto->aes, tmp, msg_s, msg_len, out);
 
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
@@ -341,8 +478,8 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16])
 {
+	struct aes_key ks;
 	uint8_t tmp[16], in[16], out[16];
-	int fd;
 
 	if (!crypto)
 		return false;
@@ -350,24 +487,16 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->ecb_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
+	crypto->aes->expand(tmp, &ks);
 
 	/* Most significant octet of plaintextData corresponds to in[0] */
 	swap_buf(plaintext, in, 16);
 
-	if (!alg_encrypt(fd, in, 16, out, 16)) {
-		close(fd);
-		return false;
-	}
+	crypto->aes->encrypt(&ks, in, out);
 
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -574,34 +703,17 @@ static bool aes_cmac(struct bt_crypto *crypto, uint8_t key[16], uint8_t *msg,
 					size_t msg_len, uint8_t res[16])
 {
 	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
 	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
-		return false;
-
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
+	cmac(crypto->aes, key_msb, msg_msb, msg_len, out);
 
 	swap_buf(out, res, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -0,0 +1,394 @@
+/*
+ * Checks ad_parse() and send_ad_fields() of bluepy-helper.c: AD structures
+ * of zero or truncated length, UUIDs of each size sent as 128-bit strings,
+ * short and complete names, service and manufacturer data, and the fields
+ * of each advertisement in tools/adv_corpus.txt. Each case is checked in
+ * text mode and again in binary mode, the frame decoded back to text.
+ * Build and run it with
+ *
+ *     make -C bluepy ad-test
+ *
+ * or run tools/ad_test [-v] [adv_corpus.txt] once built.
+ */
+
+#define main helper_main
+#include "bluepy-helper.c"
+#undef main
+
+static int failures;
+static int verbose;
+static int out_fd;
+
+static size_t unhex(const char *s, uint8_t *buf, size_t size)
+{
+	size_t n = 0;
+
+	while (s[0] && s[1] && n < size) {
+		if (sscanf(s, "%2hhx", &buf[n]) != 1)
+			break;
+		n++;
+		s += 2;
+		while (*s == ' ')
+			s++;
+	}
+
+	return n;
+}
+
+/* Appends to the text decoded from a frame */
+static void addf(char *buf, size_t size, size_t *pos, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (*pos >= size)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *pos, size - *pos, fmt, ap);
+	va_end(ap);
+	*pos += n < 0 ? 0 : n;
+}
+
+/* A binary frame as the text mode line it stands for */
+static const char *unframe(const uint8_t *p, size_t n)
+{
+	static char buf[2048];
+	size_t i = 4, o = 0, len, taglen;
+	const uint8_t *tag;
+	char kind;
+
+	buf[0] = '\0';
+	if (n < 4 || bt_get_le32(p) != n - 4)
+		return "(bad frame length)";
+
+	while (i < n) {
+		if (i + 2 > n)
+			return "(truncated field)";
+		kind = p[i];
+		taglen = p[i + 1];
+		tag = p + i + 2;
+		i += 2 + taglen;
+
+		if (kind == 'h') {
+			if (i + 4 > n)
+				return "(truncated field)";
+			addf(buf, sizeof(buf), &o, " %.*s=h%X", (int) taglen,
+						tag, bt_get_le32(p + i));
+			i += 4;
+			continue;
+		}
+
+		if (i + 2 > n)
+			return "(truncated field)";
+		len = bt_get_le16(p + i);
+		i += 2;
+		if (i + len > n)
+			return "(truncated field)";
+		addf(buf, sizeof(buf), &o, " %.*s=%c", (int) taglen, tag, kind);
+		if (kind == 'b') {
+			for (; len > 0; len--)
+				addf(buf, sizeof(buf), &o, "%02X", p[i++]);
+		} else {
+			addf(buf, sizeof(buf), &o, "%.*s", (int) len, p + i);
+			i += len;
+		}
+	}
+
+	return buf;
+}
+
+/*
+ * The fields of the advertising data s, in hex, as the helper sends them,
+ * in text mode or as a binary frame. The bytes are copied to a buffer of
+ * just their length, so a read past the end shows under valgrind or ASan.
+ */
+static const char *fields(const char *s, int bin)
+{
+	static uint8_t buf[1024];
+	uint8_t tmp[256], *eir;
+	struct ad_info ad;
+	size_t len;
+	ssize_t n;
+	int saved;
+
+	len = unhex(s, tmp, sizeof(tmp));
+	eir = g_malloc(len);
+	if (len)
+		memcpy(eir, tmp, len);
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	lseek(out_fd, 0, SEEK_SET);
+	dup2(out_fd, STDOUT_FILENO);
+
+	ad_parse(eir, len, &ad);
+	if (bin) {
+		/* As scan_report() would send them, but in a frame of their own */
+		bin_mode = 1;
+		bin_begin();
+		send_ad_fields(&ad);
+		bin_end();
+		bin_mode = 0;
+	} else {
+		send_ad_fields(&ad);
+	}
+
+	fflush(stdout);
+	n = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	g_free(eir);
+
+	if (n < 0 || n >= (ssize_t) sizeof(buf))
+		n = sizeof(buf) - 1;
+	n = pread(out_fd, buf, n, 0);
+	if (n < 0)
+		n = 0;
+	if (bin)
+		return unframe(buf, n);
+	buf[n] = '\0';
+
+	return (const char *) buf;
+}
+
+static void check_mode(const char *what, const char *data, const char *want,
+								int bin)
+{
+	const char *got = fields(data, bin);
+	const char *mode = bin ? " (binary)" : "";
+
+	if (strcmp(got, want) == 0) {
+		if (verbose)
+			printf("  %s%s:%s\n", what, mode, got);
+		return;
+	}
+
+	printf("  %s%s: FAILED\n    want:%s\n    got: %s\n", what, mode, want,
+									got);
+	failures++;
+}
+
+static void check(const char *what, const char *data, const char *want)
+{
+	check_mode(what, data, want, 0);
+	check_mode(what, data, want, 1);
+}
+
+#define UUID_180D	"0000180d-0000-1000-8000-00805f9b34fb"
+#define UUID_FEAA	"0000feaa-0000-1000-8000-00805f9b34fb"
+
+static const struct {
+	const char *what;
+	const char *data;
+	const char *want;
+} cases[] = {
+	{ "empty", "", "" },
+	{ "zero length ends the data", "020106 00 03030d18",
+						" adflags=h6" },
+	{ "truncated structure dropped", "020106 05094142",
+						" adflags=h6" },
+	{ "length past the end", "03030d18 ff", " svc='" UUID_180D },
+	{ "type without data", "0101 0119", "" },
+	{ "empty name", "0109", " name=b" },
+
+	{ "16-bit UUID", "03030d18", " svc='" UUID_180D },
+	{ "32-bit UUID", "05050d180000", " svc='" UUID_180D },
+	{ "128-bit UUID", "1107fb349b5f80000080001000000d180000",
+						" svc='" UUID_180D },
+	{ "32-bit UUID above 16 bits", "050478563412",
+			" svc='12345678-0000-1000-8000-00805f9b34fb" },
+	{ "UUID list, odd byte left over", "0602 0d18 0f18 0a",
+		" svc='" UUID_180D
+		" svc='0000180f-0000-1000-8000-00805f9b34fb" },
+	{ "solicited UUIDs", "03140d18 051f0d180000",
+		" sol='" UUID_180D " sol='" UUID_180D },
+
+	{ "short name", "04084142 43", " name=b414243 nshort=h1" },
+	{ "complete name after short", "030841 42 04094142 43",
+						" name=b414243" },
+	{ "short name after complete", "0409414243 030841 42",
+						" name=b414243" },
+	{ "later short name", "03084142 03084344",
+						" name=b4344 nshort=h1" },
+
+	{ "16-bit service data", "0616aafe102030",
+		" sdu='" UUID_FEAA " sdd=b102030" },
+	{ "32-bit service data", "07206ffd00000102",
+		" sdu='0000fd6f-0000-1000-8000-00805f9b34fb sdd=b0102" },
+	{ "128-bit service data",
+		"1321fb349b5f80000080001000000d1800000a0b",
+		" sdu='" UUID_180D " sdd=b0A0B" },
+	{ "service data of just the UUID", "0316aafe",
+		" sdu='" UUID_FEAA " sdd=b" },
+	{ "service data shorter than its UUID", "0216aa 04200d1800", "" },
+
+	{ "manufacturer data", "05ff4c000102", " mfr=h4C mfd=b0102" },
+	{ "manufacturer ID only", "03ff5900", " mfr=h59 mfd=b" },
+	{ "manufacturer data too short", "02ff4c", "" },
+
+	{ "TX power and appearance", "020af8 03194109",
+		" txp=hF8 appear=h941" },
+};
+
+/*
+ * The fields of each advertisement of tools/adv_corpus.txt, by the
+ * comment above it: the advertising data, then the scan response data.
+ */
+static const struct {
+	const char *name;
+	const char *adv;
+	const char *rsp;
+} corpus[] = {
+	{ "CC2650 SensorTag",
+		" adflags=h6 svc='0000aa80-0000-1000-8000-00805f9b34fb"
+		" mfr=hD mfd=b030000",
+		" name=b4343323635302053656E736F72546167 txp=h0" },
+	{ "CC2541 SensorTag",
+		" adflags=h6 svc='0000aa10-0000-1000-8000-00805f9b34fb",
+		" name=b53656E736F72546167 txp=h0" },
+	{ "iBeacon",
+		" adflags=h4 mfr=h4C"
+		" mfd=b0215E2C56DB5DFFB48D2B060D0F5A71096E000010002C5",
+		NULL },
+	{ "Eddystone-UID",
+		" adflags=h6 svc='" UUID_FEAA " sdu='" UUID_FEAA
+		" sdd=b00E7000102030405060708090A0B0C0D0E0F0000",
+		NULL },
+	{ "Eddystone-URL",
+		" adflags=h6 svc='" UUID_FEAA " sdu='" UUID_FEAA
+		" sdd=b10EB03676F6F2E676C2F417131387A46",
+		NULL },
+	{ "Eddystone-TLM",
+		" adflags=h6 svc='" UUID_FEAA " sdu='" UUID_FEAA
+		" sdd=b20000BB817000000100000002000",
+		NULL },
+	{ "Apple nearby",
+		" adflags=h6 txp=hC mfr=h4C mfd=b100501181C3A22",
+		NULL },
+	{ "Microsoft CDP",
+		" mfr=h6 mfd=b01092002000102030405060708090A0B0C0D0E0F"
+		"10111213141516",
+		NULL },
+	{ "Heart rate strap",
+		" adflags=h6 appear=h341 svc='" UUID_180D
+		" svc='0000180f-0000-1000-8000-00805f9b34fb"
+		" svc='0000180a-0000-1000-8000-00805f9b34fb",
+		" name=b48524D2050726F3A313233343536" },
+	{ "Fitness tracker",
+		" adflags=h6 txp=hF4"
+		" svc='adabfb00-6e7d-4601-bda2-bffaa68956ba",
+		" name=b436861726765 nshort=h1 mfr=h157 mfd=b0001020304050607" },
+	{ "Xiaomi thermometer",
+		" adflags=h6 sdu='0000fe95-0000-1000-8000-00805f9b34fb"
+		" sdd=b5020AA01030001020304050D1004E500D201",
+		" name=b4C595753443032" },
+	{ "Tile",
+		" adflags=h6 svc='0000feed-0000-1000-8000-00805f9b34fb"
+		" sdu='0000feed-0000-1000-8000-00805f9b34fb"
+		" sdd=b02000001020304050607",
+		NULL },
+	{ "Nameless sensor",
+		" adflags=h4 mfr=h59 mfd=b00010203040506070809",
+		NULL },
+	{ "Smart lock",
+		" adflags=h6 svc='0000fd6f-0000-1000-8000-00805f9b34fb"
+		" sol='9f3c8f10-7e1b-4a0b-9c2d-2b2b5e9a0c11",
+		" name=b4C6F636B20C3A974C3A9" },
+	{ "Headphones",
+		" adflags=h6 txp=h4 appear=h941"
+		" svc='0000110b-0000-1000-8000-00805f9b34fb"
+		" svc='0000110e-0000-1000-8000-00805f9b34fb"
+		" svc='0000111e-0000-1000-8000-00805f9b34fb",
+		" name=b57482D31303030584D33" },
+};
+
+#define N_CORPUS	(sizeof(corpus) / sizeof(corpus[0]))
+
+static void check_corpus(const char *path)
+{
+	char line[512], name[64] = "", what[80];
+	gboolean seen[N_CORPUS] = { FALSE };
+	char *adv, *rsp;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		printf("  %s: %s\n", path, strerror(errno));
+		failures++;
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '#') {
+			snprintf(name, sizeof(name), "%s",
+					line + 1 + strspn(line + 1, " "));
+			continue;
+		}
+		adv = strtok(line, " ");
+		if (!adv)
+			continue;
+		rsp = strtok(NULL, " ");
+
+		for (i = 0; i < N_CORPUS; i++)
+			if (strcmp(corpus[i].name, name) == 0)
+				break;
+		if (i == N_CORPUS) {
+			printf("  %s: not in ad_test.c: FAILED\n", name);
+			failures++;
+			continue;
+		}
+		seen[i] = TRUE;
+
+		snprintf(what, sizeof(what), "%s adv", name);
+		check(what, adv, corpus[i].adv);
+		snprintf(what, sizeof(what), "%s rsp", name);
+		check(what, rsp ? rsp : "", corpus[i].rsp ? corpus[i].rsp : "");
+	}
+	fclose(fp);
+
+	for (i = 0; i < N_CORPUS; i++) {
+		if (seen[i])
+			continue;
+		printf("  %s: not in %s: FAILED\n", corpus[i].name, path);
+		failures++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "tools/adv_corpus.txt";
+	unsigned int i;
+	FILE *fp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		if (opt != 'v') {
+			fprintf(stderr, "usage: ad_test [-v] [adv_corpus.txt]\n");
+			return 2;
+		}
+		verbose = 1;
+	}
+	if (optind < argc)
+		path = argv[optind];
+
+	/* send_ad_fields() writes to stdout, which fields() points here */
+	fp = tmpfile();
+	if (!fp) {
+		perror("tmpfile");
+		return 1;
+	}
+	out_fd = fileno(fp);
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		check(cases[i].what, cases[i].data, cases[i].want);
+
+	check_corpus(path);
+
+	printf("%u cases and %s, text and binary: %s\n",
+			(unsigned int) (sizeof(cases) / sizeof(cases[0])),
+			path, failures ? "FAILED" : "passed");
+
+	return failures ? 1 : 0;
+}
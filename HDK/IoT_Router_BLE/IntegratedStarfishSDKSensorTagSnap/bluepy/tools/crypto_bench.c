@@ -0,0 +1,177 @@
+/*
+ * Times bt_crypto_e() and bt_crypto_sign_att() of bluez'
+ * src/shared/crypto.c with each of its AES backends and with the kernel's
+ * AF_ALG sockets, which crypto.c used before. Build it with
+ *
+ *     make -C bluepy crypto-bench
+ *
+ * and run tools/crypto_bench [iterations]. tools/crypto_test checks the
+ * backends' results (make -C bluepy crypto-test).
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+#include "src/shared/crypto.c"
+
+#ifndef SOL_ALG
+#define SOL_ALG		279
+#endif
+
+/* AF_ALG, as crypto.c had it */
+struct alg {
+	int ecb;
+	int cmac;
+};
+
+static int alg_setup(const char *type, const char *name)
+{
+	struct sockaddr_alg salg;
+	int fd;
+
+	fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&salg, 0, sizeof(salg));
+	salg.salg_family = AF_ALG;
+	strcpy((char *) salg.salg_type, type);
+	strcpy((char *) salg.salg_name, name);
+
+	if (bind(fd, (struct sockaddr *) &salg, sizeof(salg)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool alg_run(int tfm, const uint8_t key[16], const void *in,
+				size_t len, bool encrypt, uint8_t out[16])
+{
+	uint32_t op = ALG_OP_ENCRYPT;
+	char cbuf[CMSG_SPACE(sizeof(op))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	bool ok;
+	int fd;
+
+	if (setsockopt(tfm, SOL_ALG, ALG_SET_KEY, key, 16) < 0)
+		return false;
+
+	fd = accept(tfm, NULL, 0);
+	if (fd < 0)
+		return false;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *) in;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (encrypt) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_ALG;
+		cmsg->cmsg_type = ALG_SET_OP;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(op));
+		memcpy(CMSG_DATA(cmsg), &op, sizeof(op));
+	}
+
+	ok = sendmsg(fd, &msg, 0) >= 0 && read(fd, out, 16) == 16;
+	close(fd);
+
+	return ok;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A Signed Write of a 20-octet value: opcode, handle and value */
+#define SIGN_LEN	23
+
+static void bench(const char *name, struct bt_crypto *crypto,
+					struct alg *alg, int count)
+{
+	uint8_t key[16] = { 1 }, in[SIGN_LEN] = { 2 }, out[16];
+	double t0, te, ts;
+	bool ok = true;
+	int i;
+
+	t0 = now();
+	for (i = 0; i < count; i++) {
+		in[0] = i;
+		if (crypto)
+			bt_crypto_e(crypto, key, in, out);
+		else
+			ok &= alg_run(alg->ecb, key, in, 16, true, out);
+	}
+	te = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < count; i++) {
+		in[0] = i;
+		if (crypto)
+			bt_crypto_sign_att(crypto, key, in, SIGN_LEN, i, out);
+		else
+			ok &= alg_run(alg->cmac, key, in, SIGN_LEN + 4, false,
+									out);
+	}
+	ts = now() - t0;
+
+	printf("%-10s %10.2f %12.2f%s\n", name, te * 1e6 / count,
+				ts * 1e6 / count, ok ? "" : "  (errors)");
+}
+
+int main(int argc, char **argv)
+{
+	const struct aes_ops *backends[] = {
+		&aes_soft,
+#ifdef HAVE_AESNI
+		&aes_ni,
+#endif
+	};
+	struct bt_crypto *crypto;
+	struct alg alg;
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	unsigned int i;
+
+	crypto = bt_crypto_new();
+	if (!crypto) {
+		fprintf(stderr, "bt_crypto_new() failed\n");
+		return 1;
+	}
+
+	printf("selected backend: %s\n", crypto->aes->name);
+	printf("%-10s %10s %12s\n", "backend", "e() us", "sign_att us");
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		/* Only where the CPU has them */
+		if (i > 0 && aes_select() == &aes_soft)
+			continue;
+		crypto->aes = backends[i];
+		bench(backends[i]->name, crypto, NULL, count);
+	}
+
+	alg.ecb = alg_setup("skcipher", "ecb(aes)");
+	alg.cmac = alg_setup("hash", "cmac(aes)");
+	if (alg.ecb < 0 || alg.cmac < 0)
+		printf("%-10s not available\n", "AF_ALG");
+	else
+		bench("AF_ALG", NULL, &alg, count / 10);
+
+	bt_crypto_unref(crypto);
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Checks the AES backends of bluez' src/shared/crypto.c, the portable one
+ * and AES-NI where the CPU has it, against the sample data of FIPS-197,
+ * RFC 4493 and the Bluetooth Core Specification. Build and run it with
+ *
+ *     make -C bluepy crypto-test
+ *
+ * It exits non-zero if any check fails; tools/crypto_bench times them.
+ */
+
+#include <stdio.h>
+
+#include "src/shared/crypto.c"
+
+static int failures;
+
+static void hex(const char *s, uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sscanf(s + 2 * i, "%2hhx", &buf[i]);
+}
+
+/* The same bytes in reverse, as the bt_crypto_* functions take them */
+static void hex_lsb(const char *s, uint8_t *buf, size_t len)
+{
+	uint8_t tmp[80];
+
+	hex(s, tmp, len);
+	swap_buf(tmp, buf, len);
+}
+
+static void check(const char *what, const uint8_t *got, const char *want,
+								size_t len)
+{
+	uint8_t buf[80];
+
+	hex(want, buf, len);
+	if (memcmp(got, buf, len) == 0)
+		return;
+
+	printf("  %s: FAILED\n", what);
+	failures++;
+}
+
+static void check_lsb(const char *what, const uint8_t *got,
+						const char *want, size_t len)
+{
+	uint8_t tmp[80];
+
+	swap_buf(got, tmp, len);
+	check(what, tmp, want, len);
+}
+
+/* RFC 4493 section 4 */
+static const char *rfc4493_key = "2b7e151628aed2a6abf7158809cf4f3c";
+static const char *rfc4493_msg =
+			"6bc1bee22e409f96e93d7e117393172a"
+			"ae2d8a571e03ac9c9eb76fac45af8e51"
+			"30c81c46a35ce411e5fbc1191a0a52ef"
+			"f69f2445df4f9b17ad2b417be66c3710";
+static const struct {
+	size_t len;
+	const char *mac;
+} rfc4493[] = {
+	{ 0, "bb1d6929e95937287fa37d129b756746" },
+	{ 16, "070a16b46b4d4144f79bdd9dd04a287c" },
+	{ 40, "dfa66747de9ae63030ca32611497c827" },
+	{ 64, "51f0bebf7e3b9d92fc49741779363cfe" },
+};
+
+/* Core Specification 4.2, Vol 3, Part H, Appendix D */
+#define SPEC_U	"20b003d2f297be2c5e2c83a7e9f9a5b9" \
+		"eff49111acf4fddbcc0301480e359de6"
+#define SPEC_V	"55188b3d32f6bb9a900afcfbeed4e72a" \
+		"59cb9ac2f19d7cfb6b4fdd49f47fc5fd"
+#define SPEC_W	"ec0234a357c8ad05341010a60a397d9b" \
+		"99796b13b4f866f1868d34f373bfa698"
+#define SPEC_X	"d5cb8454d177733effffb2ec712baeab"
+#define SPEC_N1	"d5cb8454d177733effffb2ec712baeab"
+#define SPEC_N2	"a6e8e7cc25a75f6e216583f7ff3dc4cf"
+#define SPEC_A1	"0056123737bfce"
+#define SPEC_A2	"00a713702dcfc1"
+
+static void check_backend(struct bt_crypto *crypto)
+{
+	uint8_t key[16], in[80], out[16], u[32], v[32], w[32], x[16];
+	uint8_t n1[16], n2[16], r[16], a1[7], a2[7], io_cap[3], ltk[16];
+	uint8_t preq[7], pres[7], ia[6], ra[6];
+	struct aes_key ks;
+	uint8_t sig[12];
+	uint32_t val;
+	unsigned int i;
+
+	/* FIPS-197 appendix C.1 */
+	hex("000102030405060708090a0b0c0d0e0f", key, 16);
+	hex("00112233445566778899aabbccddeeff", in, 16);
+	crypto->aes->expand(key, &ks);
+	crypto->aes->encrypt(&ks, in, out);
+	check("AES-128", out, "69c4e0d86a7b0430d8cdb78070b4c55a", 16);
+
+	for (i = 0; i < sizeof(rfc4493) / sizeof(rfc4493[0]); i++) {
+		hex(rfc4493_key, key, 16);
+		hex(rfc4493_msg, in, rfc4493[i].len);
+		cmac(crypto->aes, key, in, rfc4493[i].len, out);
+		check("RFC 4493 AES-CMAC", out, rfc4493[i].mac, 16);
+	}
+
+	/*
+	 * Signed Write: the last four octets of the RFC 4493 message, in
+	 * reverse, make the sign counter, and the signature is the counter
+	 * and then the upper 64 bits of the MAC, least significant first.
+	 */
+	hex_lsb(rfc4493_key, key, 16);
+	hex_lsb(rfc4493_msg, in, 40);
+	bt_crypto_sign_att(crypto, key, in, 36, get_le32(in + 36), sig);
+	check_lsb("sign_att", sig, "dfa66747de9ae6306bc1bee2", 12);
+
+	hex_lsb("00000000000000000000000000000000", key, 16);
+	hex_lsb("112233445566778899aabbccddeeff00", in, 16);
+	bt_crypto_e(crypto, key, in, out);
+	check_lsb("e", out, "9a1fe1f0e8b0f49b5b4216ae796da062", 16);
+
+	hex_lsb("ec0234a357c8ad05341010a60a397d9b", key, 16);
+	hex_lsb("708194", in, 3);
+	bt_crypto_ah(crypto, key, in, out);
+	check_lsb("ah", out, "0dfbaa", 3);
+
+	hex_lsb("00000000000000000000000000000000", key, 16);
+	hex_lsb("5783d52156ad6f0e6388274ec6702ee0", r, 16);
+	hex_lsb("05000800000302", pres, 7);
+	hex_lsb("07071000000101", preq, 7);
+	hex_lsb("a1a2a3a4a5a6", ia, 6);
+	hex_lsb("b1b2b3b4b5b6", ra, 6);
+	bt_crypto_c1(crypto, key, r, pres, preq, 1, ia, 0, ra, out);
+	check_lsb("c1", out, "1e1e3fef878988ead2a74dc5bef13b86", 16);
+
+	hex_lsb("000f0e0d0c0b0a091122334455667788", n1, 16);
+	hex_lsb("010203040506070899aabbccddeeff00", n2, 16);
+	bt_crypto_s1(crypto, key, n1, n2, out);
+	check_lsb("s1", out, "9a1fe1f0e8b0f49b5b4216ae796da062", 16);
+
+	hex_lsb(SPEC_U, u, 32);
+	hex_lsb(SPEC_V, v, 32);
+	hex_lsb(SPEC_X, x, 16);
+	bt_crypto_f4(crypto, u, v, x, 0, out);
+	check_lsb("f4", out, "f2c916f107a9bd1cf1eda1bea974872d", 16);
+
+	hex_lsb(SPEC_W, w, 32);
+	hex_lsb(SPEC_N1, n1, 16);
+	hex_lsb(SPEC_N2, n2, 16);
+	hex_lsb(SPEC_A1, a1, 7);
+	hex_lsb(SPEC_A2, a2, 7);
+	bt_crypto_f5(crypto, w, n1, n2, a1, a2, out, ltk);
+	check_lsb("f5 MacKey", out, "2965f176a1084a02fd3f6a20ce636e20", 16);
+	check_lsb("f5 LTK", ltk, "6986791169d7cd23980522b594750a38", 16);
+
+	hex_lsb("12a3343bb453bb5408da42d20c2d0fc8", r, 16);
+	hex_lsb("010102", io_cap, 3);
+	hex_lsb("2965f176a1084a02fd3f6a20ce636e20", w, 16);
+	bt_crypto_f6(crypto, w, n1, n2, r, io_cap, a1, a2, out);
+	check_lsb("f6", out, "e3c473989cd0e8c5d26c0b09da958f61", 16);
+
+	bt_crypto_g2(crypto, u, v, x, n2, &val);
+	if (val != 0x2f9ed5ba % 1000000) {
+		printf("  g2: FAILED\n");
+		failures++;
+	}
+}
+
+int main(void)
+{
+	const struct aes_ops *backends[] = {
+		&aes_soft,
+#ifdef HAVE_AESNI
+		&aes_ni,
+#endif
+	};
+	struct bt_crypto *crypto;
+	unsigned int i;
+	int before;
+
+	crypto = bt_crypto_new();
+	if (!crypto) {
+		fprintf(stderr, "bt_crypto_new() failed\n");
+		return 1;
+	}
+
+	printf("selected backend: %s\n", crypto->aes->name);
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		/* Only where the CPU has them */
+		if (i > 0 && aes_select() == &aes_soft) {
+			printf("%s: not on this CPU, skipped\n",
+							backends[i]->name);
+			continue;
+		}
+		crypto->aes = backends[i];
+		before = failures;
+		check_backend(crypto);
+		printf("%s: %s\n", backends[i]->name,
+				failures == before ? "passed" : "FAILED");
+	}
+#ifndef HAVE_AESNI
+	printf("AES-NI: not built for this architecture, skipped\n");
+#endif
+
+	bt_crypto_unref(crypto);
+
+	if (failures)
+		printf("%d checks FAILED\n", failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,468 @@
+#!/usr/bin/env python
+"""Measures notification throughput through bluepy-helper.
+
+The helper is connected to simperiph.SimPeripheral over a Unix socket, so
+no controller is needed. Each run subscribes to the IR temperature data and
+counts notifications delivered to the delegate, with the helper output in
+text, then binary frames. With --stream, the runs are repeated with the
+helper sending notifications in batches.
+
+With --conns, it instead compares a gateway of that many peripherals served
+by one helper process each against one SharedHelper serving them all.
+
+With --reconnect, it times that many cycles of connecting, discovering the
+services, characteristics and the data CCCD, subscribing and receiving the
+first notification, without and with the helper's GATT cache. Discovery is
+done a command at a time, then with one "discall" for the whole database.
+
+With --poll, it times that many rounds of reading every sensor of a CC2650
+SensorTag, with a read each, then with SensorTag.readSensors(), which is
+one "rdm", against a simulator with and without Read Multiple.
+
+With --scan, it scans continuously for that many devices advertising on
+simhci.SimController, and counts the reports reaching Python with various
+scan parameters and filters. The devices send the advertisements in
+--corpus, if given, and the last two runs compare Python parsing them
+with bluepy-helper doing so.
+"""
+
+from __future__ import print_function
+import argparse
+import os
+import select
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from bluepy import btle, sensortag
+from simperiph import CCCD, build_db, ti_uuid, uuid_bytes
+
+SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'simperiph.py')
+SIMHCI = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'simhci.py')
+
+
+class Sim:
+    """simperiph.py in its own process, so its CPU time is not ours"""
+
+    def __init__(self, rate, count, *args):
+        self.path = os.path.join(tempfile.gettempdir(), 'simperiph.%d' % os.getpid())
+        self.db = build_db()
+        self.proc = subprocess.Popen([sys.executable, SIM, self.path,
+                                      '-r', str(rate), '-n', str(count)] + list(args),
+                                     stdout=subprocess.PIPE)
+        self.proc.stdout.readline()
+
+    def stop(self):
+        """Returns the number of ATT PDUs the simulator received"""
+        self.proc.terminate()
+        out = self.proc.communicate()[0].decode()
+        return int(out.split()[0]) if out else 0
+
+
+class Counter(btle.DefaultDelegate):
+    def __init__(self):
+        btle.DefaultDelegate.__init__(self)
+        self.count = 0
+        self.bytes = 0
+
+    def handleNotification(self, cHandle, data):
+        self.count += 1
+        self.bytes += len(data)
+
+
+def helper_cpu(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+
+
+def proc_status(pid, suffix):
+    """Sum of the /proc/<pid>/status fields whose names end with suffix"""
+    n = 0
+    with open('/proc/%s/status' % pid) as f:
+        for line in f:
+            if line.endswith(suffix + ':', 0, line.find(':') + 1):
+                n += int(line.split()[1])
+    return n
+
+
+def ctx_switches(pid):
+    return proc_status(pid, 'ctxt_switches')
+
+
+class SimTag(sensortag.SensorTag):
+    """A CC2650 SensorTag; the sensors are set up once connected"""
+
+    def __init__(self, helper=None):
+        btle.Peripheral.__init__(self, helper=helper)
+
+    def setup(self):
+        self.firmwareVersion = u'1.30'
+        self._mpu9250 = sensortag.MovementSensorMPU9250(self)
+        self.IRtemperature = sensortag.IRTemperatureSensorTMP007(self)
+        self.accelerometer = sensortag.AccelerometerSensorMPU9250(self._mpu9250)
+        self.humidity = sensortag.HumiditySensorHDC1000(self)
+        self.magnetometer = sensortag.MagnetometerSensorMPU9250(self._mpu9250)
+        self.barometer = sensortag.BarometerSensorBMP280(self)
+        self.gyroscope = sensortag.GyroscopeSensorMPU9250(self._mpu9250)
+        self.lightmeter = sensortag.OpticalSensorOPT3001(self)
+        self.battery = sensortag.BatterySensor(self)
+        sensors = [self.IRtemperature, self.humidity, self.barometer,
+                   self.accelerometer, self.magnetometer, self.gyroscope,
+                   self.lightmeter, self.battery]
+        for s in sensors:
+            s.enable()
+        return sensors
+
+
+def connect_sim(path, delegate, binary, helper=None, cls=btle.Peripheral):
+    """Connects a Peripheral to the simulator, bypassing the address checks"""
+    p = cls(helper=helper)
+    p.withDelegate(delegate)
+    p._startHelper(binary=binary)
+    p._writeCmd("conn %s unix\n" % path)
+    rsp = p._getResp('stat')
+    while rsp['state'][0] == 'tryconn':
+        rsp = p._getResp('stat')
+    if rsp['state'][0] != 'conn':
+        p._stopHelper()
+        raise btle.BTLEException(btle.BTLEException.DISCONNECTED,
+                                 "Failed to connect to %s" % path)
+    return p
+
+
+def run(sim, binary, count, timeout, stream=False):
+    delegate = Counter()
+    p = connect_sim(sim.path, delegate, binary)
+    cccd = [a for a in sim.db if a.char is not None and
+            a.char.type == uuid_bytes(ti_uuid(0xAA01))][0]
+    if stream:
+        p.streamNotifications()
+
+    t0 = time.time()
+    c0 = os.times()
+    h0 = helper_cpu(p._helper.pid)
+    p.subscribe([cccd.handle])
+    while delegate.count < count:
+        if not p.waitForNotifications(timeout):
+            break
+    elapsed = time.time() - t0
+    c1 = os.times()
+    h1 = helper_cpu(p._helper.pid)
+    p.disconnect()
+
+    return {
+        'mode': ('binary' if binary else 'text') + ('+stream' if stream else ''),
+        'notifications': delegate.count,
+        'seconds': elapsed,
+        'rate': delegate.count / elapsed if elapsed else 0,
+        'python_cpu': (c1[0] + c1[1]) - (c0[0] + c0[1]),
+        'helper_cpu': h1 - h0,
+    }
+
+
+def subscribe_all(sim, periphs):
+    cccd = [a for a in sim.db if a.char is not None and
+            a.char.type == uuid_bytes(ti_uuid(0xAA01))][0]
+    for p in periphs:
+        p.subscribe([cccd.handle])
+
+
+def run_gateway(sim, conns, count, shared, binary, timeout, stream=False):
+    """conns peripherals, each sending count notifications"""
+    sh = btle.SharedHelper(binary=binary) if shared else None
+    if stream:
+        sh.streamNotifications()
+    counters = [Counter() for i in range(conns)]
+    periphs = [connect_sim(sim.path, c, binary, sh) for c in counters]
+    helpers = [sh._helper] if shared else [p._helper for p in periphs]
+    total = conns * count
+
+    def received():
+        return sum(c.count for c in counters)
+
+    t0 = time.time()
+    c0 = os.times()
+    h0 = sum(helper_cpu(h.pid) for h in helpers)
+    x0 = sum(ctx_switches(h.pid) for h in helpers) + ctx_switches('self')
+    subscribe_all(sim, periphs)
+    while received() < total:
+        if shared:
+            if not sh.waitForNotifications(timeout):
+                break
+            continue
+        # Responses already buffered in Python are invisible to select()
+        ready = [p for p in periphs if p._rpos < len(p._rbuf)]
+        if not ready:
+            fds = dict((p._helper.stdout.fileno(), p) for p in periphs)
+            r, _, _ = select.select(list(fds), [], [], timeout)
+            if not r:
+                break
+            ready = [fds[fd] for fd in r]
+        for p in ready:
+            p.waitForNotifications(0.001)
+    elapsed = time.time() - t0
+    c1 = os.times()
+    h1 = sum(helper_cpu(h.pid) for h in helpers)
+    x1 = sum(ctx_switches(h.pid) for h in helpers) + ctx_switches('self')
+    rss = sum(proc_status(h.pid, 'VmRSS') for h in helpers)
+
+    for p in periphs:
+        p.disconnect()
+    if shared:
+        sh.close()
+
+    return {
+        'mode': ('shared' if shared else 'per-conn') + ('+stream' if stream else ''),
+        'processes': len(helpers),
+        'notifications': received(),
+        'seconds': elapsed,
+        'python_cpu': (c1[0] + c1[1]) - (c0[0] + c0[1]),
+        'helper_cpu': h1 - h0,
+        'ctx_switches': x1 - x0,
+        'helper_rss': rss,
+    }
+
+
+def gateway(args, sim, binary):
+    runs = [(False, False), (True, False)]
+    if args.stream:
+        runs.append((True, True))
+    results = [run_gateway(sim, args.conns, args.count, shared, binary, args.timeout,
+                           stream)
+               for (shared, stream) in runs]
+    print("%d connections, %d notifications each at %g/s, %s output" % (
+          args.conns, args.count, args.rate, 'binary' if binary else 'text'))
+    print("%-14s %6s %8s %8s %10s %10s %9s %10s %8s" % ("mode", "procs", "ntfy",
+          "secs", "py cpu s", "hlp cpu s", "us/ntfy", "ctx sw", "rss kB"))
+    for r in results:
+        cpu = r['python_cpu'] + r['helper_cpu']
+        print("%-14s %6d %8d %8.2f %10.2f %10.2f %9.1f %10d %8d" % (
+            r['mode'], r['processes'], r['notifications'], r['seconds'],
+            r['python_cpu'], r['helper_cpu'],
+            1e6 * cpu / r['notifications'] if r['notifications'] else 0,
+            r['ctx_switches'], r['helper_rss']))
+
+
+def reconnect_cycle(path, binary, timeout, discall=False):
+    """Seconds from connecting to the first notification"""
+    delegate = Counter()
+    t0 = time.time()
+    p = connect_sim(path, delegate, binary)
+    data = None
+    for svc in (p.discoverAll() if discall else p.getServices()):
+        for c in svc.getCharacteristics():
+            if c.uuid == btle.UUID(ti_uuid(0xAA01)):
+                data = c
+    cccd = data.getDescriptors(forUUID=CCCD)[0]
+    p.writeCharacteristic(cccd.handle, b'\x01\x00', withResponse=True)
+    while delegate.count == 0:
+        if not p.waitForNotifications(timeout):
+            break
+    elapsed = time.time() - t0
+    p.disconnect()
+    return elapsed
+
+
+def reconnect(args, binary):
+    """--reconnect cycles without, then with, the GATT cache"""
+    sim_args = ['-l', str(args.latency), '--db-hash']
+    results = []
+    for discall in (False, True):
+        cache = tempfile.mkdtemp(prefix='gattcache.')
+        try:
+            for cached in (False, True):
+                btle.GattCacheDir = cache if cached else None
+                if cached:
+                    # Fill the cache, as the first connection ever would
+                    sim = Sim(10, 0, *sim_args)
+                    reconnect_cycle(sim.path, binary, args.timeout, discall)
+                    sim.stop()
+                sim = Sim(10, 0, *sim_args)
+                try:
+                    times = sorted(reconnect_cycle(sim.path, binary, args.timeout, discall)
+                                   for i in range(args.reconnect))
+                finally:
+                    requests = sim.stop()
+                results.append((discall, cached, times, requests))
+        finally:
+            btle.GattCacheDir = None
+            shutil.rmtree(cache)
+
+    print("%d reconnections, %g ms per ATT response, %s output" % (
+          args.reconnect, args.latency, 'binary' if binary else 'text'))
+    print("%-9s %-7s %10s %10s %10s" % ("discover", "cache", "median ms", "p90 ms",
+                                        "ATT PDUs"))
+    for (discall, cached, times, requests) in results:
+        print("%-9s %-7s %10.1f %10.1f %10.1f" % (
+            'discall' if discall else 'steps', 'on' if cached else 'off',
+            1e3 * times[len(times) // 2], 1e3 * times[int(len(times) * 0.9)],
+            requests / float(len(times))))
+
+
+def poll_run(sim_args, binary, batched, polls):
+    """Seconds each poll took, and the ATT PDUs the simulator received"""
+    sim = Sim(10, 0, *sim_args)
+    times = []
+    try:
+        tag = connect_sim(sim.path, Counter(), binary, cls=SimTag)
+        sensors = tag.setup()
+        for i in range(polls):
+            t0 = time.time()
+            if batched:
+                tag.readSensors(sensors)
+            else:
+                [s.read() for s in sensors]
+            times.append(time.time() - t0)
+        tag.disconnect()
+    finally:
+        requests = sim.stop()
+    return (sorted(times), requests)
+
+
+def poll(args, binary):
+    """--poll rounds of reading every sensor, a read at a time, then with one
+    readSensors(), with and without Read Multiple in the simulator"""
+    results = []
+    for (batched, read_multi) in ((False, True), (True, True), (True, False)):
+        sim_args = ['-l', str(args.latency)]
+        if not read_multi:
+            sim_args.append('--no-read-multi')
+        # Less the connection and setup, as a run with no polls counts them
+        setup = poll_run(sim_args, binary, batched, 0)[1]
+        (times, requests) = poll_run(sim_args, binary, batched, args.poll)
+        results.append((batched, read_multi, times, requests - setup))
+
+    print("%d polls of the CC2650 sensors, %g ms per ATT response, %s output" % (
+          args.poll, args.latency, 'binary' if binary else 'text'))
+    print("%-12s %-11s %10s %10s %10s" % ("reads", "read multi", "median ms",
+                                          "p90 ms", "ATT PDUs"))
+    for (batched, read_multi, times, requests) in results:
+        print("%-12s %-11s %10.1f %10.1f %10.1f" % (
+            'readSensors' if batched else 'one each', 'yes' if read_multi else 'no',
+            1e3 * times[len(times) // 2], 1e3 * times[int(len(times) * 0.9)],
+            requests / float(args.poll)))
+
+
+def scan_run(path, timeout, params, dedup_ms, fields=True):
+    scanner = btle.Scanner().withScanParameters(hciSocket=path, **params)
+    scanner._fields = fields
+    if dedup_ms:
+        scanner.withFilter(dedupMs=dedup_ms)
+    scanner.start()
+    cpu0 = time.process_time()
+    scanner.process(timeout)
+    python_cpu = time.process_time() - cpu0
+    (duty, rate) = scanner.scanStats()
+    helper = helper_cpu(scanner._helper.pid)
+    scanner.stop()
+    devs = list(scanner.getDevices())
+    return {'devices': len(devs), 'reports': sum(d.updateCount for d in devs),
+            'duty': duty, 'rate': rate, 'python_cpu': python_cpu,
+            'helper_cpu': helper}
+
+
+def scan(args):
+    """--scan devices advertising, scanned for --timeout seconds each with
+    several scan parameters and filters"""
+    path = os.path.join(tempfile.gettempdir(), 'simhci.%d' % os.getpid())
+    corpus = ['--corpus', args.corpus] if args.corpus else []
+    sim = subprocess.Popen([sys.executable, SIMHCI, path, '-d', str(args.scan),
+                            '-r', str(args.adv_rate)] + corpus,
+                           stdout=subprocess.PIPE)
+    sim.stdout.readline()
+    runs = [("window 100%", dict(intervalMs=10, windowMs=10), 0, True),
+            ("window 50%", dict(intervalMs=10, windowMs=5), 0, True),
+            ("dupfilter", dict(filterDuplicates=True), 0, True),
+            ("dedup 1 s", dict(), 1000, True),
+            ("dedup 10 s", dict(), 10000, True),
+            ("python parse", dict(active=True), 0, False),
+            ("helper parse", dict(active=True), 0, True)]
+    try:
+        results = [(name, scan_run(path, args.timeout, params, dedup, fields))
+                   for (name, params, dedup, fields) in runs]
+    finally:
+        sim.terminate()
+        sim.communicate()
+
+    print("%d devices advertising %g times a second, %g s scans" % (
+          args.scan, args.adv_rate, args.timeout))
+    print("%-12s %8s %8s %8s %10s %10s %10s %9s" % ("scan", "devices", "duty",
+          "adv/s", "reports", "py cpu s", "hlp cpu s", "us/rpt"))
+    for (name, r) in results:
+        print("%-12s %8d %8.3f %8d %10d %10.2f %10.2f %9.1f" % (
+            name, r['devices'], r['duty'], r['rate'], r['reports'],
+            r['python_cpu'], r['helper_cpu'],
+            1e6 * r['python_cpu'] / max(r['reports'], 1)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('-n', '--count', type=int, default=20000,
+                        help='notifications per run')
+    parser.add_argument('-r', '--rate', type=float, default=0,
+                        help='notifications/s from the simulator, 0 = flat out')
+    parser.add_argument('-m', '--mode', choices=['text', 'binary', 'both'],
+                        default='both')
+    parser.add_argument('-t', '--timeout', type=float, default=5.0)
+    parser.add_argument('-c', '--conns', type=int, default=0,
+                        help='compare per-connection and shared helpers for this many peripherals')
+    parser.add_argument('--reconnect', type=int, default=0,
+                        help='time this many reconnections, without and with the GATT cache')
+    parser.add_argument('--poll', type=int, default=0,
+                        help='time this many polls of all the SensorTag sensors')
+    parser.add_argument('--scan', type=int, default=0,
+                        help='scan continuously for this many simulated devices')
+    parser.add_argument('--adv-rate', type=float, default=10.0,
+                        help='advertisements/s per device, for --scan')
+    parser.add_argument('--corpus',
+                        help='advertising data for --scan, e.g. tools/adv_corpus.txt')
+    parser.add_argument('-l', '--latency', type=float, default=7.5,
+                        help='milliseconds the simulator takes to respond, for --reconnect and --poll')
+    parser.add_argument('--stream', action='store_true',
+                        help='also run with notifications sent in batches')
+    parser.add_argument('--helper', help='bluepy-helper to run, if not the built one')
+    args = parser.parse_args()
+    if args.helper:
+        btle.helperExe = args.helper
+
+    modes = {'text': [False], 'binary': [True], 'both': [False, True]}[args.mode]
+    if args.reconnect:
+        for b in modes:
+            reconnect(args, b)
+        return
+    if args.poll:
+        for b in modes:
+            poll(args, b)
+        return
+    if args.scan:
+        scan(args)
+        return
+
+    sim = Sim(args.rate, args.count)
+    try:
+        if args.conns:
+            for b in modes:
+                gateway(args, sim, b)
+            return
+        results = [run(sim, b, args.count, args.timeout, s)
+                   for s in ([False, True] if args.stream else [False])
+                   for b in modes]
+    finally:
+        sim.stop()
+
+    print("%-13s %8s %8s %10s %10s %10s %9s" % ("mode", "ntfy", "secs",
+          "ntfy/s", "py cpu s", "hlp cpu s", "us/ntfy"))
+    for r in results:
+        cpu = r['python_cpu'] + r['helper_cpu']
+        print("%-13s %8d %8.2f %10.0f %10.2f %10.2f %9.1f" % (
+            r['mode'], r['notifications'], r['seconds'], r['rate'],
+            r['python_cpu'], r['helper_cpu'],
+            1e6 * cpu / r['notifications'] if r['notifications'] else 0))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,244 @@
+#!/usr/bin/env python
+"""A simulated LE controller, for testing continuous scanning without one.
+
+It takes HCI command packets on a SOCK_SEQPACKET Unix socket, and answers
+as a controller would, which bluepy-helper uses when given its path:
+
+    lescan type=passive interval=10 window=5 hci=/tmp/hci.sock
+
+While the scan is enabled, each of the simulated devices advertises at the
+configured rate, and is heard when that falls inside a scan window. Active
+scanning adds a scan response after each advertisement. Duplicate filtering
+reports each device once per scan, and the white list filter policy only
+the devices added to it. Each packet is one HCI packet, with the packet
+type byte first, as on a raw HCI socket.
+
+With --corpus, the devices take their advertising and scan response data
+in turn from a file such as adv_corpus.txt.
+"""
+
+from __future__ import print_function
+import binascii
+import heapq
+import os
+import random
+import select
+import signal
+import socket
+import struct
+import sys
+import time
+
+HCI_COMMAND_PKT = 0x01
+HCI_EVENT_PKT = 0x04
+
+EVT_CMD_COMPLETE = 0x0E
+EVT_LE_META_EVENT = 0x3E
+EVT_LE_ADVERTISING_REPORT = 0x02
+
+OGF_LE_CTL = 0x08
+OCF_LE_SET_SCAN_PARAMETERS = 0x000B
+OCF_LE_SET_SCAN_ENABLE = 0x000C
+OCF_LE_CLEAR_WHITE_LIST = 0x0010
+OCF_LE_ADD_DEVICE_TO_WHITE_LIST = 0x0011
+
+STATUS_UNKNOWN_COMMAND = 0x01
+STATUS_COMMAND_DISALLOWED = 0x0C
+STATUS_INVALID_PARAMS = 0x12
+
+ADV_IND, ADV_NONCONN_IND, SCAN_RSP = 0x00, 0x03, 0x04
+
+UNIT = 0.000625     # seconds per interval and window unit
+
+
+def opcode(ocf):
+    return (OGF_LE_CTL << 10) | ocf
+
+
+def read_corpus(path):
+    """[(advertising data, scan response data)] from a corpus file"""
+    corpus = []
+    with open(path) as f:
+        for line in f:
+            if line.strip() and not line.startswith('#'):
+                fields = [binascii.unhexlify(h) for h in line.split()]
+                corpus.append((fields[0], fields[1] if len(fields) > 1 else b''))
+    return corpus
+
+
+class Device:
+    def __init__(self, n, rate, data=None):
+        self.addr = struct.pack('<IH', 0x10000 + n, 0xC0DE)
+        self.addr_type = n & 1
+        self.connectable = n % 4 != 3
+        self.rssi = -40 - (n * 7) % 50
+        name = ('Sim%04d' % n).encode()
+        self.adv = (b'\x02\x01\x06' +
+                    struct.pack('<BB', len(name) + 1, 0x09) + name)
+        self.rsp = b'\x05\xff\x0d\x00' + struct.pack('<H', n)
+        if data:
+            (self.adv, self.rsp) = data
+        # Spread the devices' advertising events over the interval
+        self.period = 1.0 / rate
+        self.next = (n * 0.618034 % 1.0) * self.period
+
+
+class SimController:
+    """Serves one HCI client on a Unix socket, with devices advertising
+    rate times a second each. Counts advertising events in sent and
+    those heard in heard."""
+
+    def __init__(self, path, devices=100, rate=10.0, corpus=None):
+        self.path = path
+        self.devices = [Device(n, rate, corpus[n % len(corpus)] if corpus else None)
+                        for n in range(devices)]
+        self.enabled = False
+        self.active = 0
+        self.interval = 0x10
+        self.window = 0x10
+        self.policy = 0
+        self.filter_dup = 0
+        self.white_list = set()
+        self.reported = set()
+        self.due = []           # [(time, device number)], a heap
+        self.enabled_at = 0.0
+        self.sent = 0
+        self.heard = 0
+        self.commands = 0
+        if os.path.exists(path):
+            os.unlink(path)
+        self.lsock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.lsock.bind(path)
+        self.lsock.listen(1)
+        self.client = None
+
+    def close(self):
+        if self.client:
+            self.client.close()
+        self.lsock.close()
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+    def command(self, pkt):
+        self.commands += 1
+        (op, plen) = struct.unpack_from('<HB', pkt, 1)
+        param = pkt[4:4 + plen]
+        status = 0
+        if op == opcode(OCF_LE_SET_SCAN_PARAMETERS):
+            if self.enabled:
+                status = STATUS_COMMAND_DISALLOWED
+            else:
+                (self.active, self.interval, self.window, own,
+                 self.policy) = struct.unpack('<BHHBB', param)
+                if self.window > self.interval:
+                    status = STATUS_INVALID_PARAMS
+        elif op == opcode(OCF_LE_SET_SCAN_ENABLE):
+            (enable, self.filter_dup) = struct.unpack('<BB', param)
+            if enable and not self.enabled:
+                self.enabled_at = time.time()
+                self.reported = set()
+                self.due = [(self.enabled_at + d.next % d.period, n)
+                            for (n, d) in enumerate(self.devices)]
+                heapq.heapify(self.due)
+            self.enabled = bool(enable)
+        elif op == opcode(OCF_LE_CLEAR_WHITE_LIST):
+            self.white_list = set()
+        elif op == opcode(OCF_LE_ADD_DEVICE_TO_WHITE_LIST):
+            self.white_list.add((param[0], bytes(param[1:7])))
+        else:
+            status = STATUS_UNKNOWN_COMMAND
+        self.event(EVT_CMD_COMPLETE, struct.pack('<BHB', 1, op, status))
+
+    def event(self, code, param):
+        try:
+            self.client.send(struct.pack('<BBB', HCI_EVENT_PKT, code,
+                                         len(param)) + param)
+        except socket.error:
+            pass
+
+    def report(self, d, evt_type, data):
+        if self.filter_dup:
+            if (d, evt_type) in self.reported:
+                return
+            self.reported.add((d, evt_type))
+        info = (struct.pack('<BBB', 1, evt_type, d.addr_type) + d.addr +
+                struct.pack('<B', len(data)) + data +
+                struct.pack('<b', d.rssi))
+        self.event(EVT_LE_META_EVENT,
+                   struct.pack('<B', EVT_LE_ADVERTISING_REPORT) + info)
+
+    def advertise(self, now):
+        while self.due and self.due[0][0] <= now:
+            (t, n) = self.due[0]
+            d = self.devices[n]
+            # The Core spec's advDelay, which keeps an advertiser from
+            # staying in step with a scanner
+            d.next = t + d.period + random.uniform(0.0, 0.010)
+            heapq.heapreplace(self.due, (d.next, n))
+            self.sent += 1
+            phase = ((t - self.enabled_at) / UNIT) % self.interval
+            if phase >= self.window:
+                continue
+            if self.policy and (d.addr_type, d.addr) not in self.white_list:
+                continue
+            self.heard += 1
+            evt_type = ADV_IND if d.connectable else ADV_NONCONN_IND
+            self.report(d, evt_type, d.adv)
+            if self.active and d.connectable and d.rsp:
+                self.report(d, SCAN_RSP, d.rsp)
+
+    def run(self):
+        while True:
+            socks = [self.lsock] + ([self.client] if self.client else [])
+            timeout = 0.1
+            if self.enabled and self.due:
+                timeout = max(0.0, min(timeout, self.due[0][0] - time.time()))
+            r, _, _ = select.select(socks, [], [], timeout)
+            for s in r:
+                if s is self.lsock:
+                    if self.client:
+                        self.client.close()
+                    self.client, _ = self.lsock.accept()
+                    self.enabled = False
+                    continue
+                try:
+                    pkt = bytearray(s.recv(260))
+                except socket.error:
+                    pkt = b''
+                if not pkt:
+                    s.close()
+                    self.client = None
+                    self.enabled = False
+                elif pkt[0] == HCI_COMMAND_PKT and len(pkt) >= 4:
+                    self.command(pkt)
+            if self.enabled and self.client:
+                self.advertise(time.time())
+
+
+def main():
+    import argparse
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('path', help='Unix socket to listen on')
+    parser.add_argument('-d', '--devices', type=int, default=100)
+    parser.add_argument('-r', '--rate', type=float, default=10.0,
+                        help='advertisements/s per device')
+    parser.add_argument('--corpus', help='file of advertising data to send')
+    args = parser.parse_args()
+
+    sim = SimController(args.path, args.devices, args.rate,
+                        read_corpus(args.corpus) if args.corpus else None)
+    signal.signal(signal.SIGTERM, lambda sig, frame: sys.exit(0))
+    print("%d devices advertising on %s" % (len(sim.devices), args.path))
+    sys.stdout.flush()
+    try:
+        sim.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sim.close()
+        print("%d commands, %d advertisements, %d heard" %
+              (sim.commands, sim.sent, sim.heard))
+
+
+if __name__ == "__main__":
+    main()
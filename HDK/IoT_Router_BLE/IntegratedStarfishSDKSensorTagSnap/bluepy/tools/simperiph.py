@@ -0,0 +1,462 @@
+#!/usr/bin/env python
+"""A simulated SensorTag, for testing bluepy-helper without a controller.
+
+It serves a small ATT database on a SOCK_SEQPACKET Unix socket, which
+bluepy-helper connects to with address type "unix":
+
+    conn /tmp/sim.sock unix
+
+Each packet is one ATT PDU, as on the L2CAP channel. Writing 01 00 to a
+CCCD makes the characteristic notify (02 00 indicate) at the configured
+rate, with a 32-bit sequence number at the start of the value.
+
+With --db-hash the GATT service has a Database Hash characteristic, and
+SIGUSR1 changes it and indicates Service Changed to subscribed clients.
+With --latency every response is held back that long, as a connection
+interval would.
+"""
+
+from __future__ import print_function
+import hashlib
+import os
+import select
+import signal
+import socket
+import struct
+import sys
+import threading
+import time
+
+ATT_OP_ERROR = 0x01
+ATT_OP_MTU_REQ = 0x02
+ATT_OP_MTU_RESP = 0x03
+ATT_OP_FIND_INFO_REQ = 0x04
+ATT_OP_FIND_INFO_RESP = 0x05
+ATT_OP_FIND_BY_TYPE_REQ = 0x06
+ATT_OP_FIND_BY_TYPE_RESP = 0x07
+ATT_OP_READ_BY_TYPE_REQ = 0x08
+ATT_OP_READ_BY_TYPE_RESP = 0x09
+ATT_OP_READ_REQ = 0x0A
+ATT_OP_READ_RESP = 0x0B
+ATT_OP_READ_BLOB_REQ = 0x0C
+ATT_OP_READ_BLOB_RESP = 0x0D
+ATT_OP_READ_MULTI_REQ = 0x0E
+ATT_OP_READ_MULTI_RESP = 0x0F
+ATT_OP_READ_BY_GROUP_REQ = 0x10
+ATT_OP_READ_BY_GROUP_RESP = 0x11
+ATT_OP_WRITE_REQ = 0x12
+ATT_OP_WRITE_RESP = 0x13
+ATT_OP_HANDLE_NOTIFY = 0x1B
+ATT_OP_HANDLE_IND = 0x1D
+ATT_OP_HANDLE_CNF = 0x1E
+ATT_OP_WRITE_CMD = 0x52
+
+ATT_ECODE_INVALID_HANDLE = 0x01
+ATT_ECODE_READ_NOT_PERM = 0x02
+ATT_ECODE_WRITE_NOT_PERM = 0x03
+ATT_ECODE_REQ_NOT_SUPP = 0x06
+ATT_ECODE_INVALID_OFFSET = 0x07
+ATT_ECODE_ATTR_NOT_FOUND = 0x0A
+ATT_ECODE_ATTR_NOT_LONG = 0x0B
+
+PRIMARY = 0x2800
+CHARACTERISTIC = 0x2803
+CCCD = 0x2902
+SERVICE_CHANGED = 0x2A05
+DATABASE_HASH = 0x2B2A
+
+BROADCAST, READ, WRITE_NO_RESP, WRITE, NOTIFY, INDICATE = 1, 2, 4, 8, 16, 32
+
+BASE = b'\xfb\x34\x9b\x5f\x80\x00\x00\x80\x00\x10\x00\x00'
+
+
+def uuid_bytes(u):
+    """An int is a 16-bit UUID, a string a 128-bit one, both little-endian"""
+    if isinstance(u, int):
+        return struct.pack('<H', u)
+    h = u.replace('-', '')
+    return bytes(bytearray(reversed(bytearray.fromhex(h))))
+
+
+def ti_uuid(short):
+    return 'F000%04X-0451-4000-B000-000000000000' % short
+
+
+# Services of a CC2650 SensorTag, with values of the right sizes
+SENSORTAG = [
+    (0x1800, [(0x2A00, READ, b'CC2650 SensorTag sim'),
+              (0x2A01, READ, b'\x00\x00')]),
+    (0x1801, [(0x2A05, INDICATE, b'\x01\x00\xff\xff')]),
+    (0x180A, [(0x2A29, READ, b'Texas Instruments'),
+              (0x2A24, READ, b'CC2650 SensorTag'),
+              (0x2A26, READ, b'1.30 (Jun 20 2016)')]),
+    (0x180F, [(0x2A19, READ | NOTIFY, b'\x54')]),
+    (ti_uuid(0xAA00), [(ti_uuid(0xAA01), READ | NOTIFY, b'\x00' * 4),
+                       (ti_uuid(0xAA02), READ | WRITE, b'\x00'),
+                       (ti_uuid(0xAA03), READ | WRITE, b'\x64')]),
+    (ti_uuid(0xAA20), [(ti_uuid(0xAA21), READ | NOTIFY, b'\x00' * 4),
+                       (ti_uuid(0xAA22), READ | WRITE, b'\x00'),
+                       (ti_uuid(0xAA23), READ | WRITE, b'\x64')]),
+    (ti_uuid(0xAA40), [(ti_uuid(0xAA41), READ | NOTIFY, b'\x00' * 6),
+                       (ti_uuid(0xAA42), READ | WRITE, b'\x00'),
+                       (ti_uuid(0xAA44), READ | WRITE, b'\x64')]),
+    (ti_uuid(0xAA70), [(ti_uuid(0xAA71), READ | NOTIFY, b'\x00' * 2),
+                       (ti_uuid(0xAA72), READ | WRITE, b'\x00'),
+                       (ti_uuid(0xAA73), READ | WRITE, b'\x50')]),
+    (ti_uuid(0xAA80), [(ti_uuid(0xAA81), READ | NOTIFY, b'\x00' * 18),
+                       (ti_uuid(0xAA82), READ | WRITE, b'\x00\x00'),
+                       (ti_uuid(0xAA83), READ | WRITE, b'\x64')]),
+    (ti_uuid(0xFFE0), [(0xFFE1, READ | NOTIFY, b'\x00')]),
+]
+
+
+class Attribute:
+    def __init__(self, handle, atype, value, props=0):
+        self.handle = handle
+        self.type = uuid_bytes(atype)
+        self.value = bytearray(value)
+        self.props = props
+        self.end = handle       # group end, for service declarations
+        self.char = None        # value attribute, for CCCDs
+
+
+def build_db(services=SENSORTAG):
+    db = []
+    h = 1
+    for (suuid, chars) in services:
+        svc = Attribute(h, PRIMARY, uuid_bytes(suuid))
+        db.append(svc)
+        h += 1
+        for (cuuid, props, value) in chars:
+            decl = struct.pack('<BH', props, h + 1) + uuid_bytes(cuuid)
+            db.append(Attribute(h, CHARACTERISTIC, decl))
+            val = Attribute(h + 1, cuuid, value, props)
+            db.append(val)
+            h += 2
+            if props & (NOTIFY | INDICATE):
+                cccd = Attribute(h, CCCD, b'\x00\x00', READ | WRITE)
+                cccd.char = val
+                db.append(cccd)
+                h += 1
+        svc.end = h - 1
+    return db
+
+
+class Client:
+    def __init__(self, sock):
+        self.sock = sock
+        self.mtu = 23
+        self.subs = {}          # value handle -> [opcode, next time]
+        self.seq = 0
+        self.sent = 0
+        self.changed = False    # Service Changed indications enabled
+
+
+class SimPeripheral:
+    """Serves build_db() on a Unix socket, to any number of clients.
+
+    rate is notifications per second per subscription, 0 for as fast as
+    the socket takes them; count stops each client after that many.
+    latency is the delay in seconds before each response, and db_hash adds
+    a Database Hash, which is a digest of the table rather than the AES-CMAC
+    the Core spec defines. Without read_multi, Read Multiple requests are
+    refused as not supported.
+    """
+
+    def __init__(self, path, rate=10.0, count=0, mtu=247, services=SENSORTAG,
+                 latency=0.0, db_hash=False, read_multi=True):
+        self.path = path
+        self.rate = rate
+        self.count = count
+        self.mtu = mtu
+        self.latency = latency
+        self.read_multi = read_multi
+        self.generation = 0
+        if db_hash:
+            services = [(s, chars + [(DATABASE_HASH, READ, b'\x00' * 16)])
+                        if s == 0x1801 else (s, chars) for (s, chars) in services]
+        self.db = build_db(services)
+        self.update_hash()
+        self.clients = []
+        self.delayed = []       # [time due, client, response]
+        self.requests = 0
+        self._changes = 0
+        self._stop = False
+        if os.path.exists(path):
+            os.unlink(path)
+        self.lsock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.lsock.bind(path)
+        self.lsock.listen(64)
+        self._thread = None
+
+    def attr(self, handle):
+        for a in self.db:
+            if a.handle == handle:
+                return a
+        return None
+
+    def update_hash(self):
+        h = hashlib.md5(str(self.generation).encode())
+        for a in self.db:
+            if a.type in (uuid_bytes(PRIMARY), uuid_bytes(CHARACTERISTIC)):
+                h.update(struct.pack('<H', a.handle) + bytes(a.value))
+        for a in self.db:
+            if a.type == uuid_bytes(DATABASE_HASH):
+                a.value = bytearray(h.digest())
+
+    def service_changed(self):
+        """Has the table changed, as far as clients can tell"""
+        self.generation += 1
+        self.update_hash()
+        sc = [a for a in self.db if a.type == uuid_bytes(SERVICE_CHANGED)][0]
+        pdu = struct.pack('<BHHH', ATT_OP_HANDLE_IND, sc.handle, 0x0001, 0xFFFF)
+        for c in self.clients:
+            if c.changed:
+                try:
+                    c.sock.send(pdu)
+                except socket.error:
+                    pass
+
+    def signal_changed(self, sig, frame):
+        self._changes += 1
+
+    def start(self):
+        self._thread = threading.Thread(target=self.run)
+        self._thread.daemon = True
+        self._thread.start()
+        return self
+
+    def stop(self):
+        self._stop = True
+        if self._thread:
+            self._thread.join()
+        for c in self.clients:
+            c.sock.close()
+        self.lsock.close()
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+    def run(self):
+        while not self._stop:
+            socks = [self.lsock] + [c.sock for c in self.clients]
+            streaming = [c for c in self.clients if c.subs]
+            timeout = 0.1
+            if streaming or self.delayed:
+                now = time.time()
+                due = [t for c in streaming for (op, t) in c.subs.values()]
+                due += [d[0] for d in self.delayed]
+                timeout = max(0.0, min(timeout, min(due) - now))
+            r, _, _ = select.select(socks, [], [], timeout)
+            while self._changes:
+                self._changes -= 1
+                self.service_changed()
+            self.send_delayed()
+            for s in r:
+                if s is self.lsock:
+                    conn, _ = self.lsock.accept()
+                    self.clients.append(Client(conn))
+                    continue
+                c = [c for c in self.clients if c.sock is s][0]
+                try:
+                    pdu = s.recv(1024)
+                except socket.error:
+                    pdu = b''
+                if not pdu:
+                    s.close()
+                    self.clients.remove(c)
+                    continue
+                rsp = self.handle(c, bytearray(pdu))
+                if rsp is None:
+                    continue
+                if self.latency:
+                    self.delayed.append([time.time() + self.latency, c, rsp])
+                else:
+                    s.send(bytes(rsp))
+            for c in streaming:
+                if c in self.clients:
+                    self.stream(c)
+
+    def send_delayed(self):
+        now = time.time()
+        while self.delayed and self.delayed[0][0] <= now:
+            (due, c, rsp) = self.delayed.pop(0)
+            if c in self.clients:
+                try:
+                    c.sock.send(bytes(rsp))
+                except socket.error:
+                    pass
+
+    def stream(self, c):
+        now = time.time()
+        for (hnd, sub) in list(c.subs.items()):
+            if sub[1] > now:
+                continue
+            a = self.attr(hnd)
+            burst = 64 if self.rate == 0 else 1
+            for i in range(burst):
+                if self.count and c.sent >= self.count:
+                    c.subs.clear()
+                    return
+                val = bytearray(a.value)
+                val[0:4] = struct.pack('<I', c.seq & 0xFFFFFFFF)[0:len(val)]
+                pdu = struct.pack('<BH', sub[0], hnd) + bytes(val[:c.mtu - 3])
+                try:
+                    c.sock.send(pdu)
+                except socket.error:
+                    return
+                c.seq += 1
+                c.sent += 1
+            sub[1] = now if self.rate == 0 else sub[1] + 1.0 / self.rate
+
+    @staticmethod
+    def error(op, handle, ecode):
+        return struct.pack('<BBHB', ATT_OP_ERROR, op, handle, ecode)
+
+    def in_range(self, start, end):
+        return [a for a in self.db if start <= a.handle <= end]
+
+    def handle(self, c, pdu):
+        self.requests += 1
+        op = pdu[0]
+        if op == ATT_OP_MTU_REQ:
+            c.mtu = max(23, min(self.mtu, struct.unpack_from('<H', pdu, 1)[0]))
+            return struct.pack('<BH', ATT_OP_MTU_RESP, self.mtu)
+
+        if op in (ATT_OP_READ_BY_GROUP_REQ, ATT_OP_READ_BY_TYPE_REQ):
+            start, end = struct.unpack_from('<HH', pdu, 1)
+            atype = bytes(pdu[5:])
+            found = [a for a in self.in_range(start, end) if a.type == atype]
+            if start == 0 or start > end:
+                return self.error(op, start, ATT_ECODE_INVALID_HANDLE)
+            if not found:
+                return self.error(op, start, ATT_ECODE_ATTR_NOT_FOUND)
+            group = op == ATT_OP_READ_BY_GROUP_REQ
+            if group and atype != uuid_bytes(PRIMARY):
+                return self.error(op, start, ATT_ECODE_REQ_NOT_SUPP)
+            vlen = len(found[0].value)
+            elen = (4 if group else 2) + vlen
+            rsp = bytearray(struct.pack('<BB', op + 1, elen))
+            for a in found:
+                if len(a.value) != vlen or len(rsp) + elen > c.mtu:
+                    break
+                if group:
+                    rsp += struct.pack('<HH', a.handle, a.end)
+                else:
+                    rsp += struct.pack('<H', a.handle)
+                rsp += a.value
+            return rsp
+
+        if op == ATT_OP_FIND_BY_TYPE_REQ:
+            start, end, atype = struct.unpack_from('<HHH', pdu, 1)
+            value = bytes(pdu[7:])
+            found = [a for a in self.in_range(start, end)
+                     if a.type == uuid_bytes(atype) and bytes(a.value) == value]
+            if not found:
+                return self.error(op, start, ATT_ECODE_ATTR_NOT_FOUND)
+            rsp = bytearray([ATT_OP_FIND_BY_TYPE_RESP])
+            for a in found:
+                if len(rsp) + 4 > c.mtu:
+                    break
+                rsp += struct.pack('<HH', a.handle, a.end)
+            return rsp
+
+        if op == ATT_OP_FIND_INFO_REQ:
+            start, end = struct.unpack_from('<HH', pdu, 1)
+            found = self.in_range(start, end)
+            if not found:
+                return self.error(op, start, ATT_ECODE_ATTR_NOT_FOUND)
+            tlen = len(found[0].type)
+            rsp = bytearray(struct.pack('<BB', ATT_OP_FIND_INFO_RESP,
+                                        1 if tlen == 2 else 2))
+            for a in found:
+                if len(a.type) != tlen or len(rsp) + 2 + tlen > c.mtu:
+                    break
+                rsp += struct.pack('<H', a.handle) + a.type
+            return rsp
+
+        if op in (ATT_OP_READ_REQ, ATT_OP_READ_BLOB_REQ):
+            handle = struct.unpack_from('<H', pdu, 1)[0]
+            offset = struct.unpack_from('<H', pdu, 3)[0] if op == ATT_OP_READ_BLOB_REQ else 0
+            a = self.attr(handle)
+            if a is None:
+                return self.error(op, handle, ATT_ECODE_INVALID_HANDLE)
+            if offset > len(a.value):
+                return self.error(op, handle, ATT_ECODE_INVALID_OFFSET)
+            return bytearray([op + 1]) + a.value[offset:offset + c.mtu - 1]
+
+        if op == ATT_OP_READ_MULTI_REQ:
+            if not self.read_multi:
+                return self.error(op, 0, ATT_ECODE_REQ_NOT_SUPP)
+            handles = struct.unpack_from('<%dH' % ((len(pdu) - 1) // 2), pdu, 1)
+            rsp = bytearray([ATT_OP_READ_MULTI_RESP])
+            for h in handles:
+                a = self.attr(h)
+                if a is None:
+                    return self.error(op, h, ATT_ECODE_INVALID_HANDLE)
+                rsp += a.value
+            return rsp[:c.mtu]
+
+        if op in (ATT_OP_WRITE_REQ, ATT_OP_WRITE_CMD):
+            handle = struct.unpack_from('<H', pdu, 1)[0]
+            a = self.attr(handle)
+            if a is None:
+                if op == ATT_OP_WRITE_CMD:
+                    return None
+                return self.error(op, handle, ATT_ECODE_INVALID_HANDLE)
+            a.value = pdu[3:]
+            if a.char is not None:
+                flags = struct.unpack_from('<H', bytes(a.value + b'\0\0'))[0]
+                if a.char.type == uuid_bytes(SERVICE_CHANGED):
+                    c.changed = bool(flags & 2)
+                elif flags & 3:
+                    opcode = ATT_OP_HANDLE_NOTIFY if flags & 1 else ATT_OP_HANDLE_IND
+                    c.subs[a.char.handle] = [opcode, time.time()]
+                else:
+                    c.subs.pop(a.char.handle, None)
+            if op == ATT_OP_WRITE_CMD:
+                return None
+            return bytearray([ATT_OP_WRITE_RESP])
+
+        if op == ATT_OP_HANDLE_CNF:
+            return None
+
+        if op & 0x40:   # commands get no reply
+            return None
+        return self.error(op, 0, ATT_ECODE_REQ_NOT_SUPP)
+
+
+def main():
+    import argparse
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('path', help='Unix socket to listen on')
+    parser.add_argument('-r', '--rate', type=float, default=10.0,
+                        help='notifications/s per subscription, 0 = flat out')
+    parser.add_argument('-n', '--count', type=int, default=0,
+                        help='notifications per client, 0 = no limit')
+    parser.add_argument('-m', '--mtu', type=int, default=247)
+    parser.add_argument('-l', '--latency', type=float, default=0,
+                        help='milliseconds before each response')
+    parser.add_argument('--db-hash', action='store_true',
+                        help='serve a Database Hash; SIGUSR1 changes it')
+    parser.add_argument('--no-read-multi', action='store_true',
+                        help='refuse Read Multiple requests')
+    args = parser.parse_args()
+
+    sim = SimPeripheral(args.path, args.rate, args.count, args.mtu,
+                        latency=args.latency / 1000.0, db_hash=args.db_hash,
+                        read_multi=not args.no_read_multi)
+    signal.signal(signal.SIGTERM, lambda sig, frame: sys.exit(0))
+    signal.signal(signal.SIGUSR1, sim.signal_changed)
+    print("Serving %d attributes on %s" % (len(sim.db), args.path))
+    sys.stdout.flush()
+    try:
+        sim.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sim.stop()
+        print("%d requests" % sim.requests)
+
+
+if __name__ == "__main__":
+    main()
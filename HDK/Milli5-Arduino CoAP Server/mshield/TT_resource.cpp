@@ -44,180 +44,50 @@ Networks, Inc.
 // TT Config
 TT_cfg_t TT_cfg;
 
-/**
- * crtemperature
- *
- * @brief CoAP Resource "describe your sensor here"
- *
+/*
+ * PUT /uri?cfg=<A|B>
  */
-error_t crmysensor(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it)
+static error_t TT_put_cfg( const char *v, uint8_t vl )
 {
-    struct optlv *o;
-
-    /* No URI path beyond /temp is supported, so reject if present. */
-    o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH, &it);
-    if (o)
+    if ( vl == 1 && v[0] == 'A' )
     {
-        rsp->code = COAP_RSP_404_NOT_FOUND;
-        goto err;
-    }            
-
-    /* All methods require a query, so return an error if missing. */
-    if (!(o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_QUERY, NULL))) 
-    {
-        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
-        goto err;
+        //arduino_put_TT_cfg(A);
+        return ERR_OK;
     }
-    
-    /*
-     * PUT for writing configuration or enabling the sensor
-     */
-    if (req->code == COAP_REQUEST_PUT) 
-    {
-        error_t rc = ERR_OK;
-
-        /* PUT /uri?cfg=<A|B> */
-        if (!coap_opt_strcmp(o, "cfg=A"))
-        {
-			//arduino_put_temp_cfg(CELSIUS_SCALE);
-        } 
-        else if (!coap_opt_strcmp(o, "cfg=B"))
-        {
-			//arduino_put_temp_cfg(FAHRENHEIT_SCALE);
-			
-        }
-        else
-        {
-            /* Not supported query. */
-            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
-            goto err;
-        }
-        
-        if (!rc)
-        {
-            rsp->code = COAP_RSP_204_CHANGED;
-            rsp->plen = 0;
-        }
-        else
-        {
-            switch (rc)
-            {
-            case ERR_BAD_DATA:
-            case ERR_INVAL:
-                rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
-                break;
-            default:
-                rsp->code = COAP_RSP_500_INTERNAL_ERROR;
-                break;
-            }
-            goto err;
-        }
-    } // if PUT
-    
-    /*
-     * GET for reading sensor or config information
-     */
-    else if (req->code == COAP_REQUEST_GET)
-    {
-        uint8_t rc, len = 0;
-
-        /* Config or sensor values. */
-        /* GET /temp?cfg */
-        if (!coap_opt_strcmp(o, "cfg"))
-        {
-            /* get temperature config */
-            //rc = arduino_get_temp_cfg( rsp->msg, &len );
-        }
-        /* GET /temp?sens */
-        else if (!coap_opt_strcmp(o, "sens"))
-        {
-			if ((o = copt_get_next_opt_type((sl_co*)&(req->oh), COAP_OPTION_OBSERVE, NULL))) 
-			{
-				uint32_t obsval = co_uint32_n2h(o);
-				switch(obsval)
-				{
-					//case COAP_OBS_REG:
-						//rc = coap_obs_reg();
-						break;
-					
-					//case COAP_OBS_DEREG:
-						//rc = coap_obs_dereg();
-						break;
-					
-					default:
-						rc = ERR_INVAL;
-
-				} // switch
-			}
-			else
-			{
-				/* Get sensor value */
-				//rc = arduino_get_temp( rsp->msg, &len );
-				
-			} // if-else
-        }
-        else {
-            /* Don't support other queries. */
-            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
-            goto err;
-        }
-        dlog(LOG_DEBUG, "GET (status %d) read %d bytes.", rc, len);
-        if (!rc) {
-            rsp->plen = len;
-            rsp->cf = COAP_CF_CSV;
-            rsp->code = COAP_RSP_205_CONTENT;
-        } else {
-            switch (rc) {
-            case ERR_BAD_DATA:
-            case ERR_INVAL:
-                rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
-                break;
-            default:
-                rsp->code = COAP_RSP_500_INTERNAL_ERROR;
-                break;
-            }
-            goto err;
-        }
-    } // if GET
-    
-    /*
-     * DELETE for disabling sensors.
-     */
-    /* DELETE /temp?all */
-    else if (req->code == COAP_REQUEST_DELETE) 
-    {
-        if (!coap_opt_strcmp(o, "all"))
-        {
-            //if (arduino_disab_temp()) 
-            {
-                rsp->code = COAP_RSP_500_INTERNAL_ERROR;
-                goto err;
-            }
-        } else {
-            rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
-            goto err;
-        }
-        rsp->code = COAP_RSP_202_DELETED;
-        rsp->plen = 0;
-    
-    } // if DELETE 
-    else 
+    if ( vl == 1 && v[0] == 'B' )
     {
-        /* no other operation is supported */
-        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
-        goto err;
-        
-    } // Unknown operation
+        //arduino_put_TT_cfg(B);
+        return ERR_OK;
+    }
 
-done:
-    return ERR_OK;
+    /* Not supported query. */
+    return ERR_OP_NOT_SUPP;
 
-err:
-    rsp->plen = 0;
+} // TT_put_cfg
 
-    return ERR_OK;
-    
-} // crmysensor
+/**
+ * TT_ops
+ *
+ * @brief CoAP Resource "describe your sensor here"
+ *
+ * Add it to the sensor table in mshield.ino with COAP_SENSOR(). The library
+ * parses the requests and calls these; leave out what your sensor can't do.
+ */
+const struct coap_sensor_ops TT_ops =
+{
+    .read       = arduino_get_TT,       // GET ?sens
+    .get_cfg    = arduino_get_TT_cfg,   // GET ?cfg
+    .put_cfg    = TT_put_cfg,           // PUT ?cfg=<A|B>
+    .disable    = arduino_disab_TT,     // DELETE ?all
+    .sn         = NULL,                 // ETag of ?sens, if it counts samples
+    .cfg_gen    = NULL,                 // ETag of ?cfg
+    .cfg_type   = 0,                    // /system/cfg TLV type, with the
+    .get_tlv    = NULL,                 // config to a TLV,
+    .check_tlv  = NULL,                 // check a TLV,
+    .set_tlv    = NULL,                 // and TLV to config
+    .start      = NULL,                 // start a read that takes a while,
+    .poll       = NULL                  // and poll it, for a separate response
+};
 
 /**
  * @brief Enable temp sensor.
@@ -32,6 +32,7 @@ Networks, Inc.
 #include <arduino.h>
 #include "errors.h"
 #include "hbuf.h"
+#include "coapsensor.h"
 
 typedef struct TT_cfg_struct
 {
@@ -45,10 +46,10 @@ typedef struct TT_cfg_struct
 
 /**
  *
- * @brief CoAP Resource "put description here"
+ * @brief CoAP Resource "put description here", for the sketch's sensor table
  *
  */
-error_t crmysensor(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it);
+extern const struct coap_sensor_ops TT_ops;
 
 /**
  * @brief Enable sensor
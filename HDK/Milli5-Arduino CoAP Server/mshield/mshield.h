@@ -35,8 +35,10 @@ Networks, Inc.
 #include "coappdu.h"
 #include "coapmsg.h"
 #include "temp_sensor.h"
+#include "mbus_water.h"
 #include "log.h"
 #include "arduino_time.h"
+#include "ram.h"
 
 /******************************************************************************/
 //
@@ -48,12 +50,16 @@ Networks, Inc.
 #define TEMP_SENSOR           			"temp"
 
 /* Add your own sensors here using a string of max 22 characters              */
+/* (COAP_SENS_NAME_MAX, checked when the sensor table is compiled)            */
 /* Avoid using characters such as ,.;:{}-+*&%$#@!?<>|\/[]~`                   */
 /* The string below will be part of the CoAP URI used to access this sensor   */
 /* If the string is "humi", the complete URI will be /sensor/arduino/humi     */
 #define MY_SENSOR             			"a_sensor"
 #define MY_SECOND_SENSOR       			"another_sensor"
 
+// M-Bus water meter, /sensor/arduino/mbus_water
+#define MBUS_WATER_SENSOR				"mbus_water"
+
 /******************************************************************************/
 //
 // It's possible to do a CoAP Observe on one sensor
@@ -61,7 +67,9 @@ Networks, Inc.
 // containing sensor data with timestamp and unit
 //
 
-// Pick one sensor from the sensors above to make it an "observable" sensor:
+// Pick one sensor from the sensors above to make it an "observable" sensor.
+// A client registering on another COAP_SENS_OBS sensor in the sensor table
+// (mshield.ino) moves Observe to that sensor:
 #define OBS_SENSOR_NAME     			TEMP_SENSOR
 
 // Specify the function that reads the sensor and assembles the 
@@ -94,6 +102,20 @@ Networks, Inc.
 #endif
 
 
+/******************************************************************************/
+//
+// M-Bus water meter, on a UART of its own: uncomment MBUS_UART_PTR
+// MBUS_LINK is MBUS_LINK_WIRED through an M-Bus level converter, or
+// MBUS_LINK_WMBUS through a wireless M-Bus radio module at MBUS_BAUD_RATE
+// MBUS_METER_ID is the number printed on the meter, 0 for the first heard
+//
+
+//#define MBUS_UART_PTR					&Serial2
+#define MBUS_LINK						MBUS_LINK_WMBUS
+#define MBUS_BAUD_RATE					9600
+#define MBUS_METER_ID					0
+
+
 /******************************************************************************/
 //
 // Specify baud rate for the Serial Monitor
@@ -126,6 +148,11 @@ Networks, Inc.
 /* The maximum payload length in the mNIC is 255                              */
 #define MAX_HDLC_INFO_LEN				(255)
 
+/* The library's buffers are sized for at most RAM_INFO_LEN_MAX, see ram.h */
+#if MAX_HDLC_INFO_LEN > RAM_INFO_LEN_MAX
+#error "MAX_HDLC_INFO_LEN is larger than the library's frame buffers"
+#endif
+
 /******************************************************************************/
 //
 // Local time zone relative to UTC
@@ -65,47 +65,28 @@ Networks, Inc.
 
 
 /*
- * This function handles the URI prior to the query
- * Add your own URI here
+ * The sensors below /arduino, see coapsensor.h
+ * Add your own sensor here
  */
-error_t crarduino( struct coap_msg_ctx *req, struct coap_msg_ctx *rsp )
+static const struct coap_sensor sensors[] =
 {
-    struct optlv *o;
-    void *it = NULL;
-
-    /* 
-     * No URI path beyond /arduino, except /temp is supported, so reject if present. 
-     * 
-     */
-    copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH, &it);
-    if ((o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH, &it))) 
-    {
-        // This is the default URI
-        if (!coap_opt_strcmp( o, TEMP_SENSOR ))
-        {
-            return crtemperature( req, rsp, it );
-        }
-
-        
-        /* Below, replace MY_SENSOR with your own name of your particular sensor  */
-        /* Use the enclosed template (TT_resource.cpp and TT_resource.h) to       */
-        /* implement the crmysensor function and associated methods               */
-        //if (!coap_opt_strcmp( o, MY_SENSOR ))
-        //{
-        //    /* Replace mysensor below with a name for your sensor               */
-        //    /* The function 'crmysensor' is implemented in a new C++ file       */
-        //    return crmysensor( req, rsp, it );
-        //}
-        
-        rsp->code = COAP_RSP_404_NOT_FOUND;
-    
-    } // if            
-
-    rsp->plen = 0;
-
-    return ERR_OK;
-  
-} // crarduino
+    // This is the default sensor, observable. The DHT library reads in one
+    // call, so ?sens is answered at once rather than separately
+    COAP_SENSOR( TEMP_SENSOR, COAP_SENS_OBS,
+                 "title=\"Temperature\";ct=2", &temp_sensor_ops ),
+
+    /* Below, replace MY_SENSOR with your own name of your particular sensor  */
+    /* Use the enclosed template (TT_resource.cpp and TT_resource.h) to       */
+    /* implement the TT_ops functions for your sensor                         */
+    //COAP_SENSOR( MY_SENSOR, 0, "title=\"My Sensor\";ct=2", &TT_ops ),
+
+#ifdef MBUS_UART_PTR
+    // M-Bus water meter, a reading goes to observers as each frame comes
+    COAP_SENSOR( MBUS_WATER_SENSOR, COAP_SENS_OBS | COAP_SENS_SEP,
+                 "title=\"Mbus Water Meter\";ct=2", &mbus_water_ops ),
+#endif
+};
+COAP_SENSOR_TABLE( sensors );
 
 /********************************************************************************/
 
@@ -124,6 +105,11 @@ void setup()
   // Init the temp sensor
   arduino_temp_sensor_init();
 
+#ifdef MBUS_UART_PTR
+  // Listen for the water meter
+  mbus_water_init( MBUS_UART_PTR, MBUS_LINK, MBUS_BAUD_RATE, MBUS_METER_ID );
+#endif
+
   // Init the CoAP Server
   coap_s_init( UART_PTR, COAP_MSG_MAX_AGE_IN_SECS, UART_TIMEOUT_IN_MS, MAX_HDLC_INFO_LEN, OBS_SENSOR_NAME, OBS_FUNC_PTR );
 }
@@ -135,6 +121,11 @@ void loop()
 {
   // Run CoAP Server
   coap_s_run();
+
+#ifdef MBUS_UART_PTR
+  // Read the water meter
+  mbus_water_run();
+#endif
 }
 
 /********************************************************************************/
@@ -31,6 +31,7 @@ Networks, Inc.
 
 #include "log.h"
 #include "bufutil.h"
+#include "numfmt.h"
 #include "coap_rsp_msg.h"
 #include "coapmsg.h"
 #include "coappdu.h"
@@ -45,9 +46,20 @@ RTCZero rtc;
 RTCDue rtc(XTAL);
 #endif
 
+// Fits the lines print_current_time() and print_current_date() print
+#define TIME_STR_LEN	(48)
+
 // Time relative UTC
 static int32_t seconds_relative_utc = 0;
 
+// RTC epoch at the anchor, and time_ms64() then
+static uint32_t epoch_anchor = 0;
+static uint64_t epoch_anchor_ms = 0;
+
+// The last millis() seen and its wraps
+static uint32_t ms_last = 0;
+static uint32_t ms_wraps = 0;
+
 /*
  * crtime
  *
@@ -89,9 +101,8 @@ error_t crtime(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it)
 		epoch = (time_t) atoi(p);
 		print("Epoch: "); printnum(epoch); println("");
 		
-		// Convert to the local time zone
-		epoch += seconds_relative_utc;
-		rtc.setEpoch(epoch);
+		// Set the RTC, converted to the local time zone
+		rc = rtc_set_time( epoch, 0 );
 		
 		// Print time/date
 		print_current_date();
@@ -173,6 +184,8 @@ error_t set_time_zone( int32_t zone )
 {
 	seconds_relative_utc = zone*60*60;
 	
+	return ERR_OK;
+
 } // set_time_zone
 
 /*
@@ -189,20 +202,85 @@ error_t rtc_time_init( int32_t zone )
 	
 	// Set the timezone
 	set_time_zone(zone);
+
+	// The only RTC read, the timebase counts from here
+	epoch_anchor = rtc.getEpoch();
+	epoch_anchor_ms = time_ms64();
 	
+	return ERR_OK;
+
 } // rtc_time_init()
 
 /*
- * @brief Get the RTC time in local time
+ * @brief Set the RTC to UTC sec.msec, kept in local time
+ *
+ */
+error_t rtc_set_time( uint32_t sec, uint32_t msec )
+{
+	if (msec >= 1000)
+	{
+		return ERR_INVAL;
+	}
+
+	sec += seconds_relative_utc;
+	rtc.setEpoch(sec);
+
+	// Re-anchor, the current second began msec ago
+	epoch_anchor = sec;
+	epoch_anchor_ms = time_ms64() - msec;
+
+	return ERR_OK;
+
+} // rtc_set_time()
+
+/*
+ * @brief Milliseconds since boot
+ *
+ */
+uint32_t time_ms(void)
+{
+	return millis();
+
+} // time_ms()
+
+/*
+ * @brief Milliseconds since boot, extended to 64 bits
+ *
+ * Called far more often than every 49.7 days, so a wrap of millis() is
+ * seen as it going backwards.
+ */
+uint64_t time_ms64(void)
+{
+	uint32_t now = millis();
+
+	if (now < ms_last)
+	{
+		ms_wraps++;
+	}
+	ms_last = now;
+
+	return ((uint64_t)ms_wraps << 32) | now;
+
+} // time_ms64()
+
+/*
+ * @brief Get the time in local time, in milliseconds
+ *
+ */
+uint64_t get_rtc_epoch_ms()
+{
+	return (uint64_t)epoch_anchor * 1000 + ( time_ms64() - epoch_anchor_ms );
+
+} // get_rtc_epoch_ms()
+
+/*
+ * @brief Get the time in local time
  *
  * 
  */
 time_t get_rtc_epoch()
 {
-	// Convert to UTC
-	time_t epoch;
-	epoch = rtc.getEpoch();
-	return epoch;
+	return (time_t)( get_rtc_epoch_ms() / 1000 );
 
 } // get_rtc_time()
 
@@ -214,14 +292,13 @@ time_t get_rtc_epoch()
 */
 void print_current_time(void)
 {
-	uint32_t a,b,c;
-	char buffer[PRINTF_LEN];
+	uint64_t ms = get_rtc_epoch_ms();
+	uint32_t s = (uint32_t)( ms / 1000 );
+	char buffer[TIME_STR_LEN];
 
-	// Print time
-	a = rtc.getSeconds();
-	b = rtc.getMinutes();
-	c = rtc.getHours();
-	sprintf( buffer, "Time: %02d:%02d:%02d [hr:min:sec]", c, b, a );
+	// Print time, from the timebase rather than the RTC
+	fmt_snprintf( buffer, sizeof(buffer), "Time: %02d:%02d:%02d.%03d [hr:min:sec]", 
+		(s / 3600) % 24, (s / 60) % 60, s % 60, (uint32_t)( ms % 1000 ) );
 	println(buffer);
 	
 } // print_current_time
@@ -235,13 +312,13 @@ void print_current_time(void)
 void print_current_date(void)
 {
 	uint32_t a,b,c;
-	char buffer[PRINTF_LEN];
+	char buffer[TIME_STR_LEN];
 
 	// Print time
 	a = rtc.getYear();
 	b = rtc.getDay();
 	c = rtc.getMonth();
-	sprintf( buffer, "Date: %02d:%02d:%d [mon:day:year]", c, b, a );
+	fmt_snprintf( buffer, sizeof(buffer), "Date: %02d:%02d:%d [mon:day:year]", c, b, a );
 	println(buffer);
 	
 } // print_current_date
@@ -59,18 +59,45 @@ error_t crtime( struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it );
 error_t set_time_zone( int32_t zone );
 
 /**
- * @brief
+ * @brief Init the RTC and anchor the timebase to it
  *
  */
 error_t rtc_time_init( int32_t zone );
 
+/**
+ * @brief Set the RTC to the UTC time sec.msec and re-anchor the timebase
+ *
+ */
+error_t rtc_set_time( uint32_t sec, uint32_t msec );
+
+/**
+ * @brief Milliseconds since boot, wrapping every 49.7 days
+ *
+ * For timers, compare as (uint32_t)(time_ms() - start).
+ */
+uint32_t time_ms(void);
+
+/**
+ * @brief Milliseconds since boot, never wraps
+ *
+ */
+uint64_t time_ms64(void);
+
 /**
  *
  * @brief Get RTC epoch
  *
+ * Counted from the timebase since the RTC was last read or set, so it
+ * doesn't touch the RTC.
  */
 time_t get_rtc_epoch();
 
+/**
+ * @brief As get_rtc_epoch(), in milliseconds
+ *
+ */
+uint64_t get_rtc_epoch_ms();
+
 /**
 * @brief
 * Prints the current time
@@ -30,21 +30,43 @@ Networks, Inc.
 #include "log.h"
 #include "coap_rsp_msg.h"
 #include "arduino_time.h"
+#include "numfmt.h"
+
+// Decimal places of each sensor reading
+#define RSP_MSG_DP		(2)
 
 // Assemble a CoAP response message; {Timestamp,Value(s),Unit}
+// Formatted straight into the mbuf tail, without printf.
 error_t rsp_msg( struct mbuf * m, uint8_t *len, uint32_t count, float * reading, const char * unit )
 {
-    uint8_t 	l;
-	char 		rsp_buf[256];
-	char		reading_buf[128];
-	char		unit_buf[32];
+	uint32_t	max;
+	uint16_t	ul = 0;
 	char * 		p;
-	time_t     	epoch;
+	uint16_t	l;
 	uint32_t	ix;
 	
-	// Create string containing the UNIX epoch
-	epoch = get_rtc_epoch();
-	sprintf( rsp_buf, "%d", epoch );
+	// Worst case length, the unused tail is trimmed below
+	if (unit)
+	{
+		ul = strlen(unit);
+	}
+	max = FMT_U32_MAX + ( reading ? count * ( 1 + FMT_FIXED_MAX ) : 0 ) + 
+		( unit ? 1 + ul : 0 );
+	if ( max > 255 )
+	{
+		// *len can't describe it
+		return ERR_MSGSIZE;
+	}
+
+	// Allocate memory
+	p = (char*) m_append( m, max );
+    if (!p) 
+    {
+        return ERR_NO_MEM;
+    }
+
+	// UNIX epoch
+	l = fmt_u32( p, get_rtc_epoch() );
 	
 	// Check if we have a sensor reading
 	if (reading)
@@ -52,11 +74,8 @@ error_t rsp_msg( struct mbuf * m, uint8_t *len, uint32_t count, float * reading,
 		// Get each value
 		for( ix = 0; ix < count; ix++ )
 		{
-			// Create string containing reading
-			sprintf( reading_buf, ",%.2f", *reading++ );
-
-			// Concatenate the reading
-			strcat( rsp_buf, reading_buf );
+			p[l++] = ',';
+			l += fmt_float( p + l, *reading++, RSP_MSG_DP );
 			
 		} // for
 	} // if
@@ -64,27 +83,18 @@ error_t rsp_msg( struct mbuf * m, uint8_t *len, uint32_t count, float * reading,
 	// Check if we have a unit
 	if (unit)
 	{
-		// Concatenate the unit
-		sprintf( unit_buf, ",%s", unit );
-		strcat( rsp_buf, unit_buf );
+		p[l++] = ',';
+		memcpy( p + l, unit, ul );
+		l += ul;
 		
 	} // if
 
+	// Give back what wasn't used
+	m_adj( m, -(int)( max - l ) );
+
 	// Print message
-	dlog( LOG_INFO, rsp_buf );
+	dlog( LOG_INFO, "%.*s", l, p );
 	
-	// Get length
-	l = strlen(rsp_buf);
-	
-	// Allocate memory
-	p = (char*) m_append(m,l);
-    if (!p) 
-    {
-        return ERR_NO_MEM;
-    }
-
-	// Store output
-	strcpy(p,rsp_buf);
 	*len = l;
 	
     return ERR_OK;
@@ -39,6 +39,10 @@ Networks, Inc.
 #include "coapsensoruri.h"
 #include "coapobserve.h"
 #include "exp_coap.h"
+#include "coapsep.h"
+#include "coapupg.h"
+#include "coapcfg.h"
+#include "arduino_time.h"
 #include "coap_server.h"
 
 
@@ -72,6 +76,9 @@ void coap_s_init( HardwareSerial * pSerial, uint32_t max_age, uint32_t uart_time
 	/* Set the URI used for obtaining token etc in CoAP Observe response msg */
 	set_observer( uri, pObsFuncPtr );
 
+	/* Apply the sensor config saved by the last PUT /system/cfg */
+	coap_cfg_init();
+
 	// Open the HDLC connection
 	res = hdlcs_open( pSerial, uart_timeout_ms, max_hdlc_payload_size );
 	if (res) 
@@ -134,9 +141,16 @@ mbuf_ptr_t coap_s_proc( mbuf_ptr_t m )
             goto done;
         }
 
-        /* Allocate response buffer */
+        /*
+         * Allocate response buffer, header is built in the headroom. With
+         * the mbuf pool empty, drop the request; the client retransmits.
+         */
         MGETHDR(r);
-        assert(r);
+        if (!r) {
+            coap_stats.no_mbufs++;
+            goto done;
+        }
+        m_reserve(r, COAP_OBS_HDR_SZ);
         coap_init_rsp(&cc, &rcc, r);
 
         /* Currently the proxy is catching all empty msgs anyway... */
@@ -222,7 +236,10 @@ mbuf_ptr_t coap_s_proc( mbuf_ptr_t m )
          * No observe.
          */
         MGETHDR(r);
-        assert(r);
+        if (!r) {
+            coap_stats.no_mbufs++;
+            goto done;
+        }
         coap_init_rsp(&cc, &rcc, r);
         if (cc.type == COAP_T_CONF_VAL) {
             rcc.type = COAP_T_ACK_VAL;
@@ -256,28 +273,87 @@ done:
 
 
 
+// Burst statistics, see exp_coap.h
+struct coap_s_run_stats coap_s_run_stats;
+
 // Run HDLCS and the CoAP Server 
 void coap_s_run()
 {
 	struct mbuf *appd;
 	struct mbuf *arsp;
+	uint32_t start = 0;
+	uint32_t elapsed;
+	uint16_t n = 0;
 	
-	/* Run the secondary-station HDLC state machine */
-	hdlcs_run();
-	
-	/* Serve incoming request, if any */
-	appd = hdlcs_read();
-	if (appd) 
+	do
 	{
-		/* Run the CoAP server */
-		arsp = coap_s_proc(appd);
-		if (arsp) 
-		{
-			/* Send CoAP response, if any */
-			hdlcs_write(arsp->data, arsp->len);
-     
-		} // if
+		/* Run the secondary-station HDLC state machine */
+		hdlcs_run();
 		
-	} // if	
+		/* Serve incoming request, if any */
+		appd = hdlcs_read();
+		if (appd) 
+		{
+			/* The budget starts with the first request of the burst */
+			if (n++ == 0)
+			{
+				start = time_ms();
+			}
+
+			/* Run the CoAP server */
+			arsp = coap_s_proc(appd);
+			if (arsp) 
+			{
+				/* Send CoAP response, if any */
+				hdlcs_write(arsp->data, arsp->len);
+				m_free(arsp);
+	     
+			}
+			else
+			{
+				/* Nothing to say, e.g. an ACK came in. The primary still
+				 * needs a final frame to know its I frame arrived. */
+				hdlcs_rr();
+
+			} // if-else
+			
+		} // if	
+
+		/* Drain the rest of a burst read from the UART, within budget */
+	} while ( hdlcs_rx_pending() && 
+			( n == 0 || time_ms() - start < COAP_S_RUN_BUDGET_MS ));
+
+	if (n)
+	{
+		elapsed = time_ms() - start;
+		coap_s_run_stats.bursts++;
+		coap_s_run_stats.requests += n;
+		coap_s_run_stats.last_burst = n;
+		coap_s_run_stats.last_ms = elapsed;
+		if (n > coap_s_run_stats.max_burst)
+		{
+			coap_s_run_stats.max_burst = n;
+		}
+		if (elapsed > coap_s_run_stats.max_ms)
+		{
+			coap_s_run_stats.max_ms = elapsed;
+		}
+		if (hdlcs_rx_pending())
+		{
+			coap_s_run_stats.over_budget++;
+		}
+		if (n > 1)
+		{
+			dlog(LOG_INFO, "Served %d requests in %d ms", n, elapsed);
+		}
+
+	} // if
+	else
+	{
+		/* No request waiting, make progress on a deferred one */
+		coap_sep_run();
+		coap_upg_run();
+
+	} // if-else
 
-} // coap_s_run()
+} // coap_s_run()
@@ -42,9 +42,16 @@ void coap_s_init( HardwareSerial * pSerial, uint32_t max_age, uint32_t uart_time
 
 
 
+/* Time budget for serving a burst of requests in one coap_s_run() call */
+#define COAP_S_RUN_BUDGET_MS	(100)
+
+/* Requests served per coap_s_run() call are counted in coap_s_run_stats,
+ * exp_coap.h, and read with GET /system/stats?mod=run */
+
 /**
  * @brief Run HDLCS and the CoAP Server 
  *
+ * Serves every frame that arrived together, up to COAP_S_RUN_BUDGET_MS.
  */
 void coap_s_run();
 
@@ -0,0 +1,302 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "includes.h"
+#include "errors.h"
+#include "log.h"
+#include "hbuf.h"
+#include "coappdu.h"
+#include "coapmsg.h"
+#include "coapobserve.h"
+#include "coapextif.h"
+#include "crc_xmodem.h"
+#include "upg_flash.h"
+#include "coapsensor.h"
+#include "coapsensorobs.h"
+#include "coapcfg.h"
+
+/* Config as saved in flash, one row. */
+struct coap_cfg_rec {
+    uint32_t magic;             /* COAP_CFG_MAGIC */
+    uint32_t gen;
+    uint16_t len;               /* Bytes used in tlv */
+    uint16_t crc;               /* crc_xmodem() of those */
+    uint8_t tlv[UPG_FLASH_ROW_SIZE - 12];
+};
+STATIC_ASSERT(sizeof(struct coap_cfg_rec) == UPG_FLASH_ROW_SIZE);
+
+static struct coap_cfg_rec coap_cfg_rec;
+
+static uint32_t coap_cfg_gen = 1;
+
+/* Global settings, in network order as received */
+static coap_sens_cfg_data_t coap_cfg_glbl;
+
+static error_t
+coap_cfg_glbl_check(const coap_sens_tl_t *tl)
+{
+    const coap_sens_cfg_data_t *d = (const coap_sens_cfg_data_t *)tl;
+    uint32_t prd;
+
+    if (tl->l != sizeof(*d) - sizeof(d->tl)) {
+        return ERR_BAD_DATA;
+    }
+    prd = ntohl(d->obs_prd);
+    if (prd < 1 || prd > COAP_OBS_PERIOD_MAX_MS / 1000) {
+        return ERR_INVAL;
+    }
+    return ERR_OK;
+}
+
+static void
+coap_cfg_glbl_set(const coap_sens_tl_t *tl)
+{
+    memcpy(&coap_cfg_glbl, tl, sizeof(coap_cfg_glbl));
+    set_obs_period(ntohl(coap_cfg_glbl.obs_prd) * 1000);
+}
+
+/* Sensor taking TLVs of type t, NULL if none */
+static const struct coap_sensor *
+coap_cfg_sensor(uint8_t t)
+{
+    const struct coap_sensor *s;
+    uint8_t i;
+
+    for (i = 0; i < coap_sensor_cnt; i++) {
+        s = &coap_sensor_tab[i];
+        if (s->ops->get_tlv && s->ops->cfg_type == t) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Walk the len bytes of TLVs at b. Check each one, or with apply set, apply
+ * each one; they must have been checked first.
+ */
+static error_t
+coap_cfg_walk(const uint8_t *b, uint16_t len, int apply)
+{
+    const coap_sens_tl_t *tl;
+    const struct coap_sensor *s;
+    uint16_t i;
+    error_t rc = ERR_OK;
+
+    if (!len) {
+        return ERR_BAD_DATA;
+    }
+    for (i = 0; i < len; i += sizeof(*tl) + tl->l) {
+        tl = (const coap_sens_tl_t *)(b + i);
+        if (len - i < (int)sizeof(*tl) || len - i - sizeof(*tl) < tl->l) {
+            return ERR_BAD_DATA;
+        }
+        /* The type byte, which needn't be a known coap_sens_cfg_type_t */
+        if (b[i] == csct_glbl) {
+            if (apply) {
+                coap_cfg_glbl_set(tl);
+            } else {
+                rc = coap_cfg_glbl_check(tl);
+            }
+        } else {
+            if (!(s = coap_cfg_sensor(b[i]))) {
+                return ERR_BAD_DATA;
+            }
+            if (apply) {
+                s->ops->set_tlv(tl);
+            } else {
+                rc = s->ops->check_tlv(tl);
+            }
+        }
+        if (rc) {
+            return rc;
+        }
+    }
+    return ERR_OK;
+}
+
+/* Append every TLV to m. */
+static error_t
+coap_cfg_get(struct mbuf *m)
+{
+    coap_sens_cfg_data_t *d;
+    uint8_t i;
+    error_t rc;
+
+    d = (coap_sens_cfg_data_t *)m_append(m, sizeof(*d));
+    if (!d) {
+        return ERR_NO_MEM;
+    }
+    memcpy(d, &coap_cfg_glbl, sizeof(*d));
+    for (i = 0; i < coap_sensor_cnt; i++) {
+        if (coap_sensor_tab[i].ops->get_tlv &&
+                (rc = coap_sensor_tab[i].ops->get_tlv(m)) != ERR_OK) {
+            return rc;
+        }
+    }
+    return ERR_OK;
+}
+
+/* Save the whole config and the generation in flash. */
+static error_t
+coap_cfg_save(void)
+{
+    struct coap_cfg_rec *r = &coap_cfg_rec;
+    struct mbuf *m;
+    uint16_t i;
+    error_t rc;
+
+    if (!(m = m_get())) {
+        return ERR_NO_MEM;
+    }
+    if ((rc = coap_cfg_get(m)) != ERR_OK) {
+        goto done;
+    }
+    if (m->m_pktlen > sizeof(r->tlv)) {
+        rc = ERR_MSGSIZE;
+        goto done;
+    }
+    memset(r, 0xFF, sizeof(*r));
+    r->magic = COAP_CFG_MAGIC;
+    r->gen = coap_cfg_gen;
+    r->len = m->m_pktlen;
+    memcpy(r->tlv, mtod(m, uint8_t *), r->len);
+    r->crc = crc_xmodem(crc_xmodem_init(), r->tlv, r->len);
+
+    if ((rc = upg_flash_erase_row(UPG_FLASH_CFG_OFFS)) != ERR_OK) {
+        goto done;
+    }
+    for (i = 0; i < sizeof(*r); i += UPG_FLASH_PAGE_SIZE) {
+        rc = upg_flash_write_page(UPG_FLASH_CFG_OFFS + i, (uint8_t *)r + i);
+        if (rc) {
+            goto done;
+        }
+    }
+
+done:
+    m_free(m);
+    return rc;
+}
+
+void
+coap_cfg_init(void)
+{
+    struct coap_cfg_rec *r = &coap_cfg_rec;
+
+    coap_cfg_glbl.tl.u.sct = csct_glbl;
+    coap_cfg_glbl.tl.l = sizeof(coap_cfg_glbl) - sizeof(coap_cfg_glbl.tl);
+    coap_cfg_glbl.obs_prd = htonl(COAP_OBS_PERIOD_MS / 1000);
+
+    if (upg_flash_read(UPG_FLASH_CFG_OFFS, r, sizeof(*r)) != ERR_OK ||
+            r->magic != COAP_CFG_MAGIC || r->len > sizeof(r->tlv) ||
+            r->crc != crc_xmodem(crc_xmodem_init(), r->tlv, r->len)) {
+        dlog(LOG_INFO, "No saved config");
+        return;
+    }
+    if (coap_cfg_walk(r->tlv, r->len, 0) != ERR_OK) {
+        dlog(LOG_WARNING, "Saved config rejected");
+        return;
+    }
+    coap_cfg_walk(r->tlv, r->len, 1);
+    coap_cfg_gen = r->gen;
+    dlog(LOG_INFO, "Config gen %lu applied", (unsigned long)coap_cfg_gen);
+}
+
+error_t
+crsystem_cfg(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it)
+{
+    const uint8_t *b;
+    struct mbuf *prev;
+    uint32_t gen;
+    error_t rc;
+
+    /* No URI path beyond /cfg is supported, so reject if present. */
+    if (copt_get_next_opt_type((const sl_co*)&(req->oh),
+                COAP_OPTION_URI_PATH, &it)) {
+        rsp->code = COAP_RSP_404_NOT_FOUND;
+        goto err;
+    }
+
+    if (req->code == COAP_REQUEST_GET) {
+        if (coap_cfg_get(rsp->msg) != ERR_OK) {
+            coap_stats.no_mbufs++;
+            rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+            goto err;
+        }
+        rsp->plen = rsp->msg->m_pktlen;
+        rsp->cf = COAP_CF_APPLICATION_OCTET_STREAM;
+        rsp->code = COAP_RSP_205_CONTENT;
+        coap_rsp_validate(req, rsp, coap_cfg_gen);
+        return ERR_OK;
+    } else if (req->code == COAP_REQUEST_PUT) {
+        b = mtod(req->msg, const uint8_t *) + req->hdrlen;
+        rc = coap_cfg_walk(b, req->plen, 0);
+        if (rc) {
+            rsp->code = (rc == ERR_INVAL) ? COAP_RSP_406_NOT_ACCEPTABLE :
+                COAP_RSP_400_BAD_REQUEST;
+            goto err;
+        }
+
+        /*
+         * The save writes out the applied config, so keep the current one
+         * to go back to if it fails: flash and RAM then still agree.
+         */
+        if (!(prev = m_get()) || coap_cfg_get(prev) != ERR_OK) {
+            m_free(prev);
+            coap_stats.no_mbufs++;
+            rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+            goto err;
+        }
+        gen = coap_cfg_gen;
+        coap_cfg_walk(b, req->plen, 1);
+        if (++coap_cfg_gen == 0) {
+            coap_cfg_gen = 1;
+        }
+        if ((rc = coap_cfg_save()) != ERR_OK) {
+            dlog(LOG_ERR, "Config not saved, rolled back: %d", rc);
+            coap_cfg_walk(mtod(prev, const uint8_t *), prev->m_pktlen, 1);
+            coap_cfg_gen = gen;
+            m_free(prev);
+            rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+            goto err;
+        }
+        m_free(prev);
+        rsp->etag = coap_cfg_gen;
+        rsp->code = COAP_RSP_204_CHANGED;
+    } else {
+        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
+    }
+
+err:
+    rsp->plen = 0;
+
+    return ERR_OK;
+}
@@ -0,0 +1,73 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_COAPCFG_H
+#define INC_COAPCFG_H
+
+#include "errors.h"
+#include "coapmsg.h"
+#include "coapextif.h"
+
+/*
+ * Bulk sensor configuration, /system/cfg.
+ *
+ *   GET    every binary config, as a list of TLVs: coap_sens_cfg_data_t
+ *          (csct_glbl) then one per sensor with ops->get_tlv, e.g.
+ *          coap_temp_cfg_data_t (csct_temp). The ETag is the generation.
+ *   PUT    any of those TLVs, in any order. All are checked before any is
+ *          applied, so the PUT takes effect entirely or not at all. 2.04
+ *          carries the new generation as its ETag, 4.00 for a malformed or
+ *          unknown TLV, 4.06 for a rejected value. 5.00 if it couldn't be
+ *          saved, the previous config and generation are then kept.
+ *
+ * Multi-byte fields are in network order. The generation goes up with each
+ * applied PUT. The whole config is then saved in flash, at
+ * UPG_FLASH_CFG_OFFS, and applied again by coap_cfg_init() at boot.
+ *
+ * Of the global settings only obs_prd, in seconds, is acted on: it's the
+ * observe reading period, see set_obs_period(). The others are kept and
+ * reported.
+ */
+
+#define COAP_CFG_MAGIC          (0x43464731)    /* "CFG1" */
+
+/**
+ * @brief Apply the config saved in flash, if any
+ *
+ * Call once the sensors are initialised.
+ */
+void coap_cfg_init(void);
+
+/**
+ * @brief Handle /system/cfg, it is the iterator past "cfg"
+ */
+error_t crsystem_cfg(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        void *it);
+
+#endif /* INC_COAPCFG_H */
@@ -61,6 +61,10 @@ typedef enum packed_t {
     crdt_upg_img_ver_sys,
 	crdt_upg_img_info_sys,
 	crdt_upg_state_sys,
+    crdt_stat_obs,
+    crdt_stat_txq,
+    crdt_stat_mbuf,
+    crdt_stat_run,
     crdt_none,                  /* no resource */
     crdt_max = crdt_none
 } coap_res_data_type_t;
@@ -180,6 +184,34 @@ typedef struct {
     struct coap_stats cs;   /* CoAP stats */
 } coap_sys_coap_stats_t;
 
+/* Observe notification stats */
+typedef struct {
+    coap_sens_tl_t tl;      /* type and length */
+    char pad[2];            /* align */
+    struct coap_obs_stats os; /* Observe stats */
+} coap_sys_obs_stats_t;
+
+/* TX queue stats */
+typedef struct {
+    coap_sens_tl_t tl;      /* type and length */
+    char pad[2];            /* align */
+    struct coap_txq_stats ts; /* TX queue stats */
+} coap_sys_txq_stats_t;
+
+/* mbuf stats */
+typedef struct {
+    coap_sens_tl_t tl;      /* type and length */
+    char pad[2];            /* align */
+    struct coap_mbuf_stats ms; /* mbuf stats */
+} coap_sys_mbuf_stats_t;
+
+/* coap_s_run() burst stats */
+typedef struct {
+    coap_sens_tl_t tl;      /* type and length */
+    char pad[2];            /* align */
+    struct coap_s_run_stats rs; /* burst stats */
+} coap_sys_run_stats_t;
+
 #define MAX_DEVID_LEN	10
 
 typedef struct {
@@ -34,6 +34,7 @@ Networks, Inc.
 #include "coapobserve.h"
 #include "coaputil.h"
 #include "arduino_time.h"
+#include "ram.h"
 
 /* 
  * intrct_cb_q initialisation. FIFO of mid:cb mappings. For now that's all it
@@ -133,7 +134,8 @@ coap_pathstr(const struct coap_msg_ctx *ctx)
      * This function only called from netmgr thread at present, so naturally
      * synchronous. No need for locking due to this static, yet.
      */
-    static char uristr[MAX_URI_LEN];
+    static char uristr[COAP_PATH_MAX];
+    RAM_ASSERT(sizeof(uristr) <= RAM_SHARE_COAP);
 
     uristr[0] = 0;
     /*
@@ -156,6 +158,102 @@ coap_pathstr(const struct coap_msg_ctx *ctx)
 }
 
 
+/*
+ * Option delta and length are each a 4 bit nibble, extended by one byte
+ * (13: value - 13) or two bytes (14: value - 269), RFC 7252 section 3.1.
+ */
+#define COAP_OPT_EXT1       (13)
+#define COAP_OPT_EXT2       (14)
+#define COAP_OPT_EXT1_BASE  (13)
+#define COAP_OPT_EXT2_BASE  (269)
+
+static inline int
+coap_opt_ext_len(uint16_t v)
+{
+    return (v < COAP_OPT_EXT1_BASE) ? 0 : (v < COAP_OPT_EXT2_BASE) ? 1 : 2;
+}
+
+static inline uint8_t
+coap_opt_nibble(uint16_t v)
+{
+    return (v < COAP_OPT_EXT1_BASE) ? v : 
+           (v < COAP_OPT_EXT2_BASE) ? COAP_OPT_EXT1 : COAP_OPT_EXT2;
+}
+
+static inline int
+coap_opt_ext_put(uint8_t *b, uint16_t v)
+{
+    if (v < COAP_OPT_EXT1_BASE) {
+        return 0;
+    } else if (v < COAP_OPT_EXT2_BASE) {
+        b[0] = v - COAP_OPT_EXT1_BASE;
+        return 1;
+    }
+    v -= COAP_OPT_EXT2_BASE;
+    b[0] = v >> 8;
+    b[1] = v & 0xFF;
+    return 2;
+}
+
+/*
+ * Read the extension bytes for a delta or length nibble.
+ *
+ * @return: Number of extension bytes consumed, or -1 if reserved or short.
+ */
+static inline int
+coap_opt_ext_get(uint8_t nib, const uint8_t *b, int len, uint16_t *v)
+{
+    if (nib < COAP_OPT_EXT1) {
+        *v = nib;
+        return 0;
+    } else if (nib == COAP_OPT_EXT1) {
+        if (len < 1) {
+            return -1;
+        }
+        *v = b[0] + COAP_OPT_EXT1_BASE;
+        return 1;
+    } else if (nib == COAP_OPT_EXT2) {
+        if (len < 2) {
+            return -1;
+        }
+        *v = (b[0] << 8) + b[1] + COAP_OPT_EXT2_BASE;
+        return 2;
+    }
+    /* 15 is reserved, and is the payload marker as a whole byte. */
+    return -1;
+}
+
+
+/*
+ * Size of the encoded option header (not including the value) for the given
+ * option delta and value length.
+ */
+int
+coap_opt_hdr_size(uint16_t delta, uint16_t len)
+{
+    return 1 + coap_opt_ext_len(delta) + coap_opt_ext_len(len);
+}
+
+
+/*
+ * Write an option header for the given delta and value length at b. The
+ * caller is responsible for having sized b with coap_opt_hdr_size().
+ *
+ * @return: The number of bytes written.
+ */
+int
+coap_opt_hdr_put(uint8_t *b, uint16_t delta, uint16_t len)
+{
+    int i = 1;
+
+    b[0] = (coap_opt_nibble(delta) << 4) | coap_opt_nibble(len);
+    i += coap_opt_ext_put(b + i, delta);
+    i += coap_opt_ext_put(b + i, len);
+
+    return i;
+}
+
+
 /* option tlv */
    
 int
@@ -163,40 +261,23 @@ coap_opt_parse(struct optlv *o, const uint8_t *b, int len)
 {
     uint16_t od, ol;
     int i = 1;
+    int n;
 
-    od = b[0] >> 4;
-    ol = b[0] & 0xf;
-
-    if (od < 13) {
-        i = 1;
-    }
-    else if (od == 13) {
-        od += b[1];
-        i = 2;
-    }
-    else if (od == 14) {
-        od = (b[1] << 8) + b[2] + 269;
-        i = 3;
-    }
-    else {
+    if (len < 1) {
         goto err;
     }
 
-    if (ol < 13) {
-        ;   /* nop */
-    }
-    else if (ol == 13) {
-        ol += b[i];
-        i++;
-    }
-    else if (od == 14) {
-        ol = (b[i] << 8) + b[i+1] + 269;
+    if ((n = coap_opt_ext_get(b[0] >> 4, b + i, len - i, &od)) < 0) {
+        goto err;
     }
-    else {
+    i += n;
+
+    if ((n = coap_opt_ext_get(b[0] & 0xf, b + i, len - i, &ol)) < 0) {
         goto err;
     }
+    i += n;
     
-    if (len < i || len < i + ol) {
+    if (len < i + ol) {
         goto err;
     }
 
@@ -219,44 +300,26 @@ err:
  * @param b: The start of the options.
  * @param len: The length of the buffer.
  *
- * @return: The index of the byte after the option inserted, or -1.
+ * @return: The index of the byte after the option inserted, or 0 if it
+ *      doesn't fit.
  *      NB This allows the caller to call again with the location to insert
  *      the next option and the option delta.
  */
 int
 coap_opt_add(const struct optlv *o, uint8_t *b, int len)
 {
-    uint8_t oh[4];
-    uint8_t *op = oh;
     int ohl;
 
-    if ((o->ot > 255 + 13) || (o->ol > 255 + 13)) {
-        return -1;
-    }
-    
-    if (o->ot < 13) {
-        *op++ = o->ot << 4;
-    } else {
-        *op++ = 13 << 4;
-        *op++ = o->ot - 13;
-    }
-
-    if (o->ol < 13) {
-        oh[0] |= o->ol;
-    } else {
-        oh[0] |= 13;
-        *op++ = o->ol - 13;
-    }
-
-    ohl = op - oh;
+    ohl = coap_opt_hdr_size(o->ot, o->ol);
 
     if (ohl + o->ol > len) {
         dlog(LOG_ERR, "Insufficient buffer space to add option\n");
         return 0;
     }
 
-    memcpy(b, oh, ohl);
+    /* value first, it may overlap the header location when rewriting */
     memmove(b + ohl, o->ov, o->ol);
+    (void)coap_opt_hdr_put(b, o->ot, o->ol);
 
     return (o->ol + ohl);
 }
@@ -349,6 +412,11 @@ coap_msg_log(const struct coap_msg_ctx *ctx)
     struct optlv *op;
     char uriqp[MAX_URI_LEN];
 
+    /* Nothing below is output at LOG_INFO, skip building the URI string */
+    if (!dlog_on(LOG_INFO)) {
+        return;
+    }
+
     uriqp[0] = '\0';
     dlog(LOG_DEBUG, "REQ/RSP Type: %s", 
             ctx->type == COAP_T_CONF_VAL ? "CON" : 
@@ -369,7 +437,7 @@ coap_msg_log(const struct coap_msg_ctx *ctx)
                     "Client Error" : "Server Error");
     }
     substr = coap_pathstr(ctx);
-    if (substr[0] != '\0') {
+    if (substr && substr[0] != '\0') {
         strcat(uriqp, substr);
     }
     /* Is it possible to get more than one query field? */
@@ -529,6 +597,9 @@ error_t coap_msg_parse(struct coap_msg_ctx *ctx, struct mbuf *m, uint8_t *code)
         case COAP_OPTION_BLOCK2:            /* Block2    */
                 /*FIXME willfully ignoring this option   */
 			break;
+        case COAP_OPTION_BLOCK1:            /* Block1    */
+            /* Left to the resource, only the upgrade resource takes it */
+            break;
         case COAP_OPTION_URI_PATH:          /* Uri-Path  */
         case COAP_OPTION_URI_QUERY:         /* Uri-Query */
             break;
@@ -719,6 +790,7 @@ coap_init_rsp(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
              */
             nop.ot = COAP_OPTION_OBSERVE;
             nop.ol = 3;
+            nop.ov = NULL;      /* value set when sent */
             if (copt_add_opt((sl_co*)&(rsp->oh), &nop) != ERR_OK) {
                 dlog(LOG_ERR, "Couldn't add observe option");
             }
@@ -815,162 +887,271 @@ err:
 
 
 /*
- * Build a response packet out of the context in ctx. Prepends head to existing
- * data.
+ * Encode v as a CoAP uint option value, big endian with no leading zero
+ * bytes (RFC 7252 section 3.2).
  *
- * @param ctx: Input, everything we need to know to build the response
- * (including a description?).
- * @param data: Output, the dat buffer containing the packet contents.
- * @param bufsize: Input, the size of the data buffer.
+ * @return: The encoded length, 0-4.
+ */
+static uint8_t
+coap_uint_put(uint8_t *b, uint32_t v)
+{
+    uint8_t l = (v > 0xFFFFFF) ? 4 : (v > 0xFFFF) ? 3 : (v > 0xFF) ? 2 :
+                (v > 0) ? 1 : 0;
+    uint8_t i;
+
+    for (i = l; i > 0; i--) {
+        b[i - 1] = v & 0xFF;
+        v >>= 8;
+    }
+
+    return l;
+}
+
+
+/* Maximum number of options serialised into a single response. */
+#define COAP_RSP_MAX_OPTS   (8)
+
+/* Option to be serialised: absolute number and resolved value. */
+struct coap_wopt {
+    uint16_t ot;
+    uint16_t ol;
+    const uint8_t *ov;
+};
+
+
+/*
+ * Resolve an option from the context list into wo. Options without a value
+ * pointer are placeholders whose value is only known at send time (Observe,
+ * Max-Age), these are encoded into uv.
+ *
+ * @return: 0 if the option is to be sent, nonzero to skip it.
+ */
+static int
+coap_rsp_opt_resolve(const struct optlv *op, struct coap_wopt *wo, uint8_t *uv)
+{
+    wo->ot = op->ot;
+
+    if (op->ov) {
+        wo->ol = op->ol;
+        wo->ov = (const uint8_t *)op->ov;
+        return 0;
+    }
+
+    wo->ov = uv;
+    switch (op->ot) {
+    case COAP_OPTION_OBSERVE:
+        wo->ol = coap_uint_put(uv, get_obs_val());
+        break;
+    case COAP_OPTION_MAXAGE:
+        wo->ol = coap_uint_put(uv, coap_max_age_in_seconds);
+        break;
+    default:
+        if (op->ol) {
+            dlog(LOG_WARNING, "No value for option %u, not sent", op->ot);
+            return 1;
+        }
+        wo->ol = 0;     /* empty option, e.g. If-None-Match */
+        break;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Build a response packet out of the context in ctx. The options are resolved
+ * and sized in one walk of the list, then the header, token and options are
+ * written in front of the payload already in ctx->msg. If the mbuf was set up
+ * with m_reserve() the payload isn't moved.
+ *
+ * The options in ctx->oh are kept sorted by copt_add_opt(), ETag is merged in
+ * from ctx->etag when set and Content-Format from ctx->cf when there's a
+ * payload. Any option number and length is supported, using the 1 and 2 byte
+ * extended forms as required.
+ *
+ * @param ctx: Input, everything we need to know to build the response.
  *
  * @return: Status; 0 - OK.
  */
 error_t
 coap_msg_response(struct coap_msg_ctx *ctx)
 {
-    /* 
-     * 4 + 8 (max token) + 2 (option and option length, + option) + 1 (option
-     * terminator) + 4 observe option. Can be added to later, as required.
-     */
-    uint8_t b[COAP_OBS_HDR_SZ];  /* as above, +1 */
-    error_t rc = ERR_OK;
-
-    int idx = 4;
+    struct coap_wopt wo[COAP_RSP_MAX_OPTS];
+    uint8_t uv[COAP_RSP_MAX_OPTS][sizeof(uint32_t)];
+    int nopt = 0;
+    int hdrlen = 4;
+    int i, idx;
+    uint16_t prev;
+    uint8_t *b;
+    uint8_t cf[2];
+    uint8_t etag[sizeof(uint32_t)];
     struct mbuf *n;
-
+    error_t rc = ERR_OK;
 
     coap_msg_log(ctx);
 
-    b[0] = COAP_VER | COAP_T_VAL2PDU(ctx->type);
     if (ctx->code == COAP_EMPTY_MESSAGE) {
-        b[1] = COAP_EMPTY_MESSAGE;
-        b[2] = ctx->mid >> 8;
-        b[3] = ctx->mid & 0xFF;
-    } else if (COAP_CLASS(ctx->code) == 1){  /* Not expecting this... */
-        rc = ERR_INVAL;
-        goto done;   /* error - discard */
+        ;   /* header only */
     } else if (COAP_CLASS(ctx->code) >= 2) {
-        b[1] = ctx->code;
-        b[2] = ctx->mid >> 8;
-        b[3] = ctx->mid & 0xFF;
-    } else {
-        rc = ERR_INVAL;
-        goto done;
-    }
-
-    if (ctx->code != COAP_EMPTY_MESSAGE) {
-        int onum = 0;
-        struct optlv dopt, *op;
-        uint32_t opt_val;
-        int sz;
-
-        if (ctx->tkl) {
-            if (ctx->tkl > 8) {
-                rc = ERR_INVAL;
-                goto done;   /* invalid - must not be sent */
-            }
-            memcpy(b + idx, ctx->token, ctx->tkl);
-            b[0] |= ctx->tkl;
-            idx += ctx->tkl;
+        struct optlv *op;
+        void *it = NULL;
+        struct coap_wopt syn[2];    /* options built from ctx fields */
+        struct coap_wopt *w;
+        int nsyn = 0, si = 0, skip;
+
+        if (ctx->tkl > 8) {
+            rc = ERR_INVAL;
+            goto done;   /* invalid - must not be sent */
         }
-
-        /*
-         * Add the observe option if it's present in the context structure.
-         * op doesn't contain a value yet, we add that now, so it's really just
-         * a flag so we can add the observe value to the packet.
-         */
-        if ((op = copt_get_next_opt_type((const sl_co*)&(ctx->oh), COAP_OPTION_OBSERVE, NULL))
-               != NULL) {
-            op->ov = &opt_val;
-            dopt = *op;  /* copy original but make type the delta */
-            opt_val = get_obs_val();
-            opt_val = co_uint32_h2n(&dopt);
-            dopt.ot = COAP_OPTION_OBSERVE - onum;
-            onum = COAP_OPTION_OBSERVE;
-            if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) == 0) {
-                dlog(LOG_ERR, "Couldn't add Observe option to msg");
-                rc = ERR_NO_MEM;
-                goto done;
-            }
-            idx += sz;
+        hdrlen += ctx->tkl;
+
+        /* In option order; ctx->etag and ctx->cf are authoritative. */
+        if (ctx->etag && COAP_CLASS(ctx->code) == 2) {
+            syn[nsyn].ot = COAP_OPTION_ETAG;
+            syn[nsyn].ol = coap_uint_put(etag, ctx->etag);
+            syn[nsyn].ov = etag;
+            nsyn++;
+        }
+        if (ctx->plen) {
+            syn[nsyn].ot = COAP_OPTION_CONTENT_FORMAT;
+            syn[nsyn].ol = coap_uint_put(cf, ctx->cf);
+            syn[nsyn].ov = cf;
+            nsyn++;
         }
-			   
-        /*
-         * Add the Content-Format option (Option 12)
-		 *
-         */
-        if (ctx->plen) 
-		{
-            dopt.ot = COAP_OPTION_CONTENT_FORMAT - onum;
-            onum = COAP_OPTION_CONTENT_FORMAT;
-            if (ctx->cf == 0) {     /* text/plain; */
-                dopt.ol = 0;
-                dopt.ov = &opt_val;
-                opt_val = 0;  /* 0 length anyway */
-                if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) == 0) {
-                    dlog(LOG_ERR, "Couldn't add content format option to msg");
-                    rc = ERR_NO_MEM;
-                    goto done;
-                }
-                idx += sz;
 
-            } else {
-                dopt.ol = 1;
-                dopt.ov = &(ctx->cf);
-                if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) == 0) {
-                    dlog(LOG_ERR, "Couldn't add content format option to msg");
-                    rc = ERR_NO_MEM;
-                    goto done;
-                }
-                idx += sz;
+        prev = 0;
+        op = copt_get_next_opt((const sl_co*)&(ctx->oh), &it);
+        while (op || si < nsyn) {
+            if (nopt == COAP_RSP_MAX_OPTS) {
+                goto too_many;
             }
-        
-            /*
-             * This option (Option 14) is added in observe response.
-			 * Thus observe option variable is on the calling stack, 
-			 * so it's okay to deref. If we
-             * wanted to set this for non-obs responses, we'd have to allocate
-             * it in call from coap_s_proc so it's still on stack or heap.
-             * (o->ov is the field of concern.
-             */
-            if ((op = copt_get_next_opt_type((const sl_co*)&(ctx->oh), COAP_OPTION_MAXAGE, 
-                            NULL)) != NULL) {
-				op->ov = &opt_val;
-                dopt = *op;  /* copy original but make type the delta */
-				opt_val = coap_max_age_in_seconds;
-				opt_val = co_uint32_h2n(&dopt);
-                dopt.ot = COAP_OPTION_MAXAGE - onum;
-                onum = COAP_OPTION_MAXAGE;
-                if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) <= 0) {
-                    dlog(LOG_ERR, "Couldn't add Max-Age option to msg");
-                    rc = ERR_NO_MEM;
-                    goto done;
+            w = &wo[nopt];
+            if (si < nsyn && (!op || op->ot > syn[si].ot)) {
+                *w = syn[si++];
+            } else {
+                skip = op->ot == COAP_OPTION_CONTENT_FORMAT ||
+                    (op->ot == COAP_OPTION_ETAG && ctx->etag) || /* ctx wins */
+                    coap_rsp_opt_resolve(op, w, uv[nopt]);
+                op = copt_get_next_opt((const sl_co*)&(ctx->oh), &it);
+                if (skip) {
+                    continue;
                 }
-                idx += sz;
             }
-
-        } // plen
-
-		/* End of options */	   
-        if (onum && ctx->plen) {
-            b[idx++] = 0xFF;    /* end of options */
+            /* Sized as it's added, there's no separate sizing pass */
+            hdrlen += coap_opt_hdr_size(w->ot - prev, w->ol) + w->ol;
+            prev = w->ot;
+            nopt++;
         }
+        if (ctx->plen) {
+            hdrlen++;   /* payload marker */
+        }
+    } else {
+        /* Requests and the 1.xx internal codes aren't sent from here. */
+        rc = ERR_INVAL;
+        goto done;
+    }
+
+    if (!ctx->plen && ctx->msg->m_pktlen) {
+        /* Don't send anything a failed handler left behind. */
+        m_adj(ctx->msg, -ctx->msg->m_pktlen);
     }
-    assert(idx <= COAP_OBS_HDR_SZ);
 
     /* prepend header to response */
-    n = m_prepend(ctx->msg, idx);
+    n = m_prepend(ctx->msg, hdrlen);
     if (!n) {
         rc = ERR_NO_MEM;
         goto done;
     }
     ctx->msg = n;   /* A new mbuf may be required */
-    memcpy(n->m_data, b, idx);
+    b = n->m_data;
+
+    b[0] = COAP_VER | COAP_T_VAL2PDU(ctx->type & 0x3);
+    b[1] = ctx->code;
+    b[2] = ctx->mid >> 8;
+    b[3] = ctx->mid & 0xFF;
+    idx = 4;
+
+    if (ctx->code != COAP_EMPTY_MESSAGE) {
+        b[0] |= COAP_TKL(ctx->tkl);
+        memcpy(b + idx, ctx->token, ctx->tkl);
+        idx += ctx->tkl;
+
+        prev = 0;
+        for (i = 0; i < nopt; i++) {
+            idx += coap_opt_hdr_put(b + idx, wo[i].ot - prev, wo[i].ol);
+            memcpy(b + idx, wo[i].ov, wo[i].ol);
+            idx += wo[i].ol;
+            prev = wo[i].ot;
+        }
+
+        if (ctx->plen) {
+            b[idx++] = COAP_PAYLOAD_MARKER;
+        }
+    }
+    assert(idx == hdrlen);
 
     ddump(LOG_DEBUG, "Response", n->m_data, n->m_pktlen);
 
 done:
     return rc;
+
+too_many:
+    dlog(LOG_ERR, "Too many options for response");
+    return ERR_NO_MEM;
+}
+
+/*
+ * Tag a successful response with the resource version and Max-Age. If the
+ * request carried an ETag for the same version the client's copy is still
+ * good, so the response becomes 2.03 Valid without a payload (RFC 7252
+ * section 5.10.6.2).
+ *
+ * @param req: The request, for its ETag options.
+ * @param rsp: The response, already filled in by the resource handler.
+ * @param etag: Current version of the representation, non-zero.
+ *
+ * @return: 1 if rsp was turned into 2.03 Valid, 0 otherwise.
+ */
+int
+coap_rsp_validate(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        uint32_t etag)
+{
+    struct optlv *op;
+    struct optlv nop;
+    void *it = NULL;
+    uint8_t ev[sizeof(uint32_t)];
+    uint8_t el;
+    int match = 0;
+
+    if (COAP_CLASS(rsp->code) != 2 || !etag) {
+        return 0;
+    }
+    rsp->etag = etag;
+
+    if (!copt_get_next_opt_type((const sl_co*)&(rsp->oh), COAP_OPTION_MAXAGE,
+                NULL)) {
+        nop.ot = COAP_OPTION_MAXAGE;   /* No value ptr, set when sent */
+        nop.ol = 4;
+        nop.ov = NULL;
+        if (copt_add_opt((sl_co*)&(rsp->oh), &nop) != ERR_OK) {
+            dlog(LOG_ERR, "Couldn't add Max-Age option");
+        }
+    }
+
+    el = coap_uint_put(ev, etag);
+    while ((op = copt_get_next_opt_type((const sl_co*)&(req->oh),
+                    COAP_OPTION_ETAG, &it)) != NULL) {
+        if (op->ol == el && !memcmp(op->ov, ev, el)) {
+            match = 1;
+            break;
+        }
+    }
+    if (match) {
+        rsp->code = COAP_RSP_203_VALID;
+        rsp->plen = 0;
+    }
+
+    return match;
 }
 
 /**
@@ -67,12 +67,16 @@ Networks, Inc.
 
 #define SID_MAX_LEN             32      /* Sensor component of URI, max */
 
+/* Longest Uri-Path string coap_pathstr() returns, "/arduino/<sid>" fits */
+#define COAP_PATH_MAX           (48)
+
 /* maximum length of a Uri string */
 #define OPT_STR_MAX     		(99)
 
 /* 
  * 4 + 8 (max token) + 2 (option and option length, + option) + 1 (option
  * terminator) + 4 observe option. Can be added to later, as required.
+ * Reserved as mbuf headroom so the header is built in front of the payload.
  */
 #define COAP_OBS_HDR_SZ     	(28)
 
@@ -91,6 +95,7 @@ struct coap_msg_ctx {
     int         oidx;           /* index of the first option */
     char        sid[SID_MAX_LEN];/* Sensor component of URI, if present */
     uint8_t     cf;             /* content-format */
+    uint32_t    etag;           /* resource version, sent as ETag if non-zero */
     int         plen;           /* payload length (starting at [hdrlen] */
 
     void        *client;        /* Opaque client handle */
@@ -123,6 +128,8 @@ int coap_opt_parse(struct optlv *o, const uint8_t *b, int len);
 error_t coap_msg_parse(struct coap_msg_ctx *ctx, struct mbuf *m, uint8_t *code);
 error_t coap_rsp_parse(struct coap_msg_ctx *ctx, struct mbuf *m);
 error_t coap_msg_response(struct coap_msg_ctx *rsp);
+int coap_rsp_validate(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        uint32_t etag);
 
 void coap_init_rsp(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, 
                     struct mbuf *m);
@@ -132,6 +139,8 @@ uint32_t co_uint32_h2n(const struct optlv *o);
 uint32_t co_uint32_n2h(const struct optlv *o);
 
 int coap_opt_add(const struct optlv *o, uint8_t *b, int len);
+int coap_opt_hdr_size(uint16_t delta, uint16_t len);
+int coap_opt_hdr_put(uint8_t *b, uint16_t delta, uint16_t len);
 error_t coap_opt_rpl(struct coap_msg_ctx *ctx);
 
 /* coap_opt accessor functions */
@@ -31,9 +31,11 @@ Networks, Inc.
 
 #include "hbuf.h"
 #include "log.h"
+#include "coappdu.h"
 #include "coaputil.h"
 #include "coapsensoruri.h"
 #include "coapobserve.h"
+#include "ram.h"
 
 /*
  * The main issue is with the client field, since that represents something
@@ -48,13 +50,14 @@ Networks, Inc.
  * (uri) the token associated with the request, and the client's handle.
  * NB Only one client is assumed.
  */
-#define MAX_OBS_URI_LEN     MAX_URI_LEN
-#define MAX_OBSERVERS       4
+#define MAX_OBS_URI_LEN     COAP_PATH_MAX   /* holds coap_pathstr() */
+#define MAX_OBSERVERS       RAM_OBSERVERS
 
 struct obs_t {
     char uri[MAX_OBS_URI_LEN];  /* Resource being observed */
     uint8_t tkl;                /* Token length and token */
     uint8_t token[8];
+    struct coap_obs_batch batch; /* Reading period and batching */
     void *client;               /* Opaque client handle */
     char sid[SID_MAX_LEN];      /* sensor id, if present */
 };
@@ -63,6 +66,10 @@ struct obs_t {
  * A simple array of observers.
  */
 static struct obs_t obs[MAX_OBSERVERS] = { };
+RAM_ASSERT(sizeof(obs) <= RAM_SHARE_OBS);
+
+/* Reading period of registrations without ?p= */
+static uint32_t obs_period = COAP_OBS_PERIOD_MS;
 
 /*
  * Find the observe entry in the array specified by the token and the sensor
@@ -193,6 +200,12 @@ add_obs(int slot, const char *urip, struct coap_msg_ctx *req, void *client)
     strcpy(obs[slot].uri, urip);
     obs[slot].client = client;
     strcpy(obs[slot].sid, req->sid);
+    if (parse_obs_batch(req, &obs[slot].batch) != ERR_OK) {
+        /* Not a sensor, its handler didn't check the queries */
+        memset(&obs[slot].batch, 0, sizeof(obs[slot].batch));
+        obs[slot].batch.n = 1;
+        obs[slot].batch.p = obs_period;
+    }
 }
 
 
@@ -310,3 +323,114 @@ disable_obs(const char *urip, struct coap_msg_ctx *req, void **client,
     }
     return ERR_NO_ENTRY;
 }
+
+
+
+/*
+ * Parse the batch policy from the ?n=<n>, ?t=<s>, ?b=<bytes> and ?p=<ms>
+ * queries of an Observe registration. Those absent take the defaults: 1, 0,
+ * 0 and the period set by set_obs_period().
+ *
+ * Returns 0 on success, ERR_INVAL if a value is malformed or out of range,
+ * and *pol is left alone.
+ */
+error_t
+parse_obs_batch(const struct coap_msg_ctx *req, struct coap_obs_batch *pol)
+{
+    struct coap_obs_batch b = { 1, 0, 0, obs_period };
+    struct optlv *o;
+    void *it = NULL;
+    const char *s;
+    uint32_t max;
+    uint32_t v;
+    int i;
+
+    while ((o = copt_get_next_opt_type((const sl_co*)&(req->oh), 
+                    COAP_OPTION_URI_QUERY, &it)) != NULL) {
+        s = (const char *)o->ov;
+        if (o->ol < 2 || s[1] != '=') {
+            continue;       /* e.g. ?sens */
+        }
+        switch (s[0]) {
+        case 'n':
+        case 'b':
+            max = 0xFF;
+            break;
+        case 't':
+            max = 0xFFFF;
+            break;
+        case 'p':
+            max = COAP_OBS_PERIOD_MAX_MS;
+            break;
+        default:
+            continue;
+        }
+
+        /* The value is the decimal after "<c>=" */
+        if (o->ol == 2) {
+            return ERR_INVAL;
+        }
+        for (v = 0, i = 2; i < o->ol; i++) {
+            if (s[i] < '0' || s[i] > '9' || v > max) {
+                return ERR_INVAL;
+            }
+            v = v * 10 + (s[i] - '0');
+        }
+        if (v > max) {
+            return ERR_INVAL;
+        }
+
+        if (s[0] == 'n') {
+            b.n = v;
+        } else if (s[0] == 't') {
+            b.t = v;
+        } else if (s[0] == 'b') {
+            b.b = v;
+        } else {
+            b.p = v;
+        }
+    }
+    if (!b.n || b.p < COAP_OBS_PERIOD_MIN_MS) {
+        return ERR_INVAL;
+    }
+
+    *pol = b;
+    return ERR_OK;
+}
+
+
+
+/*
+ * The batch policy of the observer of uri, NULL if there is none.
+ */
+const struct coap_obs_batch *
+get_obs_batch(const char *uri)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_OBSERVERS; i++) {
+        if (obs[i].uri[0] != '\0' && !strcmp(uri, obs[i].uri)) {
+            return &obs[i].batch;
+        }
+    }
+    return NULL;
+}
+
+
+
+/*
+ * Set the reading period of registrations without ?p=, COAP_OBS_PERIOD_MS
+ * until set. Observers running at the old default follow.
+ */
+void
+set_obs_period(uint32_t ms)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_OBSERVERS; i++) {
+        if (obs[i].uri[0] != '\0' && obs[i].batch.p == obs_period) {
+            obs[i].batch.p = ms;
+        }
+    }
+    obs_period = ms;
+}
@@ -36,6 +36,24 @@ Networks, Inc.
 #define COAP_OBS_REG                    0x0
 #define COAP_OBS_DEREG                  0x1
 
+/* Observe reading period, default and bounds, in ms */
+#define COAP_OBS_PERIOD_MS              (60000)
+#define COAP_OBS_PERIOD_MIN_MS          (100)
+#define COAP_OBS_PERIOD_MAX_MS          (86400000)
+
+/*
+ * How often an observer's readings are taken, and when they are sent. A
+ * notification goes out when n readings are batched, when the first of them
+ * is t seconds old or when the next wouldn't fit in b payload bytes,
+ * whichever comes first. Readings are CSV rows separated by '\n'.
+ */
+struct coap_obs_batch {
+    uint8_t     n;          /* Readings per notification, 1 sends each */
+    uint8_t     b;          /* Payload budget, 0 as much as a frame holds */
+    uint16_t    t;          /* Seconds a reading may wait, 0 no limit */
+    uint32_t    p;          /* ms between readings */
+};
+
 error_t enable_obs(const char *urip, struct coap_msg_ctx *req, void *client);
 error_t disable_obs(const char *urip, struct coap_msg_ctx *req, void **client, 
                 uint8_t force);
@@ -44,4 +62,8 @@ error_t get_obs_by_uri(const char *uri, uint8_t *tkl, uint8_t *token, void **cli
                    uint8_t *nxt);
 error_t get_obs_by_sid_tok(const char *sid, uint8_t tkl, const uint8_t *token, 
                   void **client, uint8_t *nxt);
+error_t parse_obs_batch(const struct coap_msg_ctx *req, 
+                  struct coap_obs_batch *pol);
+const struct coap_obs_batch *get_obs_batch(const char *uri);
+void set_obs_period(uint32_t ms);
 #endif /* _INC_COAPOBSERVE_H_ */
@@ -362,7 +362,7 @@ copt_dump(struct sl_co *hd)
 
     SLIST_FOREACH(co, hd, nxt) {
         dlog(LOG_DEBUG, "option type: %d, len: %d, Val: 0x%x", co->o.ot, 
-                co->o.ol, (uint32_t)co->o.ov);
+                co->o.ol, (uint32_t)(uintptr_t)co->o.ov);
     }
 }
 
@@ -0,0 +1,362 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "errors.h"
+#include "log.h"
+#include "hbuf.h"
+#include "exp_coap.h"
+#include "coappdu.h"
+#include "coapmsg.h"
+#include "coapobserve.h"
+#include "coapsensorobs.h"
+#include "coapsep.h"
+#include "coapsensor.h"
+
+/* Queries understood for every sensor */
+enum coap_sensor_q {
+    csq_sens = 0,
+    csq_cfg,
+    csq_cfg_set,
+    csq_all,
+    csq_none
+};
+
+static const struct {
+    const char *q;
+    uint8_t ql;
+    uint8_t prefix;             /* q is followed by a value */
+    uint8_t id;
+} coap_sensor_qtab[] = {
+    { "sens", sizeof("sens") - 1, 0, csq_sens },
+    { "cfg", sizeof("cfg") - 1, 0, csq_cfg },
+    { "cfg=", sizeof("cfg=") - 1, 1, csq_cfg_set },
+    { "all", sizeof("all") - 1, 0, csq_all },
+};
+
+/* Classify the query option o as one of coap_sensor_q. */
+static uint8_t
+coap_sensor_query(const struct optlv *o)
+{
+    uint8_t i;
+
+    for (i = 0; i < sizeof(coap_sensor_qtab) / sizeof(coap_sensor_qtab[0]);
+            i++) {
+        if ((coap_sensor_qtab[i].prefix ? o->ol > coap_sensor_qtab[i].ql :
+                    o->ol == coap_sensor_qtab[i].ql) &&
+                !memcmp(o->ov, coap_sensor_qtab[i].q, coap_sensor_qtab[i].ql)) {
+            return coap_sensor_qtab[i].id;
+        }
+    }
+    return csq_none;
+}
+
+/* Response code for a failed sensor function. */
+static uint8_t
+coap_sensor_err(error_t rc)
+{
+    switch (rc) {
+    case ERR_BAD_DATA:
+    case ERR_INVAL:
+        return COAP_RSP_406_NOT_ACCEPTABLE;
+    case ERR_OP_NOT_SUPP:
+        return COAP_RSP_501_NOT_IMPLEMENTED;
+    default:
+        return COAP_RSP_500_INTERNAL_ERROR;
+    }
+}
+
+/*
+ * Continuation of a deferred GET ?sens, reads the sensor given in arg into
+ * the separate response once its poll step is done.
+ */
+static error_t
+coap_sensor_sep(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        void *arg)
+{
+    const struct coap_sensor *s = (const struct coap_sensor *)arg;
+    uint8_t len = 0;
+    error_t rc;
+
+    rc = s->ops->poll ? s->ops->poll() : ERR_OK;
+    if (rc == ERR_INPROGRESS) {
+        return rc;
+    }
+    if (!rc) {
+        rc = s->ops->read(rsp->msg, &len);
+    }
+    dlog(LOG_DEBUG, "Deferred GET %s (status %d) read %d bytes.", s->name, rc,
+            len);
+    if (!rc) {
+        rsp->plen = len;
+        rsp->cf = COAP_CF_CSV;
+        rsp->code = COAP_RSP_205_CONTENT;
+        if (s->ops->sn) {
+            (void)coap_rsp_validate(req, rsp, s->ops->sn());
+        }
+    } else {
+        rsp->code = coap_sensor_err(rc);
+        rsp->plen = 0;
+    }
+
+    return ERR_OK;
+}
+
+/*
+ * GET ?sens: observe (de)registration, deferred or immediate read.
+ *
+ * @return: As the sensor read, ERR_INPROGRESS if rsp is now an empty ACK or
+ *          ERR_AGAIN if it couldn't be deferred.
+ */
+static error_t
+coap_sensor_get_sens(const struct coap_sensor *s, struct coap_msg_ctx *req,
+        struct coap_msg_ctx *rsp, uint8_t *len, uint8_t *obs)
+{
+    struct coap_obs_batch pol;
+    struct optlv *o;
+    error_t rc;
+
+    o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_OBSERVE,
+            NULL);
+    if (o && (s->flags & COAP_SENS_OBS)) {
+        switch (co_uint32_n2h(o)) {
+        case COAP_OBS_REG:
+            /*
+             * ?sens&n=<n>&t=<s>&b=<bytes>&p=<ms> sets period and batching,
+             * kept with the observer entry enable_obs() adds
+             */
+            if ((rc = parse_obs_batch(req, &pol)) != ERR_OK) {
+                return rc;
+            }
+            set_observer(s->name, s->ops->read);
+            *obs = true;
+            return coap_obs_reg();
+        case COAP_OBS_DEREG:
+            return coap_obs_dereg();
+        default:
+            return ERR_INVAL;
+        }
+    }
+    if (o) {
+        /* Not observable, answer once (RFC 7641 section 4.1) */
+        (void)copt_del_opt_type((sl_co*)&(rsp->oh), COAP_OPTION_OBSERVE);
+    }
+
+    /* Only a reading split in start and poll is worth a separate response */
+    if ((s->flags & COAP_SENS_SEP) && s->ops->start) {
+        rc = coap_sep_defer(req, rsp, coap_sensor_sep, (void *)s);
+        if (rc == ERR_OK) {
+            if ((rc = s->ops->start()) != ERR_OK) {
+                /* poll won't wait, the last reading is sent */
+                dlog(LOG_WARNING, "%s reading not started (%d)", s->name, rc);
+            }
+            return ERR_INPROGRESS;  /* empty ACK now */
+        } else if (rc == ERR_AGAIN) {
+            return rc;              /* too many reads outstanding */
+        }
+        /* NON request, read now */
+    }
+    return s->ops->read(rsp->msg, len);
+}
+
+/*
+ * Serve a request for sensor s, it is the Uri-Path iterator past its name.
+ */
+static error_t
+coap_sensor_proc(const struct coap_sensor *s, struct coap_msg_ctx *req,
+        struct coap_msg_ctx *rsp, void *it)
+{
+    struct optlv *o;
+    uint8_t q;
+    error_t rc;
+
+    /* No URI path beyond /<name> is supported, so reject if present. */
+    if (copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH,
+                &it)) {
+        rsp->code = COAP_RSP_404_NOT_FOUND;
+        goto err;
+    }
+
+    /* All methods require a query, so return an error if missing. */
+    if (!(o = copt_get_next_opt_type((const sl_co*)&(req->oh),
+                    COAP_OPTION_URI_QUERY, NULL))) {
+        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
+        goto err;
+    }
+    q = coap_sensor_query(o);
+
+    if (req->code == COAP_REQUEST_PUT) {
+        /* PUT ?cfg=<v> */
+        if (q != csq_cfg_set || !s->ops->put_cfg) {
+            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
+            goto err;
+        }
+        rc = s->ops->put_cfg((const char *)o->ov + sizeof("cfg=") - 1,
+                o->ol - (sizeof("cfg=") - 1));
+        if (rc) {
+            rsp->code = coap_sensor_err(rc);
+            goto err;
+        }
+        rsp->code = COAP_RSP_204_CHANGED;
+        rsp->plen = 0;
+    } else if (req->code == COAP_REQUEST_GET) {
+        uint8_t len = 0;
+        uint8_t obs = false;
+        uint32_t etag = 0;
+
+        if (q == csq_cfg && s->ops->get_cfg) {
+            rc = s->ops->get_cfg(rsp->msg, &len);
+            etag = s->ops->cfg_gen ? s->ops->cfg_gen() : 0;
+        } else if (q == csq_sens) {
+            rc = coap_sensor_get_sens(s, req, rsp, &len, &obs);
+            if (rc == ERR_INPROGRESS) {
+                goto done;      /* deferred, the empty ACK is ready */
+            }
+            if (rc == ERR_AGAIN) {
+                /* Too many reads outstanding, let the client retry */
+                rsp->code = COAP_RSP_503_SERV_UNAVAILABLE;
+                goto err;
+            }
+            etag = s->ops->sn ? s->ops->sn() : 0;
+        } else {
+            /* Don't support other queries. */
+            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
+            goto err;
+        }
+        dlog(LOG_DEBUG, "GET %s (status %d) read %d bytes.", s->name, rc, len);
+        if (rc) {
+            rsp->code = coap_sensor_err(rc);
+            goto err;
+        }
+        if (obs) {
+            /* Good code, but no content. */
+            rsp->code = COAP_RSP_203_VALID;
+            rsp->plen = 0;
+        } else {
+            rsp->plen = len;
+            rsp->cf = COAP_CF_CSV;
+            rsp->code = COAP_RSP_205_CONTENT;
+            (void)coap_rsp_validate(req, rsp, etag);
+        }
+    } else if (req->code == COAP_REQUEST_DELETE) {
+        /* DELETE ?all */
+        if (q != csq_all || !s->ops->disable) {
+            rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
+            goto err;
+        }
+        if (s->ops->disable()) {
+            rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+            goto err;
+        }
+        rsp->code = COAP_RSP_202_DELETED;
+        rsp->plen = 0;
+    } else {
+        /* no other operation is supported */
+        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
+        goto err;
+    }
+
+done:
+    return ERR_OK;
+
+err:
+    rsp->plen = 0;
+
+    return ERR_OK;
+}
+
+error_t
+crarduino(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp)
+{
+    const struct coap_sensor *s;
+    struct optlv *o;
+    void *it = NULL;
+    uint8_t i;
+
+    /* Skip /arduino, the next segment names the sensor. */
+    copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH, &it);
+    if ((o = copt_get_next_opt_type((const sl_co*)&(req->oh),
+                    COAP_OPTION_URI_PATH, &it))) {
+        for (i = 0; i < coap_sensor_cnt; i++) {
+            s = &coap_sensor_tab[i];
+            if (o->ol == s->nlen && !memcmp(o->ov, s->name, s->nlen)) {
+                return coap_sensor_proc(s, req, rsp, it);
+            }
+        }
+    }
+
+    rsp->code = COAP_RSP_404_NOT_FOUND;
+    rsp->plen = 0;
+
+    return ERR_OK;
+}
+
+error_t
+coap_sensor_links(struct mbuf *m)
+{
+    const struct coap_sensor *s;
+    char *ls;
+    int n, len;
+    uint8_t i;
+
+    for (i = 0; i < coap_sensor_cnt; i++) {
+        s = &coap_sensor_tab[i];
+
+        /* </arduino/<name>>[;<link>][;obs], */
+        len = sizeof("</" COAP_SENS_URI "/>,") - 1 + s->nlen;
+        if (s->link) {
+            len += strlen(s->link) + 1;
+        }
+        if (s->flags & COAP_SENS_OBS) {
+            len += sizeof(";obs") - 1;
+        }
+        if (!(ls = (char *)m_append(m, len))) {
+            return ERR_NO_MEM;
+        }
+
+        n = sizeof("</" COAP_SENS_URI "/") - 1;
+        memcpy(ls, "</" COAP_SENS_URI "/", n);
+        memcpy(ls + n, s->name, s->nlen);
+        n += s->nlen;
+        ls[n++] = '>';
+        if (s->link) {
+            ls[n++] = ';';
+            memcpy(ls + n, s->link, strlen(s->link));
+            n += strlen(s->link);
+        }
+        if (s->flags & COAP_SENS_OBS) {
+            memcpy(ls + n, ";obs", sizeof(";obs") - 1);
+        }
+        ls[len - 1] = ',';
+        /* no NUL terminator here */
+    }
+
+    return ERR_OK;
+}
@@ -0,0 +1,162 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_COAPSENSOR_H
+#define INC_COAPSENSOR_H
+
+#include <arduino.h>
+#include "errors.h"
+#include "hbuf.h"
+#include "coapmsg.h"
+#include "coapextif.h"
+
+/*
+ * Sensor resources, /arduino/<name>.
+ *
+ * A sensor is described by a struct coap_sensor: its name, what it can do
+ * and a table of functions. The sketch lists its sensors in one array and
+ * names it with COAP_SENSOR_TABLE(). The library routes requests through that
+ * table and answers the common queries for every sensor:
+ *
+ *   GET ?sens          reading, ops->read. Observe when COAP_SENS_OBS, as a
+ *                      separate response to a CON when COAP_SENS_SEP and
+ *                      the reading is split in ops->start and ops->poll.
+ *   GET ?cfg           config, ops->get_cfg
+ *   PUT ?cfg=<v>       set config, ops->put_cfg
+ *   DELETE ?all        disable, ops->disable
+ *
+ * Entries are also listed in .well-known/core. The table has no fixed size
+ * and doesn't use slots in the URI registry. Sensors with a binary config are
+ * also set in bulk through /system/cfg, see coapcfg.h.
+ */
+
+#define COAP_SENS_URI           "arduino"
+
+/* Longest sensor name, the observe URI "/arduino/<name>" must fit 32 bytes */
+#define COAP_SENS_NAME_MAX      (22)
+
+/* Capability flags */
+#define COAP_SENS_OBS           (0x01)  /* ?sens can be observed */
+#define COAP_SENS_SEP           (0x02)  /* CON ?sens is answered separately */
+
+/*
+ * Sensor functions. read is required, a NULL entry makes the library answer
+ * the matching request with 5.01 (GET, PUT) or 4.05 (DELETE). Errors map to
+ * response codes as in the other handlers: ERR_INVAL and ERR_BAD_DATA to
+ * 4.06, ERR_OP_NOT_SUPP to 5.01, anything else to 5.00.
+ *
+ * Initialize a table by member name, each member in the order below, e.g.
+ * { .read = my_read, .get_cfg = NULL, ... }, so a hook added later can't
+ * shift the tables by one: a table that misses it fails to build, or the
+ * hook is NULL, depending on the compiler.
+ */
+struct coap_sensor_ops {
+    /* Append the reading to m, as rsp_msg() does */
+    error_t (*read)(struct mbuf *m, uint8_t *len);
+    /* Append the config to m */
+    error_t (*get_cfg)(struct mbuf *m, uint8_t *len);
+    /* Set the config from v, the vl bytes after "cfg=", not NUL terminated */
+    error_t (*put_cfg)(const char *v, uint8_t vl);
+    error_t (*disable)(void);
+    /* Versions sent as ETags of ?sens and ?cfg, 0 or NULL for none */
+    uint32_t (*sn)(void);
+    uint32_t (*cfg_gen)(void);
+    /*
+     * Binary config for /system/cfg, none if get_tlv is NULL. The TLV is of
+     * type cfg_type (coap_sens_cfg_type_t), laid out as in coapextif.h.
+     */
+    uint8_t cfg_type;
+    /* Append the TLV to m */
+    error_t (*get_tlv)(struct mbuf *m);
+    /* Check tl, followed by its tl->l value bytes, without applying it */
+    error_t (*check_tlv)(const coap_sens_tl_t *tl);
+    /* Apply tl, which check_tlv accepted */
+    void (*set_tlv)(const coap_sens_tl_t *tl);
+    /*
+     * Reading split in steps, for COAP_SENS_SEP: start begins a reading when
+     * a CON GET ?sens is deferred, poll is called from the loop until it
+     * stops returning ERR_INPROGRESS, then read sends what came in. After
+     * COAP_SEP_TIMEOUT_MS the request is answered 5.03. NULL if read answers
+     * at once; COAP_SENS_SEP is then ignored, as deferring a read that
+     * blocks the loop anyway only adds the empty ACK.
+     */
+    error_t (*start)(void);
+    error_t (*poll)(void);
+};
+
+struct coap_sensor {
+    const char *name;           /* Uri-Path segment below /arduino */
+    uint8_t nlen;               /* strlen(name) */
+    uint8_t flags;              /* COAP_SENS_* */
+    const char *link;           /* link-format attributes, may be NULL */
+    const struct coap_sensor_ops *ops;
+};
+
+/* Length of a sensor name literal, checked when the table is compiled. */
+template <size_t N>
+struct coap_sensor_name {
+    static_assert(N > 1 && N - 1 <= COAP_SENS_NAME_MAX,
+            "sensor name must be 1 to COAP_SENS_NAME_MAX characters");
+    enum { len = N - 1 };
+};
+
+/**
+ * @brief Initialiser for one struct coap_sensor
+ *
+ * name must be a string literal. e.g.
+ *   COAP_SENSOR("temp", COAP_SENS_OBS, "title=\"Temperature\";ct=2", &ops)
+ */
+#define COAP_SENSOR(name, flags, link, ops) \
+    { (name), coap_sensor_name<sizeof(name)>::len, (flags), (link), (ops) }
+
+/**
+ * @brief Make tab, an array of struct coap_sensor, the sensor table
+ *
+ * Use once, in the sketch.
+ */
+#define COAP_SENSOR_TABLE(tab) \
+    const struct coap_sensor * const coap_sensor_tab = (tab); \
+    const uint8_t coap_sensor_cnt = sizeof(tab) / sizeof((tab)[0])
+
+extern const struct coap_sensor * const coap_sensor_tab;
+extern const uint8_t coap_sensor_cnt;
+
+/**
+ * @brief Handler for /arduino, registered by coap_registry_init()
+ */
+error_t crarduino(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp);
+
+/**
+ * @brief Append a link-format entry per sensor to m, for .well-known/core
+ *
+ * @return ERR_OK, or ERR_NO_MEM if m is full
+ */
+error_t coap_sensor_links(struct mbuf *m);
+
+#endif /* INC_COAPSENSOR_H */
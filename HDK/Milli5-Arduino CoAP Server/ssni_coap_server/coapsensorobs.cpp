@@ -39,31 +39,44 @@ Networks, Inc.
 #include "temp_sensor.h"
 #include "arduino_pins.h"
 #include "arduino_time.h"
+#include "exp_coap.h"
+#include "hdlc.h"
+#include "crc_xmodem.h"
+#include "coaptxq.h"
 
 
-// The most recent minute we sent a CoAP response message
-// Make sure we don't send Observe response more than once per minute
-static uint32_t prev_minute = 0;
+// Policy while the observer has no entry, see obs_policy()
+static const struct coap_obs_batch	obs_batch_one = { 1, 0, 0, COAP_OBS_PERIOD_MS };
+// time_ms() when the last reading was taken
+static uint32_t prev_reading = 0;
 static boolean	obs_flag = false;
 
+static const struct coap_obs_batch *obs_policy();
+static void obs_batch_age( const struct coap_obs_batch *pol );
+static void obs_batch_drop();
+
 // Check if we should send Observe message
 boolean do_observe()
 {
 	// Check if we are doing Observe
 	if (obs_flag)
 	{
-		uint32_t m = rtc.getMinutes();
+		const struct coap_obs_batch *pol = obs_policy();
+		uint32_t now = time_ms();
 		
-		// Check if the current minute is different from the previous minute
-		if ( m != prev_minute )
+		// Check if a period has passed since the last reading
+		if ( now - prev_reading >= pol->p )
 		{
-			// Record the current minute
-			prev_minute = m;
+			// Record the time of this reading
+			prev_reading = now;
 
 			// Send response
 			coap_observe_rsp();
 
 		} // if
+
+		// Send readings that have waited long enough
+		obs_batch_age( pol );
 	} // if
 	
 	// Return the obs_flag
@@ -78,13 +91,16 @@ static uint32_t start_sn;
 // Register for Observe
 error_t coap_obs_reg()
 {
-	// Record the minute that we turn on Observe
-	// Make sure we don't send Observe response more than once per minute
-	prev_minute = rtc.getMinutes();
+	// Record when we turn on Observe
+	// The first reading is taken a period later
+	prev_reading = time_ms();
 	
 	// Flag that we are doing Observe
 	obs_flag = true;
 
+	// Readings batched for a previous registration aren't wanted
+	obs_batch_drop();
+
 	// Set mNIC wake-up pin to HIGH, so that we can toggle it 0 -> 1
 	pinMode(MNIC_WAKEUP_PIN,OUTPUT);
 	digitalWrite(MNIC_WAKEUP_PIN,HIGH);
@@ -102,6 +118,7 @@ error_t coap_obs_dereg()
 	// Quit Observe
 	println("De-register for Observe");
 	obs_flag = false;
+	obs_batch_drop();
 	
 	// Set mNIC wake-up pin to LOW
 	digitalWrite(MNIC_WAKEUP_PIN,LOW);
@@ -126,21 +143,8 @@ error_t observe_rx_ack( void *cbctx, struct mbuf *m )
  * Set the code and plen, if required.
  * coap_msg_response() to build a response.
  * Register for callback when ACK received.
- * Set pending_rsp, freeing any existing one first.
- */
-
-/*
- * pending_rsp is the next payload to send to the proxy. It may be an observe
- * response that is awaiting a datalink layer connection, or it could be the
- * last frame that was sent by us. In the latter case, we hold onto it to
- * resend in the event that the proxy/primary didn't receive it.
- *
- * This assumes we only have a datalink window size of 1.
- *
- * if r is NULL, the call is just to determine if there's an outstanding
- * observe.
+ * Queue it for the proxy, replacing a notification of ours still queued.
  */
-struct mbuf *pending_rsp;
 
 #define MAX_OBSERVE_URI_LENGTH 32
 // This array will contain the URI used to obtain Token etc for the response
@@ -159,15 +163,116 @@ void set_observer( const char * uri, ObsFuncPtr p )
 
 } // set_observer()
 
-// Generate Observe response message
-error_t coap_observe_rsp()
+// Take a reading now if read is the observed sensor's
+void coap_obs_changed( ObsFuncPtr read )
+{
+	if ( obs_flag && pObsFunc == read )
+	{
+		prev_reading = time_ms();
+		(void)coap_observe_rsp();
+	}
+
+} // coap_obs_changed()
+
+// Readings waiting to go out in one notification, header room reserved
+static struct mbuf *			obs_bm;
+// Number of readings in obs_bm
+static uint8_t					obs_bn;
+// time_ms() when the first of them was taken
+static uint32_t					obs_bstart;
+
+// Notification overhead, see exp_coap.h
+struct coap_obs_stats coap_obs_stats;
+
+// The policy of the observer of obs_uri, kept with its entry in
+// coapobserve.cpp, or one reading per notification if there is none
+static const struct coap_obs_batch *obs_policy()
+{
+	const struct coap_obs_batch *	pol = get_obs_batch( obs_uri );
+
+	return pol ? pol : &obs_batch_one;
+
+} // obs_policy()
+
+// Drop the readings not yet sent
+static void obs_batch_drop()
+{
+	m_free(obs_bm);
+	obs_bm = NULL;
+	obs_bn = 0;
+
+} // obs_batch_drop()
+
+// Payload bytes one notification may carry
+static int obs_batch_budget( const struct coap_obs_batch *pol )
+{
+	int b = get_mbuf_data_size() - COAP_OBS_HDR_SZ;
+
+	if (pol->b && pol->b < b) 
+	{
+		b = pol->b;
+	}
+	return b;
+
+} // obs_batch_budget()
+
+// Start an empty batch
+static error_t obs_batch_new()
+{
+	obs_bm = m_gethdr();
+	if (!obs_bm) 
+	{
+		coap_stats.no_mbufs++;
+		return ERR_NO_MEM;
+	}
+
+	/* Allow room for coap header */
+	m_reserve( obs_bm, COAP_OBS_HDR_SZ );
+	obs_bn = 0;
+	obs_bstart = time_ms();
+
+	return ERR_OK;
+
+} // obs_batch_new()
+
+// Append a reading to the batch, a CSV row, rows are separated by '\n'
+static error_t obs_batch_add( uint8_t *len )
+{
+	char *	sep = NULL;
+	error_t	rc;
+
+	if (obs_bn) 
+	{
+		if (!(sep = (char *)m_append( obs_bm, 1 ))) 
+		{
+			return ERR_NO_MEM;
+		}
+		*sep = '\n';
+	}
+
+	rc = (*pObsFunc)( obs_bm, len );
+	if (rc) 
+	{
+		if (sep) 
+		{
+			m_adj( obs_bm, -1 );
+		}
+		return rc;
+	}
+	obs_bn++;
+
+	return ERR_OK;
+
+} // obs_batch_add()
+
+// Send the n readings in m as one notification, m is consumed
+static error_t obs_notify( struct mbuf *m, uint8_t n )
 {
-	uint8_t 			len;			// Length of temperature message
     coap_ack_cb_info_t 	cbi;			// Callback info
-    struct mbuf *		m = NULL;		// Observe response message
     struct coap_msg_ctx rsp;
     uint8_t 			nxt = 0;		// The next Observer
     struct optlv 		opt;
+    uint16_t			key;			// Coalescing key
     error_t 			rc = ERR_OK;
 
 	// Clear CoAP message
@@ -185,26 +290,6 @@ error_t coap_observe_rsp()
         goto error;
     }
 
-    // Allocate an mbuf
-	m = m_gethdr();
-    if (!m) 
-	{
-        goto done;
-    }
-	
-    /* Allow room for coap header */
-    m_prepend( m, COAP_OBS_HDR_SZ );
-
-    // Get temperature reading
-	rc = (*pObsFunc)(m,&len);
-    if (rc) 
-	{
-        m_free(m);
-        goto done;
-    }
-
-    /* Move payload up to start of buffer, enough space for prepend l8r. */
-    m_adj( m, COAP_OBS_HDR_SZ );
     rsp.msg = m;
 	
 	// Add Message ID
@@ -213,6 +298,7 @@ error_t coap_observe_rsp()
 	// Add Observe option
 	opt.ot = COAP_OPTION_OBSERVE;
 	opt.ol = 3;
+	opt.ov = NULL;		// Value set when sent
 	if (copt_add_opt((sl_co*)&(rsp.oh), &opt) != ERR_OK) 
 	{
 		dlog(LOG_ERR, "Couldn't add Observe option");
@@ -223,6 +309,7 @@ error_t coap_observe_rsp()
 	// Add Max-Age option
 	opt.ot = COAP_OPTION_MAXAGE;
 	opt.ol = 4;
+	opt.ov = NULL;
 	if (copt_add_opt((sl_co*)&(rsp.oh), &opt) != ERR_OK) 
 	{
 		dlog(LOG_ERR, "Couldn't add Max-Age option");
@@ -231,9 +318,9 @@ error_t coap_observe_rsp()
 	}
 
     /*
-     * Now get the content. Does the m_append to the mbuf.
+     * The payload is the readings, one CSV row each.
      */
-	rsp.plen = m->m_pktlen; /* payload includes type and length */
+	rsp.plen = m->m_pktlen;
     rsp.code = COAP_RSP_205_CONTENT;
 	rsp.cf = COAP_CF_CSV;
     rsp.type = COAP_T_NCONF_VAL; // TODO: CON or NON?
@@ -244,10 +331,19 @@ error_t coap_observe_rsp()
     if (coap_msg_response(&rsp) != ERR_OK) 
 	{
         dlog(LOG_ERR, "Error creating observe RSP");
-        m_free(m);
+        rc = ERR_FAIL;
         goto error;
     }
 
+	// Account for the header and the HDLC framing around the readings
+	coap_obs_stats.notifications++;
+	coap_obs_stats.readings += n;
+	coap_obs_stats.payload_bytes += rsp.plen;
+	coap_obs_stats.hdr_bytes += m->m_pktlen - rsp.plen + 
+		HDLC_HDR_SIZE + HDLC_CRC_SIZE;
+	coap_obs_stats.hdr_per_rdg = 
+		coap_obs_stats.hdr_bytes * 100 / coap_obs_stats.readings;
+
     /*
      * Record the next sn we'll use for notification. i.e. when acked,
      * we'll ack this number, indicating that's what next.
@@ -261,28 +357,108 @@ error_t coap_observe_rsp()
     coap_con_add(rsp.mid, &cbi);
 
     /*
-     * Save it for sending later.
+     * Queue it for sending, keyed by observer and resource. A single reading
+     * is replaced by a newer one until it's sent, a batch is kept whole and
+     * what follows it queues behind.
      */
-    if (pending_rsp) 
-	{
-        m_free(pending_rsp);
-		dlog(LOG_DEBUG, "%s:%d Cleared pending_rsp", __FUNCTION__, __LINE__);
-    }
-    pending_rsp = rsp.msg;
+    key = crc_xmodem( crc_xmodem_init(), obs_uri, strlen(obs_uri) );
+    key = crc_xmodem( key, rsp.token, rsp.tkl );
+    (void)coap_txq_put( rsp.msg, rsp.type == COAP_T_CONF_VAL ? 
+			COAP_TXQ_CON : COAP_TXQ_NON, 
+			0x10000 | key | ( n == 1 ? COAP_TXQ_KEY_REPLACE : 0 ));
     copt_del_all((sl_co*)&(rsp.oh));
-
-	/* Notify mnic of observe request, wait for 1ms, then high again */
-	digitalWrite(MNIC_WAKEUP_PIN,LOW);
-	delay(1);
-	digitalWrite(MNIC_WAKEUP_PIN,HIGH);
     return ERR_OK;
 
-done:
 error:
     copt_del_all((sl_co*)&(rsp.oh));
     m_free(m);
 
     return rc;
 	
-} // coap_observe_rsp()
+} // obs_notify()
+
+// Send the batch, the next reading starts another
+static error_t obs_batch_flush()
+{
+	struct mbuf *	m = obs_bm;
+	uint8_t			n = obs_bn;
+
+	obs_bm = NULL;
+	obs_bn = 0;
+
+	return m ? obs_notify( m, n ) : ERR_OK;
+
+} // obs_batch_flush()
+
+// Send the batch if its first reading has waited the policy's t seconds
+static void obs_batch_age( const struct coap_obs_batch *pol )
+{
+	if (obs_bn && pol->t && 
+			time_ms() - obs_bstart >= (uint32_t)pol->t * 1000) 
+	{
+		(void)obs_batch_flush();
+	}
 
+} // obs_batch_age()
+
+// Take a reading and send it, alone or batched as the policy says
+error_t coap_observe_rsp()
+{
+	uint8_t 			len;			// Length of the reading
+	struct mbuf *		old;
+	uint8_t				n;
+	const char *		p;
+	const struct coap_obs_batch *pol = obs_policy();
+	int					budget = obs_batch_budget( pol );
+	error_t				rc;
+
+	if (!obs_bm && (rc = obs_batch_new()) != ERR_OK) 
+	{
+		return rc;
+	}
+
+	rc = obs_batch_add( &len );
+	if (rc == ERR_NO_MEM && obs_bn) 
+	{
+		// The mbuf is full, send what it has and retry in a new one
+		(void)obs_batch_flush();
+		if ((rc = obs_batch_new()) != ERR_OK) 
+		{
+			return rc;
+		}
+		rc = obs_batch_add( &len );
+	}
+	if (rc) 
+	{
+		if (!obs_bn) 
+		{
+			obs_batch_drop();
+		}
+		return rc;
+	}
+
+	if (obs_bm->m_pktlen > budget && obs_bn > 1) 
+	{
+		// This reading overflows the budget, carry it to the next batch
+		old = obs_bm;
+		n = obs_bn - 1;
+		p = mtod( old, char * ) + old->m_pktlen - len;
+		obs_bm = NULL;
+		obs_bn = 0;
+		if (obs_batch_new() == ERR_OK) 
+		{
+			memcpy( m_append( obs_bm, len ), p, len );
+			obs_bn = 1;
+		}
+		m_adj( old, -(int)( len + 1 ) );
+		(void)obs_notify( old, n );
+	}
+
+	if (obs_bn >= pol->n || (obs_bm && obs_bm->m_pktlen >= budget)) 
+	{
+		return obs_batch_flush();
+	}
+
+	return ERR_OK;
+
+} // coap_observe_rsp()
@@ -76,10 +76,19 @@ error_t coap_obs_dereg();
 error_t observe_rx_ack( void *cbctx, struct mbuf *m );
 
 /**
- * @brief CoAP Observe response
+ * @brief Take a reading for the observer, sending the batch if the policy
+ * says it is due
  *
  * @return error_t
  */
 error_t coap_observe_rsp();
 
+/**
+ * @brief Take a reading now if read is the observed sensor's, for sensors
+ * whose data arrives on its own rather than when polled. The period starts
+ * again from this reading.
+ *
+ */
+void coap_obs_changed( ObsFuncPtr read );
+
 #endif
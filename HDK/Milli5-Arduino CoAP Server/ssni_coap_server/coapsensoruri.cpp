@@ -36,6 +36,9 @@ Networks, Inc.
 #include "coapobserve.h"
 #include "coapsensorobs.h"
 #include "arduino_time.h"
+#include "coapupg.h"
+#include "coapcfg.h"
+#include "coapsensor.h"
 
 
 /*! @brief
@@ -76,6 +79,10 @@ static error_t crsystem(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp);
 #define S_STAT_URI_Q_MOD_COAP   S_STAT_URI_Q_MODULE "=coap"
 #define S_STAT_URI_Q_MOD_PWR    S_STAT_URI_Q_MODULE "=pwr"
 #define S_STAT_URI_Q_MOD_HDLC   S_STAT_URI_Q_MODULE "=hdlc"
+#define S_STAT_URI_Q_MOD_OBS    S_STAT_URI_Q_MODULE "=obs"
+#define S_STAT_URI_Q_MOD_TXQ    S_STAT_URI_Q_MODULE "=txq"
+#define S_STAT_URI_Q_MOD_MBUF   S_STAT_URI_Q_MODULE "=mbuf"
+#define S_STAT_URI_Q_MOD_RUN    S_STAT_URI_Q_MODULE "=run"
 
 #define S_TIME_URI          "time"
 #define S_STATS_URI         "stats"
@@ -84,15 +91,8 @@ static error_t crsystem(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp);
 #define S_SV_URI            "sysvar"
 #define S_SV_URI_Q_ID       "id="
 
-#define S_UPG_URI   			"upg"
-#define S_UPG_URI_Q_INFO        "info"
-#define S_UPG_URI_Q_INFO_VER    S_UPG_URI_Q_INFO "=ver"
-#define S_UPG_URI_Q_INFO_STATE    S_UPG_URI_Q_INFO "=sts"
-#define S_UPG_URI_Q_STATE       "st"
-#define S_UPG_URI_Q_STATE_INIT     S_UPG_URI_Q_STATE "=init"
-#define S_UPG_URI_Q_STATE_VERIFY   S_UPG_URI_Q_STATE "=verify"
-#define S_UPG_URI_Q_STATE_ACTIVATE S_UPG_URI_Q_STATE "=activate"
-#define S_UPG_URI_Q_IMGOFFSET   "off="
+#define S_UPG_URI   			"upg"     /* queries in coapupg.cpp */
+#define S_CFG_URI           "cfg"     /* TLVs in coapcfg.cpp */
 
 #define CLA_SYSTEM  "if=" "\"" S_URI_SYSTEM "\"" ";title=\"System\";ct=42;rev=1;"
 
@@ -120,7 +120,7 @@ static error_t crsystem(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp);
 
 
 // Arduino URI sensors
-#define L_URI_ARDUINO "arduino"
+#define L_URI_ARDUINO COAP_SENS_URI
 #define CLA_ARDUINO   "if=" "\"" L_URI_ARDUINO "\"" ";title=\"Arduino Sensors\";ct=42;"
 
 
@@ -165,9 +165,6 @@ error_t coap_uri_register(const char *path, coap_cb cbfunc, const char *corelink
     return ERR_OK;
 }
 
-// Implemented in the Sketch
-error_t crarduino( struct coap_msg_ctx *req, struct coap_msg_ctx *rsp );
-
 // Init the CoAP registry
 void coap_registry_init(void)
 {
@@ -337,6 +334,13 @@ static error_t crwellknown(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp)
             rsp->code = COAP_RSP_205_CONTENT;
         }
 
+        /* and the sensors below /arduino, from the sketch's table */
+        if (coap_sensor_links(rsp->msg) != ERR_OK) {
+            coap_stats.no_mbufs++;
+            rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+            return ERR_FAIL;
+        }
+
         rsp->cf = COAP_CF_APPLICATION_LINK_FORMAT; /* application/link-format */
         rsp->plen = rsp->msg->m_pktlen;
     }
@@ -392,9 +396,7 @@ static error_t crsystem_time(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
                 (sizeof(coap_sys_time_data_t) - sizeof(coap_sens_tl_t)))) {
             rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
         } else if (td->tl.u.rdt == crdt_time_abs) {
-            // TODO: how to implement this?
-            //if (rtc_set_time(ntohl(td->sec), ntohl(td->msec)) == ERR_OK)
-            if (1)
+            if (rtc_set_time(ntohl(td->sec), ntohl(td->msec)) == ERR_OK)
             {
                 dlog(LOG_DEBUG, "Time changed %lu.%lu", ntohl(td->sec), 
                         ntohl(td->msec));
@@ -441,6 +443,100 @@ static error_t coap_get_coap_stats(struct mbuf *m, uint8_t *len)
     return ERR_OK;
 }
 
+/*
+ * Get the coap_obs_stats data, with TLV.
+ */
+static error_t coap_get_obs_stats(struct mbuf *m, uint8_t *len)
+{
+    coap_sys_obs_stats_t *d = (coap_sys_obs_stats_t *) m_append(m, sizeof(coap_sys_obs_stats_t));
+    if (!d) {
+        coap_stats.no_mbufs++;
+        return ERR_NO_MEM;
+    }
+    d->tl.u.rdt = crdt_stat_obs;
+    d->tl.l = sizeof(coap_obs_stats);
+    d->os.notifications = htonl(coap_obs_stats.notifications);
+    d->os.readings = htonl(coap_obs_stats.readings);
+    d->os.payload_bytes = htonl(coap_obs_stats.payload_bytes);
+    d->os.hdr_bytes = htonl(coap_obs_stats.hdr_bytes);
+    d->os.hdr_per_rdg = htonl(coap_obs_stats.hdr_per_rdg);
+    *len = sizeof(*d);
+
+    return ERR_OK;
+}
+
+/*
+ * Get the coap_txq_stats data, with TLV.
+ */
+static error_t coap_get_txq_stats(struct mbuf *m, uint8_t *len)
+{
+    coap_sys_txq_stats_t *d = (coap_sys_txq_stats_t *) m_append(m, sizeof(coap_sys_txq_stats_t));
+    if (!d) {
+        coap_stats.no_mbufs++;
+        return ERR_NO_MEM;
+    }
+    d->tl.u.rdt = crdt_stat_txq;
+    d->tl.l = sizeof(coap_txq_stats);
+    d->ts.depth = htonl(coap_txq_stats.depth);
+    d->ts.max_depth = htonl(coap_txq_stats.max_depth);
+    d->ts.queued = htonl(coap_txq_stats.queued);
+    d->ts.sent = htonl(coap_txq_stats.sent);
+    d->ts.coalesced = htonl(coap_txq_stats.coalesced);
+    d->ts.dropped = htonl(coap_txq_stats.dropped);
+    d->ts.expired = htonl(coap_txq_stats.expired);
+    *len = sizeof(*d);
+
+    return ERR_OK;
+}
+
+/*
+ * Get the coap_mbuf_stats data, with TLV.
+ */
+static error_t coap_get_mbuf_stats(struct mbuf *m, uint8_t *len)
+{
+    coap_sys_mbuf_stats_t *d = (coap_sys_mbuf_stats_t *) m_append(m, sizeof(coap_sys_mbuf_stats_t));
+    if (!d) {
+        coap_stats.no_mbufs++;
+        return ERR_NO_MEM;
+    }
+    d->tl.u.rdt = crdt_stat_mbuf;
+    d->tl.l = sizeof(coap_mbuf_stats);
+    d->ms.size = htonl(coap_mbuf_stats.size);
+    d->ms.in_use = htonl(coap_mbuf_stats.in_use);
+    d->ms.peak = htonl(coap_mbuf_stats.peak);
+    d->ms.allocs = htonl(coap_mbuf_stats.allocs);
+    d->ms.frees = htonl(coap_mbuf_stats.frees);
+    d->ms.pool = htonl(coap_mbuf_stats.pool);
+    d->ms.fails = htonl(coap_mbuf_stats.fails);
+    *len = sizeof(*d);
+
+    return ERR_OK;
+}
+
+/*
+ * Get the coap_s_run_stats data, with TLV.
+ */
+static error_t coap_get_run_stats(struct mbuf *m, uint8_t *len)
+{
+    coap_sys_run_stats_t *d = (coap_sys_run_stats_t *) m_append(m, sizeof(coap_sys_run_stats_t));
+    if (!d) {
+        coap_stats.no_mbufs++;
+        return ERR_NO_MEM;
+    }
+    d->tl.u.rdt = crdt_stat_run;
+    d->tl.l = sizeof(coap_s_run_stats);
+    d->rs.bursts = htonl(coap_s_run_stats.bursts);
+    d->rs.requests = htonl(coap_s_run_stats.requests);
+    d->rs.last_burst = htonl(coap_s_run_stats.last_burst);
+    d->rs.max_burst = htonl(coap_s_run_stats.max_burst);
+    d->rs.last_ms = htonl(coap_s_run_stats.last_ms);
+    d->rs.max_ms = htonl(coap_s_run_stats.max_ms);
+    d->rs.over_budget = htonl(coap_s_run_stats.over_budget);
+    *len = sizeof(*d);
+
+    return ERR_OK;
+}
+
 
 /*
  * Return or set, the specified system stats.
@@ -457,11 +553,28 @@ static error_t crsystem_stats(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp
         goto err;
     }            
     o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_QUERY, NULL);
+    if (!o) {
+        /* The module to report on is required */
+        rsp->code = COAP_RSP_400_BAD_REQUEST;
+        goto err;
+    }
 
     if (req->code == COAP_REQUEST_GET) {
         if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_COAP)) {
             /* get CoAP stats */
             rc = coap_get_coap_stats(rsp->msg, &len);
+        } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_OBS)) {
+            /* get Observe notification stats */
+            rc = coap_get_obs_stats(rsp->msg, &len);
+        } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_TXQ)) {
+            /* get TX queue stats */
+            rc = coap_get_txq_stats(rsp->msg, &len);
+        } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_MBUF)) {
+            /* get mbuf stats */
+            rc = coap_get_mbuf_stats(rsp->msg, &len);
+        } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_RUN)) {
+            /* get coap_s_run() burst stats */
+            rc = coap_get_run_stats(rsp->msg, &len);
         } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_PWR)) {
             /* get power stats */
             // TODO: Do we need this?
@@ -494,6 +607,15 @@ static error_t crsystem_stats(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp
             /* Set CoAP stats */
             rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
             goto err;
+        } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_MBUF)) {
+            /* Restart the peak from the mbufs in use now */
+            coap_mbuf_stats.peak = coap_mbuf_stats.in_use;
+            rc = ERR_OK;
+        } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_RUN)) {
+            /* Restart the largest and longest burst */
+            coap_s_run_stats.max_burst = 0;
+            coap_s_run_stats.max_ms = 0;
+            rc = ERR_OK;
         } else if (!coap_opt_strcmp(o, S_STAT_URI_Q_MOD_PWR)) {
             /* Set power stats */
             // TODO: Do we need this?
@@ -550,8 +672,8 @@ static error_t crsystem(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp)
         copt_del_opt_type((sl_co*)&(rsp->oh), COAP_OPTION_OBSERVE);
     }
     /* 
-     * No URI path beyond /system, except /time and /stats is supported, so
-     * reject if present. 
+     * No URI path beyond /system, except /time, /stats, /upg and /cfg is
+     * supported, so reject if present. 
      */
     copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH, &it);
     if ((o = copt_get_next_opt_type((const sl_co*) &(req->oh), COAP_OPTION_URI_PATH, &it))) {
@@ -560,6 +682,10 @@ static error_t crsystem(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp)
         } else if (!coap_opt_strcmp(o, S_STAT_URI)) {
             /* placeholder for stats */
             return crsystem_stats(req, rsp, it);
+        } else if (!coap_opt_strcmp(o, S_UPG_URI)) {
+            return crsystem_upg(req, rsp, it);
+        } else if (!coap_opt_strcmp(o, S_CFG_URI)) {
+            return crsystem_cfg(req, rsp, it);
         } else {
             rsp->code = COAP_RSP_404_NOT_FOUND;
         }
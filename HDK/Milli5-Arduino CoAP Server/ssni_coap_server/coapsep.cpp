@@ -0,0 +1,230 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "errors.h"
+#include "log.h"
+#include "hbuf.h"
+#include "coappdu.h"
+#include "coapmsg.h"
+#include "coaptxq.h"
+#include "arduino_time.h"
+#include "coapsep.h"
+
+struct coap_sep {
+    uint8_t     inuse;
+    uint16_t    mid;            /* request mid, to spot retransmissions */
+    uint8_t     tkl;            /* token of the original request */
+    uint8_t     token[8];
+    uint8_t     etagl;          /* first ETag of the request, if any */
+    uint8_t     etag[8];
+    void        *client;        /* Opaque client handle */
+    coap_sep_fn fn;             /* continuation */
+    void        *arg;
+    uint32_t    start;          /* time_ms() when parked */
+};
+
+static struct coap_sep coap_sep_q[COAP_SEP_MAX];
+static uint8_t coap_sep_nxt;   /* slot to poll next */
+
+static struct coap_sep *
+coap_sep_find(const struct coap_msg_ctx *req)
+{
+    uint8_t i;
+
+    for (i = 0; i < COAP_SEP_MAX; i++) {
+        if (coap_sep_q[i].inuse && coap_sep_q[i].client == req->client &&
+                coap_sep_q[i].mid == req->mid) {
+            return &coap_sep_q[i];
+        }
+    }
+    return NULL;
+}
+
+error_t
+coap_sep_defer(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        coap_sep_fn fn, void *arg)
+{
+    struct coap_sep *s;
+    struct optlv *op;
+    uint8_t i;
+
+    if (req->type != COAP_T_CONF_VAL) {
+        return ERR_INVAL;
+    }
+
+    /* Retransmitted request, the first ACK was lost. */
+    if ((s = coap_sep_find(req)) == NULL) {
+        for (i = 0; i < COAP_SEP_MAX; i++) {
+            if (!coap_sep_q[i].inuse) {
+                s = &coap_sep_q[i];
+                break;
+            }
+        }
+        if (!s) {
+            dlog(LOG_WARNING, "No slot to defer mid: 0x%x", req->mid);
+            return ERR_AGAIN;
+        }
+        s->mid = req->mid;
+        s->tkl = req->tkl;
+        memcpy(s->token, req->token, sizeof(s->token));
+        s->client = req->client;
+        s->etagl = 0;
+        if ((op = copt_get_next_opt_type((const sl_co*)&(req->oh),
+                        COAP_OPTION_ETAG, NULL)) != NULL &&
+                op->ol <= sizeof(s->etag)) {
+            s->etagl = op->ol;
+            memcpy(s->etag, op->ov, op->ol);
+        }
+        s->fn = fn;
+        s->arg = arg;
+        s->start = time_ms();
+        s->inuse = 1;
+        dlog(LOG_DEBUG, "Deferred mid: 0x%x", req->mid);
+    }
+
+    /* Empty ACK: no token, options or payload. */
+    rsp->code = COAP_EMPTY_MESSAGE;
+    rsp->tkl = 0;
+    rsp->plen = 0;
+    rsp->final = 1;
+    copt_del_all((sl_co*)&(rsp->oh));
+
+    return ERR_OK;
+}
+
+/*
+ * Handle CoAP ACK received for a separate response.
+ */
+static error_t
+coap_sep_rx_ack(void *cbctx, struct mbuf *m)
+{
+    (void)cbctx;
+    (void)m;
+    dlog(LOG_DEBUG, "Separate response acked");
+    return ERR_OK;
+}
+
+/*
+ * Poll one parked exchange per call, round robin, so a slow continuation
+ * delays the loop by at most one sensor access.
+ * Build the CON response in a fresh mbuf. If the continuation isn't done,
+ * drop the mbuf and try again later, unless the exchange has timed out.
+ * Register for the ACK and hand the response over as the pending frame.
+ */
+void
+coap_sep_run(void)
+{
+    struct coap_sep *s = NULL;
+    struct coap_msg_ctx req, rsp;
+    struct optlv op;
+    coap_ack_cb_info_t cbi;
+    struct mbuf *m;
+    uint8_t i;
+    error_t rc;
+
+    for (i = 0; i < COAP_SEP_MAX; i++) {
+        if (coap_sep_q[coap_sep_nxt].inuse) {
+            s = &coap_sep_q[coap_sep_nxt];
+        }
+        coap_sep_nxt = (coap_sep_nxt + 1) % COAP_SEP_MAX;
+        if (s) {
+            break;
+        }
+    }
+    if (!s) {
+        return;
+    }
+
+    m = m_gethdr();
+    if (!m) {
+        return;
+    }
+    m_reserve(m, COAP_OBS_HDR_SZ);
+
+    /* What's left of the request. */
+    memset(&req, 0, sizeof(req));
+    copt_init((sl_co*)&(req.oh));
+    req.type = COAP_T_CONF_VAL;
+    req.tkl = s->tkl;
+    memcpy(req.token, s->token, sizeof(req.token));
+    req.mid = s->mid;
+    req.client = s->client;
+    if (s->etagl) {
+        op.ot = COAP_OPTION_ETAG;
+        op.ol = s->etagl;
+        op.ov = s->etag;
+        (void)copt_add_opt((sl_co*)&(req.oh), &op);
+    }
+
+    memset(&rsp, 0, sizeof(rsp));
+    copt_init((sl_co*)&(rsp.oh));
+    rsp.type = COAP_T_CONF_VAL;
+    rsp.tkl = s->tkl;
+    memcpy(rsp.token, s->token, sizeof(rsp.token));
+    rsp.client = s->client;
+    rsp.final = 1;
+    rsp.msg = m;
+
+    rc = s->fn(&req, &rsp, s->arg);
+    if (rc == ERR_INPROGRESS) {
+        if ((uint32_t)(time_ms() - s->start) < COAP_SEP_TIMEOUT_MS) {
+            goto done;
+        }
+        dlog(LOG_WARNING, "Deferred response timed out");
+        rsp.code = COAP_RSP_503_SERV_UNAVAILABLE;
+        rsp.plen = 0;
+    } else if (rc != ERR_OK) {
+        rsp.code = COAP_RSP_500_INTERNAL_ERROR;
+        rsp.plen = 0;
+    }
+
+    s->inuse = 0;
+
+    rsp.mid = get_mid_val();
+    if (coap_msg_response(&rsp) != ERR_OK) {
+        dlog(LOG_ERR, "Error creating separate RSP");
+        goto done;
+    }
+
+    cbi.cbctx = NULL;
+    cbi.cb = coap_sep_rx_ack;
+    coap_con_add(rsp.mid, &cbi);
+
+    (void)coap_txq_put(m, COAP_TXQ_RSP, 0);
+    m = NULL;
+
+done:
+    copt_del_all((sl_co*)&(req.oh));
+    copt_del_all((sl_co*)&(rsp.oh));
+    if (m) {
+        m_free(m);
+    }
+}
@@ -0,0 +1,84 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_COAPSEP_H
+#define INC_COAPSEP_H
+
+#include "errors.h"
+#include "coapmsg.h"
+
+/*
+ * Separate (deferred) responses, RFC 7252 section 5.2.2.
+ *
+ * A resource handler that can't answer quickly parks the exchange with
+ * coap_sep_defer(). The request is acknowledged with an empty ACK, and the
+ * continuation is polled from coap_s_run() while no request is waiting. When
+ * it completes, the response is sent as a CON carrying the original token.
+ */
+
+/* Maximum number of exchanges parked at once */
+#define COAP_SEP_MAX            (2)
+
+/* A parked exchange not completed within this is answered with 5.03 */
+#define COAP_SEP_TIMEOUT_MS     (5000)
+
+/**
+ * @brief Continuation of a deferred request
+ *
+ * Called with an initialised CON response context. Append the payload to
+ * rsp->msg and set code, plen and cf as a resource handler would.
+ * req only keeps the token and the first ETag option of the original request,
+ * which is freed once the empty ACK has been built. arg is the value given to
+ * coap_sep_defer(), so it mustn't point into the request either.
+ *
+ * @return ERR_OK when rsp is complete, ERR_INPROGRESS to be polled again,
+ *         anything else to answer 5.00.
+ */
+typedef error_t (*coap_sep_fn)(const struct coap_msg_ctx *req,
+        struct coap_msg_ctx *rsp, void *arg);
+
+/**
+ * @brief Park req and turn rsp into an empty ACK
+ *
+ * Only CON requests can be deferred. A retransmission of a request that is
+ * already parked is ACKed again without taking another slot.
+ *
+ * @return ERR_OK if parked, ERR_INVAL if req is not CON, ERR_AGAIN if all
+ *         COAP_SEP_MAX slots are in use. On error rsp is left untouched.
+ */
+error_t coap_sep_defer(const struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        coap_sep_fn fn, void *arg);
+
+/**
+ * @brief Poll the next parked exchange, sending its response when done
+ *
+ */
+void coap_sep_run(void);
+
+#endif /* INC_COAPSEP_H */
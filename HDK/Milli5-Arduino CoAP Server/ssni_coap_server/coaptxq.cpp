@@ -0,0 +1,173 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "errors.h"
+#include "log.h"
+#include "hbuf.h"
+#include "exp_coap.h"
+#include "arduino_pins.h"
+#include "coaptxq.h"
+
+struct coap_txq_ent {
+    struct mbuf *m;
+    uint8_t     cls;            /* enum coap_txq_class */
+    uint8_t     ntx;            /* times sent, non-zero once in flight */
+    uint32_t    key;            /* coalescing key, 0 none */
+};
+
+/* Ordered by class then age, [0] is the head */
+static struct coap_txq_ent coap_txq[COAP_TXQ_LEN];
+static uint8_t coap_txq_n;
+RAM_ASSERT(sizeof(coap_txq) <= RAM_SHARE_TXQ);
+
+/* Queue statistics, see exp_coap.h */
+struct coap_txq_stats coap_txq_stats;
+
+/* Remove entry i, freeing its frame. */
+static void
+coap_txq_del(uint8_t i)
+{
+    m_free(coap_txq[i].m);
+    coap_txq_n--;
+    memmove(&coap_txq[i], &coap_txq[i + 1],
+            (coap_txq_n - i) * sizeof(coap_txq[0]));
+    coap_txq_stats.depth = coap_txq_n;
+}
+
+/* First entry that may be replaced or dropped, the head once sent can't. */
+static uint8_t
+coap_txq_first(void)
+{
+    return (coap_txq_n && coap_txq[0].ntx) ? 1 : 0;
+}
+
+error_t
+coap_txq_put(struct mbuf *m, uint8_t cls, uint32_t key)
+{
+    uint8_t i, v;
+
+    /*
+     * The observer's last notification the proxy hasn't seen yet, the newer
+     * one replaces it if both may be. Otherwise, e.g. a batch of readings,
+     * it queues behind so none is lost or reordered.
+     */
+    for (i = coap_txq_n; key && i > coap_txq_first(); i--) {
+        if (!((coap_txq[i - 1].key ^ key) & ~COAP_TXQ_KEY_REPLACE)) {
+            if (coap_txq[i - 1].key & key & COAP_TXQ_KEY_REPLACE) {
+                m_free(coap_txq[i - 1].m);
+                coap_txq[i - 1].m = m;
+                coap_txq_stats.coalesced++;
+                dlog(LOG_DEBUG, "Coalesced queued frame %d", i - 1);
+                goto notify;
+            }
+            break;
+        }
+    }
+
+    if (coap_txq_n == COAP_TXQ_LEN) {
+        /* Oldest frame of the least urgent class, not below the new one */
+        v = COAP_TXQ_LEN;
+        for (i = coap_txq_first(); i < coap_txq_n; i++) {
+            if (coap_txq[i].cls >= cls &&
+                    (v == COAP_TXQ_LEN || coap_txq[i].cls > coap_txq[v].cls)) {
+                v = i;
+            }
+        }
+        coap_txq_stats.dropped++;
+        if (v == COAP_TXQ_LEN) {
+            dlog(LOG_WARNING, "TX queue full, frame dropped");
+            m_free(m);
+            return ERR_AGAIN;
+        }
+        dlog(LOG_WARNING, "TX queue full, dropped queued frame %d", v);
+        coap_txq_del(v);
+    }
+
+    /* Behind the frames of the same or a more urgent class */
+    for (i = coap_txq_n; i > coap_txq_first() && coap_txq[i - 1].cls > cls;
+            i--) {
+        coap_txq[i] = coap_txq[i - 1];
+    }
+    coap_txq[i].m = m;
+    coap_txq[i].cls = cls;
+    coap_txq[i].ntx = 0;
+    coap_txq[i].key = key;
+    coap_txq_n++;
+
+    coap_txq_stats.queued++;
+    coap_txq_stats.depth = coap_txq_n;
+    if (coap_txq_n > coap_txq_stats.max_depth) {
+        coap_txq_stats.max_depth = coap_txq_n;
+    }
+
+notify:
+    /* Notify mnic of pending frame, wait for 1ms, then high again */
+    pinMode(MNIC_WAKEUP_PIN, OUTPUT);
+    digitalWrite(MNIC_WAKEUP_PIN, LOW);
+    delay(1);
+    digitalWrite(MNIC_WAKEUP_PIN, HIGH);
+
+    return ERR_OK;
+}
+
+struct mbuf *
+coap_txq_next(void)
+{
+    while (coap_txq_n && coap_txq[0].ntx >= COAP_TXQ_MAX_TX) {
+        dlog(LOG_WARNING, "Queued frame not acknowledged, dropped");
+        coap_txq_stats.expired++;
+        coap_txq_del(0);
+    }
+    if (!coap_txq_n) {
+        return NULL;
+    }
+
+    coap_txq[0].ntx++;
+    return coap_txq[0].m;
+}
+
+void
+coap_txq_acked(void)
+{
+    if (coap_txq_n && coap_txq[0].ntx) {
+        coap_txq_stats.sent++;
+        coap_txq_del(0);
+    }
+}
+
+void
+coap_txq_flush(void)
+{
+    while (coap_txq_n) {
+        coap_txq_stats.dropped++;
+        coap_txq_del(coap_txq_n - 1);
+    }
+}
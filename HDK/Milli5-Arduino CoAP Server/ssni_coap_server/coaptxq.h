@@ -0,0 +1,106 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_COAPTXQ_H
+#define INC_COAPTXQ_H
+
+#include "errors.h"
+#include "hbuf.h"
+#include "ram.h"
+
+/*
+ * Frames waiting for the proxy.
+ *
+ * The secondary station can't transmit on its own; queued frames go out one
+ * at a time when the primary polls with RR (HDLC window 1). The head frame
+ * is resent on each poll until the primary acknowledges it, then the next
+ * one goes out. Responses to a request received in an I frame are written
+ * straight back and don't pass through here.
+ *
+ * Frames are ordered by class, then by age. A single reading notification
+ * that is still queued is replaced by a newer one for the same observer and
+ * resource, so only the freshest value is sent. A batch of readings is
+ * never replaced, and queues behind the observer's last frame like anything
+ * queued after a batch. When the queue is full the oldest frame
+ * of the lowest class at or below the new one's is dropped, or the new one
+ * if all queued frames rank above it.
+ */
+
+/* Frames held at once, including the one in flight */
+#define COAP_TXQ_LEN            (RAM_TXQ_LEN)
+
+/* Sends of the head frame without an acknowledgement before it's dropped */
+#define COAP_TXQ_MAX_TX         (4)
+
+/* Key flag of a frame that may replace, and be replaced by, a newer one */
+#define COAP_TXQ_KEY_REPLACE    (0x80000000UL)
+
+/* Frame classes, most urgent first */
+enum coap_txq_class {
+    COAP_TXQ_RSP = 0,           /* Separate responses to requests */
+    COAP_TXQ_CON,               /* CON notifications */
+    COAP_TXQ_NON                /* NON notifications */
+};
+
+/**
+ * @brief Queue m for the proxy and pulse the mNIC wake-up pin so it polls
+ *
+ * m is consumed whatever the outcome.
+ *
+ * @param key   Non-zero identifies the observer and resource of a
+ *              notification. With COAP_TXQ_KEY_REPLACE it replaces the
+ *              observer's last queued frame if that has the flag too.
+ *              0 never coalesces.
+ *
+ * @return ERR_OK if queued, ERR_AGAIN if m was dropped as the queue is full
+ *         of more urgent frames.
+ */
+error_t coap_txq_put(struct mbuf *m, uint8_t cls, uint32_t key);
+
+/**
+ * @brief The frame to send on this poll, NULL if none
+ *
+ * The head frame stays queued, and is returned again, until
+ * coap_txq_acked(). After COAP_TXQ_MAX_TX sends it is dropped instead.
+ */
+struct mbuf *coap_txq_next(void);
+
+/**
+ * @brief The primary acknowledged the last frame sent, release it
+ *
+ */
+void coap_txq_acked(void);
+
+/**
+ * @brief Drop every queued frame, e.g. when the link is disconnected
+ *
+ */
+void coap_txq_flush(void);
+
+#endif /* INC_COAPTXQ_H */
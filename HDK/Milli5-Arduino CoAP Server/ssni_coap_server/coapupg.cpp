@@ -0,0 +1,544 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "includes.h"
+#include "errors.h"
+#include "log.h"
+#include "hbuf.h"
+#include "coappdu.h"
+#include "coapmsg.h"
+#include "coapextif.h"
+#include "crc_xmodem.h"
+#include "upg_flash.h"
+#include "arduino_time.h"
+#include "coapupg.h"
+
+#define S_UPG_URI_Q_INFO            "info"
+#define S_UPG_URI_Q_INFO_VER        S_UPG_URI_Q_INFO "=ver"
+#define S_UPG_URI_Q_INFO_STATE      S_UPG_URI_Q_INFO "=sts"
+#define S_UPG_URI_Q_STATE           "st"
+#define S_UPG_URI_Q_STATE_INIT      S_UPG_URI_Q_STATE "=init"
+#define S_UPG_URI_Q_STATE_VERIFY    S_UPG_URI_Q_STATE "=verify"
+#define S_UPG_URI_Q_STATE_ACTIVATE  S_UPG_URI_Q_STATE "=activate"
+#define S_UPG_URI_Q_IMGOFFSET       "off="
+
+/* Block1 option value fields, RFC 7959 section 2.2 */
+#define UPG_BLK_NUM(v)      ((v) >> 4)
+#define UPG_BLK_M           (0x08)
+#define UPG_BLK_SZX(v)      ((v) & 0x07)
+#define UPG_BLK_SIZE(szx)   (1 << ((szx) + 4))
+
+/*
+ * Transfer state. Only one client, and requests are serialised, so a single
+ * instance. Image data is collected in page, which is programmed when full;
+ * off counts every byte received, including those still in page.
+ */
+static struct {
+    coap_upgrade_state_t state;
+    coap_upg_ver_t ver;         /* staged image, host order */
+    uint16_t flags;
+    uint16_t img_crc;
+    uint32_t img_len;
+    uint32_t device_type;
+    uint32_t off;               /* expected_offset */
+    uint16_t crc;               /* running crc_xmodem() of [0, off) */
+    uint16_t blk_size;          /* size of the last Block1 */
+    uint8_t page[UPG_FLASH_PAGE_SIZE];
+    uint8_t reset;              /* reset pending, at reset_at */
+    uint32_t reset_at;
+} upg;
+
+/* Block1 value for the response, sent after the handler returns. */
+static uint8_t upg_blk1[3];
+
+
+/* Value of a 0-3 byte uint option. */
+static uint32_t
+upg_opt_uint(const struct optlv *o)
+{
+    const uint8_t *v = (const uint8_t *)o->ov;
+    uint32_t r = 0;
+    int i;
+
+    for (i = 0; i < o->ol && i < 3; i++) {
+        r = (r << 8) | v[i];
+    }
+    return r;
+}
+
+/* Add a Block1 option to rsp, for the block num of size 2^(szx+4). */
+static error_t
+upg_blk1_add(struct coap_msg_ctx *rsp, uint32_t num, uint8_t more,
+        uint8_t szx)
+{
+    struct optlv opt;
+    uint32_t v = (num << 4) | (more ? UPG_BLK_M : 0) | szx;
+    uint8_t l = (v > 0xFFFF) ? 3 : (v > 0xFF) ? 2 : (v > 0) ? 1 : 0;
+    int i;
+
+    for (i = l; i > 0; i--) {
+        upg_blk1[i - 1] = v & 0xFF;
+        v >>= 8;
+    }
+    opt.ot = COAP_OPTION_BLOCK1;
+    opt.ol = l;
+    opt.ov = upg_blk1;
+    return copt_add_opt((sl_co*)&(rsp->oh), &opt);
+}
+
+/* Program the page holding offs, erasing its row first when it's the first */
+static error_t
+upg_page_flush(uint32_t offs)
+{
+    error_t rc;
+
+    offs = rounddown2(offs, UPG_FLASH_PAGE_SIZE);
+    if (!(offs & (UPG_FLASH_ROW_SIZE - 1))) {
+        if ((rc = upg_flash_erase_row(offs)) != ERR_OK) {
+            return rc;
+        }
+    }
+    rc = upg_flash_write_page(offs, upg.page);
+    memset(upg.page, 0xFF, sizeof(upg.page));
+    return rc;
+}
+
+/*
+ * Take image data for offset offs. Data before upg.off was written already and
+ * is skipped, so retransmissions and resumes with a different block size are
+ * fine. The last partial page is programmed when the image is complete.
+ *
+ * @return: ERR_OK, ERR_NO_ENTRY if offs is past upg.off, ERR_MSGSIZE if the
+ *          data runs past img_len, ERR_INVAL if no transfer is in progress or
+ *          ERR_IO on a flash error, which fails the transfer.
+ */
+static error_t
+upg_write(uint32_t offs, const uint8_t *d, uint16_t len)
+{
+    uint32_t skip;
+    uint16_t po, n;
+    error_t rc = ERR_OK;
+
+    if (upg.state != cust_init_passed && upg.state != cust_txr_passed) {
+        return ERR_INVAL;
+    }
+    if (offs > upg.off) {
+        return ERR_NO_ENTRY;
+    }
+    skip = upg.off - offs;
+    if (skip >= len) {
+        return ERR_OK;      /* duplicate */
+    }
+    d += skip;
+    len -= skip;
+    if (len > upg.img_len - upg.off) {
+        return ERR_MSGSIZE;
+    }
+
+    upg.crc = crc_xmodem(upg.crc, d, len);
+    while (len) {
+        po = upg.off & (UPG_FLASH_PAGE_SIZE - 1);
+        n = min(len, (uint16_t)(UPG_FLASH_PAGE_SIZE - po));
+        memcpy(upg.page + po, d, n);
+        upg.off += n;
+        d += n;
+        len -= n;
+        if (po + n == UPG_FLASH_PAGE_SIZE &&
+                (rc = upg_page_flush(upg.off - 1)) != ERR_OK) {
+            goto err;
+        }
+    }
+
+    if (upg.off == upg.img_len) {
+        if ((upg.off & (UPG_FLASH_PAGE_SIZE - 1)) &&
+                (rc = upg_page_flush(upg.off)) != ERR_OK) {
+            goto err;
+        }
+        if (upg.crc == upg.img_crc) {
+            upg.state = cust_txr_passed;
+            dlog(LOG_INFO, "Upgrade image received, %lu bytes",
+                    (unsigned long)upg.off);
+        } else {
+            upg.state = cust_txr_failed;
+            dlog(LOG_ERR, "Upgrade image CRC %04x, expected %04x", upg.crc,
+                    upg.img_crc);
+        }
+    }
+    return ERR_OK;
+
+err:
+    dlog(LOG_ERR, "Upgrade flash write failed at %lu (%d)",
+            (unsigned long)upg.off, rc);
+    upg.state = cust_txr_failed;
+    return rc;
+}
+
+/* Response code for image data, once upg_write() returned rc. */
+static uint8_t
+upg_write_code(error_t rc, uint8_t more)
+{
+    switch (rc) {
+    case ERR_OK:
+        if (more) {
+            return COAP_RSP_231_CONTINUE;
+        }
+        if (upg.state == cust_txr_passed) {
+            return COAP_RSP_204_CHANGED;
+        }
+        /* Last block but short, or the CRC is wrong */
+        return (upg.state == cust_txr_failed) ? COAP_RSP_406_NOT_ACCEPTABLE :
+            COAP_RSP_408_REQ_INCOMPLETE;
+    case ERR_NO_ENTRY:
+        return COAP_RSP_408_REQ_INCOMPLETE;
+    case ERR_MSGSIZE:
+        return COAP_RSP_413_REQ_TOO_LARGE;
+    case ERR_INVAL:
+        return COAP_RSP_412_PRE_FAILED;
+    default:
+        return COAP_RSP_500_INTERNAL_ERROR;
+    }
+}
+
+/* PUT with Block1 */
+static void
+upg_put_block(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        const struct optlv *b1)
+{
+    uint32_t v = upg_opt_uint(b1);
+    uint32_t num = UPG_BLK_NUM(v);
+    uint8_t szx = UPG_BLK_SZX(v);
+    uint8_t more = !!(v & UPG_BLK_M);
+    uint16_t size;
+    error_t rc;
+
+    if (szx == 7) {
+        rsp->code = COAP_RSP_400_BAD_REQUEST;
+        return;
+    }
+    if (szx > UPG_BLK_SZX_MAX) {
+        /* Tell the client the size we take, RFC 7959 section 2.9.3 */
+        rsp->code = COAP_RSP_413_REQ_TOO_LARGE;
+        (void)upg_blk1_add(rsp, 0, 0, UPG_BLK_SZX_MAX);
+        return;
+    }
+    size = UPG_BLK_SIZE(szx);
+    if (req->plen > size || (more && req->plen != size)) {
+        rsp->code = COAP_RSP_400_BAD_REQUEST;
+        return;
+    }
+
+    upg.blk_size = size;
+    rc = upg_write(num * size, mtod(req->msg, uint8_t *) + req->hdrlen,
+            req->plen);
+    rsp->code = upg_write_code(rc, more);
+    if (COAP_CLASS(rsp->code) == 2 &&
+            upg_blk1_add(rsp, num, more, szx) != ERR_OK) {
+        rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+    }
+}
+
+/* PUT ?off=<n>, the offset being the decimal after "off=" */
+static void
+upg_put_offs(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        const struct optlv *q)
+{
+    const char *s = (const char *)q->ov;
+    uint32_t offs = 0;
+    int i = sizeof(S_UPG_URI_Q_IMGOFFSET) - 1;
+    error_t rc;
+
+    if (i == q->ol) {
+        rsp->code = COAP_RSP_400_BAD_REQUEST;
+        return;
+    }
+    for (; i < q->ol; i++) {
+        if (s[i] < '0' || s[i] > '9' || offs > UPG_FLASH_IMG_MAX) {
+            rsp->code = COAP_RSP_400_BAD_REQUEST;
+            return;
+        }
+        offs = offs * 10 + (s[i] - '0');
+    }
+
+    rc = upg_write(offs, mtod(req->msg, uint8_t *) + req->hdrlen, req->plen);
+    rsp->code = upg_write_code(rc, upg.off < upg.img_len);
+    if (rsp->code == COAP_RSP_231_CONTINUE) {
+        rsp->code = COAP_RSP_204_CHANGED;   /* no Block1, nothing to continue */
+    }
+}
+
+/* PUT ?st=init */
+static void
+upg_init(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp)
+{
+    coap_sys_upg_img_info_t ii;
+    uint32_t len;
+
+    if (req->plen != sizeof(ii)) {
+        rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
+        return;
+    }
+    memcpy(&ii, mtod(req->msg, uint8_t *) + req->hdrlen, sizeof(ii));
+    if (ii.tl.u.rdt != crdt_upg_img_info_sys ||
+            ii.tl.l != sizeof(ii) - sizeof(coap_sens_tl_t)) {
+        rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
+        return;
+    }
+    len = ntohl(ii.img_len);
+    if (len == 0 || len > UPG_FLASH_IMG_MAX) {
+        upg.state = cust_init_failed;
+        rsp->code = COAP_RSP_413_REQ_TOO_LARGE;
+        return;
+    }
+
+    /* Same image again, e.g. after a link drop: keep what we have. */
+    if ((upg.state == cust_init_passed || upg.state == cust_txr_passed) &&
+            upg.img_len == len && upg.img_crc == ntohs(ii.img_crc) &&
+            upg.ver.major == ii.ver.major && upg.ver.minor == ii.ver.minor &&
+            upg.ver.revision == ntohs(ii.ver.revision)) {
+        dlog(LOG_INFO, "Upgrade resumed at %lu", (unsigned long)upg.off);
+        rsp->code = COAP_RSP_204_CHANGED;
+        return;
+    }
+
+    /* A record left from an earlier image must not survive the new one. */
+    if (upg_flash_erase_row(UPG_FLASH_REC_OFFS) != ERR_OK) {
+        upg.state = cust_init_failed;
+        rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+        return;
+    }
+
+    upg.ver.major = ii.ver.major;
+    upg.ver.minor = ii.ver.minor;
+    upg.ver.revision = ntohs(ii.ver.revision);
+    upg.flags = ntohs(ii.flags);
+    upg.img_crc = ntohs(ii.img_crc);
+    upg.img_len = len;
+    upg.device_type = ntohl(ii.device_type);
+    upg.off = 0;
+    upg.crc = crc_xmodem_init();
+    upg.blk_size = 0;
+    memset(upg.page, 0xFF, sizeof(upg.page));
+    upg.state = cust_init_passed;
+    dlog(LOG_INFO, "Upgrade to %d.%d.%u, %lu bytes", upg.ver.major,
+            upg.ver.minor, upg.ver.revision, (unsigned long)upg.img_len);
+    rsp->code = COAP_RSP_204_CHANGED;
+}
+
+/* PUT ?st=verify, CRC of the image as read back from flash */
+static void
+upg_verify(struct coap_msg_ctx *rsp)
+{
+    uint8_t b[UPG_FLASH_PAGE_SIZE];
+    uint16_t crc = crc_xmodem_init();
+    uint32_t offs, n;
+
+    if (upg.state != cust_txr_passed && upg.state != cust_verify_passed &&
+            upg.state != cust_verify_failed) {
+        rsp->code = COAP_RSP_412_PRE_FAILED;
+        return;
+    }
+    for (offs = 0; offs < upg.img_len; offs += n) {
+        n = min(upg.img_len - offs, (uint32_t)sizeof(b));
+        if (upg_flash_read(offs, b, n) != ERR_OK) {
+            break;
+        }
+        crc = crc_xmodem(crc, b, n);
+    }
+    if (offs == upg.img_len && crc == upg.img_crc) {
+        upg.state = cust_verify_passed;
+        rsp->code = COAP_RSP_204_CHANGED;
+    } else {
+        upg.state = cust_verify_failed;
+        dlog(LOG_ERR, "Upgrade verify CRC %04x, expected %04x", crc,
+                upg.img_crc);
+        rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
+    }
+}
+
+/* PUT ?st=activate */
+static void
+upg_activate(struct coap_msg_ctx *rsp)
+{
+#if defined(UPG_HAVE_BOOTLOADER)
+    struct upg_rec *r = (struct upg_rec *)upg.page;
+#endif
+
+    if (upg.state != cust_verify_passed) {
+        rsp->code = COAP_RSP_412_PRE_FAILED;
+        return;
+    }
+
+#if !defined(UPG_HAVE_BOOTLOADER)
+    /* Nothing would apply the record, so don't answer as if it took */
+    dlog(LOG_WARNING, "Upgrade not activated, no bootloader takes it");
+    rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
+#else
+    /* The transfer is complete, so page is free to build the record in. */
+    memset(upg.page, 0xFF, sizeof(upg.page));
+    r->magic = UPG_REC_MAGIC;
+    r->img_len = upg.img_len;
+    r->img_crc = upg.img_crc;
+    r->flags = upg.flags;
+    r->ver = upg.ver;
+    r->device_type = upg.device_type;
+    if (upg_page_flush(UPG_FLASH_REC_OFFS) != ERR_OK) {
+        upg.state = cust_activate_failed;
+        rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+        return;
+    }
+
+    upg.state = cust_activate_passed;
+    upg.reset = 1;
+    upg.reset_at = time_ms() + UPG_RESET_DELAY_MS;
+    dlog(LOG_INFO, "Upgrade activated, reset in %d ms", UPG_RESET_DELAY_MS);
+    rsp->code = COAP_RSP_204_CHANGED;
+#endif
+}
+
+/* GET ?info=ver */
+static error_t
+upg_get_ver(struct coap_msg_ctx *rsp)
+{
+    coap_sys_upg_ver_t *d;
+
+    d = (coap_sys_upg_ver_t *)m_append(rsp->msg, sizeof(*d));
+    if (!d) {
+        return ERR_NO_MEM;
+    }
+    memset(d, 0, sizeof(*d));
+    d->tl.u.rdt = crdt_upg_img_ver_sys;
+    d->tl.l = sizeof(*d) - sizeof(coap_sens_tl_t);
+    d->ver.major = UPG_FW_VER_MAJOR;
+    d->ver.minor = UPG_FW_VER_MINOR;
+    d->ver.revision = htons(UPG_FW_VER_REVISION);
+    rsp->plen = sizeof(*d);
+    return ERR_OK;
+}
+
+/* GET ?info=sts */
+static error_t
+upg_get_state(struct coap_msg_ctx *rsp)
+{
+    coap_sys_upg_state_t *d;
+
+    d = (coap_sys_upg_state_t *)m_append(rsp->msg, sizeof(*d));
+    if (!d) {
+        return ERR_NO_MEM;
+    }
+    memset(d, 0, sizeof(*d));
+    d->tl.u.rdt = crdt_upg_state_sys;
+    d->tl.l = sizeof(*d) - sizeof(coap_sens_tl_t);
+    d->upg_ver.major = upg.ver.major;
+    d->upg_ver.minor = upg.ver.minor;
+    d->upg_ver.revision = htons(upg.ver.revision);
+    d->expected_offset = htonl(upg.off);
+    d->img_len = htonl(upg.img_len);
+    d->block_size = htons(upg.blk_size);
+    d->state = upg.state;
+    rsp->plen = sizeof(*d);
+    return ERR_OK;
+}
+
+error_t
+crsystem_upg(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it)
+{
+    struct optlv *o, *b1;
+    error_t rc = ERR_OK;
+
+    /* No URI path beyond /upg is supported, so reject if present. */
+    if ((o = copt_get_next_opt_type((const sl_co*)&(req->oh),
+                    COAP_OPTION_URI_PATH, &it))) {
+        rsp->code = COAP_RSP_404_NOT_FOUND;
+        goto err;
+    }
+    o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_QUERY,
+            NULL);
+
+    if (req->code == COAP_REQUEST_GET) {
+        if (o && !coap_opt_strcmp(o, S_UPG_URI_Q_INFO_VER)) {
+            rc = upg_get_ver(rsp);
+        } else if (o && !coap_opt_strcmp(o, S_UPG_URI_Q_INFO_STATE)) {
+            rc = upg_get_state(rsp);
+        } else {
+            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
+            goto err;
+        }
+        if (rc) {
+            coap_stats.no_mbufs++;
+            rsp->code = COAP_RSP_500_INTERNAL_ERROR;
+            goto err;
+        }
+        rsp->cf = COAP_CF_APPLICATION_OCTET_STREAM;
+        rsp->code = COAP_RSP_205_CONTENT;
+        return ERR_OK;
+    } else if (req->code == COAP_REQUEST_PUT) {
+        b1 = copt_get_next_opt_type((const sl_co*)&(req->oh),
+                COAP_OPTION_BLOCK1, NULL);
+        if (b1) {
+            upg_put_block(req, rsp, b1);
+        } else if (o && !coap_opt_strcmp(o, S_UPG_URI_Q_STATE_INIT)) {
+            upg_init(req, rsp);
+        } else if (o && !coap_opt_strcmp(o, S_UPG_URI_Q_STATE_VERIFY)) {
+            upg_verify(rsp);
+        } else if (o && !coap_opt_strcmp(o, S_UPG_URI_Q_STATE_ACTIVATE)) {
+            upg_activate(rsp);
+        } else if (o && o->ol >= sizeof(S_UPG_URI_Q_IMGOFFSET) - 1 &&
+                !memcmp(o->ov, S_UPG_URI_Q_IMGOFFSET,
+                    sizeof(S_UPG_URI_Q_IMGOFFSET) - 1)) {
+            upg_put_offs(req, rsp, o);
+        } else {
+            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
+        }
+    } else {
+        rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
+    }
+
+err:
+    rsp->plen = 0;
+
+    return ERR_OK;
+}
+
+void
+coap_upg_run(void)
+{
+    if (!upg.reset || (int32_t)(time_ms() - upg.reset_at) < 0) {
+        return;
+    }
+    upg.reset = 0;
+    dlog(LOG_INFO, "Resetting into the new image");
+#if defined(SSN_x86)
+    ;   /* nothing to reset into, the record is in UPG_FLASH_FILE */
+#else
+    delay(10);      /* let the log out */
+    NVIC_SystemReset();
+#endif
+}
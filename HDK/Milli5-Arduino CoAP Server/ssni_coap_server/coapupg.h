@@ -0,0 +1,100 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_COAPUPG_H
+#define INC_COAPUPG_H
+
+#include "errors.h"
+#include "coapmsg.h"
+#include "coapextif.h"
+
+/*
+ * Firmware upgrade, /system/upg.
+ *
+ *   PUT ?st=init       coap_sys_upg_img_info_t payload, prepares staging.
+ *                      Repeating it with the same image keeps the progress.
+ *   PUT + Block1       image data, written to staging flash as it arrives
+ *                      (RFC 7959). 2.31 Continue per block, 2.04 on the last
+ *                      one once length and CRC match.
+ *   PUT ?off=<n>       image data at byte offset n, for clients without
+ *                      Block1 support.
+ *   PUT ?st=verify     re-reads the staged image and checks its CRC.
+ *   PUT ?st=activate   writes the activation record and resets. 5.01 unless
+ *                      built with UPG_HAVE_BOOTLOADER, see below.
+ *   GET ?info=ver      running firmware version, coap_sys_upg_ver_t.
+ *   GET ?info=sts      coap_sys_upg_state_t. After a link drop the client
+ *                      resumes from expected_offset, in any block size.
+ *
+ * img_crc is crc_xmodem() over the image. Data must arrive in order; a block
+ * past expected_offset gets 4.08, one already written is acknowledged again.
+ */
+
+/* Running firmware version, reported by GET ?info=ver */
+#define UPG_FW_VER_MAJOR        (1)
+#define UPG_FW_VER_MINOR        (0)
+#define UPG_FW_VER_REVISION     (0)
+
+/* Largest Block1 SZX accepted, 128 bytes. Bigger blocks don't fit an mbuf. */
+#define UPG_BLK_SZX_MAX         (3)
+
+/* Delay from a successful activate to the reset, so the response gets out */
+#define UPG_RESET_DELAY_MS      (1000)
+
+/*
+ * Activation record, written at UPG_FLASH_REC_OFFS. The bootloader copies a
+ * staged image with a valid record over the application and erases the
+ * record. The stock bootloader doesn't, so activating is refused with 5.01
+ * and the verified image stays staged, unless UPG_HAVE_BOOTLOADER is defined
+ * for a board whose bootloader does.
+ */
+#define UPG_REC_MAGIC           (0x55504731)    /* "UPG1" */
+
+struct upg_rec {
+    uint32_t magic;
+    uint32_t img_len;
+    uint16_t img_crc;
+    uint16_t flags;
+    coap_upg_ver_t ver;
+    uint32_t device_type;
+};
+
+/**
+ * @brief Handle /system/upg, it is the iterator past "upg"
+ */
+error_t crsystem_upg(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp,
+        void *it);
+
+/**
+ * @brief Reset into the new image once activated
+ *
+ * Called from coap_s_run() while no request is waiting.
+ */
+void coap_upg_run(void);
+
+#endif /* INC_COAPUPG_H */
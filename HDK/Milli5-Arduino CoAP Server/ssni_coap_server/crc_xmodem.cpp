@@ -212,3 +212,33 @@ crc_dnp(const uint8_t *data, int len)
 }
 
 
+/* Bits of a nibble reversed, for crc_mbus() */
+static const uint8_t rev_nibble[16] = {
+        0x0,0x8,0x4,0xc,0x2,0xa,0x6,0xe,0x1,0x9,0x5,0xd,0x3,0xb,0x7,0xf
+};
+#define REV8(b)     ((uint8_t)((rev_nibble[(b) & 0xF] << 4) | rev_nibble[(b) >> 4]))
+
+uint16_t
+crc_mbus_init(void)
+{
+    return 0;
+}
+
+uint16_t
+crc_mbus(uint16_t crc, const void *addr_v, unsigned int len)
+{
+    const uint8_t *addr = (const uint8_t *)addr_v;
+    uint8_t ch;
+
+    while (len--) {
+        ch = *addr++;
+        crc = crc >> 8 ^ dnp_crctable[(crc ^ REV8(ch)) & 0xFF];
+    }
+    return crc;
+}
+
+uint16_t
+crc_mbus_final(uint16_t crc)
+{
+    return ~((REV8(crc & 0xFF) << 8) | REV8(crc >> 8));
+}
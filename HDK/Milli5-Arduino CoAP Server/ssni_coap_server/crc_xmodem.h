@@ -50,4 +50,15 @@ int crc16_validate(const void *addr_v, unsigned int len);
 /* CRC-DNP implementation for dnp3/m-bus */
 uint16_t crc_dnp(const uint8_t *data, int len);
 
+/*
+ * CRC-16/EN-13757, over each block of a wireless M-Bus frame (EN 13757-4).
+ * Same polynomial as crc_dnp() but MSB first, so it runs on the DNP table
+ * with the bits of each byte and of the result reversed. crc_mbus() can be
+ * called a byte at a time; crc_mbus_final() gives the value sent after the
+ * block, high byte first. "123456789" gives 0xC2B7.
+ */
+uint16_t crc_mbus_init(void);
+uint16_t crc_mbus(uint16_t crc, const void *addr, unsigned int len);
+uint16_t crc_mbus_final(uint16_t crc);
+
 #endif
@@ -44,4 +44,54 @@ struct coap_stats {
 
 extern struct coap_stats coap_stats;
 
+/* Observe notification overhead, see parse_obs_batch(). */
+struct coap_obs_stats {
+    uint32_t notifications; /* Notifications sent. */
+    uint32_t readings;      /* Readings they carried. */
+    uint32_t payload_bytes; /* CoAP payload of them. */
+    uint32_t hdr_bytes;     /* CoAP header and HDLC framing of them. */
+    uint32_t hdr_per_rdg;   /* hdr_bytes per reading, in 1/100 byte. */
+};
+
+extern struct coap_obs_stats coap_obs_stats;
+
+/* Frames queued for the proxy, see coaptxq.h. */
+struct coap_txq_stats {
+    uint32_t depth;         /* Frames queued now. */
+    uint32_t max_depth;     /* Most frames queued at once. */
+    uint32_t queued;        /* Frames queued. */
+    uint32_t sent;          /* Frames acknowledged by the primary. */
+    uint32_t coalesced;     /* Notifications replaced by a newer one. */
+    uint32_t dropped;       /* Frames dropped, queue full or link down. */
+    uint32_t expired;       /* Frames dropped, never acknowledged. */
+};
+
+extern struct coap_txq_stats coap_txq_stats;
+
+/* mbuf use, see hbuf.h. */
+struct coap_mbuf_stats {
+    uint32_t size;          /* Bytes of one mbuf, header and data. */
+    uint32_t in_use;        /* mbufs allocated now. */
+    uint32_t peak;          /* Most mbufs allocated at once. */
+    uint32_t allocs;        /* mbufs allocated. */
+    uint32_t frees;         /* mbufs freed. */
+    uint32_t pool;          /* mbufs in the pool. */
+    uint32_t fails;         /* m_get() with the pool empty. */
+};
+
+extern struct coap_mbuf_stats coap_mbuf_stats;
+
+/* Requests served per coap_s_run() call, i.e. per burst. */
+struct coap_s_run_stats {
+    uint32_t bursts;        /* Calls that served at least one request. */
+    uint32_t requests;      /* Requests served. */
+    uint32_t last_burst;    /* Requests served by the last burst. */
+    uint32_t max_burst;
+    uint32_t last_ms;       /* Time taken by the last burst. */
+    uint32_t max_ms;
+    uint32_t over_budget;   /* Bursts that left frames for the next call. */
+};
+
+extern struct coap_s_run_stats coap_s_run_stats;
+
 #endif
@@ -40,14 +40,42 @@ Networks, Inc.
 
 #include <assert.h>
 #include "hbuf.h"
+#include "exp_coap.h"
+#include "ram.h"
 
 int malloc_cnt;
 int free_cnt;
 
+struct coap_mbuf_stats coap_mbuf_stats;
+
+/*
+ * mbufs come from a static pool rather than the heap, see ram.h. Each
+ * entry is an mbuf header and the largest info field.
+ */
+#define MBUF_ALIGN      (sizeof(void *))
+#define MBUF_LEN        ((sizeof(struct mbuf) + RAM_INFO_LEN_MAX + MBUF_ALIGN - 1) & \
+                         ~(MBUF_ALIGN - 1))
+
+static union {
+    struct mbuf m;
+    uint8_t     b[MBUF_LEN];
+} mbuf_pool[RAM_MBUFS];
+static uint8_t mbuf_used[RAM_MBUFS];
+
+RAM_ASSERT(sizeof(mbuf_pool) <= RAM_SHARE_MBUF);
+RAM_ASSERT(RAM_SHARE_MBUF + RAM_SHARE_HDLC + RAM_SHARE_OBS + RAM_SHARE_TXQ +
+           RAM_SHARE_LOG + RAM_SHARE_COAP <= RAM_BUDGET);
+
 // Set the size of the mbuf data buffer
 static int mbuf_data_buf_size = 0;
 void set_mbuf_data_size( int buf_size )
 {
+	// The pool's buffers hold up to RAM_INFO_LEN_MAX
+	if ( buf_size > RAM_INFO_LEN_MAX )
+	{
+		buf_size = RAM_INFO_LEN_MAX;
+	}
+
 	// Get the size of the mbuf data buffer
 	mbuf_data_buf_size = buf_size;
 	
@@ -66,21 +94,47 @@ int get_mbuf_data_size()
 struct mbuf * m_get()
 {
     struct mbuf *m;
-	int mbuf_size = sizeof(*m) + mbuf_data_buf_size;
-	SerialUSB.print("Allocating mbuf with size: "); SerialUSB.println(mbuf_size);
-    m = (struct mbuf *) malloc(mbuf_size);
-    assert(m);
+    int i;
+
+    for (i = 0; i < RAM_MBUFS && mbuf_used[i]; i++) {
+    }
+    if (i == RAM_MBUFS) {
+        coap_mbuf_stats.fails++;
+        return NULL;
+    }
+    mbuf_used[i] = 1;
+    m = &mbuf_pool[i].m;
     m->len = 0;
     m->size = mbuf_data_buf_size;
+    m->data = m->buf;
     malloc_cnt++;
+
+    coap_mbuf_stats.size = MBUF_LEN;
+    coap_mbuf_stats.pool = RAM_MBUFS;
+    coap_mbuf_stats.allocs++;
+    if (++coap_mbuf_stats.in_use > coap_mbuf_stats.peak) {
+        coap_mbuf_stats.peak = coap_mbuf_stats.in_use;
+    }
     return m;
 }
 
 void
 m_free(struct mbuf *m)
 {
-    free(m);
+    int i;
+
+    if (!m) {
+        return;
+    }
+    i = (uint8_t *)m - mbuf_pool[0].b;
+    assert(i >= 0 && i % MBUF_LEN == 0 && i / MBUF_LEN < RAM_MBUFS);
+    i /= MBUF_LEN;
+    assert(mbuf_used[i]);
+    mbuf_used[i] = 0;
     free_cnt++;
+
+    coap_mbuf_stats.frees++;
+    coap_mbuf_stats.in_use--;
 }
 
 
@@ -93,6 +147,7 @@ m_dup(struct mbuf *m)
     if (n) {
         memcpy(n, m, sizeof(*m) + mbuf_data_buf_size);
         n->len = m->len;
+        n->data = n->buf + M_LEADINGSPACE(m);
     }
 
     return n;
@@ -100,16 +155,36 @@ m_dup(struct mbuf *m)
 }
 
 
+void
+m_reserve(struct mbuf *m, int len)
+{
+    /* only meaningful before any data has been added */
+    if (m->len || len > m->size) {
+        return;
+    }
+
+    m->data = m->buf + len;
+}
+
+
 struct mbuf *
 m_prepend(struct mbuf *m, int len)
 {
 
+    if (M_LEADINGSPACE(m) >= len) {
+        /* headroom reserved - header goes in front, data stays put */
+        m->data -= len;
+        m->len += len;
+        return m;
+    }
+
     if (m->len + len > mbuf_data_buf_size) {
         return NULL;
     }
 
     /* make space at the top of the buffer */
-    memmove(m->data + len, m->data, m->len);
+    memmove(m->buf + len, m->data, m->len);
+    m->data = m->buf;
     m->len += len;
 
     return m;
@@ -124,6 +199,12 @@ m_append(struct mbuf *m, int16_t len)
         return NULL;
     }
 
+    if (M_TRAILINGSPACE(m) < len) {
+        /* give up the headroom rather than fail */
+        memmove(m->buf, m->data, m->len);
+        m->data = m->buf;
+    }
+
     d = m->data + m->len;
     m->len += len;
     
@@ -163,9 +244,9 @@ m_adj(struct mbuf *mp, int req_len)
     }
 
     if (req_len >= 0) {
-        /* Trim from head. */
+        /* Trim from head, the trimmed bytes become headroom. */
         mp->len -= req_len;
-        memmove(mp->data, &(mp->data[req_len]), mp->len);
+        mp->data += req_len;
     } else {
         /* Trim from tail. */
         mp->len += req_len;
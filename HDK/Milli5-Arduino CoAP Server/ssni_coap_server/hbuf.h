@@ -40,7 +40,8 @@ Networks, Inc.
 struct mbuf {
     uint16_t len;
     uint16_t size;
-    uint8_t data[0];    /* allocated to actual size */
+    uint8_t *data;      /* start of valid data, inside buf[] */
+    uint8_t buf[0];     /* allocated to actual size */
 };
 
 typedef struct mbuf * mbuf_ptr_t;
@@ -97,6 +98,18 @@ void *m_append(struct mbuf *mp, int16_t len);
  */
 struct mbuf *m_prepend(struct mbuf *m, int len);
 
+/**
+ * @brief Reserve headroom in an empty mbuf
+ *
+ * A later m_prepend() of up to len bytes is then satisfied in place, without
+ * moving the data appended in the meantime.
+ *
+ * @param[in] m Pointer to the mbuf
+ * @param[in] len Number of bytes of headroom to leave
+ *
+ */
+void m_reserve(struct mbuf *m, int len);
+
 /**
  * @brief Duplicate the mbuf
  *
@@ -112,7 +125,8 @@ void m_adj(struct mbuf *mp, int req_len);
 /* Compatibility macros for full mbuf - use only these to access mbuf */
 #define m_gethdr()  m_get()
 #define MGETHDR(m) (m = m_gethdr())
-#define M_TRAILINGSPACE(m) (MLEN - (m)->len)
+#define M_LEADINGSPACE(m)  ((m)->data - (m)->buf)
+#define M_TRAILINGSPACE(m) ((m)->size - M_LEADINGSPACE(m) - (m)->len)
 #define m_pktlen    len
 #define m_data      data
  /* mtod(m, t)   -- Convert mbuf pointer to data pointer of correct type. */
@@ -51,6 +51,12 @@ Networks, Inc.
 #include "crc_xmodem.h"
 #include "log.h"
 #include "coapsensorobs.h"
+#include "arduino_time.h"
+#include "ram.h"
+
+#ifdef SSN_x86
+#include <unistd.h>
+#endif
 
 #define HDLC_SINGLE_BYTE_ADDR_ONLY
 
@@ -525,12 +531,8 @@ int hdlc_send_frame( const uint8_t *hdr, const uint8_t *info, int infolen )
 #define FRAME_CLOSE_FLAG    (4)
 #define FRAME_ERR_FLUSH     (5)
 
-#define HDLC_INFO_MAX   (256)
-
-
+/* The frame is parsed in place in UART_Buf */
 struct hdlcux {
-    /* store full frame, header (incl. HCS), info and FCS */
-    uint8_t h_frame[HDLC_HDR_MAX + HDLC_INFO_MAX + 2];
     uint8_t h_infoidx; /* fixed header format, this is constant */
     uint16_t h_infolen;
 };
@@ -692,16 +694,12 @@ struct hdlcu_ctx hctx;
 
 void print_hctx_state()
 {
-	char buffer[256];
-	sprintf( buffer, "hctx.hu_state: %d", hctx.hu_state );
-    dlog( LOG_INFO, buffer );
+    dlog( LOG_INFO, "hctx.hu_state: %d", hctx.hu_state );
 }
 
 void print_hctx_pend()
 {
-	char buffer[256];
-	sprintf( buffer, "hctx.hu_pend: %d", hctx.hu_pend );
-    dlog( LOG_INFO, buffer );
+    dlog( LOG_INFO, "hctx.hu_pend: %d", hctx.hu_pend );
 }
 
 #define HDLC_FRAME_BASE         (0)
@@ -713,6 +711,15 @@ void print_hctx_pend()
 
 // UART receive buffer
 uint8_t UART_Buf[UART_MAX_BUF_LEN];
+RAM_ASSERT(sizeof(UART_Buf) <= RAM_SHARE_HDLC);
+
+// Bytes read into UART_Buf, and offset of the next frame to process. A burst
+// of frames read in one go is handed out one frame per hdlc_rx() call. A
+// frame cut off by the end of a read is moved to the start of UART_Buf and
+// the next read goes after it.
+static uint16_t uart_buf_len;
+static uint16_t uart_buf_off;
+static boolean uart_buf_part;	// What's left is the start of a frame
 
 // Count the number of received frames
 static int hframerecv;
@@ -720,15 +727,47 @@ static int hframerecv;
 // Sleep for 1 ms while waiting for a frame to arrive on UART
 #define MS_SLEEP				(1)
 
+// Check if a complete frame may already be waiting in UART_Buf
+boolean hdlc_rx_pending()
+{
+	return !uart_buf_part &&
+		( uart_buf_len - uart_buf_off ) >= ( HDLC_HDR_SIZE + 2 );
+
+} // hdlc_rx_pending()
+
+// Drop whatever is left in UART_Buf
+static void hdlc_rx_flush()
+{
+	uart_buf_off = uart_buf_len;
+	uart_buf_part = false;
+
+} // hdlc_rx_flush()
+
+// Move what's left to the start of UART_Buf, the next read completes it
+static void hdlc_rx_keep()
+{
+	uart_buf_len -= uart_buf_off;
+	if ( uart_buf_len && UART_Buf[uart_buf_off] != HDLC_FLAG )
+	{
+		// Not the start of a frame
+		++hustats.hs_discard;
+		uart_buf_len = 0;
+
+	} // if
+	memmove( UART_Buf, &UART_Buf[uart_buf_off], uart_buf_len );
+	uart_buf_off = 0;
+
+	// More than a lone closing flag is a frame waiting for the rest
+	uart_buf_part = ( uart_buf_len > 1 );
+
+} // hdlc_rx_keep()
+
 // Receive an HDLC frame
 int hdlc_rx( uint8_t *hdr, uint8_t *info, int framesz, int hdlc_frame_timeout )
 {
-	char buffer[256];
     uint32_t cnt;
 	int rc;
-	boolean obs_flag;
-    float elapsed;
-	float timeout;
+	uint32_t start;
 	uint8_t * pHdr;
 	uint8_t * pPayload;
 	uint16_t rx_len = 0;
@@ -737,163 +776,367 @@ int hdlc_rx( uint8_t *hdr, uint8_t *info, int framesz, int hdlc_frame_timeout )
 
     memset( pHUX, 0x0, sizeof(hctx.hux) );
 
-	// Read UART for maximum 200 ms
-	uart.setTimeout(READ_BUF_TIMEOUT);	 
-
-	// Wait for incoming HDLC frame
-	elapsed = 0.0;
-	timeout = (float) hdlc_frame_timeout;
-	while( elapsed < timeout ) 
+	// Wait for incoming HDLC frame, unless the last read left one behind
+	if ( !hdlc_rx_pending() )
 	{
-		// Check if there is nothing at the UART
-		if (!uart.available())
+		// Keep the start of a frame the last read cut off
+		hdlc_rx_keep();
+
+		// Read UART for maximum 200 ms
+		uart.setTimeout(READ_BUF_TIMEOUT);	 
+
+		start = time_ms();
+		while( !uart.available() ) 
 		{
+			// Time-out
+			if ( (uint32_t)( time_ms() - start ) >= (uint32_t)hdlc_frame_timeout )
+			{
+				// The rest of a frame would have come by now
+				if ( uart_buf_part )
+				{
+					++hustats.hs_discard;
+
+				} // if
+				hdlc_rx_flush();
+				return 0;
+
+			} // if
+
 			// Check if it is time to send Observe response message
-			// The function call returns a flag that determines if Observe is turned on
-			obs_flag = do_observe();
+			(void)do_observe();
 			
-#if defined(ARDUINO_ARCH_SAMD)
-			if (obs_flag)
-			{
-				// The reading of the time on SAMD takes about 5.5 ms
-				// Adjust the variable accordingly
-				elapsed += 5.5;
-				continue;
-			}
-#endif
 			// Sleep for 1 ms
 			delay(MS_SLEEP);
-			elapsed++;
-			continue;
 			
-		} // if
+		} // while
 		
-		// Read the HDLC frame until time-out
-		cnt = uart.readBytes( UART_Buf, UART_MAX_BUF_LEN );
-		sprintf( buffer, "readBytes() count: %d", cnt );
-		dlog( LOG_INFO, buffer );
-		capture_dump( UART_Buf, cnt );
+		// Read the HDLC frame(s) until time-out, after what was kept
+		cnt = uart.readBytes( &UART_Buf[uart_buf_len], UART_MAX_BUF_LEN - uart_buf_len );
+		dlog( LOG_INFO, "readBytes() count: %d", cnt );
+		capture_dump( &UART_Buf[uart_buf_len], cnt );
 		
 		// Check if we received more bytes than there is space for in the receive buffer
-		if ( cnt > UART_MAX_BUF_LEN )
+		if ( cnt > (uint32_t)( UART_MAX_BUF_LEN - uart_buf_len ) )
 		{
 			// This should never happen as the readBytes method above already sets the limit
 			dlog( LOG_DEBUG, "The UART receive buffer has overflown!" );
-			sprintf( buffer, "We read %d bytes and the max is %d bytes.", cnt, UART_MAX_BUF_LEN );
-			dlog( LOG_DEBUG, buffer );
+			dlog( LOG_DEBUG, "We read %d bytes and the max is %d bytes.", cnt, UART_MAX_BUF_LEN );
+			cnt = UART_MAX_BUF_LEN - uart_buf_len;
 			
 		} // if
+		uart_buf_len += cnt;
+		uart_buf_part = false;
 
-		// Check for HDLC frame delimiters
-		hctx.hu_state = HDLC_FRAME_BASE;
-		if (( UART_Buf[0] != HDLC_FLAG ) || ( UART_Buf[cnt-1] != HDLC_FLAG ))
-		{
-            ++hustats.hs_discard;  
-			dlog( LOG_DEBUG, "Missing HDLC flag(s)" );
-			return 0;
-			
-		} // if
+	} // if
+
+	/* Number of bytes left, including the frame delimiters */
+	rx_len = uart_buf_len - uart_buf_off;
+
+	// A closing flag the last read ended with, then the next frame's
+	while (( rx_len > 1 ) && ( UART_Buf[uart_buf_off] == HDLC_FLAG ) &&
+		   ( UART_Buf[uart_buf_off + 1] == HDLC_FLAG ))
+	{
+		uart_buf_off++;
+		rx_len--;
+
+	} // while
+
+	// Check for the opening HDLC frame delimiter
+	hctx.hu_state = HDLC_FRAME_BASE;
+	if (( rx_len > 0 ) && ( rx_len < HDLC_HDR_SIZE + 2 ) && ( UART_Buf[uart_buf_off] == HDLC_FLAG ))
+	{
+		// The header isn't all here yet
+		uart_buf_part = true;
+		return 0;
+
+	} // if
+	if (( rx_len < HDLC_HDR_SIZE + 2 ) || ( UART_Buf[uart_buf_off] != HDLC_FLAG ))
+	{
+		++hustats.hs_discard;  
+		dlog( LOG_DEBUG, "Missing HDLC flag(s)" );
+		hdlc_rx_flush();
+		return 0;
+		
+	} // if
+	
+	// Parse the header
+	pHdr = &UART_Buf[uart_buf_off + 1];
+	rc = hu_hdlc_parse_hdr( pHdr, HDLC_HDR_SIZE, &hctx.hu_pend );
+	if (rc) 
+	{
+		/* header parsing error - need to flush */
+		hctx.hu_state = HDLC_FRAME_ERR_FLUSH;
+		dlog( LOG_DEBUG, "Bad hdr - flush" );
+		hdlc_rx_flush();
+		return 0;
 		
-		/* Number of bytes received excluding the two frame delimiters */
-		rx_len = cnt - 2;
+	} // if
+
+	/* TODO: How should this be handled? */
+	if ( hctx.hu_pend == 2 ) 
+	{
+		dlog( LOG_DEBUG, "hctx.hu_pend == 2" );
+		hdlc_rx_flush();
+		return 0;
 		
-		// Parse the header
-		pHdr = &UART_Buf[1];
-		rc = hu_hdlc_parse_hdr( pHdr, HDLC_HDR_SIZE, &hctx.hu_pend );
-		if (rc) 
+	} // if
+
+	/* Header complete - always, working with fixed hdr size */
+	/* Payload, if any, starts after the header */
+	hctx.hu_state = HDLC_FRAME_HDR;
+	pHUX->h_infoidx = HDLC_HDR_SIZE;
+
+	// Get payload size
+	rc = hu_hdlc_parse_infolen( pHdr, HDLC_HDR_SIZE, &pHUX->h_infolen );
+	if (rc)
+	{
+		hctx.hu_state = HDLC_FRAME_ERR_FLUSH;
+		dlog( LOG_DEBUG, "bad infolen - flush" );
+		hdlc_rx_flush();
+		return 0;
+	
+	} // if
+	
+	// Check the frame fits in what was received and ends with a flag
+	frame_len = pHUX->h_infoidx + pHUX->h_infolen;
+	if (( frame_len + 2 > rx_len ) && ( frame_len + 2 <= UART_MAX_BUF_LEN ))
+	{
+		// The rest of it comes with the next read
+		dlog( LOG_DEBUG, "Frame split over reads, %d of %d bytes", rx_len, frame_len + 2 );
+		uart_buf_part = true;
+		return 0;
+
+	} // if
+	if (( frame_len + 2 > rx_len ) || ( pHdr[frame_len] != HDLC_FLAG ))
+	{
+		dlog( LOG_DEBUG, "The frame length doesn't match the number of received bytes" );
+		print("frame_len: ");	printnum(frame_len);	println("");
+		print("rx_len:    ");	printnum(rx_len - 2);	println("");
+		hdlc_rx_flush();
+		return 0;
+		
+	} // if
+
+	// Consume the frame. The closing flag may also open the next frame.
+	uart_buf_off += frame_len + 1;
+	if (( uart_buf_off + 1 < uart_buf_len ) && ( UART_Buf[uart_buf_off + 1] == HDLC_FLAG ))
+	{
+		uart_buf_off++;
+
+	} // if
+
+	// CRC check
+	if ( crc16_validate( pHdr, frame_len )) 
+	{
+		dlog( LOG_DEBUG, "Discard frame - CRC error" );
+		return 0;
+	}
+	
+	/* Return header */
+	memcpy( hdr, pHdr, HDLC_HDR_SIZE );
+
+	// Check for payload
+	if (pHUX->h_infolen) 
+	{
+		/* If the payload is present, it can't be zero bytes */
+		if ( pHUX->h_infolen <= HDLC_CRC_SIZE ) 
 		{
-			/* header parsing error - need to flush */
-			hctx.hu_state = HDLC_FRAME_ERR_FLUSH;
-			dlog( LOG_DEBUG, "Bad hdr - flush" );
+			/* Invalid payload size */
+			dlog( LOG_DEBUG, "Discard frame - bad info len" );
 			return 0;
 			
 		} // if
 
-		/* TODO: How should this be handled? */
-		if ( hctx.hu_pend == 2 ) 
+		/* Check if payload is greater than the maximum allowed */
+		rx_len = pHUX->h_infolen - HDLC_CRC_SIZE;
+		if ( rx_len > max_payload_size )
 		{
-			dlog( LOG_DEBUG, "hctx.hu_pend == 2" );
+			dlog( LOG_DEBUG, "The HDLC payload is too large!" );
+			dlog( LOG_DEBUG, "We got %d bytes and the max is %d bytes.", rx_len, max_payload_size );
 			return 0;
 			
 		} // if
 
-		/* Header complete - always, working with fixed hdr size */
-		/* Payload, if any, starts after the header */
-		hctx.hu_state = HDLC_FRAME_HDR;
-		pHUX->h_infoidx = HDLC_HDR_SIZE;
+		// Return payload
+		pPayload = pHdr + HDLC_HDR_SIZE;
+		memcpy( info, pPayload, rx_len );
+		hctx.hu_state = HDLC_FRAME_INFO;
+	}
+	else 
+	{
+		dlog( LOG_DEBUG, "Zero infolen" );
+		
+	} // if-else
+
+	// Increment the receive frame counter
+	hframerecv++;
+	log_msg( "HDLC recv frame", pHdr, frame_len, 1 );
+	return 1;
+	
+} // hdlc_rx()
+
+#ifdef SSN_x86
+
+// Build an I frame with len bytes of val as payload, flags at both ends
+static int hdlc_test_frame( uint8_t ns, uint8_t val, int len, uint8_t *f )
+{
+	uint8_t hdr[HDLC_HDR_MAX];
+	uint8_t *info;
+	int hdrlen;
+
+	if ( hdlc_hdr( 0, hdlc_control_i( 0, ns, 0 ), hdlc_addr_encode( 1 ),
+				   hdlc_addr_encode( 1 ), hdr, &hdrlen ))
+	{
+		return 0;
+
+	} // if
+	info = &f[1 + hdrlen];
+	memset( info, val, len );
+	if ( hdlc_frm_add_info( hdr, &f[1], info, len, &info[len] ))
+	{
+		return 0;
+
+	} // if
+	f[0] = HDLC_FLAG;
+	info[len + HDLC_CRC_SIZE] = HDLC_FLAG;
+	return 1 + hdrlen + len + HDLC_CRC_SIZE + 1;
+
+} // hdlc_test_frame()
 
-		// Get payload size
-		rc = hu_hdlc_parse_infolen( pHdr, HDLC_HDR_SIZE, &pHUX->h_infolen );
-		if (rc)
+// Check hdlc_rx() gives back a frame with len bytes of val, or nothing if len is 0
+static int hdlc_test_get( uint8_t val, int len )
+{
+	uint8_t hdr[HDLC_HDR_SIZE];
+	uint8_t info[MNIC_MAX_PAYLOAD_SIZE];
+	int rc;
+	int i;
+
+	rc = hdlc_rx( hdr, info, sizeof(info), 50 );
+	if ( !len )
+	{
+		return rc != 0;
+
+	} // if
+	if ( rc != 1 )
+	{
+		return 1;
+
+	} // if
+	for ( i = 0; i < len; i++ )
+	{
+		if ( info[i] != val )
 		{
-			hctx.hu_state = HDLC_FRAME_ERR_FLUSH;
-			dlog( LOG_DEBUG, "bad infolen - flush" );
-		
+			return 1;
+
 		} // if
-		
-		// Check if the frame length equals the number of received bytes
-		frame_len = pHUX->h_infoidx + pHUX->h_infolen;
-		if ( frame_len != rx_len )
+
+	} // for
+	return 0;
+
+} // hdlc_test_get()
+
+/*
+ * hdlc_rx() on a pipe. A burst longer than UART_Buf cuts one frame in its
+ * header and a later one in its payload, each must come out whole from the
+ * next read. A frame whose rest never comes is dropped once the wait times
+ * out. 0 if it passes.
+ */
+int hdlc_test_rx_split( void )
+{
+	// Payload sizes, a 100 byte frame is 111 bytes and a 1 byte one 12:
+	// 4 * 111 + 7 * 12 leaves 4 bytes of the 12th frame's header in the
+	// first 532 byte read, and the 17th frame is cut 76 bytes in
+	static const uint8_t size[] = {
+		100, 100, 100, 100, 1, 1, 1, 1, 1, 1, 1, 1,
+		100, 100, 100, 100, 100, 1
+	};
+	static uint8_t burst[sizeof(size) * ( 1 + HDLC_HDR_MAX + 100 + HDLC_CRC_SIZE + 1 )];
+	HardwareSerial pipe_uart;
+	HardwareSerial *save_pU = pU;
+	uint32_t save_max = max_payload_size;
+	uint32_t discard;
+	uint8_t f[1 + HDLC_HDR_MAX + 1 + HDLC_CRC_SIZE + 1];
+	int p[2];
+	int n = 0;
+	int len;
+	int i;
+	int rc = 1;
+
+	for ( i = 0; i < (int)sizeof(size); i++ )
+	{
+		len = hdlc_test_frame( i, 0x10 + i, size[i], &burst[n] );
+		if ( !len )
 		{
-			dlog( LOG_DEBUG, "The frame length doesn't match the number of received bytes" );
-			print("frame_len: ");	printnum(frame_len);	println("");
-			print("rx_len:    ");	printnum(rx_len);		println("");
-			return 0;
-			
+			return 1;
+
 		} // if
+		n += len;
+
+	} // for
+	if (( n <= UART_MAX_BUF_LEN ) || ( hdlc_test_frame( 0, 0x55, 1, f ) != sizeof(f) ) ||
+		pipe( p ))
+	{
+		return 1;
 
-		// CRC check
-		if ( crc16_validate( pHdr, frame_len )) 
+	} // if
+	pipe_uart.attach( p[0] );
+	pU = &pipe_uart;
+	max_payload_size = MNIC_MAX_PAYLOAD_SIZE;
+	hdlc_rx_flush();
+
+	do
+	{
+		// Every frame of the burst, in order
+		if ( write( p[1], burst, n ) != n )
 		{
-			dlog( LOG_DEBUG, "Discard frame - CRC error" );
-			return 0;
-		}
-		
-		/* Return header */
-		memcpy( hdr, pHdr, HDLC_HDR_SIZE );
+			break;
 
-		// Check for payload
-		if (pHUX->h_infolen) 
+		} // if
+		for ( i = 0; i < (int)sizeof(size); i++ )
 		{
-			/* If the payload is present, it can't be zero bytes */
-			if ( pHUX->h_infolen <= HDLC_CRC_SIZE ) 
+			// The frames cut off take one more call
+			do
 			{
-				/* Invalid payload size */
-				dlog( LOG_DEBUG, "Discard frame - bad info len" );
-				return 0;
-				
-			} // if
+				rc = hdlc_test_get( 0x10 + i, size[i] );
 
-			/* Check if payload is greater than the maximum allowed */
-			rx_len = pHUX->h_infolen - HDLC_CRC_SIZE;
-			if ( rx_len > max_payload_size )
+			} while ( rc && uart_buf_part );
+			if ( rc )
 			{
-				dlog( LOG_DEBUG, "The HDLC payload is too large!" );
-				sprintf( buffer, "We got %d bytes and the max is %d bytes.", rx_len, max_payload_size );
-				dlog( LOG_DEBUG, buffer );
-				return 0;
-				
+				break;
+
 			} // if
 
-			// Return payload
-			pPayload = pHdr + HDLC_HDR_SIZE;
-			memcpy( info, pPayload, rx_len );
-			hctx.hu_state = HDLC_FRAME_INFO;
-		}
-		else 
+		} // for
+		rc = 1;
+		if (( i < (int)sizeof(size) ) || hdlc_test_get( 0, 0 ))
 		{
-			dlog( LOG_DEBUG, "Zero infolen" );
-			
-		} // if-else
+			break;
 
-		// Increment the receive frame counter
-		hframerecv++;
-		log_msg( "HDLC recv frame", pHdr, frame_len, 1 );
-		return 1;
+		} // if
 
-    } // while
+		// A frame cut off for good is dropped once the wait times out,
+		// without getting in the way of the next one
+		discard = hustats.hs_discard;
+		if (( write( p[1], f, 9 ) != 9 ) ||
+			hdlc_test_get( 0, 0 ) || !uart_buf_part || hdlc_test_get( 0, 0 ) ||
+			( hustats.hs_discard != discard + 1 ) ||
+			( write( p[1], f, sizeof(f) ) != sizeof(f) ) ||
+			hdlc_test_get( 0x55, 1 ))
+		{
+			break;
 
-	// Time-out
-	return 0;
-	
-} // hdlc_rx()
+		} // if
+		rc = 0;
+
+	} while ( 0 );
+
+	hdlc_rx_flush();
+	pU = save_pU;
+	max_payload_size = save_max;
+	close( p[0] );
+	close( p[1] );
+	return rc;
+
+} // hdlc_test_rx_split()
+
+#endif // SSN_x86
@@ -38,9 +38,6 @@ Networks, Inc.
 /* The UART time-out period in milliseconds */
 #define READ_BUF_TIMEOUT		400
 
-/* The maximum number of bytes we can receive in one chunk over the UART */
-#define UART_MAX_BUF_LEN		1024
-
 /* The max payload size in the mNIC */
 #define MNIC_MAX_PAYLOAD_SIZE	255
 
@@ -52,6 +49,15 @@ Networks, Inc.
 #define HDLC_HDR_MAX        	HDLC_HDR_SIZE
 #define HDLC_CRC_SIZE			(2)
 
+/* A frame on the line: flag, header, info, FCS and flag */
+#define HDLC_FRAME_MAX			(1 + HDLC_HDR_SIZE + MNIC_MAX_PAYLOAD_SIZE + HDLC_CRC_SIZE + 1)
+
+/*
+ * The maximum number of bytes we can receive in one chunk over the UART.
+ * The primary waits for a reply to each frame, so two frames is plenty.
+ */
+#define UART_MAX_BUF_LEN		(2 * HDLC_FRAME_MAX)
+
 
 /* Supported frame types */
 #define HDLC_I      (1)
@@ -213,6 +219,7 @@ const struct hdlc_profile* hdlc_profile_get(void);
 int hdlc_test_control(void);
 int hdlc_test_frame_encode(void);
 int hdlc_test_rsp_ua(void);
+int hdlc_test_rx_split(void);
 #endif
 
 /* Used by standard STAT functions - use only 32 bit values */
@@ -256,6 +263,9 @@ struct hdlcstat {
 int hdlc_recv_frame(uint8_t *hdr, uint8_t *info, int framesz, int timeout);
 int hdlc_rx(uint8_t *hdr, uint8_t *info, int framesz, int timeout);
 
+/* Check if the last UART read left another complete frame behind */
+boolean hdlc_rx_pending();
+
 int hdlc_send_frame(const uint8_t *hdr, const uint8_t *info, int infolen);
 
 int
@@ -0,0 +1,858 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "hdlc.h"
+#include "hdlcp.h"
+
+#if defined(SSN_x86)
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "bufutil.h"
+#include "crc_xmodem.h"
+#include "log.h"
+
+#define INCM8(i)    ((i + 1) & 0x07)
+
+/* Flag, header, info, FCS and closing flag of the largest frame */
+#define HDLCP_FRAME_MAX     (1 + HDLC_HDR_MAX + MNIC_MAX_PAYLOAD_SIZE + \
+                             HDLC_CRC_SIZE + 1)
+
+/* Bits on the wire per byte, 8N1 */
+#define HDLCP_BITS_PER_BYTE (10)
+
+struct hdlc_conn {
+    int         used;
+    int         fd;
+    uint8_t     esrc;           /* encoded addresses */
+    uint8_t     edst;
+    int         connected;
+
+    uint8_t     vs;
+    uint8_t     vr;
+
+    struct hdlcp_cfg        cfg;
+    struct hdlc_snrm_params hsp;    /* negotiated in SNRM/UA */
+
+    uint64_t    line_us;        /* when the last byte clears the line */
+
+    /* Bytes read from fd that don't form a complete frame yet */
+    uint8_t     rbuf[2 * HDLCP_FRAME_MAX];
+    int         rlen;
+
+    /* Info of an I frame received before the caller asked for it */
+    uint8_t     data[MNIC_MAX_PAYLOAD_SIZE];
+    int         dlen;
+    int         dvalid;
+
+    struct hdlcstat st;
+};
+
+static struct hdlc_conn hconn[HDLCP_MAX_CONN];
+
+static struct hdlcp_cfg hcfg = {
+    0, 2000, 3, MNIC_MAX_PAYLOAD_SIZE
+};
+
+/* A received frame */
+struct hdlcp_frm {
+    struct hdlc_hdr_fields  hh;
+    struct hdlc_ctrl        hc;
+    uint8_t     info[MNIC_MAX_PAYLOAD_SIZE];
+};
+
+
+void
+hdlcp_init(const struct hdlcp_cfg *cfg)
+{
+    hcfg = *cfg;
+    if (hcfg.max_info == 0 || hcfg.max_info > MNIC_MAX_PAYLOAD_SIZE) {
+        hcfg.max_info = MNIC_MAX_PAYLOAD_SIZE;
+    }
+    if (hcfg.max_retry == 0) {
+        hcfg.max_retry = 1;
+    }
+}
+
+const struct hdlcstat *
+hdlcp_stats(const struct hdlc_conn *conn)
+{
+    return &conn->st;
+}
+
+uint32_t
+hdlcp_max_info(const struct hdlc_conn *conn)
+{
+    return conn->hsp.max_info_tx;
+}
+
+
+static uint64_t
+hdlcp_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Hold the caller until n more bytes would have crossed the line at the
+ * configured rate. A pty moves a frame at once, this makes it take as long
+ * as on the mNIC UART. Both directions share the clock, the window 1 link
+ * is half duplex in practice.
+ */
+static void
+hdlcp_pace(struct hdlc_conn *conn, int n)
+{
+    uint64_t now, wire;
+    struct timespec ts;
+
+    if (!conn->cfg.baud) {
+        return;
+    }
+    now = hdlcp_now_us();
+    wire = (uint64_t)n * HDLCP_BITS_PER_BYTE * 1000000 / conn->cfg.baud;
+    if (conn->line_us < now) {
+        conn->line_us = now;
+    }
+    conn->line_us += wire;
+    if (conn->line_us > now) {
+        ts.tv_sec = (conn->line_us - now) / 1000000;
+        ts.tv_nsec = ((conn->line_us - now) % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) && errno == EINTR) {
+        }
+    }
+}
+
+static int
+hdlcp_write(int fd, const uint8_t *b, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = write(fd, b, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        b += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Send one frame with an optional info field */
+static int
+hdlcp_send(struct hdlc_conn *conn, int16_t control, const void *info,
+           int infolen)
+{
+    uint8_t f[HDLCP_FRAME_MAX];
+    uint8_t hdr[HDLC_HDR_MAX];
+    int hdrlen, n = 0;
+
+    if (infolen > MNIC_MAX_PAYLOAD_SIZE) {
+        return HDLC_ERROR_SEND_FRAME;
+    }
+    if (hdlc_hdr(0, control, conn->edst, conn->esrc, hdr, &hdrlen)) {
+        ++conn->st.send_bad_hdr;
+        return HDLC_ERROR_HDR;
+    }
+
+    f[n++] = HDLC_FLAG;
+    if (info && infolen > 0) {
+        hdlc_frm_add_info(hdr, f + n, (const uint8_t *)info, infolen,
+                          f + n + hdrlen + infolen);
+        n += hdrlen;
+        memcpy(f + n, info, infolen);
+        n += infolen + HDLC_CRC_SIZE;
+    } else {
+        memcpy(f + n, hdr, hdrlen);
+        n += hdrlen;
+    }
+    f[n++] = HDLC_FLAG;
+
+    ddump(LOG_DEBUG, "HDLC send frame", f, n);
+    if (hdlcp_write(conn->fd, f, n)) {
+        ++conn->st.frame_send_err;
+        return HDLC_ERROR_SEND_FRAME;
+    }
+    hdlcp_pace(conn, n);
+    return 0;
+}
+
+/*
+ * Take a complete frame off the front of rbuf.
+ *
+ * Returns 1 when fr holds a frame, 0 if more bytes are needed. Bytes that
+ * can't start a valid frame are dropped as they're found.
+ */
+static int
+hdlcp_frame(struct hdlc_conn *conn, struct hdlcp_frm *fr)
+{
+    int i, rc, flen;
+
+    for (;;) {
+        /* Sync on a flag, a run of flags opens with the last one */
+        for (i = 0; i < conn->rlen; i++) {
+            if (conn->rbuf[i] == HDLC_FLAG &&
+                (i + 1 == conn->rlen || conn->rbuf[i + 1] != HDLC_FLAG)) {
+                break;
+            }
+        }
+        if (i) {
+            memmove(conn->rbuf, conn->rbuf + i, conn->rlen - i);
+            conn->rlen -= i;
+        }
+        if (conn->rlen < 1 + HDLC_HDR_SIZE) {
+            return 0;
+        }
+
+        rc = hdlc_parse_hdr(&fr->hh, conn->rbuf + 1, conn->rlen - 1);
+        if (rc == HDLC_PARSE_SHORT) {
+            return 0;
+        }
+        flen = fr->hh.framelen;
+        if (rc == 0 && flen < fr->hh.hdrlen) {
+            rc = HDLC_PARSE_HDR_ERR;
+        }
+        if (rc == 0 && 1 + flen + 1 > (int)sizeof(conn->rbuf)) {
+            ++conn->st.recv_large_frame_dropped;
+            rc = HDLC_PARSE_HDR_ERR;
+        }
+        if (rc == 0 && conn->rlen < 1 + flen + 1) {
+            return 0;
+        }
+        if (rc == 0 && conn->rbuf[1 + flen] != HDLC_FLAG) {
+            rc = HDLC_PARSE_HDR_ERR;
+        }
+        if (rc) {
+            /* Not a frame, look for the next flag */
+            ++conn->st.recv_hdr_err;
+            conn->rbuf[0] = 0;
+            continue;
+        }
+
+        ddump(LOG_DEBUG, "HDLC recv frame", conn->rbuf, flen + 2);
+        hdlcp_pace(conn, flen + 2);
+
+        /* The closing flag stays, it may open the next frame */
+        rc = 1;
+        if (fr->hh.infolen) {
+            if (crc16_validate(conn->rbuf + 1, flen)) {
+                ++conn->st.recv_fcs_err;
+                rc = 0;
+            } else if (fr->hh.infolen > MNIC_MAX_PAYLOAD_SIZE) {
+                ++conn->st.recv_large_frame_dropped;
+                rc = 0;
+            } else {
+                memcpy(fr->info, conn->rbuf + 1 + fr->hh.hdrlen,
+                       fr->hh.infolen);
+            }
+        }
+        if (rc && hdlc_parse_control(fr->hh.control, &fr->hc)) {
+            ++conn->st.recv_ss_error;
+            rc = 0;
+        }
+        memmove(conn->rbuf, conn->rbuf + 1 + flen, conn->rlen - 1 - flen);
+        conn->rlen -= 1 + flen;
+        if (rc) {
+            return 1;
+        }
+    }
+}
+
+/*
+ * Wait up to timeout_ms for the next frame.
+ *
+ * Returns 0 with the frame in fr, HDLC_ERROR_RECV_FRAME on timeout.
+ */
+static int
+hdlcp_recv(struct hdlc_conn *conn, struct hdlcp_frm *fr, uint32_t timeout_ms)
+{
+    uint64_t end = hdlcp_now_us() + (uint64_t)timeout_ms * 1000;
+    struct pollfd pfd;
+    uint64_t now;
+    int n;
+
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        if (hdlcp_frame(conn, fr)) {
+            return 0;
+        }
+        if (conn->rlen == (int)sizeof(conn->rbuf)) {
+            /* Can't be a frame - start over */
+            ++conn->st.drop;
+            conn->rlen = 0;
+        }
+        now = hdlcp_now_us();
+        if (now >= end) {
+            break;
+        }
+        n = poll(&pfd, 1, (int)((end - now + 999) / 1000));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        n = read(conn->fd, conn->rbuf + conn->rlen,
+                 sizeof(conn->rbuf) - conn->rlen);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            /* pty with no secondary attached yet, or the device is gone */
+            poll(NULL, 0, 10);
+            continue;
+        }
+        conn->rlen += n;
+    }
+    ++conn->st.recv_frame_timeout;
+    return HDLC_ERROR_RECV_FRAME;
+}
+
+/* Keep the info of an I frame for the next read */
+static void
+hdlcp_keep(struct hdlc_conn *conn, const struct hdlcp_frm *fr)
+{
+    if (conn->dvalid) {
+        ++conn->st.data_buf_overrun;
+    }
+    memcpy(conn->data, fr->info, fr->hh.infolen);
+    conn->dlen = fr->hh.infolen;
+    conn->dvalid = 1;
+}
+
+/*
+ * Account for an I frame from the secondary. Its data is kept if it's the
+ * one expected next, a repeat of one already received means our
+ * acknowledgement got lost and it is dropped.
+ */
+static void
+hdlcp_recv_i(struct hdlc_conn *conn, const struct hdlcp_frm *fr)
+{
+    ++conn->st.recv_i;
+    if (fr->hc.ns != conn->vr) {
+        dlog(LOG_INFO, "Repeated frame N(S) = %d  V(R) = %d",
+             fr->hc.ns, conn->vr);
+        ++conn->st.seqnum_err;
+        return;
+    }
+    conn->vr = INCM8(conn->vr);
+    hdlcp_keep(conn, fr);
+}
+
+/* Copy out kept data */
+static int
+hdlcp_take(struct hdlc_conn *conn, void *rsp, int *rsplen, int rbufsize)
+{
+    *rsplen = 0;
+    if (!conn->dvalid) {
+        return 0;
+    }
+    conn->dvalid = 0;
+    if (conn->dlen > rbufsize) {
+        ++conn->st.data_buf_overrun;
+        return HDLC_ERROR_RX_OVERRUN;
+    }
+    memcpy(rsp, conn->data, conn->dlen);
+    *rsplen = conn->dlen;
+    return 0;
+}
+
+/* Frames the secondary answers with after losing the connection */
+static int
+hdlcp_unexpected(struct hdlc_conn *conn, const struct hdlcp_frm *fr)
+{
+    if (fr->hc.type == HDLC_DM) {
+        dlog(LOG_WARNING, "Secondary in disconnected mode");
+        conn->connected = 0;
+        return HDLC_ERROR_CONNECTION;
+    }
+    if (fr->hc.type == HDLC_FRMR) {
+        dlog(LOG_WARNING, "Frame rejected by secondary");
+        return HDLC_ERROR_RSP_UNEXPECTED;
+    }
+    return 0;
+}
+
+
+int
+hdlc_get_connection(struct hdlc_conn **conn, uint32_t dst, uint32_t src, int fd)
+{
+    struct hdlc_conn *c = NULL;
+    int i;
+
+    /* Encoded they must fit hdlc_hdr()'s single address byte */
+    *conn = NULL;
+    if (hdlc_addr_encode(dst) > 0x7F || hdlc_addr_encode(src) > 0x7F ||
+        dst > 0x7F || src > 0x7F) {
+        return HDLC_ERROR_CONNECTION;
+    }
+    for (i = 0; i < HDLCP_MAX_CONN; i++) {
+        if (hconn[i].used && hconn[i].fd == fd &&
+            hconn[i].edst == hdlc_addr_encode(dst) &&
+            hconn[i].esrc == hdlc_addr_encode(src)) {
+            *conn = &hconn[i];
+            return 0;
+        }
+        if (!hconn[i].used && !c) {
+            c = &hconn[i];
+        }
+    }
+    if (!c) {
+        return HDLC_ERROR_BUSY;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->used = 1;
+    c->fd = fd;
+    c->edst = hdlc_addr_encode(dst);
+    c->esrc = hdlc_addr_encode(src);
+    c->cfg = hcfg;
+    *conn = c;
+    return 0;
+}
+
+/* Set normal response mode with SNRM, the secondary answers UA */
+static int
+hdlc_connect(struct hdlc_conn *conn)
+{
+    struct hdlc_snrm_params hsp;
+    struct hdlcp_frm fr;
+    uint8_t param[26];
+    uint32_t plen;
+    uint32_t i;
+    int rc;
+
+    conn->connected = 0;
+    memset(&conn->st, 0, sizeof(conn->st));
+
+    hsp.max_info_tx = conn->cfg.max_info;
+    hsp.max_info_rx = conn->cfg.max_info;
+    hsp.window_tx = 1;
+    hsp.window_rx = 1;
+    hdlc_fill_snrm_param(param, sizeof(param), &plen, &hsp);
+
+    for (i = 0; i < conn->cfg.max_retry; i++) {
+        if (i) {
+            ++conn->st.snrm_retry;
+        }
+        ++conn->st.send_snrm;
+        rc = hdlcp_send(conn, hdlc_control(HDLC_SNRM, 1), param, plen);
+        if (rc) {
+            return rc;
+        }
+        while (hdlcp_recv(conn, &fr, conn->cfg.rsp_timeout_ms) == 0) {
+            if (fr.hc.type != HDLC_UA) {
+                ++conn->st.snrm_rsp_retry;
+                continue;
+            }
+
+            /* Peer's view: its tx limit is our rx limit */
+            conn->hsp = hsp;
+            if (fr.hh.infolen &&
+                hdlc_parse_snrm_param(fr.info, fr.hh.infolen, &hsp) == 0) {
+                conn->hsp.max_info_tx = min(conn->hsp.max_info_tx,
+                                            hsp.max_info_tx);
+                conn->hsp.max_info_rx = min(conn->hsp.max_info_rx,
+                                            hsp.max_info_rx);
+            } else if (fr.hh.infolen) {
+                ++conn->st.snrm_rsp_err;
+            }
+            conn->vs = 0;
+            conn->vr = 0;
+            conn->dvalid = 0;
+            conn->connected = 1;
+            dlog(LOG_INFO, "Connected, max info tx %d rx %d",
+                 conn->hsp.max_info_tx, conn->hsp.max_info_rx);
+            return 0;
+        }
+    }
+    return HDLC_ERROR_CONNECTION;
+}
+
+int
+hdlc_session_connect(struct hdlc_conn **hc, int fd, const uint32_t *src,
+                     const uint32_t *dst)
+{
+    int rc;
+
+    rc = hdlc_get_connection(hc, dst ? *dst : HDLCP_ADDR_DEFAULT,
+                             src ? *src : HDLCP_ADDR_DEFAULT, fd);
+    if (rc) {
+        return rc;
+    }
+    return hdlc_connect(*hc);
+}
+
+int
+hdlc_disconnect(struct hdlc_conn *conn)
+{
+    struct hdlcp_frm fr;
+    uint32_t i;
+    int rc = HDLC_ERROR_CONNECTION;
+
+    for (i = 0; i < conn->cfg.max_retry && rc; i++) {
+        ++conn->st.send_other;
+        if (hdlcp_send(conn, hdlc_control(HDLC_DISC, 1), NULL, 0)) {
+            break;
+        }
+        while (hdlcp_recv(conn, &fr, conn->cfg.rsp_timeout_ms) == 0) {
+            if (fr.hc.type == HDLC_UA || fr.hc.type == HDLC_DM) {
+                rc = 0;
+                break;
+            }
+        }
+    }
+    conn->connected = 0;
+    conn->used = 0;
+    return rc;
+}
+
+/*
+ * Poll the secondary with RR, which also acknowledges the last I frame
+ * received. An I frame in reply is kept for the next read.
+ */
+static int
+hdlcp_poll(struct hdlc_conn *conn)
+{
+    struct hdlcp_frm fr;
+    uint32_t i;
+    int rc;
+
+    if (!conn->connected) {
+        return HDLC_ERROR_CONNECTION;
+    }
+    for (i = 0; i < conn->cfg.max_retry; i++) {
+        ++conn->st.send_rr;
+        rc = hdlcp_send(conn, hdlc_control_rr(conn->vr, 1), NULL, 0);
+        if (rc) {
+            return rc;
+        }
+        while (hdlcp_recv(conn, &fr, conn->cfg.rsp_timeout_ms) == 0) {
+            if ((rc = hdlcp_unexpected(conn, &fr))) {
+                return rc;
+            }
+            if (fr.hc.type == HDLC_RR) {
+                ++conn->st.recv_rr;
+                return 0;
+            }
+            if (fr.hc.type == HDLC_I) {
+                hdlcp_recv_i(conn, &fr);
+                if (conn->dvalid) {
+                    return 0;
+                }
+                /* A repeat, the RR sent again acknowledges it */
+                break;
+            }
+            if (fr.hc.type == HDLC_RNR) {
+                ++conn->st.recv_rnr;
+                break;
+            }
+        }
+    }
+    return HDLC_ERROR_RECV_FRAME;
+}
+
+int
+hdlc_keep_alive(struct hdlc_conn *conn)
+{
+    if (conn->dvalid) {
+        /* Read what's there first, a poll could bring more */
+        return 0;
+    }
+    return hdlcp_poll(conn);
+}
+
+int
+hdlc_listen_snrm(struct hdlc_conn *conn)
+{
+    struct hdlc_snrm_params hsp;
+    struct hdlcp_frm fr;
+    uint8_t param[26];
+    uint32_t plen, i;
+
+    for (i = 0; i < conn->cfg.max_retry; i++) {
+        if (hdlcp_recv(conn, &fr, conn->cfg.rsp_timeout_ms)) {
+            continue;
+        }
+        if (fr.hc.type != HDLC_SNRM) {
+            hdlcp_send(conn, hdlc_control(HDLC_DM, 1), NULL, 0);
+            continue;
+        }
+        hsp.max_info_tx = conn->cfg.max_info;
+        hsp.max_info_rx = conn->cfg.max_info;
+        hsp.window_tx = 1;
+        hsp.window_rx = 1;
+        conn->hsp = hsp;
+        hdlc_fill_snrm_param(param, sizeof(param), &plen, &hsp);
+        conn->vs = 0;
+        conn->vr = 0;
+        conn->connected = 1;
+        return hdlcp_send(conn, hdlc_control(HDLC_UA, 1), param, plen);
+    }
+    return HDLC_ERROR_CONNECTION;
+}
+
+int
+hdlc_data_send(struct hdlc_conn *conn, const void *req, int reqlen)
+{
+    struct hdlcp_frm fr;
+    uint32_t i;
+    int rc;
+
+    if (!conn->connected) {
+        return HDLC_ERROR_CONNECTION;
+    }
+    if (reqlen <= 0 || (uint32_t)reqlen > conn->hsp.max_info_tx) {
+        ++conn->st.send_i_err;
+        return HDLC_ERROR_EXCESS_RXLLC;
+    }
+
+    for (i = 0; i < conn->cfg.max_retry; i++) {
+        if (i) {
+            ++conn->st.send_i_recovery;
+        }
+        ++conn->st.send_i;
+        rc = hdlcp_send(conn, hdlc_control_i(conn->vr, conn->vs, 1),
+                        req, reqlen);
+        if (rc) {
+            return rc;
+        }
+        while (hdlcp_recv(conn, &fr, conn->cfg.rsp_timeout_ms) == 0) {
+            if ((rc = hdlcp_unexpected(conn, &fr))) {
+                return rc;
+            }
+            if (fr.hc.type == HDLC_I) {
+                hdlcp_recv_i(conn, &fr);
+            } else if (fr.hc.type == HDLC_RR) {
+                ++conn->st.recv_rr;
+            } else if (fr.hc.type == HDLC_RNR) {
+                ++conn->st.recv_rnr;
+                break;
+            } else {
+                continue;
+            }
+
+            if (fr.hc.nr == INCM8(conn->vs)) {
+                conn->vs = INCM8(conn->vs);
+                return 0;
+            }
+            /* Not acknowledged, the secondary didn't get it */
+            ++conn->st.seqnum_err;
+            break;
+        }
+    }
+    ++conn->st.data_txfr_abort;
+    return HDLC_ERROR_TX_RETRY;
+}
+
+int
+hdlc_data_recv(struct hdlc_conn *conn, void *rsp, int *rsplen, int rbufsize)
+{
+    int rc;
+
+    *rsplen = 0;
+    if (!conn->dvalid && (rc = hdlcp_poll(conn))) {
+        return rc;
+    }
+    return hdlcp_take(conn, rsp, rsplen, rbufsize);
+}
+
+int
+hdlc_data_txfr(struct hdlc_conn *conn, const void *req, int reqlen,
+               void *rsp, int *rsplen, int rbuflen)
+{
+    int rc;
+
+    *rsplen = 0;
+    if (conn->dvalid) {
+        /* Data nobody read is overwritten by the reply */
+        ++conn->st.data_buf_overrun;
+        conn->dvalid = 0;
+    }
+    if ((rc = hdlc_data_send(conn, req, reqlen))) {
+        return rc;
+    }
+    /* The server answers in the acknowledging I frame, or not at all */
+    return hdlcp_take(conn, rsp, rsplen, rbuflen);
+}
+
+int
+hdlc_rx(struct hdlc_conn *conn, void *rsp, int *rsplen, int rbufsize)
+{
+    struct hdlcp_frm fr;
+
+    *rsplen = 0;
+    if (!conn->dvalid &&
+        hdlcp_recv(conn, &fr, conn->cfg.rsp_timeout_ms) == 0 &&
+        fr.hc.type == HDLC_I) {
+        hdlcp_recv_i(conn, &fr);
+    }
+    return hdlcp_take(conn, rsp, rsplen, rbufsize);
+}
+
+
+/*
+ * Unit tests of the frame encoders and decoders, 0 if they pass
+ */
+
+int
+hdlc_test_control(void)
+{
+    static const uint8_t utype[] = {
+        HDLC_SNRM, HDLC_DISC, HDLC_UA, HDLC_DM, HDLC_FRMR, HDLC_UI
+    };
+    struct hdlc_ctrl hc;
+    uint8_t nr, ns, pf, i;
+
+    for (nr = 0; nr < 8; nr++) {
+        for (pf = 0; pf < 2; pf++) {
+            for (ns = 0; ns < 8; ns++) {
+                if (hdlc_parse_control(hdlc_control_i(nr, ns, pf), &hc) ||
+                    hc.type != HDLC_I || hc.nr != nr || hc.ns != ns ||
+                    hc.pf != pf) {
+                    return 1;
+                }
+            }
+            if (hdlc_parse_control(hdlc_control_rr(nr, pf), &hc) ||
+                hc.type != HDLC_RR || hc.nr != nr || hc.pf != pf) {
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < sizeof(utype); i++) {
+        for (pf = 0; pf < 2; pf++) {
+            if (hdlc_control(utype[i], pf) < 0 ||
+                hdlc_parse_control(hdlc_control(utype[i], pf), &hc) ||
+                hc.type != utype[i] || hc.pf != pf) {
+                return 1;
+            }
+        }
+    }
+    if (hdlc_control(HDLC_I, 0) >= 0) {
+        return 1;
+    }
+    return 0;
+}
+
+int
+hdlc_test_frame_encode(void)
+{
+    static const uint8_t info[] = { 0x40, 0x01, 0x12, 0x34, HDLC_FLAG };
+    struct hdlc_hdr_fields hh;
+    uint8_t f[HDLC_HDR_MAX + sizeof(info) + HDLC_CRC_SIZE];
+    uint8_t hdr[HDLC_HDR_MAX];
+    int hdrlen;
+
+    /* Header only */
+    if (hdlc_hdr(0, hdlc_control_rr(3, 1), hdlc_addr_encode(1),
+                 hdlc_addr_encode(2), hdr, &hdrlen) ||
+        hdrlen != HDLC_HDR_SIZE ||
+        hdlc_parse_hdr(&hh, hdr, hdrlen) || hh.infolen != 0 ||
+        hh.framelen != HDLC_HDR_SIZE || hh.dst != hdlc_addr_encode(1) ||
+        hh.src != hdlc_addr_encode(2) || hh.control != hdlc_control_rr(3, 1)) {
+        return 1;
+    }
+
+    /* With info, header and frame check sequences must both hold */
+    if (hdlc_frm_add_info(hdr, f, info, sizeof(info), f + hdrlen + sizeof(info))) {
+        return 1;
+    }
+    memcpy(f + hdrlen, info, sizeof(info));
+    if (hdlc_parse_hdr(&hh, f, sizeof(f)) ||
+        hh.infolen != (int)sizeof(info) || hh.framelen != (int)sizeof(f) ||
+        crc16_validate(f, sizeof(f))) {
+        return 1;
+    }
+    f[hdrlen + 1] ^= 0x01;
+    if (!crc16_validate(f, sizeof(f))) {
+        return 1;
+    }
+
+    /* Addresses are single byte, an invalid control is refused */
+    if (!hdlc_hdr(0, 0, 0x80, 1, hdr, &hdrlen) ||
+        !hdlc_hdr(0, hdlc_control(HDLC_I, 0), 1, 1, hdr, &hdrlen)) {
+        return 1;
+    }
+    return 0;
+}
+
+int
+hdlc_test_rsp_ua(void)
+{
+    struct hdlc_snrm_params hsp, psp;
+    struct hdlc_hdr_fields hh;
+    struct hdlc_ctrl hc;
+    uint8_t hdr[HDLC_HDR_MAX];
+    uint8_t f[HDLC_HDR_MAX + 26 + HDLC_CRC_SIZE];
+    uint8_t param[26];
+    uint32_t plen;
+    int hdrlen;
+
+    /* The UA hdlcs sends in answer to SNRM */
+    hsp.max_info_tx = 128;
+    hsp.max_info_rx = 64;
+    hsp.window_tx = 1;
+    hsp.window_rx = 1;
+    if (hdlc_hdr(0, hdlc_control(HDLC_UA, 1), hdlc_addr_encode(1),
+                 hdlc_addr_encode(1), hdr, &hdrlen) ||
+        hdlc_fill_snrm_param(param, sizeof(param), &plen, &hsp) ||
+        hdlc_frm_add_info(hdr, f, param, plen, f + hdrlen + plen)) {
+        return 1;
+    }
+    memcpy(f + hdrlen, param, plen);
+
+    if (hdlc_parse_hdr(&hh, f, hdrlen + plen + HDLC_CRC_SIZE) ||
+        crc16_validate(f, hh.framelen) ||
+        hdlc_parse_control(hh.control, &hc) ||
+        hc.type != HDLC_UA || hc.pf != 1 || hh.infolen != (int)plen) {
+        return 1;
+    }
+
+    /* The peer's transmit limit is the receive limit seen from here */
+    memset(&psp, 0, sizeof(psp));
+    if (hdlc_parse_snrm_param(f + hdrlen, hh.infolen, &psp) ||
+        psp.max_info_rx != 128 || psp.max_info_tx != 64 ||
+        psp.window_rx != 1 || psp.window_tx != 1) {
+        return 1;
+    }
+    return 0;
+}
+
+#endif /* SSN_x86 */
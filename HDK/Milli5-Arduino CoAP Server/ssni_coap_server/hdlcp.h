@@ -0,0 +1,79 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef _HDLCP_H
+#define _HDLCP_H
+
+#include "hdlc.h"
+
+/*
+ * HDLC primary station, the mNIC side of the link.
+ *
+ * Host build (SSN_x86) only. It implements the connection and data API
+ * declared in hdlc.h over a file descriptor - a pty or a serial device -
+ * so host tools can drive the server the way the mNIC does: SNRM to
+ * connect, an I frame per request answered by an I or RR frame, and RR
+ * polls to collect frames the server has queued. Frames that go
+ * unanswered are sent again up to max_retry times.
+ */
+
+/* Connections open at once */
+#define HDLCP_MAX_CONN          (2)
+
+/* Addresses used when hdlc_session_connect() is passed NULL */
+#define HDLCP_ADDR_DEFAULT      (1)
+
+struct hdlcp_cfg {
+    uint32_t baud;              /* pace frames at this line rate, 0 don't */
+    uint32_t rsp_timeout_ms;    /* wait for a reply before sending again */
+    uint32_t max_retry;         /* sends of a frame before giving up */
+    uint32_t max_info;          /* largest info field offered in SNRM */
+};
+
+/**
+ * @brief Set the configuration for connections opened from now on
+ *
+ * Without a call the defaults are no pacing, a 2 s reply timeout, 3 sends
+ * and MNIC_MAX_PAYLOAD_SIZE.
+ */
+void hdlcp_init(const struct hdlcp_cfg *cfg);
+
+/**
+ * @brief Counters of a connection, they're reset by hdlc_session_connect()
+ *
+ */
+const struct hdlcstat *hdlcp_stats(const struct hdlc_conn *conn);
+
+/**
+ * @brief Largest info field the secondary accepts, as negotiated in SNRM
+ *
+ */
+uint32_t hdlcp_max_info(const struct hdlc_conn *conn);
+
+#endif /* _HDLCP_H */
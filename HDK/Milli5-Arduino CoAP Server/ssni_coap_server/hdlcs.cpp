@@ -36,6 +36,7 @@ Networks, Inc.
 #include "bufutil.h"
 #include "crc_xmodem.h"
 #include "log.h"
+#include "coaptxq.h"
 
 
 extern int verbose;
@@ -167,9 +168,6 @@ hdlcs_close(void)
 }
 
 
-// This pointer will be assigned when an Observe message is ready to be sent
-extern struct mbuf *pending_rsp;
-
 /* The main HDLC Secondary station state machine */
 int hdlcs_run(void)
 {
@@ -210,6 +208,7 @@ int hdlcs_run(void)
 	{
         dlog(LOG_DEBUG, "response rxed at primary");
         hss.vs = INCM8(hss.vs);
+        coap_txq_acked();
     }
 
     switch (hss.state) 
@@ -252,9 +251,7 @@ int hdlcs_run(void)
 
         else if (hc.type == HDLC_DISC) {
             dlog( LOG_DEBUG, "HDLC_DISC" );
-            m_free(pending_rsp);
-            pending_rsp = NULL;
-            dlog(LOG_DEBUG, "%s:%d Cleared pending_rsp", __FUNCTION__, __LINE__);
+            coap_txq_flush();
             rc = hdlcs_disc();
         }
         else {
@@ -292,14 +289,27 @@ boolean hdlcs_is_connected()
 } // hdlcs_is_connected
 
 
+/*
+ * @brief Check if another received frame is waiting to be processed
+ *
+ */
+boolean hdlcs_rx_pending()
+{
+	return hdlc_rx_pending();
+
+} // hdlcs_rx_pending
+
+
 struct mbuf * hdlcs_read(void)
 {
     struct mbuf *r;
     
     if (hss.r_complete) {
-        /* using a duplicate here */
+        /* using a duplicate here, the frame waits if the pool is empty */
         r = m_dup(hss.recv);
-        assert(r);
+        if (!r) {
+            return NULL;
+        }
         hss.recv->len = 0;
         hss.r_complete = 0;
         memset(hss.recv->data, 0, hss.recv->size);
@@ -429,16 +439,17 @@ hdlcs_rr(void)
 {
     uint8_t hdr[HDLC_HDR_SIZE];
     int hdrlen;
+    struct mbuf *m;
 
-    if (!pending_rsp) {
+    if (!(m = coap_txq_next())) {
         dlog(LOG_DEBUG, "respond to RR with RR");
         hdlc_hdr(0, hdlc_control_rr(hss.vr, 1), hss.esrc, hss.edst, hdr, &hdrlen);
         hdlc_send_frame(hdr, NULL, 0);
     }
     else {
 
-        dlog(LOG_DEBUG, "Resending frame");
-        hdlcs_write(pending_rsp->m_data, pending_rsp->m_pktlen);
+        dlog(LOG_DEBUG, "Sending queued frame");
+        hdlcs_write(m->m_data, m->m_pktlen);
 
         /* CoAP will also send app confirm */
         /* if not (and there is no data), proxy should send RR to confirm */
@@ -61,5 +61,11 @@ void hdlcs_data_register(hdlcs_data_handler f);
  */
 boolean hdlcs_is_connected();
 
+/*
+ * @brief Check if another received frame is waiting to be processed
+ *
+ */
+boolean hdlcs_rx_pending();
+
 #endif /* _INC_HDLC_SECONDARY_H_ */
 
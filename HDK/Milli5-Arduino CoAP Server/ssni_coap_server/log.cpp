@@ -31,6 +31,8 @@ Networks, Inc.
 #include <stdarg.h>
 #include "log.h"    
 #include "arduino_time.h"
+#include "numfmt.h"
+#include "ram.h"
 
 extern int verbose;
 
@@ -47,6 +49,9 @@ static Serial_ *pSerMon = NULL;
 #define SerMon (*pSerMon)
 static bool log_enabled = false;
 
+// Formatting buffer of dlog(), ddump() and capture_dump(), see log.h
+char log_buf[PRINTF_LEN];
+
 /* Init logging */
 void log_init( Serial_ *pSerial, uint32_t baud, uint32_t log_level )
 {
@@ -85,10 +90,15 @@ void dlog_level(int level)
     log_level = level;
 }
 
+bool dlog_on(int level)
+{
+    return log_enabled && level <= log_level;
+}
+
 void dlog(int level, const char *format, ...)
 {
     va_list args;
-	char buffer[PRINTF_LEN];
+	char *buffer = log_buf;
 	
 	// Is logging enabled?
 	if (!log_enabled)
@@ -107,7 +117,7 @@ void dlog(int level, const char *format, ...)
 
 	// Print to serial port using the format
 	va_start( args, format );
-	vsprintf( buffer,format, args );
+	fmt_vsnprintf( buffer, PRINTF_LEN, format, args );
 	SerMon.println(buffer);
 	va_end(args);
 
@@ -116,8 +126,8 @@ void dlog(int level, const char *format, ...)
 void ddump(int level, const char *label, const void *data, int datalen)
 {
     const uint8_t *b = (const uint8_t *) data;
-	char buffer[PRINTF_LEN];
-    int i;
+	char *buffer = log_buf;
+    int i, n = 0;
     
     // Is logging enabled?
     if (!log_enabled)
@@ -135,17 +145,25 @@ void ddump(int level, const char *label, const void *data, int datalen)
 
     if (label) 
 	{
-		sprintf( buffer, "%s:", label );
-        SerMon.print(buffer);
+        SerMon.print(label);
+        SerMon.print(":");
     }
 
+	// Print the bytes a buffer at a time
     for(i = 0; i < datalen; i++) 
 	{
-		sprintf( buffer, " %02x", b[i] );
-        SerMon.print(buffer);
+		buffer[n++] = ' ';
+		n += fmt_hex( buffer + n, b[i], 2 );
+		if ( n > PRINTF_LEN - 4 )
+		{
+			buffer[n] = '\0';
+			SerMon.print(buffer);
+			n = 0;
+		}
     }
+    buffer[n] = '\0';
     
-    SerMon.println("");
+    SerMon.println(buffer);
 
 } // ddump
 
@@ -155,6 +173,7 @@ void log_msg(const char *label, const void *data, int datalen, int eol)
     static char llabel[64];
     static int llen;
     static uint8_t line[256];
+    RAM_ASSERT(sizeof(log_buf) + sizeof(llabel) + sizeof(line) <= RAM_SHARE_LOG);
     
     // Is logging enabled?
     if (!log_enabled)
@@ -246,20 +265,24 @@ void printnum( int n )
 	
 } // println
 
-uint8_t capture_buf[1024];
+#ifdef LOG_CAPTURE_LEN
+uint8_t capture_buf[LOG_CAPTURE_LEN];
 uint16_t cap_count = 0;
 
 void capture( uint8_t ch )
 {
-	capture_buf[cap_count++] = ch;
+	if ( cap_count < LOG_CAPTURE_LEN )
+	{
+		capture_buf[cap_count++] = ch;
+	}
 	
 } // capture
+#endif
 
 void capture_dump( uint8_t * p, int count )
 {
-	char str[6];
-    uint8_t ch;
-	uint16_t ix;
+	char *str = log_buf;
+	uint16_t ix, n = 0;
 	
 	// Is logging enabled?
 	if (!log_enabled)
@@ -275,29 +298,41 @@ void capture_dump( uint8_t * p, int count )
 	
 	if (!p)
 	{
+#ifdef LOG_CAPTURE_LEN
 		p = &capture_buf[0];
-	}
-
-	if ( !count && ( cap_count >= 0 ))
-	{
-		count = cap_count;
-		
+		if ( !count )
+		{
+			count = cap_count;
+		}
+#else
+		return;
+#endif
 	}
 	
 	SerMon.println("======================================================");
-	for( ix = 0; ix < count-1; ix++ )
+	for( ix = 0; ix < count; ix++ )
 	{
-		ch = p[ix];
-		sprintf( str, "%02x,", ch );
-		SerMon.print(str);
+		n += fmt_hex( str + n, p[ix], 2 );
+		if ( ix < count - 1 )
+		{
+			str[n++] = ',';
+		}
+		if ( n > PRINTF_LEN - 4 )
+		{
+			str[n] = '\0';
+			SerMon.print(str);
+			n = 0;
+		}
 
 	} // for
-	sprintf( str, "%02x", p[ix] );
+	str[n] = '\0';
 	SerMon.println(str);
 	SerMon.println("======================================================");
 
+#ifdef LOG_CAPTURE_LEN
 	// Reset the count
 	cap_count = 0;
+#endif
 
 } // capture_dump
 
@@ -57,6 +57,12 @@ Networks, Inc.
 
 #define PRINTF_LEN		256
 
+/*
+ * dlog(), ddump() and capture_dump() format into this one buffer rather
+ * than each on the stack. They're called from the main loop only.
+ */
+extern char log_buf[PRINTF_LEN];
+
 #define LOG_EMERG       (0)         /* system is unusable */
 #define LOG_ALERT       (1)         /* action must be taken immediately */
 #define LOG_CRIT        (2)         /* critical conditions */
@@ -88,6 +94,16 @@ void log_init( Serial_ * pSerial, uint32_t baud, uint32_t log_level );
 */
 extern void dlog_level(int level);
 
+/**
+* @brief
+* Would a message at this level be output
+*
+* @param level The log level
+* @return true if logging is on and level is within the log level
+*
+*/
+extern bool dlog_on(int level);
+
 /**
 * @brief
 * Output a debug message to serial port
@@ -157,16 +173,21 @@ void log_msg(const char *label, const void *data, int datalen, int eol);
 /**
 * @brief Store one character in a Capture Buffer
 *
+* The Capture Buffer takes RAM; build with LOG_CAPTURE_LEN defined to its
+* size to have it.
+*
 * @param[in] ch The character to be stored in the Capture Buffer
 *
 */
+#ifdef LOG_CAPTURE_LEN
 void capture( uint8_t ch );
+#endif
 
 
 /**
 * @brief Dump the contect of the Capture Buffer
 *
-* @param[in] p Pointer to buffer to be dumped; if this is NULL, 'capture_buf' will be used
+* @param[in] p Pointer to buffer to be dumped; if this is NULL, 'capture_buf' will be used, if built
 * @param[in] count The number of characters to print
 *
 */
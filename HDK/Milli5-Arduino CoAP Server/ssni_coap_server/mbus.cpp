@@ -0,0 +1,425 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "errors.h"
+#include "crc_xmodem.h"
+#include "mbus.h"
+
+/* mbus_dec.st */
+enum {
+    MBUS_ST_IDLE = 0,       /* Waiting for 68, or for L */
+    MBUS_ST_LEN,            /* Wired: L */
+    MBUS_ST_LEN2,           /* Wired: L again */
+    MBUS_ST_START2,         /* Wired: the second 68 */
+    MBUS_ST_DATA,
+    MBUS_ST_CS,             /* Wired: checksum */
+    MBUS_ST_STOP,           /* Wired: 16 */
+    MBUS_ST_CRC_HI,         /* Wireless: CRC after a block */
+    MBUS_ST_CRC_LO,
+};
+
+#define MBUS_START          (0x68)
+#define MBUS_STOP           (0x16)
+
+/* Wireless: C M M A A A A A A follow L in the first block */
+#define MBUS_WMBUS_HDR      (9)
+#define MBUS_WMBUS_BLK      (16)
+
+/* CI fields */
+#define MBUS_CI_HDR_LONG    (0x72)  /* ID M M ver med acc sts cfg cfg */
+#define MBUS_CI_HDR_SHORT   (0x7A)  /* acc sts cfg cfg */
+#define MBUS_CI_HDR_NONE    (0x78)
+
+/* DIF */
+#define MBUS_DIF_EXT        (0x80)
+#define MBUS_DIF_FILL       (0x2F)
+#define MBUS_DIF_VAR        (0x0D)
+#define MBUS_DIF_MANUF      (0x0F)  /* 0F and 1F, the rest isn't records */
+
+/* VIF */
+#define MBUS_VIF_EXT        (0x80)
+#define MBUS_VIF_TEXT       (0x7C)  /* Unit follows in ASCII */
+#define MBUS_VIFE_MAX       (10)
+
+/* Data bytes by DIF data field, variable (0D) and special (0F) aside */
+static const uint8_t mbus_dif_len[16] = {
+    0, 1, 2, 3, 4, 4, 6, 8, 0, 1, 2, 3, 4, 0, 6, 0
+};
+
+void
+mbus_dec_init(struct mbus_dec *d, uint8_t link)
+{
+    memset(d, 0, sizeof(*d));
+    d->link = link;
+    d->st = MBUS_ST_IDLE;
+}
+
+error_t
+mbus_dec_put(struct mbus_dec *d, uint8_t c)
+{
+    switch (d->st) {
+    case MBUS_ST_IDLE:
+        if (d->link == MBUS_LINK_WIRED) {
+            if (c == MBUS_START) {
+                d->st = MBUS_ST_LEN;
+            }
+            return ERR_AGAIN;
+        }
+        /* Too short for the header and CI, not a frame start */
+        if (c <= MBUS_WMBUS_HDR) {
+            return ERR_AGAIN;
+        }
+        d->l = c;
+        d->n = 0;
+        d->crc = crc_mbus(crc_mbus_init(), &c, 1);
+        d->left = MBUS_WMBUS_HDR;
+        d->st = MBUS_ST_DATA;
+        return ERR_AGAIN;
+
+    case MBUS_ST_LEN:
+        d->l = c;
+        d->st = MBUS_ST_LEN2;
+        return ERR_AGAIN;
+
+    case MBUS_ST_LEN2:
+        /* At least C, A and CI */
+        if (c != d->l || c < 3) {
+            goto bad;
+        }
+        d->st = MBUS_ST_START2;
+        return ERR_AGAIN;
+
+    case MBUS_ST_START2:
+        if (c != MBUS_START) {
+            goto bad;
+        }
+        d->n = 0;
+        d->crc = 0;
+        d->left = d->l;
+        d->st = MBUS_ST_DATA;
+        return ERR_AGAIN;
+
+    case MBUS_ST_DATA:
+        d->buf[d->n++] = c;
+        if (d->link == MBUS_LINK_WIRED) {
+            d->crc += c;
+        } else {
+            d->crc = crc_mbus(d->crc, &c, 1);
+        }
+        if (--d->left) {
+            return ERR_AGAIN;
+        }
+        d->st = (d->link == MBUS_LINK_WIRED) ? MBUS_ST_CS : MBUS_ST_CRC_HI;
+        return ERR_AGAIN;
+
+    case MBUS_ST_CS:
+        if (c != (d->crc & 0xFF)) {
+            goto bad;
+        }
+        d->st = MBUS_ST_STOP;
+        return ERR_AGAIN;
+
+    case MBUS_ST_STOP:
+        d->st = MBUS_ST_IDLE;
+        return (c == MBUS_STOP) ? ERR_OK : ERR_BAD_DATA;
+
+    case MBUS_ST_CRC_HI:
+        d->crc_hi = c;
+        d->st = MBUS_ST_CRC_LO;
+        return ERR_AGAIN;
+
+    case MBUS_ST_CRC_LO:
+        if ((uint16_t)((d->crc_hi << 8) | c) != crc_mbus_final(d->crc)) {
+            goto bad;
+        }
+        if (d->n == d->l) {
+            d->st = MBUS_ST_IDLE;
+            return ERR_OK;
+        }
+        d->left = min(d->l - d->n, MBUS_WMBUS_BLK);
+        d->crc = crc_mbus_init();
+        d->st = MBUS_ST_DATA;
+        return ERR_AGAIN;
+    }
+
+bad:
+    d->st = MBUS_ST_IDLE;
+    return ERR_BAD_DATA;
+}
+
+static uint32_t
+mbus_le(const uint8_t *b, uint8_t len)
+{
+    uint32_t v = 0;
+
+    while (len--) {
+        v = (v << 8) | b[len];
+    }
+    return v;
+}
+
+/* Unit and exponent of a primary VIF, without its extension bit */
+static uint8_t
+mbus_vif_unit(uint8_t vif, int8_t *exp)
+{
+    switch (vif & 0x78) {
+    case 0x00:
+        *exp = (vif & 7) - 3;
+        return MBUS_UNIT_WH;
+    case 0x10:
+        *exp = (vif & 7) - 6;
+        return MBUS_UNIT_M3;
+    case 0x18:
+        *exp = (vif & 7) - 3;
+        return MBUS_UNIT_KG;
+    case 0x28:
+        *exp = (vif & 7) - 3;
+        return MBUS_UNIT_W;
+    case 0x38:
+        *exp = (vif & 7) - 6;
+        return MBUS_UNIT_M3H;
+    }
+    *exp = (vif & 3) - 3;
+    switch (vif & 0x7C) {
+    case 0x58:
+        return MBUS_UNIT_FLOW_C;
+    case 0x5C:
+        return MBUS_UNIT_RETURN_C;
+    case 0x64:
+        return MBUS_UNIT_EXT_C;
+    case 0x68:
+        return MBUS_UNIT_BAR;
+    }
+    *exp = 0;
+    if (vif == 0x6C) {
+        return MBUS_UNIT_DATE;
+    }
+    if (vif == 0x6D) {
+        return MBUS_UNIT_DATETIME;
+    }
+    return MBUS_UNIT_NONE;
+}
+
+/*
+ * Value of the len data bytes at b, as DIF data field df says. Dates are
+ * bit fields, their bits are kept as they are. Returns 0 if it isn't a number this code
+ * reads or doesn't fit an int32.
+ */
+static int
+mbus_val(const uint8_t *b, uint8_t len, uint8_t df, uint8_t unit,
+        int32_t *val)
+{
+    int64_t v = 0;
+    uint8_t d;
+    uint8_t neg = 0;
+    int i;
+
+    switch (df) {
+    case 0x1: case 0x2: case 0x3: case 0x4: case 0x6: case 0x7:
+        for (i = len - 1; i >= 0; i--) {
+            v = (v << 8) | b[i];
+        }
+        if (unit == MBUS_UNIT_DATE || unit == MBUS_UNIT_DATETIME) {
+            if (len > 4) {
+                return 0;
+            }
+            *val = (int32_t)(uint32_t)v;
+            return 1;
+        }
+        if (len < 8 && (b[len - 1] & 0x80)) {
+            v -= (int64_t)1 << (8 * len);
+        }
+        break;
+    case 0x9: case 0xA: case 0xB: case 0xC: case 0xE:
+        for (i = 2 * len - 1; i >= 0; i--) {
+            d = (b[i / 2] >> (4 * (i & 1))) & 0xF;
+            if (i == 2 * len - 1 && d == 0xF) {
+                neg = 1;        /* The top digit is a minus sign */
+                continue;
+            }
+            if (d > 9) {
+                return 0;
+            }
+            v = v * 10 + d;
+        }
+        if (neg) {
+            v = -v;
+        }
+        break;
+    default:
+        return 0;
+    }
+    if (v < INT32_MIN || v > INT32_MAX) {
+        return 0;
+    }
+    *val = (int32_t)v;
+    return 1;
+}
+
+error_t
+mbus_parse(const struct mbus_dec *d, struct mbus_frame *f)
+{
+    const uint8_t *b = d->buf;
+    struct mbus_rec r;
+    uint16_t n = d->n;
+    uint16_t i;
+    uint16_t cfg = 0;
+    uint8_t dif, ext, vif, len, k;
+
+    memset(f, 0, sizeof(*f));
+    if (d->link == MBUS_LINK_WMBUS) {
+        /* C, then the sender's address: M M ID ID ID ID ver med */
+        f->man = mbus_le(b + 1, 2);
+        f->id = mbus_le(b + 3, 4);
+        f->ver = b[7];
+        f->med = b[8];
+        i = MBUS_WMBUS_HDR;
+    } else {
+        /* C A */
+        i = 2;
+    }
+
+    switch (b[i++]) {
+    case MBUS_CI_HDR_LONG:
+        if (n - i < 12) {
+            return ERR_BAD_DATA;
+        }
+        f->id = mbus_le(b + i, 4);
+        f->man = mbus_le(b + i + 4, 2);
+        f->ver = b[i + 6];
+        f->med = b[i + 7];
+        i += 8;
+        /* FALLTHROUGH */
+    case MBUS_CI_HDR_SHORT:
+        if (n - i < 4) {
+            return ERR_BAD_DATA;
+        }
+        f->acc = b[i];
+        f->sts = b[i + 1];
+        cfg = mbus_le(b + i + 2, 2);
+        i += 4;
+        break;
+    case MBUS_CI_HDR_NONE:
+        break;
+    default:
+        return ERR_OP_NOT_SUPP;
+    }
+    /* Encryption mode */
+    if (cfg & 0x1F00) {
+        return ERR_OP_NOT_SUPP;
+    }
+
+    while (i < n) {
+        dif = b[i++];
+        if (dif == MBUS_DIF_FILL) {
+            continue;
+        }
+        if ((dif & 0x0F) == MBUS_DIF_MANUF) {
+            break;
+        }
+        memset(&r, 0, sizeof(r));
+        r.func = (dif >> 4) & 3;
+        r.storage = (dif >> 6) & 1;
+        for (k = 0, ext = dif & MBUS_DIF_EXT; ext; k++) {
+            if (i >= n || k == MBUS_VIFE_MAX) {
+                return ERR_BAD_DATA;
+            }
+            ext = b[i] & MBUS_DIF_EXT;
+            /* Kept while they fit, higher ones make it not current anyway */
+            if (k < 2) {
+                r.storage |= (b[i] & 0x0F) << (1 + 4 * k);
+                r.tariff |= ((b[i] >> 4) & 3) << (2 * k);
+            } else if (b[i] & 0x0F) {
+                r.storage = 0xFF;
+            }
+            i++;
+        }
+
+        if (i >= n) {
+            return ERR_BAD_DATA;
+        }
+        vif = b[i++];
+        if ((vif & ~MBUS_VIF_EXT) == MBUS_VIF_TEXT) {
+            if (i >= n || n - i - 1 < b[i]) {
+                return ERR_BAD_DATA;
+            }
+            i += 1 + b[i];
+        }
+        for (k = 0, ext = vif & MBUS_VIF_EXT; ext; k++) {
+            if (i >= n || k == MBUS_VIFE_MAX) {
+                return ERR_BAD_DATA;
+            }
+            ext = b[i++] & MBUS_VIF_EXT;
+        }
+        /* 0xFB, 0xFD and text VIFs only have meaning with their VIFEs */
+        r.vif = vif & ~MBUS_VIF_EXT;
+        r.unit = (vif == 0xFB || vif == 0xFD || r.vif == MBUS_VIF_TEXT) ?
+            (uint8_t)MBUS_UNIT_NONE : mbus_vif_unit(r.vif, &r.exp);
+        /* A VIFE after a primary VIF changes its meaning */
+        if ((vif & MBUS_VIF_EXT) && r.unit != MBUS_UNIT_NONE) {
+            r.unit = MBUS_UNIT_NONE;
+        }
+
+        len = mbus_dif_len[dif & 0x0F];
+        if ((dif & 0x0F) == MBUS_DIF_VAR) {
+            if (i >= n) {
+                return ERR_BAD_DATA;
+            }
+            len = b[i++];
+            if (len >= 0xF0) {
+                return ERR_BAD_DATA;
+            }
+            if (len >= 0xE0) {
+                len -= 0xE0;    /* Binary */
+            } else if (len >= 0xC0) {
+                len &= 0x0F;    /* BCD */
+            }
+        }
+        if (n - i < len) {
+            return ERR_BAD_DATA;
+        }
+        if (r.unit != MBUS_UNIT_NONE && f->nrec < MBUS_REC_MAX &&
+                mbus_val(b + i, len, dif & 0x0F, r.unit, &r.val)) {
+            f->rec[f->nrec++] = r;
+        }
+        i += len;
+    }
+
+    return ERR_OK;
+}
+
+void
+mbus_man_str(uint16_t man, char b[3])
+{
+    b[0] = '@' + ((man >> 10) & 0x1F);
+    b[1] = '@' + ((man >> 5) & 0x1F);
+    b[2] = '@' + (man & 0x1F);
+}
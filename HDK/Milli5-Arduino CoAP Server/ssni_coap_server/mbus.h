@@ -0,0 +1,148 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_MBUS_H
+#define INC_MBUS_H
+
+#include <arduino.h>
+#include "errors.h"
+
+/*
+ * M-Bus (EN 13757) meter frames, decoded as they arrive from a UART.
+ *
+ * Two link layers are taken, chosen at mbus_dec_init():
+ *   MBUS_LINK_WIRED    EN 13757-2 long frames: 68 L L 68 C A CI .. CS 16.
+ *                      Anything between frames, such as the single char
+ *                      ack E5, is skipped.
+ *   MBUS_LINK_WMBUS    EN 13757-4 format A frames, as a radio module passes
+ *                      them on: L C M M A A A A A A CI .. in a block of 10
+ *                      bytes, then blocks of up to 16, each followed by its
+ *                      crc_mbus(). Each CRC is checked as its block ends.
+ *
+ * mbus_dec_put() takes one byte at a time and keeps the frame, without L,
+ * framing or CRCs, in the struct mbus_dec. After a bad wireless frame the
+ * rest of it looks like noise; mbus_dec_init() again, once the line has
+ * been quiet, to find the next one. mbus_parse() then decodes the
+ * application layer (EN 13757-3) into a struct mbus_frame: the header and
+ * the data records with a VIF this code knows. Nothing is allocated.
+ *
+ * Encrypted frames and manufacturer specific data aren't decoded.
+ */
+
+enum mbus_link {
+    MBUS_LINK_WIRED = 0,
+    MBUS_LINK_WMBUS,
+};
+
+/* Largest frame, L and the bytes after it with CRCs removed */
+#define MBUS_FRAME_MAX      (256)
+
+/* Data records kept per frame, later ones are dropped */
+#define MBUS_REC_MAX        (12)
+
+/* Device types, the medium byte */
+#define MBUS_MED_WATER      (0x07)
+#define MBUS_MED_WARM_WATER (0x06)
+#define MBUS_MED_HOT_WATER  (0x15)
+#define MBUS_MED_COLD_WATER (0x16)
+
+/* Units of struct mbus_rec, from the VIF */
+enum mbus_unit {
+    MBUS_UNIT_NONE = 0,
+    MBUS_UNIT_WH,           /* Energy */
+    MBUS_UNIT_M3,           /* Volume */
+    MBUS_UNIT_KG,           /* Mass */
+    MBUS_UNIT_W,            /* Power */
+    MBUS_UNIT_M3H,          /* Volume flow */
+    MBUS_UNIT_FLOW_C,       /* Flow temperature, degrees C */
+    MBUS_UNIT_RETURN_C,     /* Return temperature */
+    MBUS_UNIT_EXT_C,        /* External temperature */
+    MBUS_UNIT_BAR,          /* Pressure */
+    MBUS_UNIT_DATE,         /* Type G date, val as read */
+    MBUS_UNIT_DATETIME,     /* Type F date and time, val as read */
+};
+
+/* One data record. The value is val * 10^exp unit. */
+struct mbus_rec {
+    uint8_t unit;           /* enum mbus_unit */
+    int8_t  exp;
+    uint8_t func;           /* DIF function: 0 value, 1 max, 2 min, 3 error */
+    uint8_t storage;        /* Storage number, 0 is the current value */
+    uint8_t tariff;
+    uint8_t vif;            /* VIF, extension bit cleared */
+    int32_t val;
+};
+
+/* A decoded frame */
+struct mbus_frame {
+    uint32_t id;            /* Identification number, BCD */
+    uint16_t man;           /* Manufacturer, three letters 5 bits each */
+    uint8_t  ver;           /* Version */
+    uint8_t  med;           /* Device type, MBUS_MED_* */
+    uint8_t  acc;           /* Access number, up one per frame sent */
+    uint8_t  sts;           /* Status, 0 when all is well */
+    uint8_t  nrec;
+    struct mbus_rec rec[MBUS_REC_MAX];
+};
+
+/* Receive state, see mbus_dec_init() */
+struct mbus_dec {
+    uint8_t  link;          /* enum mbus_link */
+    uint8_t  st;            /* Where in the frame the next byte goes */
+    uint8_t  l;             /* L field */
+    uint8_t  left;          /* Bytes to the end of this block */
+    uint16_t n;             /* Bytes in buf */
+    uint16_t crc;           /* crc_mbus() or checksum so far */
+    uint8_t  crc_hi;
+    uint8_t  buf[MBUS_FRAME_MAX];
+};
+
+void mbus_dec_init(struct mbus_dec *d, uint8_t link);
+
+/**
+ * @brief Add the next byte received
+ *
+ * @return ERR_OK when it ends a good frame, now in d->buf. ERR_AGAIN when
+ * more are needed. ERR_BAD_DATA when it ends a bad one, d waits for the next
+ * frame either way.
+ */
+error_t mbus_dec_put(struct mbus_dec *d, uint8_t c);
+
+/**
+ * @brief Decode the frame mbus_dec_put() last completed into f
+ *
+ * @return ERR_OK, ERR_OP_NOT_SUPP if encrypted or an unknown CI,
+ * ERR_BAD_DATA if malformed. Records up to a malformed one are kept.
+ */
+error_t mbus_parse(const struct mbus_dec *d, struct mbus_frame *f);
+
+/* The manufacturer as three letters, into b */
+void mbus_man_str(uint16_t man, char b[3]);
+
+#endif /* INC_MBUS_H */
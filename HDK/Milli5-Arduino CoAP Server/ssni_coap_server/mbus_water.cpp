@@ -0,0 +1,383 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "log.h"
+#include "hbuf.h"
+#include "arduino_time.h"
+#include "numfmt.h"
+#include "coapsensorobs.h"
+#include "mbus.h"
+#include "mbus_water.h"
+
+// Wired REQ_UD2, C with and without the frame count bit
+#define MBUS_C_REQ_UD2			(0x5B)
+#define MBUS_C_FCB				(0x20)
+
+// What's kept of the last frame
+struct mbus_water
+{
+	uint32_t		epoch;			// When it came
+	uint32_t		sn;				// Frames so far, the ETag of ?sens
+	uint32_t		id;
+	uint16_t		man;
+	uint8_t			ver;
+	uint8_t			med;
+	uint8_t			has_vol;
+	uint8_t			has_flow;
+	struct mbus_rec	vol;
+	struct mbus_rec	flow;
+};
+
+static HardwareSerial *		mbus_port;
+static uint32_t				mbus_id;		// BCD, 0 for any
+static struct mbus_dec		mbus_rx;
+static struct mbus_frame	mbus_frame;		// The frame being decoded
+static struct mbus_water	mbus_last;
+static uint32_t				mbus_req_ms;
+static uint32_t				mbus_rx_ms;		// When bytes were last read
+static uint8_t				mbus_fcb;
+static uint32_t				mbus_wait_sn;	// Polled until sn moves on from it
+static uint8_t				mbus_wait;
+
+// The number as printed in BCD, as it is sent
+static uint32_t mbus_water_bcd( uint32_t v )
+{
+	uint32_t	bcd = 0;
+	uint8_t		i;
+
+	for ( i = 0; i < 8 && v; i++, v /= 10 )
+	{
+		bcd |= ( v % 10 ) << ( 4 * i );
+	}
+	return bcd;
+
+} // mbus_water_bcd()
+
+error_t mbus_water_init( HardwareSerial *port, uint8_t link, uint32_t baud,
+		uint32_t id )
+{
+	if ( link == MBUS_LINK_WIRED )
+	{
+		port->begin( MBUS_WATER_WIRED_BAUD, SERIAL_8E1 );
+	}
+	else
+	{
+		port->begin( baud );
+	}
+	mbus_dec_init( &mbus_rx, link );
+	mbus_id = mbus_water_bcd( id );
+	mbus_port = port;
+
+	// Ask a wired meter straight away
+	mbus_req_ms = time_ms() - MBUS_WATER_REQ_MS;
+
+	return ERR_OK;
+
+} // mbus_water_init()
+
+// Ask a wired meter for its data
+static void mbus_water_req()
+{
+	uint8_t f[5];
+
+	f[0] = 0x10;
+	f[1] = MBUS_C_REQ_UD2 | ( mbus_fcb ? MBUS_C_FCB : 0 );
+	f[2] = MBUS_WATER_WIRED_ADDR;
+	f[3] = f[1] + f[2];
+	f[4] = 0x16;
+	mbus_port->write( f, sizeof(f) );
+	mbus_fcb = !mbus_fcb;
+
+} // mbus_water_req()
+
+// The current value of unit in f, NULL if none
+static const struct mbus_rec *mbus_water_rec( const struct mbus_frame *f,
+		uint8_t unit )
+{
+	uint8_t i;
+
+	for ( i = 0; i < f->nrec; i++ )
+	{
+		if ( f->rec[i].unit == unit && f->rec[i].func == 0 &&
+			 f->rec[i].storage == 0 && f->rec[i].tariff == 0 )
+		{
+			return &f->rec[i];
+		}
+	}
+	return NULL;
+
+} // mbus_water_rec()
+
+// Keep the frame just decoded, if it's our meter's
+static void mbus_water_frame()
+{
+	const struct mbus_frame *	f = &mbus_frame;
+	const struct mbus_rec *		r;
+	error_t						rc;
+
+	rc = mbus_parse( &mbus_rx, &mbus_frame );
+	if ( rc )
+	{
+		dlog( LOG_DEBUG, "M-Bus frame not decoded (%d)", rc );
+		return;
+	}
+	if ( f->med != MBUS_MED_WATER && f->med != MBUS_MED_WARM_WATER &&
+		 f->med != MBUS_MED_HOT_WATER && f->med != MBUS_MED_COLD_WATER )
+	{
+		return;
+	}
+	if ( mbus_id && f->id != mbus_id )
+	{
+		return;
+	}
+	// The first one heard, keep to it
+	mbus_id = f->id;
+
+	mbus_last.epoch = get_rtc_epoch();
+	mbus_last.id = f->id;
+	mbus_last.man = f->man;
+	mbus_last.ver = f->ver;
+	mbus_last.med = f->med;
+	r = mbus_water_rec( f, MBUS_UNIT_M3 );
+	mbus_last.has_vol = ( r != NULL );
+	if (r)
+	{
+		mbus_last.vol = *r;
+	}
+	r = mbus_water_rec( f, MBUS_UNIT_M3H );
+	mbus_last.has_flow = ( r != NULL );
+	if (r)
+	{
+		mbus_last.flow = *r;
+	}
+	if ( ++mbus_last.sn == 0 )
+	{
+		mbus_last.sn = 1;
+	}
+
+	// Observers get it now, not at the next period
+	coap_obs_changed( mbus_water_read );
+
+} // mbus_water_frame()
+
+void mbus_water_run()
+{
+	int n;
+
+	if ( !mbus_port )
+	{
+		return;
+	}
+
+	if ( mbus_rx.link == MBUS_LINK_WIRED &&
+		 time_ms() - mbus_req_ms >= MBUS_WATER_REQ_MS )
+	{
+		mbus_req_ms = time_ms();
+		mbus_water_req();
+	}
+
+	// Only what has arrived, the decoder keeps its place
+	n = mbus_port->available();
+	if ( n <= 0 )
+	{
+		// Seen idle, not just late to look
+		if ( time_ms() - mbus_rx_ms >= MBUS_WATER_GAP_MS )
+		{
+			mbus_dec_init( &mbus_rx, mbus_rx.link );
+		}
+		return;
+	}
+	mbus_rx_ms = time_ms();
+	for ( ; n > 0; n-- )
+	{
+		switch ( mbus_dec_put( &mbus_rx, mbus_port->read() ) )
+		{
+		case ERR_OK:
+			mbus_water_frame();
+			break;
+		case ERR_BAD_DATA:
+			dlog( LOG_DEBUG, "M-Bus frame dropped" );
+			break;
+		default:
+			break;
+		}
+	}
+
+} // mbus_water_run()
+
+// r's value, scaled to its unit
+static uint8_t mbus_water_fmt( char *p, const struct mbus_rec *r )
+{
+	int64_t	v = r->val;
+	int8_t	e;
+
+	if ( r->exp < 0 )
+	{
+		return fmt_fixed( p, r->val, -r->exp );
+	}
+	for ( e = r->exp; e > 0 && v >= INT32_MIN && v <= INT32_MAX; e-- )
+	{
+		v *= 10;
+	}
+	v = v < INT32_MIN ? INT32_MIN : v > INT32_MAX ? INT32_MAX : v;
+	return fmt_i32( p, (int32_t)v );
+
+} // mbus_water_fmt()
+
+#define MBUS_WATER_UNIT		"m3"
+
+error_t mbus_water_read( struct mbuf *m, uint8_t *len )
+{
+	const uint8_t	max = FMT_U32_MAX + 2 * ( 1 + FMT_FIXED_MAX ) + 1 +
+					  sizeof(MBUS_WATER_UNIT) - 1;
+	char *			p;
+	uint8_t			l;
+
+	if ( !mbus_last.sn )
+	{
+		return ERR_AGAIN;
+	}
+	p = (char *) m_append( m, max );
+	if (!p)
+	{
+		return ERR_NO_MEM;
+	}
+
+	l = fmt_u32( p, mbus_last.epoch );
+	p[l++] = ',';
+	if ( mbus_last.has_vol )
+	{
+		l += mbus_water_fmt( p + l, &mbus_last.vol );
+	}
+	p[l++] = ',';
+	if ( mbus_last.has_flow )
+	{
+		l += mbus_water_fmt( p + l, &mbus_last.flow );
+	}
+	p[l++] = ',';
+	memcpy( p + l, MBUS_WATER_UNIT, sizeof(MBUS_WATER_UNIT) - 1 );
+	l += sizeof(MBUS_WATER_UNIT) - 1;
+
+	// Give back what wasn't used
+	m_adj( m, -(int)( max - l ) );
+	*len = l;
+
+	return ERR_OK;
+
+} // mbus_water_read()
+
+// GET ?cfg, the meter
+static error_t mbus_water_get_cfg( struct mbuf *m, uint8_t *len )
+{
+	const uint8_t	max = FMT_HEX32_MAX + 1 + 3 + 1 + 3 + 1 + 2;
+	char *			p;
+	uint8_t			l;
+
+	if ( !mbus_last.sn )
+	{
+		return ERR_AGAIN;
+	}
+	p = (char *) m_append( m, max );
+	if (!p)
+	{
+		return ERR_NO_MEM;
+	}
+
+	l = fmt_hex( p, mbus_last.id, 8 );
+	p[l++] = ',';
+	mbus_man_str( mbus_last.man, p + l );
+	l += 3;
+	p[l++] = ',';
+	l += fmt_u32( p + l, mbus_last.ver );
+	p[l++] = ',';
+	l += fmt_hex( p + l, mbus_last.med, 2 );
+
+	m_adj( m, -(int)( max - l ) );
+	*len = l;
+
+	return ERR_OK;
+
+} // mbus_water_get_cfg()
+
+static uint32_t mbus_water_sn()
+{
+	return mbus_last.sn;
+
+} // mbus_water_sn()
+
+// GET ?sens to a CON, ask a wired meter now rather than send the last frame
+static error_t mbus_water_start()
+{
+	if ( !mbus_port )
+	{
+		return ERR_OP_NOT_SUPP;
+	}
+	if ( mbus_rx.link == MBUS_LINK_WIRED )
+	{
+		mbus_wait_sn = mbus_last.sn;
+		mbus_wait = 1;
+		mbus_req_ms = time_ms();
+		mbus_water_req();
+	}
+	return ERR_OK;
+
+} // mbus_water_start()
+
+// Until the meter's answer has been decoded
+static error_t mbus_water_poll()
+{
+	if ( mbus_wait && mbus_last.sn == mbus_wait_sn )
+	{
+		return ERR_INPROGRESS;
+	}
+	mbus_wait = 0;
+	return ERR_OK;
+
+} // mbus_water_poll()
+
+/*
+ * CoAP resource water meter, see coapsensor.h
+ */
+const struct coap_sensor_ops mbus_water_ops =
+{
+	.read		= mbus_water_read,		// GET ?sens
+	.get_cfg	= mbus_water_get_cfg,	// GET ?cfg
+	.put_cfg	= NULL,					// PUT ?cfg
+	.disable	= NULL,					// DELETE ?all
+	.sn			= mbus_water_sn,		// ETag of ?sens
+	.cfg_gen	= NULL,					// ETag of ?cfg
+	.cfg_type	= 0,					// no /system/cfg
+	.get_tlv	= NULL,
+	.check_tlv	= NULL,
+	.set_tlv	= NULL,
+	.start		= mbus_water_start,		// GET ?sens, separate response
+	.poll		= mbus_water_poll
+};
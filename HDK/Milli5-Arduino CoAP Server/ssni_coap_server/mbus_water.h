@@ -0,0 +1,101 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef MBUS_WATER_H_
+#define MBUS_WATER_H_
+
+#include <arduino.h>
+#include "errors.h"
+#include "hbuf.h"
+#include "coapsensor.h"
+#include "mbus.h"
+
+/*
+ * M-Bus water meter on a second UART, see mbus.h for the link layers.
+ *
+ * mbus_water_run() passes on what the UART received. Each frame from the
+ * meter replaces the cached reading and, when the sensor is observed, is
+ * sent as a reading at once. A wired meter only answers a REQ_UD2, sent
+ * every MBUS_WATER_REQ_MS.
+ *
+ *   GET ?sens      <epoch>,<volume>,<flow>,m3 from the last frame: when it
+ *                  came, the volume in m3 and the volume flow in m3/h, left
+ *                  empty if the meter doesn't send it. 5.03 until the first
+ *                  frame. The ETag goes up with each frame. A CON to a wired
+ *                  meter is ACKed and sends a REQ_UD2, the reading follows
+ *                  in a separate response when the meter has answered.
+ *   GET ?cfg       <id>,<manufacturer>,<version>,<device type in hex>
+ */
+
+/* Wired M-Bus: 2400 baud, even parity. Meter at the point-to-point address */
+#define MBUS_WATER_WIRED_BAUD   (2400)
+#define MBUS_WATER_WIRED_ADDR   (0xFE)
+#define MBUS_WATER_REQ_MS       (30000)
+
+/* A frame left unfinished this long is dropped, so the next one is found */
+#define MBUS_WATER_GAP_MS       (100)
+
+/*
+ * mbus_water_ops
+ *
+ * @brief CoAP Resource water meter, for the sketch's sensor table
+ *
+ */
+extern const struct coap_sensor_ops mbus_water_ops;
+
+/**
+ * @brief Start listening on port
+ *
+ * @param[in] port The UART of the meter, or of its radio module
+ * @param[in] link MBUS_LINK_WIRED or MBUS_LINK_WMBUS
+ * @param[in] baud Of the radio module, wired M-Bus is always at
+ * MBUS_WATER_WIRED_BAUD
+ * @param[in] id Identification number of the meter, as printed on it, 0
+ * takes the first water meter heard
+ * @return error_t
+ */
+error_t mbus_water_init( HardwareSerial *port, uint8_t link, uint32_t baud,
+		uint32_t id );
+
+/**
+ * @brief Read and decode what the meter sent, call from loop()
+ *
+ */
+void mbus_water_run();
+
+/**
+ * @brief Get the last reading, the sensor's ObsFuncPtr
+ *
+ * @param[in] m Pointer to input mbuf
+ * @param[in] len Length of input
+ * @return error_t ERR_AGAIN before the first frame
+ */
+error_t mbus_water_read( struct mbuf *m, uint8_t *len );
+
+#endif /* MBUS_WATER_H_ */
@@ -0,0 +1,305 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include "numfmt.h"
+
+/*
+ * Digits are produced by repeated subtraction of powers of ten, the
+ * Cortex-M0+ has no divide instruction and a division per digit costs more.
+ */
+static const uint32_t fmt_pow10[] = {
+    1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL,
+    10000UL, 1000UL, 100UL, 10UL, 1UL
+};
+#define FMT_POW10_N     (sizeof(fmt_pow10) / sizeof(fmt_pow10[0]))
+
+static const char fmt_hexdig[] = "0123456789abcdef";
+
+uint8_t
+fmt_u32(char *b, uint32_t v)
+{
+    uint8_t i, n = 0;
+    char d;
+
+    for (i = 0; i < FMT_POW10_N - 1; i++) {
+        d = '0';
+        while (v >= fmt_pow10[i]) {
+            v -= fmt_pow10[i];
+            d++;
+        }
+        if (n || d != '0') {
+            b[n++] = d;
+        }
+    }
+    b[n++] = '0' + v;
+
+    return n;
+}
+
+uint8_t
+fmt_i32(char *b, int32_t v)
+{
+    if (v < 0) {
+        b[0] = '-';
+        return 1 + fmt_u32(b + 1, -(uint32_t)v);
+    }
+    return fmt_u32(b, v);
+}
+
+uint8_t
+fmt_hex(char *b, uint32_t v, uint8_t width)
+{
+    uint8_t n = 1, i;
+    uint32_t t;
+
+    for (t = v >> 4; t; t >>= 4) {
+        n++;
+    }
+    if (width > FMT_HEX32_MAX) {
+        width = FMT_HEX32_MAX;
+    }
+    if (n < width) {
+        n = width;
+    }
+    for (i = n; i > 0; i--) {
+        b[i - 1] = fmt_hexdig[v & 0xF];
+        v >>= 4;
+    }
+
+    return n;
+}
+
+uint8_t
+fmt_fixed(char *b, int32_t v, uint8_t dp)
+{
+    char d[FMT_U32_MAX];
+    uint8_t n = 0, nd, i;
+
+    if (dp > FMT_DP_MAX) {
+        dp = FMT_DP_MAX;
+    }
+    if (v < 0) {
+        b[n++] = '-';
+    }
+    nd = fmt_u32(d, (v < 0) ? -(uint32_t)v : (uint32_t)v);
+    if (!dp) {
+        memcpy(b + n, d, nd);
+        return n + nd;
+    }
+
+    if (nd > dp) {
+        memcpy(b + n, d, nd - dp);
+        n += nd - dp;
+        b[n++] = '.';
+        memcpy(b + n, d + nd - dp, dp);
+        n += dp;
+    } else {
+        /* No integer digits, pad the fraction with leading zeros. */
+        b[n++] = '0';
+        b[n++] = '.';
+        for (i = nd; i < dp; i++) {
+            b[n++] = '0';
+        }
+        memcpy(b + n, d, nd);
+        n += nd;
+    }
+
+    return n;
+}
+
+uint8_t
+fmt_float(char *b, float f, uint8_t dp)
+{
+    uint32_t p, ip, fq, v;
+    float a;
+
+    if (f != f) {
+        memcpy(b, "nan", 3);
+        return 3;
+    }
+    if (dp > FMT_DP_MAX) {
+        dp = FMT_DP_MAX;
+    }
+    p = fmt_pow10[FMT_POW10_N - 1 - dp];
+
+    /*
+     * No double, it's emulated in software. The integer part comes off
+     * exactly, and the fraction as 0.32 fixed point, exact for |f| >= 2^-9.
+     * Scaling and rounding it is one 32x32 bit multiply.
+     */
+    a = (f < 0) ? -f : f;
+    ip = (a < 2147483648.0f) ? (uint32_t)a : UINT32_MAX;
+    v = (uint32_t)INT32_MAX + 1;    /* out of range */
+    if (ip <= INT32_MAX / p) {
+        fq = (uint32_t)((a - ip) * 4294967296.0f);
+        v = ip * p + (uint32_t)(((uint64_t)fq * p + 0x80000000UL) >> 32);
+    }
+    if (v > INT32_MAX) {
+        return fmt_fixed(b, (f < 0) ? INT32_MIN : INT32_MAX, dp);
+    }
+
+    return fmt_fixed(b, (f < 0) ? -(int32_t)v : (int32_t)v, dp);
+}
+
+int
+fmt_vsnprintf(char *b, int size, const char *fmt, va_list ap)
+{
+    char t[FMT_I32_MAX + 2];
+    const char *s;
+    int n = 0;
+    uint8_t tl, width, zero, lng, i;
+    int prec;
+    char pad;
+
+    if (size <= 0) {
+        return 0;
+    }
+
+#define FMT_PUT(c)  do { if (n < size - 1) { b[n++] = (c); } } while (0)
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            FMT_PUT(*fmt);
+            continue;
+        }
+        fmt++;
+        zero = (*fmt == '0');
+        if (zero) {
+            fmt++;
+        }
+        for (width = 0; *fmt >= '0' && *fmt <= '9'; fmt++) {
+            width = width * 10 + (*fmt - '0');
+        }
+        prec = -1;
+        if (*fmt == '.') {
+            fmt++;
+            if (*fmt == '*') {
+                prec = va_arg(ap, int);
+                fmt++;
+            } else {
+                for (prec = 0; *fmt >= '0' && *fmt <= '9'; fmt++) {
+                    prec = prec * 10 + (*fmt - '0');
+                }
+            }
+        }
+        lng = (*fmt == 'l');
+        if (lng) {
+            fmt++;
+        }
+
+        s = t;
+        switch (*fmt) {
+        case 'd':
+        case 'i':
+            tl = fmt_i32(t, lng ? (int32_t)va_arg(ap, long) : va_arg(ap, int));
+            break;
+        case 'u':
+            tl = fmt_u32(t, lng ? (uint32_t)va_arg(ap, unsigned long) :
+                    va_arg(ap, unsigned int));
+            break;
+        case 'x':
+        case 'X':
+            tl = fmt_hex(t, lng ? (uint32_t)va_arg(ap, unsigned long) :
+                    va_arg(ap, unsigned int), 0);
+            if (*fmt == 'X') {
+                for (i = 0; i < tl; i++) {
+                    if (t[i] >= 'a') {
+                        t[i] -= 'a' - 'A';
+                    }
+                }
+            }
+            break;
+        case 'p':
+            t[0] = '0';
+            t[1] = 'x';
+            tl = 2 + fmt_hex(t + 2, (uint32_t)(uintptr_t)va_arg(ap, void *), 0);
+            break;
+        case 'c':
+            t[0] = (char)va_arg(ap, int);
+            tl = 1;
+            break;
+        case 's':
+            s = va_arg(ap, const char *);
+            if (!s) {
+                s = "(null)";
+            }
+            for (tl = 0; tl < 255 && tl != prec && s[tl]; tl++) {
+                ;
+            }
+            break;
+        case '%':
+            t[0] = '%';
+            tl = 1;
+            break;
+        case '\0':
+            fmt--;      /* trailing '%', stop at the NUL */
+            continue;
+        default:
+            /* Unsupported, print it as-is. */
+            t[0] = '%';
+            t[1] = *fmt;
+            tl = 2;
+            break;
+        }
+
+        pad = (zero && s == t) ? '0' : ' ';
+        if (pad == '0' && tl && t[0] == '-') {
+            FMT_PUT('-');   /* sign goes before the zero padding */
+            s++;
+            tl--;
+            if (width) {
+                width--;
+            }
+        }
+        for (; width > tl; width--) {
+            FMT_PUT(pad);
+        }
+        while (tl--) {
+            FMT_PUT(*s++);
+        }
+    }
+
+#undef FMT_PUT
+
+    b[n] = '\0';
+    return n;
+}
+
+int
+fmt_snprintf(char *b, int size, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = fmt_vsnprintf(b, size, fmt, ap);
+    va_end(ap);
+
+    return n;
+}
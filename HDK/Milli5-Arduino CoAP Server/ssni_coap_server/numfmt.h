@@ -0,0 +1,77 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef UTIL_NUMFMT_H
+#define UTIL_NUMFMT_H
+
+#include <arduino.h>
+#include <stdarg.h>
+
+/*
+ * Integer and fixed-point to ASCII, without printf. Each formatter writes
+ * into b, doesn't NUL terminate, and returns the number of chars written.
+ * b must hold at least the FMT_*_MAX chars for the conversion.
+ */
+
+#define FMT_U32_MAX     (10)    /* 4294967295 */
+#define FMT_I32_MAX     (11)    /* -2147483648 */
+#define FMT_HEX32_MAX   (8)
+#define FMT_FIXED_MAX   (12)    /* sign, 10 digits and a decimal point */
+
+/* Largest number of decimal places fmt_fixed() and fmt_float() take */
+#define FMT_DP_MAX      (6)
+
+uint8_t fmt_u32(char *b, uint32_t v);
+uint8_t fmt_i32(char *b, int32_t v);
+
+/* Lower case hex, zero padded to at least width digits. */
+uint8_t fmt_hex(char *b, uint32_t v, uint8_t width);
+
+/* v is scaled by 10^dp, e.g. fmt_fixed(b, -705, 2) writes "-7.05". */
+uint8_t fmt_fixed(char *b, int32_t v, uint8_t dp);
+
+/*
+ * f rounded to dp decimal places, half away from zero. Scaled in integer
+ * fixed point, no double, the digits come from fmt_fixed(). Values out of
+ * int32 range after scaling are clamped.
+ */
+uint8_t fmt_float(char *b, float f, uint8_t dp);
+
+/*
+ * Minimal vsnprintf() for log messages: %d %i %u %x %X %c %s %p and %%, with
+ * an optional '0' flag, width and 'l' length modifier. A precision, including
+ * '*', only limits %s. No floating point.
+ * Output is truncated to size - 1 chars and always NUL terminated.
+ *
+ * @return: chars written, excluding the NUL.
+ */
+int fmt_vsnprintf(char *b, int size, const char *fmt, va_list ap);
+int fmt_snprintf(char *b, int size, const char *fmt, ...);
+
+#endif /* UTIL_NUMFMT_H */
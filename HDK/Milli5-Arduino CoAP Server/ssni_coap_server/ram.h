@@ -0,0 +1,87 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_RAM_H
+#define INC_RAM_H
+
+#include "includes.h"
+#include "hdlc.h"
+
+/*
+ * Static RAM of the library.
+ *
+ * The SAMD21 has 32 KB for the sketch, the Arduino core, the heap and the
+ * stack. The library's large buffers are all sized here, from the largest
+ * HDLC info field, so their total is known when building:
+ *
+ * - mbufs come from one pool of frame buffers (hbuf.cpp), each holding an
+ *   info field. They carry received frames, responses, notification
+ *   batches and the frames waiting in the TX queue.
+ * - The UART receive buffer holds two frames as they are on the line.
+ * - Observers hold the Uri-Path string of the resource they observe.
+ *
+ * Each module checks what it defines against its share below with
+ * RAM_ASSERT(), and the shares are checked against RAM_BUDGET. The shares
+ * are the sizes on the target; a 64-bit host build doesn't check them.
+ * Use tools/ram_report on the linker map to see the whole picture.
+ */
+
+/* Largest HDLC info field, MAX_HDLC_INFO_LEN of the sketch can't exceed it */
+#define RAM_INFO_LEN_MAX        (MNIC_MAX_PAYLOAD_SIZE)
+
+/* Frames held in the TX queue, COAP_TXQ_LEN */
+#define RAM_TXQ_LEN             (8)
+
+/* Concurrent observers */
+#define RAM_OBSERVERS           (8)
+
+/*
+ * mbufs in the pool: the TX queue, plus the frame being received and its
+ * copy, the response, a notification batch, a separate response on its
+ * way to the queue and a config record.
+ */
+#define RAM_MBUFS               (RAM_TXQ_LEN + 6)
+
+/* Shares of RAM_BUDGET, in bytes */
+#define RAM_SHARE_MBUF          (3712)  /* mbuf pool, hbuf.cpp */
+#define RAM_SHARE_HDLC          (544)   /* UART receive buffer, hdlc.cpp */
+#define RAM_SHARE_OBS           (832)   /* observers, coapobserve.cpp */
+#define RAM_SHARE_TXQ           (128)   /* TX queue entries, coaptxq.cpp */
+#define RAM_SHARE_LOG           (576)   /* print and frame dump buffers, log.cpp */
+#define RAM_SHARE_COAP          (64)    /* coap_pathstr(), coapmsg.cpp */
+
+#define RAM_BUDGET              (6 * 1024)
+
+#if defined(SSN_x86) && __SIZEOF_POINTER__ > 4
+#define RAM_ASSERT(x)
+#else
+#define RAM_ASSERT(x)           STATIC_ASSERT(x)
+#endif
+
+#endif /* INC_RAM_H */
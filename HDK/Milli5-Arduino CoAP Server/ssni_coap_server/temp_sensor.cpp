@@ -39,8 +39,6 @@ Networks, Inc.
 #include "exp_coap.h"
 #include "coap_rsp_msg.h"
 #include "coappdu.h"
-#include "coapobserve.h"
-#include "coapsensorobs.h"
 #include "temp_sensor.h"
 #include "arduino_pins.h"
 
@@ -50,191 +48,100 @@ Networks, Inc.
 /******************************************************************************/
 
 /*
- * crtemperature
- *
- * @brief CoAP Resource temperature sensor
- *
+ * PUT /temp?cfg=<C|F>
  */
-error_t crtemperature(struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it)
+static error_t temp_put_cfg( const char *v, uint8_t vl )
 {
-    struct optlv *o;
-	uint8_t obs = false;
+	if ( vl == 1 && v[0] == 'C' )
+	{
+		return arduino_put_temp_cfg( CELSIUS_SCALE );
+	}
+	if ( vl == 1 && v[0] == 'F' )
+	{
+		return arduino_put_temp_cfg( FAHRENHEIT_SCALE );
+	}
 
+	/* Not supported query. */
+	return ERR_OP_NOT_SUPP;
 
-    /* No URI path beyond /temp is supported, so reject if present. */
-    o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_PATH, &it);
-    if (o)
-    {
-        rsp->code = COAP_RSP_404_NOT_FOUND;
-        goto err;
-    }            
+} // temp_put_cfg
 
-    /* All methods require a query, so return an error if missing. */
-    if (!(o = copt_get_next_opt_type((const sl_co*)&(req->oh), COAP_OPTION_URI_QUERY, NULL))) 
-    {
-        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
-        goto err;
-    }
-    
-    /*
-     * PUT for writing configuration or enabling sensors
-     */
-    if (req->code == COAP_REQUEST_PUT) 
-    {
-        error_t rc = ERR_OK;
-
-        /* PUT /temp?cfg=<C|F> */
-        if (!coap_opt_strcmp(o, "cfg=C"))
-        {
-			arduino_put_temp_cfg(CELSIUS_SCALE);
-        } 
-        else if (!coap_opt_strcmp(o, "cfg=F"))
-        {
-			arduino_put_temp_cfg(FAHRENHEIT_SCALE);
-			
-        }
-        else
-        {
-            /* Not supported query. */
-            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
-            goto err;
-        }
-        
-        if (!rc)
-        {
-            rsp->code = COAP_RSP_204_CHANGED;
-            rsp->plen = 0;
-        }
-        else
-        {
-            switch (rc)
-            {
-            case ERR_BAD_DATA:
-            case ERR_INVAL:
-                rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
-                break;
-            default:
-                rsp->code = COAP_RSP_500_INTERNAL_ERROR;
-                break;
-            }
-            goto err;
-        }
-    } // if PUT
-    
-    /*
-     * GET for reading sensor or config information
-     */
-    else if (req->code == COAP_REQUEST_GET)
-    {
-        uint8_t rc, len = 0;
-
-        /* Config or sensor values. */
-        /* GET /temp?cfg */
-        if (!coap_opt_strcmp(o, "cfg"))
-        {
-            /* get temperature config */
-            rc = arduino_get_temp_cfg( rsp->msg, &len );
-        }
-        /* GET /temp?sens */
-        else if (!coap_opt_strcmp(o, "sens"))
-        {
-			if ((o = copt_get_next_opt_type((sl_co*)&(req->oh), COAP_OPTION_OBSERVE, NULL))) 
-			{
-				uint32_t obsval = co_uint32_n2h(o);
-				switch(obsval)
-				{
-					case COAP_OBS_REG:
-						rc = coap_obs_reg();
-						obs = true;
-						break;
-					
-					case COAP_OBS_DEREG:
-						rc = coap_obs_dereg();
-						break;
-					
-					default:
-						rc = ERR_INVAL;
-
-				} // switch
-			}
-			else
-			{
-				/* Get sensor value */
-				rc = arduino_get_temp( rsp->msg, &len );
-				
-			} // if-else
-        }
-        else {
-            /* Don't support other queries. */
-            rsp->code = COAP_RSP_501_NOT_IMPLEMENTED;
-            goto err;
-        }
-        dlog(LOG_DEBUG, "GET (status %d) read %d bytes.", rc, len);
-        if (!rc) {
-			if (obs)
-			{                        
-			/* Good code, but no content. */
-				rsp->code = COAP_RSP_203_VALID;
-				rsp->plen = 0;
-			}
-			else
-			{
-				rsp->plen = len;
-				rsp->cf = COAP_CF_CSV;
-				rsp->code = COAP_RSP_205_CONTENT;
-			}
-        } else {
-            switch (rc) {
-            case ERR_BAD_DATA:
-            case ERR_INVAL:
-                rsp->code = COAP_RSP_406_NOT_ACCEPTABLE;
-                break;
-            default:
-                rsp->code = COAP_RSP_500_INTERNAL_ERROR;
-                break;
-            }
-            goto err;
-        }
-    } // if GET
-    
-    /*
-     * DELETE for disabling sensors.
-     */
-    /* DELETE /temp?all */
-    else if (req->code == COAP_REQUEST_DELETE) 
-    {
-        if (!coap_opt_strcmp(o, "all"))
-        {
-            if (arduino_disab_temp()) 
-            {
-                rsp->code = COAP_RSP_500_INTERNAL_ERROR;
-                goto err;
-            }
-        } else {
-            rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
-            goto err;
-        }
-        rsp->code = COAP_RSP_202_DELETED;
-        rsp->plen = 0;
-    
-    } // if DELETE 
-    else 
-    {
-        /* no other operation is supported */
-        rsp->code = COAP_RSP_405_METHOD_NOT_ALLOWED;
-        goto err;
-        
-    } // Unknown operation
+/*
+ * /system/cfg, coap_temp_cfg_data_t
+ */
+static error_t temp_get_tlv( struct mbuf *m )
+{
+	coap_temp_cfg_data_t *d;
 
-done:
-    return ERR_OK;
+	d = (coap_temp_cfg_data_t *) m_append( m, sizeof(*d) );
+	if (!d)
+	{
+		return ERR_NO_MEM;
+	}
+	d->tl.u.sct = csct_temp;
+	d->tl.l = sizeof(*d) - sizeof(d->tl);
+	d->temp_min = temp_ctx.cfg.temp_min_thres;
+	d->temp_max = temp_ctx.cfg.temp_max_thres;
+	d->temp_hyst = temp_ctx.cfg.temp_hyst;
+	d->enable = ( temp_ctx.state != tsat_disabled );
+
+	return ERR_OK;
 
-err:
-    rsp->plen = 0;
+} // temp_get_tlv
 
-    return ERR_OK;
-    
-} // crtemperature
+static error_t temp_check_tlv( const coap_sens_tl_t *tl )
+{
+	const coap_temp_cfg_data_t *d = (const coap_temp_cfg_data_t *) tl;
+
+	if ( tl->l != sizeof(*d) - sizeof(d->tl) )
+	{
+		return ERR_BAD_DATA;
+	}
+	if ( d->temp_min > d->temp_max || d->enable > 1 )
+	{
+		return ERR_INVAL;
+	}
+
+	return ERR_OK;
+
+} // temp_check_tlv
+
+static void temp_set_tlv( const coap_sens_tl_t *tl )
+{
+	const coap_temp_cfg_data_t *d = (const coap_temp_cfg_data_t *) tl;
+
+	temp_ctx.cfg.temp_min_thres = d->temp_min;
+	temp_ctx.cfg.temp_max_thres = d->temp_max;
+	temp_ctx.cfg.temp_hyst = d->temp_hyst;
+	if (d->enable)
+	{
+		arduino_enab_temp();
+	}
+	else
+	{
+		arduino_disab_temp();
+	}
+
+} // temp_set_tlv
+
+/*
+ * CoAP resource temperature sensor, see coapsensor.h
+ */
+const struct coap_sensor_ops temp_sensor_ops =
+{
+	.read		= arduino_get_temp,			// GET ?sens
+	.get_cfg	= arduino_get_temp_cfg,		// GET ?cfg
+	.put_cfg	= temp_put_cfg,				// PUT ?cfg=<C|F>
+	.disable	= arduino_disab_temp,		// DELETE ?all
+	.sn			= arduino_get_temp_sn,		// ETag of ?sens
+	.cfg_gen	= arduino_get_temp_cfg_gen,	// ETag of ?cfg
+	.cfg_type	= csct_temp,				// /system/cfg
+	.get_tlv	= temp_get_tlv,
+	.check_tlv	= temp_check_tlv,
+	.set_tlv	= temp_set_tlv,
+	.start		= NULL,						// the DHT library reads in one call
+	.poll		= NULL
+};
 
 
 // TODO: What is this used for
@@ -305,6 +212,33 @@ error_t arduino_disab_temp()
 // Scale of temperature measurement
 static temp_scale_t temp_scale = FAHRENHEIT_SCALE;
 
+// Versions of the sample and of the config, sent as ETags. 0 is no version.
+static uint32_t temp_sample_sn = 0;
+static float	temp_sample_last = INVALID_TEMP;
+static uint32_t temp_cfg_gen = 1;
+
+/*
+ * arduino_get_temp_sn()
+ *
+ * Sequence number of the last distinct temperature sample
+ */
+uint32_t arduino_get_temp_sn()
+{
+	return temp_sample_sn;
+
+} // arduino_get_temp_sn
+
+/*
+ * arduino_get_temp_cfg_gen()
+ *
+ * Generation of the temperature config, bumped when the scale changes
+ */
+uint32_t arduino_get_temp_cfg_gen()
+{
+	return temp_cfg_gen;
+
+} // arduino_get_temp_cfg_gen
+
 /*
  * arduino_get_temp_scale()
  *
@@ -370,6 +304,8 @@ error_t arduino_get_temp( struct mbuf *m, uint8_t *len )
  */
 error_t arduino_put_temp_cfg( temp_scale_t scale )
 {
+	temp_scale_t prev = temp_scale;
+
 	switch(scale)
 	{
 	case CELSIUS_SCALE:
@@ -387,6 +323,13 @@ error_t arduino_put_temp_cfg( temp_scale_t scale )
 		
 	} // switch
 
+	// New config version, unless it's unchanged
+	if ( temp_scale != prev && ++temp_cfg_gen == 0 )
+	{
+		temp_cfg_gen = 1;
+
+	} // if
+
 	// Enable
 	arduino_enab_temp();
 	return ERR_OK;
@@ -453,6 +396,16 @@ error_t temp_sensor_read(float * p)
 			re *= 1.8;
 			re += 32;
 		}
+
+		// New sample version only if the reading changed
+		if ( re != temp_sample_last )
+		{
+			temp_sample_last = re;
+			if ( ++temp_sample_sn == 0 )
+			{
+				temp_sample_sn = 1;
+			}
+		}
 		
 		rc = ERR_OK;
 	}
@@ -32,6 +32,7 @@ Networks, Inc.
 
 #include <arduino.h>
 #include "errors.h"
+#include "coapsensor.h"
 
 typedef enum
 {
@@ -67,18 +68,20 @@ typedef struct temp_ctx
     
 } temp_ctx_t;
 
+extern temp_ctx_t temp_ctx;
+
 /******************************************************************************/
 /*                      Public Methods                                        */
 /******************************************************************************/
 
 
 /*
- * crtemperature
+ * temp_sensor_ops
  *
- * @brief CoAP Resource temperature sensor
+ * @brief CoAP Resource temperature sensor, for the sketch's sensor table
  *
  */
-error_t crtemperature( struct coap_msg_ctx *req, struct coap_msg_ctx *rsp, void *it );
+extern const struct coap_sensor_ops temp_sensor_ops;
 
 /*
  * disab_temp
@@ -136,6 +139,22 @@ error_t arduino_put_temp_cfg( temp_scale_t scale );
  */
 error_t arduino_get_temp_cfg(struct mbuf *m, uint8_t *len);
 
+/**
+ * @brief Sequence number of the last distinct temperature sample
+ *
+ * Sent as the ETag of GET /temp?sens, so a client can revalidate.
+ * @return uint32_t, 0 until the first good reading
+ */
+uint32_t arduino_get_temp_sn();
+
+/**
+ * @brief Generation of the temperature config
+ *
+ * Sent as the ETag of GET /temp?cfg, bumped whenever the scale changes.
+ * @return uint32_t
+ */
+uint32_t arduino_get_temp_cfg_gen();
+
 
 /******************************************************************************/
 /*                     Private Methods                                        */
@@ -0,0 +1,232 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <arduino.h>
+
+#include "includes.h"
+#include "errors.h"
+#include "log.h"
+#include "upg_flash.h"
+
+#if defined(SSN_x86)
+
+/*
+ * Host build: the region lives in a file, so an upgrade can be run end to
+ * end against the CoAP handler and the result inspected afterwards.
+ */
+static FILE *upg_fp;
+
+static FILE *
+upg_flash_file(void)
+{
+    if (!upg_fp) {
+        upg_fp = fopen(UPG_FLASH_FILE, "r+b");
+        if (!upg_fp) {
+            upg_fp = fopen(UPG_FLASH_FILE, "w+b");
+        }
+        if (!upg_fp) {
+            dlog(LOG_ERR, "Can't open %s", UPG_FLASH_FILE);
+        }
+    }
+    return upg_fp;
+}
+
+/* Read from the file, anything past its end reads as erased. */
+static error_t
+upg_file_read(uint32_t offs, void *buf, uint32_t len)
+{
+    FILE *fp = upg_flash_file();
+    size_t n = 0;
+
+    if (!fp) {
+        return ERR_IO;
+    }
+    if (fseek(fp, offs, SEEK_SET) == 0) {
+        n = fread(buf, 1, len, fp);
+    }
+    memset((uint8_t *)buf + n, 0xFF, len - n);
+    return ERR_OK;
+}
+
+static error_t
+upg_file_write(uint32_t offs, const void *buf, uint32_t len)
+{
+    FILE *fp = upg_flash_file();
+
+    if (!fp || fseek(fp, offs, SEEK_SET) != 0 ||
+            fwrite(buf, 1, len, fp) != len || fflush(fp) != 0) {
+        return ERR_IO;
+    }
+    return ERR_OK;
+}
+
+error_t
+upg_flash_erase_row(uint32_t offs)
+{
+    uint8_t row[UPG_FLASH_ROW_SIZE];
+
+    if (offs >= UPG_FLASH_REGION_SIZE) {
+        return ERR_INVAL;
+    }
+    memset(row, 0xFF, sizeof(row));
+    return upg_file_write(rounddown2(offs, UPG_FLASH_ROW_SIZE), row,
+            sizeof(row));
+}
+
+error_t
+upg_flash_write_page(uint32_t offs, const void *data)
+{
+    uint8_t page[UPG_FLASH_PAGE_SIZE];
+    const uint8_t *d = (const uint8_t *)data;
+    int i;
+
+    if ((offs & (UPG_FLASH_PAGE_SIZE - 1)) ||
+            offs >= UPG_FLASH_REGION_SIZE) {
+        return ERR_INVAL;
+    }
+    if (upg_file_read(offs, page, sizeof(page)) != ERR_OK) {
+        return ERR_IO;
+    }
+    for (i = 0; i < UPG_FLASH_PAGE_SIZE; i++) {
+        page[i] &= d[i];    /* programming only clears bits */
+    }
+    return upg_file_write(offs, page, sizeof(page));
+}
+
+error_t
+upg_flash_read(uint32_t offs, void *buf, uint32_t len)
+{
+    if (offs > UPG_FLASH_REGION_SIZE || len > UPG_FLASH_REGION_SIZE - offs) {
+        return ERR_INVAL;
+    }
+    return upg_file_read(offs, buf, len);
+}
+
+#elif defined(ARDUINO_ARCH_SAMD)
+
+/* NVM controller errors that can follow a command. */
+#define UPG_NVM_ERR     (NVMCTRL_STATUS_PROGE | NVMCTRL_STATUS_LOCKE | \
+                         NVMCTRL_STATUS_NVME)
+
+static void
+upg_nvm_wait(void)
+{
+    while (!NVMCTRL->INTFLAG.bit.READY) {
+        ;
+    }
+}
+
+/* Issue cmd, the CPU stalls on flash reads until it completes. */
+static error_t
+upg_nvm_cmd(uint32_t cmd)
+{
+    NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | cmd;
+    upg_nvm_wait();
+    if (NVMCTRL->STATUS.reg & UPG_NVM_ERR) {
+        return ERR_IO;
+    }
+    return ERR_OK;
+}
+
+error_t
+upg_flash_erase_row(uint32_t offs)
+{
+    if (offs >= UPG_FLASH_REGION_SIZE) {
+        return ERR_INVAL;
+    }
+    upg_nvm_wait();
+    NVMCTRL->STATUS.reg |= NVMCTRL_STATUS_MASK;
+    /* ADDR is in 16-bit words */
+    NVMCTRL->ADDR.reg =
+        (UPG_FLASH_BASE + rounddown2(offs, UPG_FLASH_ROW_SIZE)) / 2;
+    return upg_nvm_cmd(NVMCTRL_CTRLA_CMD_ER);
+}
+
+error_t
+upg_flash_write_page(uint32_t offs, const void *data)
+{
+    volatile uint32_t *dst = (volatile uint32_t *)(UPG_FLASH_BASE + offs);
+    const uint8_t *d = (const uint8_t *)data;
+    uint32_t w;
+    error_t rc;
+    int i;
+
+    if ((offs & (UPG_FLASH_PAGE_SIZE - 1)) ||
+            offs >= UPG_FLASH_REGION_SIZE) {
+        return ERR_INVAL;
+    }
+
+    /* Manual write: fill the page buffer, then commit it with WP. */
+    upg_nvm_wait();
+    NVMCTRL->CTRLB.bit.MANW = 1;
+    if ((rc = upg_nvm_cmd(NVMCTRL_CTRLA_CMD_PBC)) != ERR_OK) {
+        return rc;
+    }
+    NVMCTRL->STATUS.reg |= NVMCTRL_STATUS_MASK;
+
+    /* The page buffer only takes 32-bit writes, data may be unaligned. */
+    for (i = 0; i < UPG_FLASH_PAGE_SIZE / 4; i++) {
+        memcpy(&w, d + 4 * i, sizeof(w));
+        dst[i] = w;
+    }
+    return upg_nvm_cmd(NVMCTRL_CTRLA_CMD_WP);
+}
+
+error_t
+upg_flash_read(uint32_t offs, void *buf, uint32_t len)
+{
+    if (offs > UPG_FLASH_REGION_SIZE || len > UPG_FLASH_REGION_SIZE - offs) {
+        return ERR_INVAL;
+    }
+    memcpy(buf, (const void *)(UPG_FLASH_BASE + offs), len);
+    return ERR_OK;
+}
+
+#else
+
+/* No staging flash on this architecture, upgrades are refused. */
+error_t
+upg_flash_erase_row(uint32_t offs)
+{
+    return ERR_OP_NOT_SUPP;
+}
+
+error_t
+upg_flash_write_page(uint32_t offs, const void *data)
+{
+    return ERR_OP_NOT_SUPP;
+}
+
+error_t
+upg_flash_read(uint32_t offs, void *buf, uint32_t len)
+{
+    return ERR_OP_NOT_SUPP;
+}
+
+#endif
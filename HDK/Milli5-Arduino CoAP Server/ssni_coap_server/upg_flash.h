@@ -0,0 +1,72 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef INC_UPG_FLASH_H
+#define INC_UPG_FLASH_H
+
+#include <arduino.h>
+#include "errors.h"
+
+/*
+ * Staging region for firmware upgrade images.
+ *
+ * On the SAMD21 the region is the upper 128 KB of the 256 KB flash, so the
+ * running sketch must fit below UPG_FLASH_BASE. The last row holds the
+ * activation record read by the bootloader, the one before it the saved
+ * sensor configuration (coapcfg.h). Built with SSN_x86 the region is
+ * simulated by the file UPG_FLASH_FILE, with the same erase and write rules:
+ * rows erase to 0xFF and writes can only clear bits.
+ *
+ * Offsets passed to the functions below are relative to the start of the
+ * region.
+ */
+#define UPG_FLASH_BASE          (0x20000)
+#define UPG_FLASH_PAGE_SIZE     (64)        /* Write granularity */
+#define UPG_FLASH_ROW_SIZE      (256)       /* Erase granularity, 4 pages */
+#define UPG_FLASH_REGION_SIZE   (0x20000)
+
+/* Largest image that can be staged, the config and activation rows follow */
+#define UPG_FLASH_IMG_MAX       (UPG_FLASH_REGION_SIZE - 2 * UPG_FLASH_ROW_SIZE)
+#define UPG_FLASH_CFG_OFFS      (UPG_FLASH_IMG_MAX)
+#define UPG_FLASH_REC_OFFS      (UPG_FLASH_REGION_SIZE - UPG_FLASH_ROW_SIZE)
+
+#ifdef SSN_x86
+#define UPG_FLASH_FILE          "upg_flash.bin"
+#endif
+
+/* Erase the row containing offs. */
+error_t upg_flash_erase_row(uint32_t offs);
+
+/* Write one page. offs must be page aligned and the row already erased. */
+error_t upg_flash_write_page(uint32_t offs, const void *data);
+
+/* Copy len bytes starting at offs into buf. */
+error_t upg_flash_read(uint32_t offs, void *buf, uint32_t len);
+
+#endif /* INC_UPG_FLASH_H */
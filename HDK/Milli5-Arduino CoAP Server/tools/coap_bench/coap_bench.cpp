@@ -0,0 +1,1283 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+/*
+ * CoAP load generator and latency benchmark.
+ *
+ * Plays the mNIC: it is the HDLC primary station on a pty or serial device
+ * and sends the server the requests of one or more scenario files, each a
+ * weighted mix of GET/PUT/POST/DELETE requests plus observe registrations.
+ * Requests go one at a time in CON messages, as the mNIC forwards them;
+ * separate responses and notifications are collected with RR polls and
+ * ACKed.
+ *
+ * For each scenario it reports the throughput, the latency percentiles of
+ * each request line, CoAP and HDLC retransmissions, and the server's mbuf
+ * use read from /system/stats?mod=mbuf: allocations per request, the
+ * peak in use out of the pool, and allocations the pool couldn't serve.
+ * With observers it also counts the readings the notifications carried,
+ * one CSV row each, against those the server sent from
+ * /system/stats?mod=obs less the ones it replaced by newer ones in its
+ * queue (mod=txq); any difference is reported as lost.
+ * The results go to stdout or a file as JSON, for comparing
+ * runs, and as a table to stderr.
+ *
+ * Scenario files are line based, # starts a comment:
+ *
+ *   name     temp                  name in the results, default the file
+ *   requests 100                   stop after this many requests
+ *   duration 60                    or this many seconds, whichever first
+ *   think    0                     ms between requests
+ *   req  3 GET /arduino/temp?sens  weight, method, URI, payload in hex
+ *   observe /arduino/temp?sens&p=1000   registered for the whole run
+ *   observe /arduino/temp?sens&p=1000&n=3   three readings a notification
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <arduino.h>
+#include "hdlc.h"
+#include "hdlcp.h"
+#include "log.h"
+#include "coapmsg.h"
+#include "coappdu.h"
+#include "coapextif.h"
+#include "exp_coap.h"
+#include "arduino_time.h"
+#include "line.h"
+
+#define BENCH_BAUD              (38400)     /* UART_BAUD_RATE of the server */
+#define BENCH_PDU_MAX           (MNIC_MAX_PAYLOAD_SIZE)
+#define BENCH_URI_MAX           (OPT_STR_MAX)
+#define BENCH_PAYLOAD_MAX       (64)
+#define BENCH_REQ_MAX           (16)        /* req lines per scenario */
+#define BENCH_OBS_MAX           (4)         /* observe lines per scenario */
+#define BENCH_SCN_MAX           (16)        /* scenario files per run */
+#define BENCH_TKL               (4)
+#define BENCH_ACKQ              (8)
+
+/* CoAP transmission parameters, RFC 7252 4.8 */
+#define BENCH_ACK_TIMEOUT_MS    (2000)
+#define BENCH_MAX_RETRANSMIT    (4)
+
+/* Wait for a separate response after its empty ACK */
+#define BENCH_SEP_TIMEOUT_MS    (10000)
+
+/* Wait for the server to answer SNRM after it's started */
+#define BENCH_CONNECT_MS        (10000)
+
+/* Poll for notifications at least this often while requests go out */
+#define BENCH_OBS_POLL_MS       (1000)
+
+/* Default run length when a scenario gives neither requests nor duration */
+#define BENCH_REQUESTS          (100)
+
+struct bench_cfg {
+    const char  *dev;           /* serial device, NULL a new pty */
+    const char  *server;        /* command started with the pty appended */
+    const char  *server_log;    /* its stdout and stderr */
+    const char  *out;           /* JSON results, NULL stdout */
+    uint32_t    baud;
+    uint32_t    timeout_ms;
+    uint32_t    retry;
+    uint32_t    seed;
+    int         log_level;
+};
+
+/* Latency samples and counters of a request line */
+struct bench_lat {
+    uint32_t    *us;
+    uint32_t    n;
+    uint32_t    size;
+};
+
+struct bench_req {
+    uint32_t    weight;
+    uint8_t     code;
+    char        uri[BENCH_URI_MAX + 1];
+    uint8_t     payload[BENCH_PAYLOAD_MAX];
+    int         plen;
+
+    struct bench_lat lat;
+    uint32_t    sent;
+    uint32_t    errors;         /* 4.xx and 5.xx responses */
+    uint32_t    timeouts;       /* no response, or the link dropped */
+    uint32_t    retransmit;     /* CoAP retransmissions */
+    uint32_t    separate;       /* separate responses */
+};
+
+struct bench_obs {
+    char        uri[BENCH_URI_MAX + 1];
+    uint8_t     token[BENCH_TKL];
+    uint8_t     code;           /* of the registration */
+    uint32_t    notifications;
+    uint32_t    readings;       /* rows in their payloads */
+};
+
+/* The HDLC counters reported, summed over reconnects */
+struct bench_hdlc {
+    uint32_t    send_i;
+    uint32_t    send_i_recovery;
+    uint32_t    send_rr;
+    uint32_t    recv_frame_timeout;
+    uint32_t    recv_fcs_err;
+    uint32_t    seqnum_err;
+    uint32_t    link_err;
+};
+
+/* The server's count of readings notified, see bench_rdg_stats() */
+struct bench_rdg {
+    uint32_t    readings;       /* coap_obs_stats */
+    uint32_t    coalesced;      /* coap_txq_stats, replaced before sent */
+};
+
+struct bench_scn {
+    const char  *file;
+    char        name[32];
+    uint32_t    requests;
+    uint32_t    duration_s;
+    uint32_t    think_ms;
+    struct bench_req req[BENCH_REQ_MAX];
+    int         nreq;
+    uint32_t    wsum;
+    struct bench_obs obs[BENCH_OBS_MAX];
+    int         nobs;
+
+    /* Results */
+    uint32_t    done;
+    uint32_t    elapsed_ms;
+    uint32_t    unexpected;     /* frames for no request or observer */
+    struct bench_hdlc hdlc;
+    int         have_mbuf;
+    struct coap_mbuf_stats mb_start;
+    struct coap_mbuf_stats mb_end;
+    uint32_t    mb_read_allocs; /* allocations of one stats read */
+    int         have_rdg;
+    struct bench_rdg rdg_start;
+    struct bench_rdg rdg_end;
+};
+
+/* The exchange in progress */
+struct bench_txn {
+    uint16_t    mid;
+    uint8_t     token[BENCH_TKL];
+    int         acked;          /* empty ACK, a separate response follows */
+    int         done;
+    uint8_t     code;
+    uint8_t     rsp[BENCH_PDU_MAX];
+    int         rsplen;
+};
+
+static struct bench_cfg     bcfg;
+static struct bench_scn     bscn[BENCH_SCN_MAX];
+static int                  nscn;
+static struct bench_scn     *cur_scn;
+static struct bench_txn     txn;
+static struct hdlc_conn     *bconn;
+static struct bench_hdlc    bhdlc;  /* counters of closed connections */
+static int                  bfd = -1;
+static pid_t                bserver;
+static uint16_t             bmid;
+static uint32_t             btoken;
+static uint16_t             backq[BENCH_ACKQ];
+static int                  nackq;
+static volatile sig_atomic_t bstop;
+
+
+static void
+bench_signal(int sig)
+{
+    (void)sig;
+    bstop = 1;
+}
+
+static void
+bench_new_token(uint8_t *t)
+{
+    ++btoken;
+    t[0] = btoken >> 24;
+    t[1] = btoken >> 16;
+    t[2] = btoken >> 8;
+    t[3] = btoken;
+}
+
+
+/******************************************************************************
+ * CoAP messages
+ *****************************************************************************/
+
+/* Put an option header and value, returns its length */
+static int
+bench_opt(uint8_t *b, uint16_t prev, uint16_t num, const void *v, int len)
+{
+    uint16_t d = num - prev;
+    int i = 1;
+
+    b[0] = 0;
+    if (d < 13) {
+        b[0] |= d << 4;
+    } else {
+        b[0] |= 13 << 4;
+        b[i++] = d - 13;
+    }
+    if (len < 13) {
+        b[0] |= len;
+    } else {
+        b[0] |= 13;
+        b[i++] = len - 13;
+    }
+    memcpy(b + i, v, len);
+    return i + len;
+}
+
+/*
+ * Build a CON request for uri, "/path/to?q1&q2". obs is the Observe value,
+ * or -1 for none. Returns the length, 0 if it doesn't fit.
+ */
+static int
+bench_encode(uint8_t *b, uint8_t code, const char *uri, int obs,
+             const uint8_t *token, const uint8_t *payload, int plen)
+{
+    const char *s, *e, *q;
+    uint16_t prev = 0;
+    uint8_t ov;
+    int i = 0;
+
+    if (strlen(uri) + plen + 32 > BENCH_PDU_MAX) {
+        return 0;
+    }
+    b[i++] = COAP_VER | COAP_T_CONF | BENCH_TKL;
+    b[i++] = code;
+    b[i++] = bmid >> 8;
+    b[i++] = bmid;
+    memcpy(b + i, token, BENCH_TKL);
+    i += BENCH_TKL;
+
+    if (obs >= 0) {
+        ov = obs;
+        i += bench_opt(b + i, prev, COAP_OPTION_OBSERVE, &ov, obs ? 1 : 0);
+        prev = COAP_OPTION_OBSERVE;
+    }
+    q = strchr(uri, '?');
+    for (s = uri; s < (q ? q : uri + strlen(uri)); s = e) {
+        s += (*s == '/');
+        e = s + strcspn(s, "/?");
+        i += bench_opt(b + i, prev, COAP_OPTION_URI_PATH, s, e - s);
+        prev = COAP_OPTION_URI_PATH;
+    }
+    for (s = q; s && *s; s = e) {
+        s++;
+        e = s + strcspn(s, "&");
+        i += bench_opt(b + i, prev, COAP_OPTION_URI_QUERY, s, e - s);
+        prev = COAP_OPTION_URI_QUERY;
+    }
+    if (plen) {
+        b[i++] = 0xFF;
+        memcpy(b + i, payload, plen);
+        i += plen;
+    }
+    return i;
+}
+
+/* Offset of the payload of a message, len if there's none, -1 if bad */
+static int
+bench_payload(const uint8_t *m, int len)
+{
+    int i, d, l;
+
+    i = 4 + COAP_TKL(m[0]);
+    while (i < len) {
+        if (m[i] == 0xFF) {
+            return i + 1;
+        }
+        d = m[i] >> 4;
+        l = m[i] & 0x0F;
+        i++;
+        if (d == 15 || l == 15) {
+            return -1;
+        }
+        i += (d == 13) + 2 * (d == 14);
+        if (l >= 13) {
+            if (i + l - 12 > len) {
+                return -1;
+            }
+            l = l == 13 ? m[i] + 13 : (m[i] << 8 | m[i + 1]) + 269;
+            i += l >= 269 ? 2 : 1;
+        }
+        i += l;
+    }
+    return i == len ? len : -1;
+}
+
+/* Readings in a notification, its payload rows are separated by '\n' */
+static uint32_t
+bench_rows(const uint8_t *m, int len)
+{
+    uint32_t n;
+    int off;
+
+    off = bench_payload(m, len);
+    if (off < 0 || off == len) {
+        return 0;
+    }
+    for (n = 1; off < len; off++) {
+        n += m[off] == '\n';
+    }
+    return n;
+}
+
+static const char *
+bench_method(uint8_t code)
+{
+    switch (code) {
+    case COAP_CODE_GET:     return "GET";
+    case COAP_CODE_POST:    return "POST";
+    case COAP_CODE_PUT:     return "PUT";
+    case COAP_CODE_DELETE:  return "DELETE";
+    default:                return "?";
+    }
+}
+
+
+/******************************************************************************
+ * The link
+ *****************************************************************************/
+
+static void
+bench_hdlc_add(struct bench_hdlc *h, const struct hdlcstat *st)
+{
+    h->send_i += st->send_i;
+    h->send_i_recovery += st->send_i_recovery;
+    h->send_rr += st->send_rr;
+    h->recv_frame_timeout += st->recv_frame_timeout;
+    h->recv_fcs_err += st->recv_fcs_err;
+    h->seqnum_err += st->seqnum_err;
+}
+
+/* Counters so far, over all connections */
+static void
+bench_hdlc_get(struct bench_hdlc *h)
+{
+    *h = bhdlc;
+    if (bconn) {
+        bench_hdlc_add(h, hdlcp_stats(bconn));
+    }
+}
+
+static int
+bench_connect(uint32_t wait_ms)
+{
+    uint32_t start = time_ms();
+    int rc;
+
+    do {
+        rc = hdlc_session_connect(&bconn, bfd, NULL, NULL);
+        if (!rc) {
+            nackq = 0;
+            return 0;
+        }
+        bconn = NULL;
+    } while (!bstop && (uint32_t)(time_ms() - start) < wait_ms);
+    fprintf(stderr, "SNRM not answered (%d)\n", rc);
+    return rc;
+}
+
+/*
+ * A link error ends the connection; start over with SNRM, as the mNIC
+ * does. The exchange in progress is lost.
+ */
+static int
+bench_link_err(int rc)
+{
+    if (rc == HDLC_ERROR_CONNECTION || rc == HDLC_ERROR_TX_RETRY ||
+        rc == HDLC_ERROR_RECV_FRAME) {
+        dlog(LOG_WARNING, "HDLC link lost (%d)", rc);
+        bench_hdlc_add(&bhdlc, hdlcp_stats(bconn));
+        ++bhdlc.link_err;
+        hdlc_disconnect(bconn);
+        bconn = NULL;
+        bench_connect(BENCH_CONNECT_MS);
+    }
+    return rc;
+}
+
+/* A frame from the server: a response, a notification or an empty ACK */
+static void
+bench_dispatch(const uint8_t *m, int len)
+{
+    uint8_t type, tkl;
+    uint16_t mid;
+    int i;
+
+    if (len < 4 || (m[0] & 0xC0) != COAP_VER || len < 4 + COAP_TKL(m[0])) {
+        ++cur_scn->unexpected;
+        return;
+    }
+    type = m[0] & 0x30;
+    tkl = COAP_TKL(m[0]);
+    mid = m[2] << 8 | m[3];
+
+    if (type == COAP_T_CONF && nackq < BENCH_ACKQ) {
+        backq[nackq++] = mid;
+    }
+    if (tkl == BENCH_TKL && m[1] != COAP_CODE_EMPTY) {
+        if (!txn.done && !memcmp(m + 4, txn.token, BENCH_TKL)) {
+            txn.done = 1;
+            txn.code = m[1];
+            memcpy(txn.rsp, m, len);
+            txn.rsplen = len;
+            return;
+        }
+        for (i = 0; i < cur_scn->nobs; i++) {
+            if (!memcmp(m + 4, cur_scn->obs[i].token, BENCH_TKL)) {
+                ++cur_scn->obs[i].notifications;
+                cur_scn->obs[i].readings += bench_rows(m, len);
+                return;
+            }
+        }
+    } else if (type == COAP_T_ACK && m[1] == COAP_CODE_EMPTY &&
+               mid == txn.mid) {
+        txn.acked = 1;
+        return;
+    }
+    ++cur_scn->unexpected;
+}
+
+/*
+ * Send a message, or poll with RR if m is NULL, and handle the frame the
+ * server answers with. CON frames from the server are ACKed here.
+ */
+static int
+bench_xfer(const uint8_t *m, int len)
+{
+    uint8_t buf[BENCH_PDU_MAX + 1], ack[4];
+    int rc, n;
+
+    if (!bconn && (rc = bench_connect(0))) {
+        return rc;
+    }
+    if (m) {
+        rc = hdlc_data_txfr(bconn, m, len, buf, &n, sizeof(buf));
+    } else {
+        rc = hdlc_data_recv(bconn, buf, &n, sizeof(buf));
+    }
+    if (rc) {
+        return bench_link_err(rc);
+    }
+    if (n > 0) {
+        bench_dispatch(buf, n);
+    }
+    while (nackq) {
+        --nackq;
+        ack[0] = COAP_VER | COAP_T_ACK;
+        ack[1] = COAP_CODE_EMPTY;
+        ack[2] = backq[nackq] >> 8;
+        ack[3] = backq[nackq];
+        rc = hdlc_data_txfr(bconn, ack, sizeof(ack), buf, &n, sizeof(buf));
+        if (rc) {
+            return bench_link_err(rc);
+        }
+        if (n > 0) {
+            bench_dispatch(buf, n);
+        }
+    }
+    return 0;
+}
+
+/*
+ * One request and its response. Sent again after ACK_TIMEOUT, doubling,
+ * if nothing comes back. Returns 0 once the response is in txn.
+ */
+static int
+bench_request(uint8_t code, const char *uri, int obs, const uint8_t *token,
+              const uint8_t *payload, int plen, uint32_t *lat_us,
+              uint32_t *retransmit, uint32_t *separate)
+{
+    uint8_t m[BENCH_PDU_MAX];
+    uint32_t t0, sent, timeout;
+    int len, rc, tx;
+
+    memset(&txn, 0, sizeof(txn));
+    txn.mid = ++bmid;
+    memcpy(txn.token, token, BENCH_TKL);
+    len = bench_encode(m, code, uri, obs, token, payload, plen);
+    if (!len) {
+        return ERR_INVAL;
+    }
+
+    t0 = micros();
+    timeout = BENCH_ACK_TIMEOUT_MS;
+    for (tx = 0; tx <= BENCH_MAX_RETRANSMIT && !txn.done && !txn.acked; tx++) {
+        if (tx && retransmit) {
+            ++*retransmit;
+        }
+        sent = time_ms();
+        rc = bench_xfer(m, len);
+        while (!rc && !txn.done && !txn.acked && !bstop &&
+               (uint32_t)(time_ms() - sent) < timeout) {
+            rc = bench_xfer(NULL, 0);
+        }
+        if (rc || bstop) {
+            return rc ? rc : ERR_FAIL;
+        }
+        timeout *= 2;
+    }
+
+    if (txn.acked && !txn.done) {
+        if (separate) {
+            ++*separate;
+        }
+        sent = time_ms();
+        while (!txn.done && !bstop &&
+               (uint32_t)(time_ms() - sent) < BENCH_SEP_TIMEOUT_MS) {
+            if ((rc = bench_xfer(NULL, 0))) {
+                return rc;
+            }
+        }
+    }
+    if (!txn.done) {
+        return ERR_TIME_OUT;
+    }
+    if (lat_us) {
+        *lat_us = micros() - t0;
+    }
+    return 0;
+}
+
+/* GET, or PUT to reset, the server's mbuf counters */
+static int
+bench_mbuf_stats(uint8_t code, struct coap_mbuf_stats *ms)
+{
+    const coap_sys_mbuf_stats_t *d;
+    uint8_t token[BENCH_TKL];
+    int off;
+
+    bench_new_token(token);
+    if (bench_request(code, "/system/stats?mod=mbuf", -1, token, NULL, 0,
+                      NULL, NULL, NULL)) {
+        return 1;
+    }
+    if (code == COAP_CODE_PUT) {
+        return txn.code != COAP_RSP_204_CHANGED;
+    }
+    off = bench_payload(txn.rsp, txn.rsplen);
+    if (txn.code != COAP_RSP_205_CONTENT || off < 0 ||
+        txn.rsplen - off < (int)sizeof(*d)) {
+        return 1;
+    }
+    d = (const coap_sys_mbuf_stats_t *)(txn.rsp + off);
+    if (d->tl.u.rdt != crdt_stat_mbuf) {
+        return 1;
+    }
+    ms->size = ntohl(d->ms.size);
+    ms->in_use = ntohl(d->ms.in_use);
+    ms->peak = ntohl(d->ms.peak);
+    ms->allocs = ntohl(d->ms.allocs);
+    ms->frees = ntohl(d->ms.frees);
+    ms->pool = ntohl(d->ms.pool);
+    ms->fails = ntohl(d->ms.fails);
+    return 0;
+}
+
+/* The payload of a GET of /system/stats?mod=<mod>, NULL if none */
+static const void *
+bench_stats_get(const char *mod, uint8_t rdt, int size)
+{
+    const coap_sens_tl_t *tl;
+    uint8_t token[BENCH_TKL];
+    char uri[BENCH_URI_MAX + 1];
+    int off;
+
+    snprintf(uri, sizeof(uri), "/system/stats?mod=%s", mod);
+    bench_new_token(token);
+    if (bench_request(COAP_CODE_GET, uri, -1, token, NULL, 0,
+                      NULL, NULL, NULL)) {
+        return NULL;
+    }
+    off = bench_payload(txn.rsp, txn.rsplen);
+    if (txn.code != COAP_RSP_205_CONTENT || off < 0 ||
+        txn.rsplen - off < size) {
+        return NULL;
+    }
+    tl = (const coap_sens_tl_t *)(txn.rsp + off);
+    return tl->u.rdt == rdt ? tl : NULL;
+}
+
+/* GET the readings the server notified, and the ones it coalesced */
+static int
+bench_rdg_stats(struct bench_rdg *rs)
+{
+    const coap_sys_obs_stats_t *os;
+    const coap_sys_txq_stats_t *ts;
+
+    os = (const coap_sys_obs_stats_t *)
+         bench_stats_get("obs", crdt_stat_obs, sizeof(*os));
+    if (!os) {
+        return 1;
+    }
+    rs->readings = ntohl(os->os.readings);
+    ts = (const coap_sys_txq_stats_t *)
+         bench_stats_get("txq", crdt_stat_txq, sizeof(*ts));
+    if (!ts) {
+        return 1;
+    }
+    rs->coalesced = ntohl(ts->ts.coalesced);
+    return 0;
+}
+
+
+/******************************************************************************
+ * Scenarios
+ *****************************************************************************/
+
+static int
+bench_hex(const char *s, uint8_t *b, int size)
+{
+    int n = 0;
+    unsigned int v;
+
+    while (*s) {
+        if (n == size || sscanf(s, "%2x", &v) != 1 || !s[1]) {
+            return -1;
+        }
+        b[n++] = v;
+        s += 2;
+    }
+    return n;
+}
+
+static int
+bench_load(struct bench_scn *sc, const char *file)
+{
+    char line[256], *kw, *a[4];
+    struct bench_req *r;
+    const char *base;
+    FILE *fp;
+    int ln = 0, n;
+
+    memset(sc, 0, sizeof(*sc));
+    sc->file = file;
+    base = strrchr(file, '/');
+    snprintf(sc->name, sizeof(sc->name), "%s", base ? base + 1 : file);
+    if (strchr(sc->name, '.')) {
+        *strchr(sc->name, '.') = '\0';
+    }
+
+    if (!(fp = fopen(file, "r"))) {
+        fprintf(stderr, "Can't open %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        ln++;
+        if (strchr(line, '#')) {
+            *strchr(line, '#') = '\0';
+        }
+        if (!(kw = strtok(line, " \t\r\n"))) {
+            continue;
+        }
+        for (n = 0; n < 4 && (a[n] = strtok(NULL, " \t\r\n")); n++) {
+        }
+
+        if (!strcmp(kw, "name") && n == 1) {
+            snprintf(sc->name, sizeof(sc->name), "%s", a[0]);
+        } else if (!strcmp(kw, "requests") && n == 1) {
+            sc->requests = strtoul(a[0], NULL, 0);
+        } else if (!strcmp(kw, "duration") && n == 1) {
+            sc->duration_s = strtoul(a[0], NULL, 0);
+        } else if (!strcmp(kw, "think") && n == 1) {
+            sc->think_ms = strtoul(a[0], NULL, 0);
+        } else if (!strcmp(kw, "req") && (n == 3 || n == 4) &&
+                   sc->nreq < BENCH_REQ_MAX && strlen(a[2]) <= BENCH_URI_MAX) {
+            r = &sc->req[sc->nreq];
+            r->weight = strtoul(a[0], NULL, 0);
+            r->code = !strcmp(a[1], "GET") ? COAP_CODE_GET :
+                      !strcmp(a[1], "POST") ? COAP_CODE_POST :
+                      !strcmp(a[1], "PUT") ? COAP_CODE_PUT :
+                      !strcmp(a[1], "DELETE") ? COAP_CODE_DELETE : 0;
+            strcpy(r->uri, a[2]);
+            r->plen = n == 4 ? bench_hex(a[3], r->payload, sizeof(r->payload)) : 0;
+            if (!r->weight || !r->code || r->plen < 0) {
+                goto bad;
+            }
+            sc->wsum += r->weight;
+            sc->nreq++;
+        } else if (!strcmp(kw, "observe") && n == 1 && sc->nobs < BENCH_OBS_MAX &&
+                   strlen(a[0]) <= BENCH_URI_MAX) {
+            strcpy(sc->obs[sc->nobs++].uri, a[0]);
+        } else {
+            goto bad;
+        }
+    }
+    fclose(fp);
+    if (!sc->nreq) {
+        fprintf(stderr, "%s: no requests\n", file);
+        return 1;
+    }
+    if (!sc->requests && !sc->duration_s) {
+        sc->requests = BENCH_REQUESTS;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "%s:%d: bad line\n", file, ln);
+    fclose(fp);
+    return 1;
+}
+
+static struct bench_req *
+bench_pick(struct bench_scn *sc)
+{
+    uint32_t w = rand() % sc->wsum;
+    int i;
+
+    for (i = 0; w >= sc->req[i].weight; i++) {
+        w -= sc->req[i].weight;
+    }
+    return &sc->req[i];
+}
+
+static void
+bench_lat_add(struct bench_lat *l, uint32_t us)
+{
+    if (l->n == l->size) {
+        l->size = l->size ? l->size * 2 : 256;
+        l->us = (uint32_t *)realloc(l->us, l->size * sizeof(*l->us));
+        if (!l->us) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    l->us[l->n++] = us;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted samples, p in thousandths */
+static uint32_t
+bench_pct(const struct bench_lat *l, uint32_t p)
+{
+    uint32_t r;
+
+    if (!l->n) {
+        return 0;
+    }
+    r = ((uint64_t)l->n * p + 999) / 1000;
+    return l->us[r ? r - 1 : 0];
+}
+
+static uint32_t
+bench_mean(const struct bench_lat *l)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < l->n; i++) {
+        sum += l->us[i];
+    }
+    return l->n ? sum / l->n : 0;
+}
+
+static uint32_t
+bench_notifications(const struct bench_scn *sc)
+{
+    uint32_t n = 0;
+    int i;
+
+    for (i = 0; i < sc->nobs; i++) {
+        n += sc->obs[i].notifications;
+    }
+    return n;
+}
+
+/* Poll until the server has no more notifications queued, as the mNIC does */
+static void
+bench_poll(const struct bench_scn *sc)
+{
+    uint32_t n;
+
+    do {
+        n = bench_notifications(sc);
+        if (bench_xfer(NULL, 0)) {
+            break;
+        }
+    } while (!bstop && bench_notifications(sc) != n);
+}
+
+static void
+bench_observe(struct bench_scn *sc, int on)
+{
+    struct bench_obs *o;
+    int i;
+
+    for (i = 0; i < sc->nobs; i++) {
+        o = &sc->obs[i];
+        if (on) {
+            bench_new_token(o->token);
+        }
+        if (!bench_request(COAP_CODE_GET, o->uri, on ? 0 : 1, o->token,
+                           NULL, 0, NULL, NULL, NULL) && on) {
+            o->code = txn.code;
+        }
+    }
+}
+
+static void
+bench_run(struct bench_scn *sc)
+{
+    struct bench_hdlc h0, h1;
+    struct coap_mbuf_stats ms;
+    struct bench_req *r;
+    uint8_t token[BENCH_TKL];
+    uint32_t start, last_poll, us;
+    int i, rc;
+
+    cur_scn = sc;
+    fprintf(stderr, "%s: ", sc->name);
+
+    /*
+     * Restart the mbuf peak, then read the counters twice; the difference
+     * is what a read costs, taken off the allocations of the run. The
+     * readings count starts before the observers register.
+     */
+    sc->have_rdg = sc->nobs && !bench_rdg_stats(&sc->rdg_start);
+    bench_observe(sc, 1);
+    sc->have_mbuf = !bench_mbuf_stats(COAP_CODE_PUT, NULL) &&
+                    !bench_mbuf_stats(COAP_CODE_GET, &ms) &&
+                    !bench_mbuf_stats(COAP_CODE_GET, &sc->mb_start);
+    if (sc->have_mbuf) {
+        sc->mb_read_allocs = sc->mb_start.allocs - ms.allocs;
+    }
+    bench_hdlc_get(&h0);
+
+    start = last_poll = time_ms();
+    while (!bstop && (!sc->requests || sc->done < sc->requests) &&
+           (!sc->duration_s ||
+            (uint32_t)(time_ms() - start) < sc->duration_s * 1000)) {
+        r = bench_pick(sc);
+        bench_new_token(token);
+        ++r->sent;
+        rc = bench_request(r->code, r->uri, -1, token, r->payload, r->plen,
+                           &us, &r->retransmit, &r->separate);
+        if (rc) {
+            ++r->timeouts;
+        } else {
+            bench_lat_add(&r->lat, us);
+            if ((txn.code & COAP_CODE_C_MASK) != COAP_CODE_SUCCESS) {
+                ++r->errors;
+            }
+        }
+        ++sc->done;
+        if (sc->done % 10 == 0) {
+            fputc('.', stderr);
+        }
+
+        /* Think, collecting notifications */
+        us = time_ms();
+        do {
+            if (sc->nobs &&
+                (uint32_t)(time_ms() - last_poll) >= BENCH_OBS_POLL_MS) {
+                bench_poll(sc);
+                last_poll = time_ms();
+            } else if (sc->think_ms) {
+                delay(10);
+            }
+        } while (!bstop && (uint32_t)(time_ms() - us) < sc->think_ms);
+    }
+    sc->elapsed_ms = time_ms() - start;
+
+    bench_hdlc_get(&h1);
+    sc->hdlc.send_i = h1.send_i - h0.send_i;
+    sc->hdlc.send_i_recovery = h1.send_i_recovery - h0.send_i_recovery;
+    sc->hdlc.send_rr = h1.send_rr - h0.send_rr;
+    sc->hdlc.recv_frame_timeout = h1.recv_frame_timeout - h0.recv_frame_timeout;
+    sc->hdlc.recv_fcs_err = h1.recv_fcs_err - h0.recv_fcs_err;
+    sc->hdlc.seqnum_err = h1.seqnum_err - h0.seqnum_err;
+    sc->hdlc.link_err = h1.link_err - h0.link_err;
+
+    if (sc->have_mbuf) {
+        sc->have_mbuf = !bench_mbuf_stats(COAP_CODE_GET, &sc->mb_end);
+    }
+    bench_observe(sc, 0);
+
+    /* Collect the notifications still queued, then what the server sent */
+    if (sc->have_rdg) {
+        bench_poll(sc);
+        sc->have_rdg = !bench_rdg_stats(&sc->rdg_end);
+    }
+    fputc('\n', stderr);
+
+    for (i = 0; i < sc->nreq; i++) {
+        qsort(sc->req[i].lat.us, sc->req[i].lat.n, sizeof(uint32_t), bench_cmp);
+    }
+}
+
+
+/******************************************************************************
+ * Results
+ *****************************************************************************/
+
+static void
+bench_json_str(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+        }
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static double
+bench_allocs_per_req(const struct bench_scn *sc)
+{
+    uint32_t a = sc->mb_end.allocs - sc->mb_start.allocs - sc->mb_read_allocs;
+
+    return sc->done ? (double)a / sc->done : 0;
+}
+
+static uint32_t
+bench_readings(const struct bench_scn *sc)
+{
+    uint32_t n = 0;
+    int i;
+
+    for (i = 0; i < sc->nobs; i++) {
+        n += sc->obs[i].readings;
+    }
+    return n;
+}
+
+/*
+ * Readings the server sent that never arrived. A coalesced notification
+ * carried a single reading, replaced by design, so it isn't counted.
+ */
+static int
+bench_lost(const struct bench_scn *sc)
+{
+    return (int)(sc->rdg_end.readings - sc->rdg_start.readings -
+                 (sc->rdg_end.coalesced - sc->rdg_start.coalesced) -
+                 bench_readings(sc));
+}
+
+static void
+bench_json(FILE *fp)
+{
+    const struct bench_scn *sc;
+    const struct bench_req *r;
+    const struct bench_obs *o;
+    uint32_t n, err, retx, notif;
+    int i, j;
+
+    fprintf(fp, "{\n  \"tool\": \"coap_bench\",\n  \"version\": 1,\n"
+                "  \"baud\": %u,\n  \"scenarios\": [", bcfg.baud);
+    for (i = 0; i < nscn; i++) {
+        sc = &bscn[i];
+        n = err = retx = notif = 0;
+        for (j = 0; j < sc->nreq; j++) {
+            n += sc->req[j].lat.n;
+            err += sc->req[j].errors + sc->req[j].timeouts;
+            retx += sc->req[j].retransmit;
+        }
+        notif = bench_notifications(sc);
+
+        fprintf(fp, "%s\n    {\n      \"name\": ", i ? "," : "");
+        bench_json_str(fp, sc->name);
+        fprintf(fp, ",\n      \"file\": ");
+        bench_json_str(fp, sc->file);
+        fprintf(fp, ",\n      \"requests\": %u,\n      \"responses\": %u,\n"
+                    "      \"errors\": %u,\n      \"elapsed_ms\": %u,\n"
+                    "      \"throughput_rps\": %.3f,\n"
+                    "      \"coap_retransmit\": %u,\n"
+                    "      \"notifications\": %u,\n      \"unexpected\": %u,\n",
+                sc->done, n, err, sc->elapsed_ms,
+                sc->elapsed_ms ? sc->done * 1000.0 / sc->elapsed_ms : 0.0,
+                retx, notif, sc->unexpected);
+        fprintf(fp, "      \"hdlc\": {\"send_i\": %u, \"send_i_recovery\": %u, "
+                    "\"send_rr\": %u, \"recv_frame_timeout\": %u, "
+                    "\"recv_fcs_err\": %u, \"seqnum_err\": %u, "
+                    "\"link_err\": %u},\n",
+                sc->hdlc.send_i, sc->hdlc.send_i_recovery, sc->hdlc.send_rr,
+                sc->hdlc.recv_frame_timeout, sc->hdlc.recv_fcs_err,
+                sc->hdlc.seqnum_err, sc->hdlc.link_err);
+        if (sc->have_mbuf) {
+            fprintf(fp, "      \"mbuf\": {\"size\": %u, \"allocs_per_request\": "
+                        "%.2f, \"peak\": %u, \"pool\": %u, \"fails\": %u, "
+                        "\"in_use_start\": %u, \"in_use_end\": %u},\n",
+                    sc->mb_end.size, bench_allocs_per_req(sc), sc->mb_end.peak,
+                    sc->mb_end.pool, sc->mb_end.fails - sc->mb_start.fails,
+                    sc->mb_start.in_use, sc->mb_end.in_use);
+        } else {
+            fprintf(fp, "      \"mbuf\": null,\n");
+        }
+
+        if (sc->have_rdg) {
+            fprintf(fp, "      \"readings\": {\"received\": %u, \"sent\": %u, "
+                        "\"coalesced\": %u, \"lost\": %d},\n",
+                    bench_readings(sc), sc->rdg_end.readings - sc->rdg_start.readings,
+                    sc->rdg_end.coalesced - sc->rdg_start.coalesced,
+                    bench_lost(sc));
+        } else {
+            fprintf(fp, "      \"readings\": null,\n");
+        }
+        fprintf(fp, "      \"observe\": [");
+        for (j = 0; j < sc->nobs; j++) {
+            o = &sc->obs[j];
+            fprintf(fp, "%s\n        {\"uri\": ", j ? "," : "");
+            bench_json_str(fp, o->uri);
+            fprintf(fp, ", \"code\": \"%u.%02u\", \"notifications\": %u, "
+                        "\"readings\": %u}",
+                    o->code >> 5, o->code & COAP_CODE_DD_MASK, o->notifications,
+                    o->readings);
+        }
+        fprintf(fp, "%s],\n      \"uris\": [", sc->nobs ? "\n      " : "");
+        for (j = 0; j < sc->nreq; j++) {
+            r = &sc->req[j];
+            fprintf(fp, "%s\n        {\"method\": \"%s\", \"uri\": ",
+                    j ? "," : "", bench_method(r->code));
+            bench_json_str(fp, r->uri);
+            fprintf(fp, ", \"sent\": %u, \"responses\": %u, \"errors\": %u, "
+                        "\"timeouts\": %u, \"retransmit\": %u, \"separate\": %u,\n"
+                        "         \"latency_us\": {\"min\": %u, \"mean\": %u, "
+                        "\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}}",
+                    r->sent, r->lat.n, r->errors, r->timeouts, r->retransmit,
+                    r->separate, bench_pct(&r->lat, 0), bench_mean(&r->lat),
+                    bench_pct(&r->lat, 500), bench_pct(&r->lat, 990),
+                    bench_pct(&r->lat, 999), bench_pct(&r->lat, 1000));
+        }
+        fprintf(fp, "\n      ]\n    }");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+static void
+bench_table(void)
+{
+    const struct bench_scn *sc;
+    const struct bench_req *r;
+    char what[BENCH_URI_MAX + 8];
+    int i, j;
+
+    for (i = 0; i < nscn; i++) {
+        sc = &bscn[i];
+        fprintf(stderr, "\n%s: %u requests in %.1f s, %.2f/s\n", sc->name,
+                sc->done, sc->elapsed_ms / 1000.0,
+                sc->elapsed_ms ? sc->done * 1000.0 / sc->elapsed_ms : 0.0);
+        fprintf(stderr, "  %-36s %5s %4s %4s %8s %8s %8s %8s\n", "request",
+                "rsp", "err", "retx", "p50 ms", "p99 ms", "p999 ms", "max ms");
+        for (j = 0; j < sc->nreq; j++) {
+            r = &sc->req[j];
+            snprintf(what, sizeof(what), "%s %s", bench_method(r->code), r->uri);
+            fprintf(stderr, "  %-36s %5u %4u %4u %8.1f %8.1f %8.1f %8.1f\n",
+                    what, r->lat.n, r->errors + r->timeouts, r->retransmit,
+                    bench_pct(&r->lat, 500) / 1000.0,
+                    bench_pct(&r->lat, 990) / 1000.0,
+                    bench_pct(&r->lat, 999) / 1000.0,
+                    bench_pct(&r->lat, 1000) / 1000.0);
+        }
+        for (j = 0; j < sc->nobs; j++) {
+            fprintf(stderr, "  observe %-28s %u notifications, %u readings\n",
+                    sc->obs[j].uri, sc->obs[j].notifications,
+                    sc->obs[j].readings);
+        }
+        if (sc->have_rdg) {
+            fprintf(stderr, "  readings: %u sent, %u coalesced, %d lost\n",
+                    sc->rdg_end.readings - sc->rdg_start.readings,
+                    sc->rdg_end.coalesced - sc->rdg_start.coalesced,
+                    bench_lost(sc));
+        }
+        fprintf(stderr, "  hdlc: %u I frames, %u resent, %u reply timeouts, "
+                "%u link errors\n", sc->hdlc.send_i, sc->hdlc.send_i_recovery,
+                sc->hdlc.recv_frame_timeout, sc->hdlc.link_err);
+        if (sc->have_mbuf) {
+            fprintf(stderr, "  mbuf: %.2f allocs/request, peak %u of %u x %u "
+                    "bytes, %u failed, in use %u -> %u\n",
+                    bench_allocs_per_req(sc), sc->mb_end.peak,
+                    sc->mb_end.pool, sc->mb_end.size,
+                    sc->mb_end.fails - sc->mb_start.fails,
+                    sc->mb_start.in_use, sc->mb_end.in_use);
+        }
+    }
+}
+
+
+/******************************************************************************
+ * Main
+ *****************************************************************************/
+
+/* Start the server on the pty, its output goes to the log */
+static pid_t
+bench_start_server(const char *cmd, const char *pty, const char *logf)
+{
+    char *sh;
+    pid_t pid;
+    int fd;
+
+    if (asprintf(&sh, "exec %s %s", cmd, pty) < 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        fd = open(logf ? logf : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execl("/bin/sh", "sh", "-c", sh, (char *)NULL);
+        _exit(127);
+    }
+    free(sh);
+    return pid;
+}
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+        "usage: coap_bench [options] scenario...\n"
+        "  -s dev   serial device, default a new pty\n"
+        "  -x cmd   start the server as 'cmd pty', e.g. ../mshield_host/mshield_host\n"
+        "  -L file  the server's output, default /dev/null\n"
+        "  -b baud  line rate, default %d\n"
+        "  -t ms    HDLC reply timeout, default 2000\n"
+        "  -n n     HDLC sends before giving up, default 3\n"
+        "  -S seed  of the request mix, default 1\n"
+        "  -o file  JSON results, default stdout\n"
+        "  -v n     log level 0-7, default %d\n",
+        BENCH_BAUD, LOG_WARNING);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct hdlcp_cfg hcfg;
+    const char *pty = NULL;
+    FILE *fp;
+    int i, opt, rc = 0;
+
+    bcfg.baud = BENCH_BAUD;
+    bcfg.timeout_ms = 2000;
+    bcfg.retry = 3;
+    bcfg.seed = 1;
+    bcfg.log_level = LOG_WARNING;
+
+    while ((opt = getopt(argc, argv, "s:x:L:b:t:n:S:o:v:h")) != -1) {
+        switch (opt) {
+        case 's': bcfg.dev = optarg;                        break;
+        case 'x': bcfg.server = optarg;                     break;
+        case 'L': bcfg.server_log = optarg;                 break;
+        case 'b': bcfg.baud = strtoul(optarg, NULL, 0);     break;
+        case 't': bcfg.timeout_ms = strtoul(optarg, NULL, 0); break;
+        case 'n': bcfg.retry = strtoul(optarg, NULL, 0);    break;
+        case 'S': bcfg.seed = strtoul(optarg, NULL, 0);     break;
+        case 'o': bcfg.out = optarg;                        break;
+        case 'v': bcfg.log_level = atoi(optarg);            break;
+        default:
+            bench_usage();
+            return 2;
+        }
+    }
+    if (optind == argc || argc - optind > BENCH_SCN_MAX ||
+        !line_baud_ok(bcfg.baud) || (bcfg.server && bcfg.dev)) {
+        bench_usage();
+        return 2;
+    }
+    for (i = optind; i < argc; i++) {
+        if (bench_load(&bscn[nscn++], argv[i])) {
+            return 2;
+        }
+    }
+
+    log_init(&SerialUSB, 0, bcfg.log_level);
+    srand(bcfg.seed);
+    signal(SIGINT, bench_signal);
+    signal(SIGTERM, bench_signal);
+
+    hcfg.baud = bcfg.dev ? 0 : bcfg.baud;
+    hcfg.rsp_timeout_ms = bcfg.timeout_ms;
+    hcfg.max_retry = bcfg.retry;
+    hcfg.max_info = MNIC_MAX_PAYLOAD_SIZE;
+    hdlcp_init(&hcfg);
+
+    if ((bfd = line_open(bcfg.dev, bcfg.baud, &pty)) < 0) {
+        return 1;
+    }
+    if (bcfg.server) {
+        bserver = bench_start_server(bcfg.server, pty, bcfg.server_log);
+        if (bserver < 0) {
+            fprintf(stderr, "Can't start %s\n", bcfg.server);
+            return 1;
+        }
+    } else if (pty) {
+        fprintf(stderr, "pty %s, waiting for the server\n", pty);
+    }
+
+    if (bench_connect(bcfg.server || pty ? BENCH_CONNECT_MS * 6 : BENCH_CONNECT_MS)) {
+        rc = 1;
+        goto done;
+    }
+    for (i = 0; i < nscn && !bstop; i++) {
+        bench_run(&bscn[i]);
+    }
+    nscn = i;
+
+    bench_table();
+    fp = bcfg.out ? fopen(bcfg.out, "w") : stdout;
+    if (!fp) {
+        fprintf(stderr, "Can't open %s: %s\n", bcfg.out, strerror(errno));
+        rc = 1;
+        goto done;
+    }
+    bench_json(fp);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+done:
+    if (bconn) {
+        hdlc_disconnect(bconn);
+    }
+    if (bserver > 0) {
+        kill(bserver, SIGTERM);
+        waitpid(bserver, NULL, 0);
+    }
+    return rc;
+}
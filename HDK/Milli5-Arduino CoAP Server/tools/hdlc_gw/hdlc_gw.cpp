@@ -0,0 +1,523 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+/*
+ * HDLC to CoAP/UDP gateway.
+ *
+ * Stands in for the mNIC so the Milli5 CoAP server can be driven with any
+ * CoAP client. The gateway is the HDLC primary station on a pty or serial
+ * device, and a CoAP endpoint on localhost:
+ *
+ *   coap client <-> UDP 127.0.0.1:5683 <-> hdlc_gw <-> pty/UART <-> server
+ *
+ * Each datagram is sent to the server in an I frame and the frame it
+ * answers with is returned to the sender. Between requests the server is
+ * polled with RR for separate responses and notifications, which go to
+ * the client that sent the request with the same token.
+ *
+ * The mesh between the clients and the mNIC is emulated with a one way
+ * delay, jitter and a loss rate, applied to datagrams in both directions.
+ * On a pty frames are paced to the UART line rate; a serial device paces
+ * itself.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <arduino.h>
+#include "hdlc.h"
+#include "hdlcp.h"
+#include "log.h"
+#include "arduino_time.h"
+#include "line.h"
+
+#define GW_UDP_PORT         (5683)
+#define GW_BAUD             (38400)     /* UART_BAUD_RATE of the server */
+#define GW_POLL_MS          (200)       /* RR poll interval when idle */
+#define GW_RECONNECT_MS     (1000)
+
+/* Datagrams in flight across the emulated mesh, each direction */
+#define GW_QLEN             (32)
+
+/* Tokens remembered to route server frames back to clients */
+#define GW_ROUTES           (16)
+
+#define GW_DGRAM_MAX        (MNIC_MAX_PAYLOAD_SIZE)
+
+struct gw_pkt {
+    uint32_t            due;        /* time_ms() it leaves the mesh */
+    struct sockaddr_in  addr;       /* client */
+    int                 len;
+    uint8_t             data[GW_DGRAM_MAX];
+};
+
+struct gw_q {
+    struct gw_pkt   p[GW_QLEN];
+    int             n;
+};
+
+struct gw_route {
+    uint32_t            used;       /* time_ms() last seen */
+    uint8_t             tkl;
+    uint8_t             token[8];
+    struct sockaddr_in  addr;
+};
+
+struct gw_stats {
+    uint32_t    udp_rx;
+    uint32_t    udp_tx;
+    uint32_t    mesh_loss;
+    uint32_t    mesh_overflow;
+    uint32_t    too_large;
+    uint32_t    requests;
+    uint32_t    responses;
+    uint32_t    polled;
+    uint32_t    unrouted;
+    uint32_t    link_err;
+    uint32_t    reconnects;
+};
+
+struct gw_cfg {
+    const char  *dev;               /* serial device, NULL for a pty */
+    uint32_t    baud;
+    uint16_t    port;
+    uint32_t    delay_ms;
+    uint32_t    jitter_ms;
+    uint32_t    loss_pct;
+    uint32_t    poll_ms;
+    uint32_t    timeout_ms;
+    uint32_t    retry;
+    int         log_level;
+};
+
+static struct gw_q      gw_in;      /* clients to server */
+static struct gw_q      gw_out;     /* server to clients */
+static struct gw_route  gw_rt[GW_ROUTES];
+static struct sockaddr_in gw_last;  /* most recent client */
+static int              gw_have_last;
+static struct gw_stats  gws;
+static volatile sig_atomic_t gw_stop;
+
+
+static void
+gw_signal(int sig)
+{
+    (void)sig;
+    gw_stop = 1;
+}
+
+/* Open the line to the server, print the name of a new pty */
+static int
+gw_open_line(const struct gw_cfg *cfg)
+{
+    const char *pty = NULL;
+    int fd;
+
+    fd = line_open(cfg->dev, cfg->baud, &pty);
+    if (fd >= 0 && pty) {
+        printf("pty %s\n", pty);
+        fflush(stdout);
+    }
+    return fd;
+}
+
+static int
+gw_open_udp(uint16_t port)
+{
+    struct sockaddr_in a;
+    int s;
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s, (struct sockaddr *)&a, sizeof(a))) {
+        fprintf(stderr, "Can't bind UDP port %d: %s\n", port, strerror(errno));
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+
+/*
+ * Hand a datagram to the mesh. It's lost with the configured probability,
+ * otherwise it comes out after the delay plus up to the jitter. Jitter can
+ * reorder datagrams, as the mesh does.
+ */
+static void
+gw_mesh_put(const struct gw_cfg *cfg, struct gw_q *q,
+            const struct sockaddr_in *addr, const uint8_t *data, int len)
+{
+    struct gw_pkt *p;
+    uint32_t due;
+    int i;
+
+    if (cfg->loss_pct && (uint32_t)(rand() % 100) < cfg->loss_pct) {
+        ++gws.mesh_loss;
+        return;
+    }
+    if (q->n == GW_QLEN) {
+        ++gws.mesh_overflow;
+        return;
+    }
+
+    due = time_ms() + cfg->delay_ms;
+    if (cfg->jitter_ms) {
+        due += rand() % (cfg->jitter_ms + 1);
+    }
+
+    /* Keep the queue ordered by exit time */
+    for (i = q->n; i > 0 && (int32_t)(q->p[i - 1].due - due) > 0; i--) {
+        q->p[i] = q->p[i - 1];
+    }
+    p = &q->p[i];
+    p->due = due;
+    p->addr = *addr;
+    p->len = len;
+    memcpy(p->data, data, len);
+    q->n++;
+}
+
+/* The next datagram out of the mesh, NULL if none is due */
+static struct gw_pkt *
+gw_mesh_due(struct gw_q *q)
+{
+    if (q->n && (int32_t)(time_ms() - q->p[0].due) >= 0) {
+        return &q->p[0];
+    }
+    return NULL;
+}
+
+static void
+gw_mesh_pop(struct gw_q *q)
+{
+    memmove(&q->p[0], &q->p[1], (q->n - 1) * sizeof(q->p[0]));
+    q->n--;
+}
+
+
+/* Remember who sent the request with this token */
+static void
+gw_route_add(const uint8_t *m, int len, const struct sockaddr_in *addr)
+{
+    struct gw_route *r, *old = &gw_rt[0];
+    uint8_t tkl;
+    int i;
+
+    gw_last = *addr;
+    gw_have_last = 1;
+    tkl = len >= 4 ? m[0] & 0x0F : 0;
+    if (tkl == 0 || tkl > 8 || len < 4 + tkl) {
+        return;
+    }
+    for (i = 0; i < GW_ROUTES; i++) {
+        r = &gw_rt[i];
+        if (r->tkl == tkl && !memcmp(r->token, m + 4, tkl)) {
+            old = r;
+            break;
+        }
+        if ((int32_t)(r->used - old->used) < 0 || !r->tkl) {
+            old = r;
+        }
+    }
+    old->used = time_ms();
+    old->tkl = tkl;
+    memcpy(old->token, m + 4, tkl);
+    old->addr = *addr;
+}
+
+/* The client a frame from the server goes to, by its token */
+static const struct sockaddr_in *
+gw_route_find(const uint8_t *m, int len)
+{
+    uint8_t tkl;
+    int i;
+
+    tkl = len >= 4 ? m[0] & 0x0F : 0;
+    if (tkl && tkl <= 8 && len >= 4 + tkl) {
+        for (i = 0; i < GW_ROUTES; i++) {
+            if (gw_rt[i].tkl == tkl && !memcmp(gw_rt[i].token, m + 4, tkl)) {
+                gw_rt[i].used = time_ms();
+                return &gw_rt[i].addr;
+            }
+        }
+    }
+    ++gws.unrouted;
+    return gw_have_last ? &gw_last : NULL;
+}
+
+
+static int
+gw_connect(int fd, struct hdlc_conn **conn)
+{
+    int rc;
+
+    rc = hdlc_session_connect(conn, fd, NULL, NULL);
+    if (rc) {
+        dlog(LOG_WARNING, "SNRM not answered (%d)", rc);
+        return rc;
+    }
+    printf("connected, max info %u\n", hdlcp_max_info(*conn));
+    fflush(stdout);
+    return 0;
+}
+
+static void
+gw_print_stats(struct hdlc_conn *conn)
+{
+    const struct hdlcstat *st;
+
+    printf("udp_rx %u\nudp_tx %u\nmesh_loss %u\nmesh_overflow %u\n"
+           "too_large %u\nrequests %u\nresponses %u\npolled %u\n"
+           "unrouted %u\nlink_err %u\nreconnects %u\n",
+           gws.udp_rx, gws.udp_tx, gws.mesh_loss, gws.mesh_overflow,
+           gws.too_large, gws.requests, gws.responses, gws.polled,
+           gws.unrouted, gws.link_err, gws.reconnects);
+    if (!conn) {
+        return;
+    }
+    st = hdlcp_stats(conn);
+    printf("send_snrm %u\nsend_i %u\nsend_rr %u\nsend_i_recovery %u\n"
+           "recv_i %u\nrecv_rr %u\nrecv_rnr %u\nseqnum_err %u\n"
+           "recv_frame_timeout %u\nrecv_hdr_err %u\nrecv_fcs_err %u\n"
+           "data_txfr_abort %u\n",
+           st->send_snrm, st->send_i, st->send_rr, st->send_i_recovery,
+           st->recv_i, st->recv_rr, st->recv_rnr, st->seqnum_err,
+           st->recv_frame_timeout, st->recv_hdr_err, st->recv_fcs_err,
+           st->data_txfr_abort);
+}
+
+static int
+gw_self_test(void)
+{
+    int rc = 0;
+
+    if (hdlc_test_control()) {
+        fprintf(stderr, "hdlc_test_control failed\n");
+        rc = 1;
+    }
+    if (hdlc_test_frame_encode()) {
+        fprintf(stderr, "hdlc_test_frame_encode failed\n");
+        rc = 1;
+    }
+    if (hdlc_test_rsp_ua()) {
+        fprintf(stderr, "hdlc_test_rsp_ua failed\n");
+        rc = 1;
+    }
+    if (hdlc_test_rx_split()) {
+        fprintf(stderr, "hdlc_test_rx_split failed\n");
+        rc = 1;
+    }
+    printf("self test %s\n", rc ? "failed" : "passed");
+    return rc;
+}
+
+static void
+gw_usage(void)
+{
+    fprintf(stderr,
+        "usage: hdlc_gw [options]\n"
+        "  -s dev   serial device, default a new pty\n"
+        "  -b baud  line rate, default %d\n"
+        "  -u port  UDP port on 127.0.0.1, default %d\n"
+        "  -d ms    one way mesh delay\n"
+        "  -j ms    mesh jitter, added to the delay\n"
+        "  -l pct   mesh loss, each way\n"
+        "  -r ms    RR poll interval when idle, default %d\n"
+        "  -t ms    HDLC reply timeout, default 2000\n"
+        "  -n n     HDLC sends before giving up, default 3\n"
+        "  -v n     log level 0-7, default %d\n"
+        "  -T       run the HDLC unit tests and exit\n",
+        GW_BAUD, GW_UDP_PORT, GW_POLL_MS, LOG_WARNING);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct gw_cfg cfg;
+    struct hdlcp_cfg hcfg;
+    struct hdlc_conn *conn = NULL;
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    struct pollfd pfd;
+    struct gw_pkt *p;
+    const struct sockaddr_in *to;
+    uint8_t buf[GW_DGRAM_MAX + 1];
+    uint32_t now, last_poll = 0, last_try = 0;
+    int fd, s, n, rc, opt, wait;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.baud = GW_BAUD;
+    cfg.port = GW_UDP_PORT;
+    cfg.poll_ms = GW_POLL_MS;
+    cfg.timeout_ms = 2000;
+    cfg.retry = 3;
+    cfg.log_level = LOG_WARNING;
+
+    while ((opt = getopt(argc, argv, "s:b:u:d:j:l:r:t:n:v:Th")) != -1) {
+        switch (opt) {
+        case 's': cfg.dev = optarg;                     break;
+        case 'b': cfg.baud = strtoul(optarg, NULL, 0);  break;
+        case 'u': cfg.port = strtoul(optarg, NULL, 0);  break;
+        case 'd': cfg.delay_ms = strtoul(optarg, NULL, 0); break;
+        case 'j': cfg.jitter_ms = strtoul(optarg, NULL, 0); break;
+        case 'l': cfg.loss_pct = strtoul(optarg, NULL, 0); break;
+        case 'r': cfg.poll_ms = strtoul(optarg, NULL, 0); break;
+        case 't': cfg.timeout_ms = strtoul(optarg, NULL, 0); break;
+        case 'n': cfg.retry = strtoul(optarg, NULL, 0); break;
+        case 'v': cfg.log_level = atoi(optarg);         break;
+        case 'T': return gw_self_test();
+        default:
+            gw_usage();
+            return 2;
+        }
+    }
+    if (!line_baud_ok(cfg.baud) || cfg.loss_pct > 100) {
+        gw_usage();
+        return 2;
+    }
+
+    log_init(&SerialUSB, 0, cfg.log_level);
+    srand(time(NULL));
+    signal(SIGINT, gw_signal);
+    signal(SIGTERM, gw_signal);
+
+    hcfg.baud = cfg.dev ? 0 : cfg.baud;
+    hcfg.rsp_timeout_ms = cfg.timeout_ms;
+    hcfg.max_retry = cfg.retry;
+    hcfg.max_info = MNIC_MAX_PAYLOAD_SIZE;
+    hdlcp_init(&hcfg);
+
+    if ((fd = gw_open_line(&cfg)) < 0 || (s = gw_open_udp(cfg.port)) < 0) {
+        return 1;
+    }
+
+    while (!gw_stop) {
+        now = time_ms();
+        rc = 0;
+
+        /* (Re)connect, then serve the link */
+        if (!conn && (uint32_t)(now - last_try) >= GW_RECONNECT_MS) {
+            last_try = now;
+            if (gw_connect(fd, &conn)) {
+                conn = NULL;
+            }
+        } else if (conn && (p = gw_mesh_due(&gw_in))) {
+            ++gws.requests;
+            rc = hdlc_data_txfr(conn, p->data, p->len, buf, &n, sizeof(buf));
+            if (rc == 0 && n > 0) {
+                ++gws.responses;
+                gw_mesh_put(&cfg, &gw_out, &p->addr, buf, n);
+            }
+            gw_mesh_pop(&gw_in);
+            last_poll = time_ms();
+        } else if (conn && (uint32_t)(now - last_poll) >= cfg.poll_ms) {
+            rc = hdlc_data_recv(conn, buf, &n, sizeof(buf));
+            if (rc == 0 && n > 0) {
+                ++gws.polled;
+                if ((to = gw_route_find(buf, n))) {
+                    gw_mesh_put(&cfg, &gw_out, to, buf, n);
+                }
+                /* More may be queued, poll again right away */
+            } else {
+                last_poll = time_ms();
+            }
+        }
+
+        if (conn && (rc == HDLC_ERROR_CONNECTION || rc == HDLC_ERROR_TX_RETRY ||
+                     rc == HDLC_ERROR_RECV_FRAME)) {
+            /* Start over with SNRM, the server may have restarted */
+            dlog(LOG_WARNING, "HDLC link lost (%d)", rc);
+            ++gws.link_err;
+            ++gws.reconnects;
+            conn = NULL;
+        }
+
+        /* Deliver what has crossed the mesh towards the clients */
+        while ((p = gw_mesh_due(&gw_out))) {
+            if (sendto(s, p->data, p->len, 0, (struct sockaddr *)&p->addr,
+                       sizeof(p->addr)) == p->len) {
+                ++gws.udp_tx;
+            }
+            gw_mesh_pop(&gw_out);
+        }
+
+        /* Sleep until a datagram arrives or there's something to do */
+        wait = conn ? cfg.poll_ms : GW_RECONNECT_MS;
+        if (gw_in.n) {
+            wait = (int32_t)(gw_in.p[0].due - time_ms());
+        }
+        if (gw_out.n && (int32_t)(gw_out.p[0].due - time_ms()) < wait) {
+            wait = (int32_t)(gw_out.p[0].due - time_ms());
+        }
+        if (conn && (uint32_t)(time_ms() - last_poll) < cfg.poll_ms &&
+            (int32_t)(cfg.poll_ms - (time_ms() - last_poll)) < wait) {
+            wait = cfg.poll_ms - (time_ms() - last_poll);
+        }
+        if (wait < 0) {
+            wait = 0;
+        }
+        pfd.fd = s;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, wait) <= 0) {
+            continue;
+        }
+
+        fromlen = sizeof(from);
+        n = recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+        if (n <= 0) {
+            continue;
+        }
+        ++gws.udp_rx;
+        if (n > GW_DGRAM_MAX || (conn && (uint32_t)n > hdlcp_max_info(conn))) {
+            /* Larger than an HDLC info field, the mNIC drops these too */
+            ++gws.too_large;
+            continue;
+        }
+        gw_route_add(buf, n, &from);
+        gw_mesh_put(&cfg, &gw_in, &from, buf, n);
+    }
+
+    if (conn) {
+        hdlc_disconnect(conn);
+    }
+    gw_print_stats(conn);
+    return 0;
+}
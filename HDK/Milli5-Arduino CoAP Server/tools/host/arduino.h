@@ -0,0 +1,122 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+/*
+ * Host stand-in for the parts of the Arduino core the CoAP server library
+ * uses, so library sources built with SSN_x86 compile and link on Linux.
+ * HardwareSerial is backed by a file descriptor (pty or serial device),
+ * Serial_ (the USB monitor) prints to stderr.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH            (1)
+#define LOW             (0)
+#define INPUT           (0)
+#define OUTPUT          (1)
+
+#define A0              (14)
+#define A1              (15)
+#define A2              (16)
+#define A3              (17)
+#define A4              (18)
+#define A5              (19)
+#define LED_BUILTIN     (13)
+
+#define SERIAL_8N1      (0x06)
+#define SERIAL_8E1      (0x16)
+
+#ifndef min
+#define min(a,b)        ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b)        ((a) > (b) ? (a) : (b))
+#endif
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int analogRead(uint8_t pin);
+
+/* Console, printed to stderr */
+class Serial_ {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    void print(const char *s) { fputs(s, stderr); }
+    void print(int n) { fprintf(stderr, "%d", n); }
+    void println(const char *s) { fprintf(stderr, "%s\n", s); }
+    void println(int n) { fprintf(stderr, "%d\n", n); }
+    void println(void) { fputc('\n', stderr); }
+    void flush(void) { fflush(stderr); }
+    operator bool() { return true; }
+};
+
+/*
+ * UART on a file descriptor. Reads follow the Arduino Stream rules:
+ * readBytes() returns once len bytes are in or nothing has arrived for the
+ * timeout set with setTimeout().
+ */
+class HardwareSerial {
+public:
+    HardwareSerial() : fd(-1), timeout_ms(1000) {}
+    void attach(int f) { fd = f; }
+    void begin(unsigned long baud) { (void)baud; }
+    void begin(unsigned long baud, uint16_t config) { (void)baud; (void)config; }
+    void end(void) {}
+    void setTimeout(unsigned long ms) { timeout_ms = ms; }
+    int available(void);
+    int read(void);
+    size_t readBytes(uint8_t *buf, size_t len);
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t len);
+    void flush(void) {}
+    operator bool() { return fd >= 0; }
+private:
+    int fd;
+    unsigned long timeout_ms;
+};
+
+extern Serial_ SerialUSB;
+extern HardwareSerial Serial1;
+
+#endif /* HOST_ARDUINO_H */
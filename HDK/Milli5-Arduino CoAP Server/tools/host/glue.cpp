@@ -0,0 +1,64 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+/*
+ * hdlc.cpp, log.cpp and coapmsg.cpp bring in calls to the secondary's loop
+ * and the RTC timebase. Tools that link the HDLC or CoAP message code without
+ * the rest of the server don't run those paths; these keep them linking.
+ */
+
+#include <time.h>
+
+#include "arduino.h"
+#include "coapsensorobs.h"
+#include "arduino_time.h"
+
+boolean do_observe()
+{
+    return false;
+}
+
+uint32_t time_ms(void)
+{
+    return millis();
+}
+
+void print_current_time(void)
+{
+    char b[32];
+    time_t t = time(NULL);
+
+    strftime(b, sizeof(b), "%H:%M:%S ", localtime(&t));
+    fputs(b, stderr);
+}
+
+time_t get_rtc_epoch()
+{
+    return time(NULL);
+}
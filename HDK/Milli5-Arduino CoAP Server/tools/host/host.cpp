@@ -0,0 +1,143 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "arduino.h"
+
+Serial_ SerialUSB;
+HardwareSerial Serial1;
+
+static uint64_t
+host_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned long
+millis(void)
+{
+    return (unsigned long)(host_now_us() / 1000);
+}
+
+unsigned long
+micros(void)
+{
+    return (unsigned long)host_now_us();
+}
+
+void
+delay(unsigned long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+void digitalWrite(uint8_t pin, uint8_t val) { (void)pin; (void)val; }
+int analogRead(uint8_t pin) { (void)pin; return 0; }
+
+int
+HardwareSerial::available(void)
+{
+    int n = 0;
+
+    if (fd < 0 || ioctl(fd, FIONREAD, &n) < 0) {
+        return 0;
+    }
+    return n;
+}
+
+int
+HardwareSerial::read(void)
+{
+    uint8_t c;
+
+    if (fd < 0 || ::read(fd, &c, 1) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+size_t
+HardwareSerial::readBytes(uint8_t *buf, size_t len)
+{
+    struct pollfd pfd;
+    size_t got = 0;
+    ssize_t n;
+
+    if (fd < 0) {
+        return 0;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (got < len) {
+        if (poll(&pfd, 1, (int)timeout_ms) <= 0) {
+            break;
+        }
+        n = ::read(fd, buf + got, len - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+size_t
+HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    if (fd < 0) {
+        return 0;
+    }
+    while (done < len) {
+        n = ::write(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
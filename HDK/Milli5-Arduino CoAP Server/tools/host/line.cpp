@@ -0,0 +1,105 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "line.h"
+
+static speed_t
+line_speed(uint32_t baud)
+{
+    switch (baud) {
+    case 9600:      return B9600;
+    case 19200:     return B19200;
+    case 38400:     return B38400;
+    case 57600:     return B57600;
+    case 115200:    return B115200;
+    default:        return B0;
+    }
+}
+
+static int
+line_raw(int fd, uint32_t baud)
+{
+    struct termios t;
+
+    if (tcgetattr(fd, &t)) {
+        return 1;
+    }
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    if (baud && (cfsetispeed(&t, line_speed(baud)) ||
+                 cfsetospeed(&t, line_speed(baud)))) {
+        return 1;
+    }
+    return tcsetattr(fd, TCSANOW, &t);
+}
+
+bool
+line_baud_ok(uint32_t baud)
+{
+    return line_speed(baud) != B0;
+}
+
+int
+line_open(const char *dev, uint32_t baud, const char **pty)
+{
+    int fd, sfd;
+    const char *name;
+
+    if (dev) {
+        fd = open(dev, O_RDWR | O_NOCTTY);
+        if (fd < 0 || line_raw(fd, baud)) {
+            fprintf(stderr, "Can't open %s: %s\n", dev, strerror(errno));
+            return -1;
+        }
+        return fd;
+    }
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd) || !(name = ptsname(fd))) {
+        fprintf(stderr, "Can't create pty: %s\n", strerror(errno));
+        return -1;
+    }
+    sfd = open(name, O_RDWR | O_NOCTTY);
+    if (sfd < 0 || line_raw(sfd, 0)) {
+        fprintf(stderr, "Can't open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    *pty = name;
+    return fd;
+}
@@ -0,0 +1,55 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+#ifndef HOST_LINE_H
+#define HOST_LINE_H
+
+#include <stdint.h>
+
+/*
+ * The UART between the mNIC and the server, on the host: a serial device
+ * or a new pty the server attaches to.
+ */
+
+/**
+ * @brief True if baud is a line rate line_open() can set
+ *
+ */
+bool line_baud_ok(uint32_t baud);
+
+/**
+ * @brief Open the line in raw mode
+ *
+ * With dev NULL a pty is created; its slave side is left open so the
+ * server can come and go, and *pty is set to its name. Returns the fd,
+ * or -1 with the reason printed.
+ */
+int line_open(const char *dev, uint32_t baud, const char **pty);
+
+#endif /* HOST_LINE_H */
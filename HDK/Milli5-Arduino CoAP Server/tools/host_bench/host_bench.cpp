@@ -0,0 +1,617 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc.
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc.
+shall not be used in advertising or otherwise to promote the sale, use or other
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+/*
+ * Micro benchmarks of library code paths on the host, each against the code
+ * it replaced. Over the 38400 baud link coap_bench can't see differences of
+ * this size, so these time the code alone, in a loop:
+ *
+ *   rsp    coap_msg_response() building in the mbuf's headroom, against the
+ *          builder it replaced: header and options composed in a stack
+ *          buffer, then the payload moved down to make room and the header
+ *          copied in front of it. The old builder moves every payload byte
+ *          once more; on x86 that is nearly free, on the Cortex-M0+ it
+ *          isn't, so compare the two at the payload sizes the server sends.
+ *   fmt    numfmt's fmt_snprintf() and fmt_float(), against the libc
+ *          snprintf() they replaced, on the log lines and sensor readings
+ *          the server formats. On the board the libc is newlib, whose float
+ *          printf is far slower than glibc's, so the gap there is wider.
+ *
+ * Each case reports ns per call, the best of a few runs, and the bytes
+ * produced; the first column the library, the second the old code.
+ *
+ *   ./host_bench [-n iterations] [case ...]
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include <arduino.h>
+#include "log.h"
+#include "hbuf.h"
+#include "coapmsg.h"
+#include "coappdu.h"
+#include "coapobserve.h"
+#include "coapsensoruri.h"
+#include "hdlc.h"
+#include "numfmt.h"
+
+#define BENCH_ITER          (200000)
+#define BENCH_RUNS          (5)
+#define BENCH_PAYLOAD_MAX   (200)
+#define RSP_BATCH           (8)         /* fewer than RAM_MBUFS */
+#define FMT_BUF             (128)
+
+#define BENCH_NELEM(a)      (sizeof(a) / sizeof((a)[0]))
+
+extern uint32_t coap_max_age_in_seconds;
+
+static uint64_t
+bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * coap_msg_log() as in coapmsg.cpp, where it is static. Both builders log the
+ * same way, so only building the response differs.
+ */
+static void
+copy_msg_log(const struct coap_msg_ctx *ctx)
+{
+    char *substr;
+    struct optlv *op;
+    char uriqp[MAX_URI_LEN];
+
+    /* Nothing below is output at LOG_INFO, skip building the URI string */
+    if (!dlog_on(LOG_INFO)) {
+        return;
+    }
+
+    uriqp[0] = '\0';
+    dlog(LOG_DEBUG, "REQ/RSP Type: %s", 
+            ctx->type == COAP_T_CONF_VAL ? "CON" : 
+            ctx->type == COAP_T_NCONF_VAL ? "NON" :
+            ctx->type == COAP_T_ACK_VAL ? "ACK" : "RST");
+    if ((ctx->code & COAP_CODE_C_MASK) == COAP_CODE_REQUEST) {
+        dlog(LOG_DEBUG, "REQ/ACK Code: %s",
+                (ctx->code & COAP_CODE_DD_MASK) == COAP_CODE_GET ? "GET" :
+                (ctx->code & COAP_CODE_DD_MASK) == COAP_CODE_POST ? "POST" :
+                (ctx->code & COAP_CODE_DD_MASK) == COAP_CODE_PUT ? "PUT" : 
+                (ctx->code & COAP_CODE_DD_MASK) == COAP_CODE_DELETE ? 
+                "DELETE" : "EMPTY");
+    } else {
+        dlog(LOG_DEBUG, "RSP Code: %s",
+                (ctx->code & COAP_CODE_C_MASK) == COAP_CODE_SUCCESS ? 
+                    "Success" :
+                (ctx->code & COAP_CODE_C_MASK) == COAP_CODE_CLIENT_ERR ? 
+                    "Client Error" : "Server Error");
+    }
+    substr = coap_pathstr(ctx);
+    if (substr && substr[0] != '\0') {
+        strcat(uriqp, substr);
+    }
+    /* Is it possible to get more than one query field? */
+    if ((op = copt_get_next_opt_type((const sl_co*)&(ctx->oh), COAP_OPTION_URI_QUERY, NULL))) {
+        strcat(uriqp, "?");
+        strncat(uriqp, (char *)op->ov, op->ol);
+    }
+    if (uriqp[0] != '\0') {
+        dlog(LOG_INFO, "Uri-Path-Query: %s", uriqp);
+    }
+}
+
+
+/*
+ * The response builder before it wrote in place, as it was but for its name.
+ * Used on an mbuf without headroom, as it was, so m_prepend() moves the
+ * payload down.
+ */
+static error_t
+copy_msg_response(struct coap_msg_ctx *ctx)
+{
+    /* 
+     * 4 + 8 (max token) + 2 (option and option length, + option) + 1 (option
+     * terminator) + 4 observe option. Can be added to later, as required.
+     */
+    uint8_t b[COAP_OBS_HDR_SZ];  /* as above, +1 */
+    error_t rc = ERR_OK;
+
+    int idx = 4;
+    struct mbuf *n;
+
+
+    copy_msg_log(ctx);
+
+    b[0] = COAP_VER | COAP_T_VAL2PDU(ctx->type);
+    if (ctx->code == COAP_EMPTY_MESSAGE) {
+        b[1] = COAP_EMPTY_MESSAGE;
+        b[2] = ctx->mid >> 8;
+        b[3] = ctx->mid & 0xFF;
+    } else if (COAP_CLASS(ctx->code) == 1){  /* Not expecting this... */
+        rc = ERR_INVAL;
+        goto done;   /* error - discard */
+    } else if (COAP_CLASS(ctx->code) >= 2) {
+        b[1] = ctx->code;
+        b[2] = ctx->mid >> 8;
+        b[3] = ctx->mid & 0xFF;
+    } else {
+        rc = ERR_INVAL;
+        goto done;
+    }
+
+    if (ctx->code != COAP_EMPTY_MESSAGE) {
+        int onum = 0;
+        struct optlv dopt, *op;
+        uint32_t opt_val;
+        int sz;
+
+        if (ctx->tkl) {
+            if (ctx->tkl > 8) {
+                rc = ERR_INVAL;
+                goto done;   /* invalid - must not be sent */
+            }
+            memcpy(b + idx, ctx->token, ctx->tkl);
+            b[0] |= ctx->tkl;
+            idx += ctx->tkl;
+        }
+
+        /*
+         * Add the observe option if it's present in the context structure.
+         * op doesn't contain a value yet, we add that now, so it's really just
+         * a flag so we can add the observe value to the packet.
+         */
+        if ((op = copt_get_next_opt_type((const sl_co*)&(ctx->oh), COAP_OPTION_OBSERVE, NULL))
+               != NULL) {
+            op->ov = &opt_val;
+            dopt = *op;  /* copy original but make type the delta */
+            opt_val = get_obs_val();
+            opt_val = co_uint32_h2n(&dopt);
+            dopt.ot = COAP_OPTION_OBSERVE - onum;
+            onum = COAP_OPTION_OBSERVE;
+            if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) == 0) {
+                dlog(LOG_ERR, "Couldn't add Observe option to msg");
+                rc = ERR_NO_MEM;
+                goto done;
+            }
+            idx += sz;
+        }
+			   
+        /*
+         * Add the Content-Format option (Option 12)
+		 *
+         */
+        if (ctx->plen) 
+		{
+            dopt.ot = COAP_OPTION_CONTENT_FORMAT - onum;
+            onum = COAP_OPTION_CONTENT_FORMAT;
+            if (ctx->cf == 0) {     /* text/plain; */
+                dopt.ol = 0;
+                dopt.ov = &opt_val;
+                opt_val = 0;  /* 0 length anyway */
+                if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) == 0) {
+                    dlog(LOG_ERR, "Couldn't add content format option to msg");
+                    rc = ERR_NO_MEM;
+                    goto done;
+                }
+                idx += sz;
+
+            } else {
+                dopt.ol = 1;
+                dopt.ov = &(ctx->cf);
+                if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) == 0) {
+                    dlog(LOG_ERR, "Couldn't add content format option to msg");
+                    rc = ERR_NO_MEM;
+                    goto done;
+                }
+                idx += sz;
+            }
+        
+            /*
+             * This option (Option 14) is added in observe response.
+			 * Thus observe option variable is on the calling stack, 
+			 * so it's okay to deref. If we
+             * wanted to set this for non-obs responses, we'd have to allocate
+             * it in call from coap_s_proc so it's still on stack or heap.
+             * (o->ov is the field of concern.
+             */
+            if ((op = copt_get_next_opt_type((const sl_co*)&(ctx->oh), COAP_OPTION_MAXAGE, 
+                            NULL)) != NULL) {
+				op->ov = &opt_val;
+                dopt = *op;  /* copy original but make type the delta */
+				opt_val = coap_max_age_in_seconds;
+				opt_val = co_uint32_h2n(&dopt);
+                dopt.ot = COAP_OPTION_MAXAGE - onum;
+                onum = COAP_OPTION_MAXAGE;
+                if ((sz = coap_opt_add(&dopt, &(b[idx]), COAP_OBS_HDR_SZ - idx)) <= 0) {
+                    dlog(LOG_ERR, "Couldn't add Max-Age option to msg");
+                    rc = ERR_NO_MEM;
+                    goto done;
+                }
+                idx += sz;
+            }
+
+        } // plen
+
+		/* End of options */	   
+        if (onum && ctx->plen) {
+            b[idx++] = 0xFF;    /* end of options */
+        }
+    }
+    assert(idx <= COAP_OBS_HDR_SZ);
+
+    /* prepend header to response */
+    n = m_prepend(ctx->msg, idx);
+    if (!n) {
+        rc = ERR_NO_MEM;
+        goto done;
+    }
+    ctx->msg = n;   /* A new mbuf may be required */
+    memcpy(n->m_data, b, idx);
+
+    ddump(LOG_DEBUG, "Response", n->m_data, n->m_pktlen);
+
+done:
+    return rc;
+}
+
+
+/* A response as the server builds one */
+struct rsp_case {
+    const char  *name;
+    uint8_t     code;
+    uint8_t     tkl;
+    uint8_t     cf;
+    int         obs;            /* Observe and Max-Age, as a notification */
+    int         plen;
+};
+
+static const struct rsp_case rsp_cases[] = {
+    { "ack",        COAP_EMPTY_MESSAGE,   0, 0,           0, 0 },
+    { "get 16",     COAP_RSP_205_CONTENT, 2, 0,           0, 16 },
+    { "get 64",     COAP_RSP_205_CONTENT, 2, 0,           0, 64 },
+    { "get 200",    COAP_RSP_205_CONTENT, 2, 0,           0, 200 },
+    { "notify 16",  COAP_RSP_205_CONTENT, 4, COAP_CF_CSV, 1, 16 },
+    { "notify 64",  COAP_RSP_205_CONTENT, 4, COAP_CF_CSV, 1, 64 },
+    { "notify 200", COAP_RSP_205_CONTENT, 4, COAP_CF_CSV, 1, 200 },
+};
+
+/*
+ * Build the response of c iter times, with the headroom reserved and the
+ * library builder, or with neither and the old one. Responses are set up
+ * RSP_BATCH at a time and only building them is timed.
+ *
+ * @return: ns per response, the PDU length in *len.
+ */
+static double
+rsp_run(const struct rsp_case *c, int inplace, uint32_t iter, int *len)
+{
+    static const uint8_t payload[BENCH_PAYLOAD_MAX] = { 0x31 };
+    struct coap_msg_ctx ctx[RSP_BATCH];
+    struct optlv opt;
+    struct mbuf *m;
+    uint64_t t0, ns = 0;
+    uint32_t i, j;
+
+    *len = -1;
+    for (i = 0; i < iter; i += RSP_BATCH) {
+        for (j = 0; j < RSP_BATCH; j++) {
+            memset(&ctx[j], 0, sizeof(ctx[j]));
+            copt_init((sl_co*)&(ctx[j].oh));
+            ctx[j].type = c->code == COAP_EMPTY_MESSAGE ? COAP_T_ACK_VAL :
+                COAP_T_NCONF_VAL;
+            ctx[j].code = c->code;
+            ctx[j].mid = i + j;
+            ctx[j].tkl = c->tkl;
+            memset(ctx[j].token, 0xA5, c->tkl);
+            ctx[j].cf = c->cf;
+            if (c->obs) {
+                opt.ot = COAP_OPTION_OBSERVE;
+                opt.ol = 3;
+                opt.ov = NULL;
+                (void)copt_add_opt((sl_co*)&(ctx[j].oh), &opt);
+                opt.ot = COAP_OPTION_MAXAGE;
+                opt.ol = 4;
+                (void)copt_add_opt((sl_co*)&(ctx[j].oh), &opt);
+            }
+
+            m = m_get();
+            if (inplace) {
+                m_reserve(m, COAP_OBS_HDR_SZ);
+            }
+            memcpy(m_append(m, c->plen), payload, c->plen);
+            ctx[j].plen = c->plen;
+            ctx[j].msg = m;
+        }
+
+        t0 = bench_ns();
+        for (j = 0; j < RSP_BATCH; j++) {
+            if (inplace) {
+                (void)coap_msg_response(&ctx[j]);
+            } else {
+                (void)copy_msg_response(&ctx[j]);
+            }
+        }
+        ns += bench_ns() - t0;
+
+        *len = ctx[0].msg->m_pktlen;
+        for (j = 0; j < RSP_BATCH; j++) {
+            copt_del_all((sl_co*)&(ctx[j].oh));
+            m_free(ctx[j].msg);
+        }
+    }
+
+    return (double)ns / i;
+}
+
+/* The best of BENCH_RUNS runs */
+static double
+rsp_best(const struct rsp_case *c, int inplace, uint32_t iter, int *len)
+{
+    double ns, best = 0;
+    int i;
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        ns = rsp_run(c, inplace, iter, len);
+        if (!i || ns < best) {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+static void
+bench_rsp(uint32_t iter)
+{
+    const struct rsp_case *c;
+    double ns_new, ns_old;
+    int len_new, len_old;
+
+    printf("%-12s %10s %10s %8s %8s\n", "rsp", "ns", "old ns", "bytes",
+            "old");
+    for (c = rsp_cases; c < rsp_cases + BENCH_NELEM(rsp_cases); c++) {
+        ns_new = rsp_best(c, 1, iter, &len_new);
+        ns_old = rsp_best(c, 0, iter, &len_old);
+        printf("%-12s %10.1f %10.1f %8d %8d\n", c->name, ns_new, ns_old,
+                len_new, len_old);
+    }
+}
+
+
+/*
+ * A line formatted by numfmt and by snprintf, from the same inputs. i varies
+ * the numbers so neither can be folded into a constant.
+ */
+struct fmt_case {
+    const char  *name;
+    int         (*lib)(char *b, uint32_t i);
+    int         (*libc)(char *b, uint32_t i);
+};
+
+static float
+fmt_reading(uint32_t i)
+{
+    return (float)(i % 100000) / 1000.0f - 20.0f;
+}
+
+static int
+fmt_lib_log(char *b, uint32_t i)
+{
+    return fmt_snprintf(b, FMT_BUF, "We read %d bytes and the max is %d bytes.",
+            (int)(i & 0x3FF), UART_MAX_BUF_LEN);
+}
+
+static int
+fmt_libc_log(char *b, uint32_t i)
+{
+    return snprintf(b, FMT_BUF, "We read %d bytes and the max is %d bytes.",
+            (int)(i & 0x3FF), UART_MAX_BUF_LEN);
+}
+
+static int
+fmt_lib_time(char *b, uint32_t i)
+{
+    return fmt_snprintf(b, FMT_BUF, "Time: %02d:%02d:%02d.%03d [hr:min:sec]",
+            (int)(i % 24), (int)(i % 60), (int)(i % 59), (int)(i % 1000));
+}
+
+static int
+fmt_libc_time(char *b, uint32_t i)
+{
+    return snprintf(b, FMT_BUF, "Time: %02d:%02d:%02d.%03d [hr:min:sec]",
+            (int)(i % 24), (int)(i % 60), (int)(i % 59), (int)(i % 1000));
+}
+
+static int
+fmt_lib_hex(char *b, uint32_t i)
+{
+    return fmt_snprintf(b, FMT_BUF, "addr %08lx len %x",
+            (unsigned long)(uint32_t)(i * 2654435761UL), (unsigned)(i & 0xFFF));
+}
+
+static int
+fmt_libc_hex(char *b, uint32_t i)
+{
+    return snprintf(b, FMT_BUF, "addr %08lx len %x",
+            (unsigned long)(uint32_t)(i * 2654435761UL), (unsigned)(i & 0xFFF));
+}
+
+static int
+fmt_lib_float(char *b, uint32_t i)
+{
+    return fmt_float(b, fmt_reading(i), 2);
+}
+
+static int
+fmt_libc_float(char *b, uint32_t i)
+{
+    return snprintf(b, FMT_BUF, "%.2f", fmt_reading(i));
+}
+
+/* A reading as rsp_msg() formats it: epoch, value and unit */
+static int
+fmt_lib_reading(char *b, uint32_t i)
+{
+    int n;
+
+    n = fmt_u32(b, 1700000000UL + i);
+    b[n++] = ',';
+    n += fmt_float(b + n, fmt_reading(i), 2);
+    b[n++] = ',';
+    memcpy(b + n, "C", 1);
+    return n + 1;
+}
+
+static int
+fmt_libc_reading(char *b, uint32_t i)
+{
+    return snprintf(b, FMT_BUF, "%lu,%.2f,%s", 1700000000UL + i,
+            fmt_reading(i), "C");
+}
+
+static const struct fmt_case fmt_cases[] = {
+    { "log",        fmt_lib_log,        fmt_libc_log },
+    { "time",       fmt_lib_time,       fmt_libc_time },
+    { "hex",        fmt_lib_hex,        fmt_libc_hex },
+    { "float",      fmt_lib_float,      fmt_libc_float },
+    { "reading",    fmt_lib_reading,    fmt_libc_reading },
+};
+
+/*
+ * Format f iter times, the best of BENCH_RUNS runs.
+ *
+ * @return: ns per line, the chars of the last one in *len.
+ */
+static double
+fmt_best(int (*f)(char *b, uint32_t i), uint32_t iter, int *len)
+{
+    char b[FMT_BUF];
+    double ns, best = 0;
+    uint64_t t0;
+    uint32_t i;
+    int r, n = 0;
+
+    for (r = 0; r < BENCH_RUNS; r++) {
+        t0 = bench_ns();
+        for (i = 0; i < iter; i++) {
+            n = f(b, i);
+        }
+        ns = (double)(bench_ns() - t0) / iter;
+        if (!r || ns < best) {
+            best = ns;
+        }
+    }
+    *len = n;
+
+    return best;
+}
+
+static void
+bench_fmt(uint32_t iter)
+{
+    const struct fmt_case *c;
+    double ns_lib, ns_libc;
+    int len_lib, len_libc;
+
+    printf("%-12s %10s %10s %8s %8s\n", "fmt", "ns", "printf ns", "chars",
+            "printf");
+    for (c = fmt_cases; c < fmt_cases + BENCH_NELEM(fmt_cases); c++) {
+        ns_lib = fmt_best(c->lib, iter, &len_lib);
+        ns_libc = fmt_best(c->libc, iter, &len_libc);
+        printf("%-12s %10.1f %10.1f %8d %8d\n", c->name, ns_lib, ns_libc,
+                len_lib, len_libc);
+    }
+}
+
+
+struct bench_case {
+    const char  *name;
+    void        (*run)(uint32_t iter);
+};
+
+static const struct bench_case bench_cases[] = {
+    { "rsp", bench_rsp },
+    { "fmt", bench_fmt },
+};
+
+static void
+usage(const char *prog)
+{
+    const struct bench_case *b;
+
+    fprintf(stderr, "usage: %s [-n iterations] [case ...]\n  cases:", prog);
+    for (b = bench_cases; b < bench_cases + BENCH_NELEM(bench_cases); b++) {
+        fprintf(stderr, " %s", b->name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct bench_case *b;
+    uint32_t iter = BENCH_ITER;
+    int opt, i, ran = 0;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n': iter = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!iter) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    dlog_level(LOG_ERR);
+    set_mbuf_data_size(MNIC_MAX_PAYLOAD_SIZE);
+
+    for (b = bench_cases; b < bench_cases + BENCH_NELEM(bench_cases); b++) {
+        for (i = optind; i < argc && strcmp(argv[i], b->name); i++) {
+        }
+        if (optind == argc || i < argc) {
+            b->run(iter);
+            ran++;
+        }
+    }
+    if (!ran) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
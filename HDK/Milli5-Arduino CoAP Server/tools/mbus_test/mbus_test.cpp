@@ -0,0 +1,275 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+
+/*
+ * M-Bus decoder test.
+ *
+ * Streams recorded meter frames through a pty into a HardwareSerial, as
+ * the meter's UART or its radio module would, and decodes them with
+ * mbus_dec_put() and mbus_parse() the way mbus_water_run() does: a byte
+ * at a time, as they arrive, and mbus_dec_init() again once the line has
+ * been quiet for MBUS_TEST_GAP_MS. Each frame completed, good or bad, is
+ * checked against the file.
+ *
+ * The frames file is line based, # starts a comment:
+ *
+ *   wired 12345678/1/12345 6819196808...16   link, result, frame in hex
+ *   wmbus bad 18442d2c78...                  a frame mbus_dec_put() drops
+ *   wmbus bad,bad 18442d2c78...              whose rest is taken for another
+ *   wired - e5                               bytes that complete no frame
+ *   quiet                                    the line goes quiet
+ *
+ * A result is the identification number, access number and first
+ * record's value of the frame mbus_parse() decoded. Frames up to a quiet
+ * line, or one of a different link, are written back to back, so the
+ * decoder has to find each one in the stream.
+ *
+ *   make check
+ *   ./mbus_test -v frames.txt
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <arduino.h>
+#include "errors.h"
+#include "mbus.h"
+#include "line.h"
+
+/* MBUS_WATER_GAP_MS, mbus_water.h needs the rest of the server */
+#define MBUS_TEST_GAP_MS        (100)
+
+#define MBUS_TEST_LINE_MAX      (2 * (MBUS_FRAME_MAX + 32) + 64)
+#define MBUS_TEST_RES_MAX       (32)
+#define MBUS_TEST_EXP_MAX       (64)
+
+/* A result the file expects, and the line it's on */
+struct mbus_test_exp {
+    int         line;
+    char        res[MBUS_TEST_RES_MAX];
+};
+
+static struct mbus_test_exp mexp[MBUS_TEST_EXP_MAX];
+static int                  nexp;       /* expected so far */
+static int                  ngot;       /* checked so far */
+static int                  nfail;
+static int                  mverbose;
+static struct mbus_dec      mdec;
+static HardwareSerial       mport;
+
+
+/* Check the next result against the file */
+static void
+mbus_test_got(const char *res)
+{
+    if (ngot == nexp) {
+        printf("unexpected %s\n", res);
+        ++nfail;
+        return;
+    }
+    if (strcmp(res, mexp[ngot].res)) {
+        printf("line %d: expected %s, got %s\n", mexp[ngot].line,
+               mexp[ngot].res, res);
+        ++nfail;
+    } else if (mverbose) {
+        printf("line %d: %s\n", mexp[ngot].line, res);
+    }
+    ++ngot;
+}
+
+/* A frame mbus_dec_put() completed */
+static void
+mbus_test_frame(void)
+{
+    struct mbus_frame f;
+    char res[MBUS_TEST_RES_MAX];
+    error_t rc;
+
+    rc = mbus_parse(&mdec, &f);
+    if (rc != ERR_OK) {
+        snprintf(res, sizeof(res), "parse%d", rc);
+    } else {
+        snprintf(res, sizeof(res), "%08lx/%u/%ld", (unsigned long)f.id,
+                 f.acc, f.nrec ? (long)f.rec[0].val : 0L);
+    }
+    mbus_test_got(res);
+}
+
+/*
+ * Decode what arrives until the line has been quiet for MBUS_TEST_GAP_MS,
+ * then wait for the next frame from the start, as mbus_water_run() does.
+ */
+static void
+mbus_test_drain(void)
+{
+    uint32_t last = millis();
+    int n;
+
+    while ((uint32_t)(millis() - last) < MBUS_TEST_GAP_MS) {
+        n = mport.available();
+        if (n <= 0) {
+            delay(1);
+            continue;
+        }
+        last = millis();
+        for (; n > 0; n--) {
+            switch (mbus_dec_put(&mdec, mport.read())) {
+            case ERR_OK:
+                mbus_test_frame();
+                break;
+            case ERR_BAD_DATA:
+                mbus_test_got("bad");
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    mbus_dec_init(&mdec, mdec.link);
+}
+
+static int
+mbus_test_hex(const char *s, uint8_t *b, int size)
+{
+    int n = 0;
+    unsigned int v;
+
+    while (*s) {
+        if (n == size || sscanf(s, "%2x", &v) != 1 || !s[1]) {
+            return -1;
+        }
+        b[n++] = v;
+        s += 2;
+    }
+    return n;
+}
+
+static int
+mbus_test_run(const char *file, int fd)
+{
+    char line[MBUS_TEST_LINE_MAX];
+    char kw[8], res[4 * MBUS_TEST_RES_MAX], hex[MBUS_TEST_LINE_MAX];
+    uint8_t b[MBUS_TEST_LINE_MAX / 2];
+    uint8_t link;
+    char *r, *save;
+    FILE *fp;
+    int ln = 0, n;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    mbus_dec_init(&mdec, MBUS_LINK_WIRED);
+    while (fgets(line, sizeof(line), fp)) {
+        ++ln;
+        if (line[0] == '#') {
+            continue;
+        }
+        n = sscanf(line, "%7s %127s %s", kw, res, hex);
+        if (n <= 0) {
+            continue;
+        }
+        if (n == 1 && !strcmp(kw, "quiet")) {
+            mbus_test_drain();
+            continue;
+        }
+        if (n != 3 || (strcmp(kw, "wired") && strcmp(kw, "wmbus")) ||
+            (n = mbus_test_hex(hex, b, sizeof(b))) < 0) {
+            fprintf(stderr, "%s:%d: bad line\n", file, ln);
+            fclose(fp);
+            return -1;
+        }
+        link = strcmp(kw, "wired") ? MBUS_LINK_WMBUS : MBUS_LINK_WIRED;
+        if (link != mdec.link) {
+            mbus_test_drain();
+            mbus_dec_init(&mdec, link);
+        }
+        for (r = strtok_r(res, ",", &save); r && strcmp(r, "-");
+             r = strtok_r(NULL, ",", &save)) {
+            if (nexp == MBUS_TEST_EXP_MAX || strlen(r) >= MBUS_TEST_RES_MAX) {
+                fprintf(stderr, "%s:%d: too many frames\n", file, ln);
+                fclose(fp);
+                return -1;
+            }
+            mexp[nexp].line = ln;
+            strcpy(mexp[nexp++].res, r);
+        }
+        if (write(fd, b, n) != n) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    mbus_test_drain();
+
+    for (; ngot < nexp; ngot++) {
+        printf("line %d: expected %s, got nothing\n", mexp[ngot].line,
+               mexp[ngot].res);
+        ++nfail;
+    }
+    return nfail;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *pty;
+    int mfd, sfd, opt, rc;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v': mverbose = 1;                                 break;
+        default:
+            fprintf(stderr, "usage: mbus_test [-v] [frames.txt]\n");
+            return 2;
+        }
+    }
+
+    /* The meter writes to the pty, the decoder reads its raw slave side */
+    if ((mfd = line_open(NULL, 0, &pty)) < 0) {
+        return 1;
+    }
+    if ((sfd = open(pty, O_RDWR | O_NOCTTY)) < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", pty, strerror(errno));
+        return 1;
+    }
+    mport.attach(sfd);
+
+    rc = mbus_test_run(optind < argc ? argv[optind] : "frames.txt", mfd);
+    if (rc >= 0) {
+        printf("%d frames, %s\n", nexp, rc ? "failed" : "passed");
+    }
+    close(mfd);
+    close(sfd);
+    return rc ? 1 : 0;
+}
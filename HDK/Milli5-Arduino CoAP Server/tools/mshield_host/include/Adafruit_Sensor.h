@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for the Adafruit Unified Sensor types temp_sensor.cpp uses.
+ */
+
+#ifndef HOST_ADAFRUIT_SENSOR_H
+#define HOST_ADAFRUIT_SENSOR_H
+
+#include <arduino.h>
+
+typedef struct {
+    char        name[12];
+    int32_t     version;
+    int32_t     sensor_id;
+    float       max_value;
+    float       min_value;
+    float       resolution;
+} sensor_t;
+
+typedef struct {
+    float       temperature;
+    float       relative_humidity;
+} sensors_event_t;
+
+#endif /* HOST_ADAFRUIT_SENSOR_H */
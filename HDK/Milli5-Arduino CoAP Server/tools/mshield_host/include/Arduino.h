@@ -0,0 +1,5 @@
+/*
+ * The sketch and coap_rsp_msg.h include <Arduino.h>, the host core is
+ * tools/host/arduino.h.
+ */
+#include <arduino.h>
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for the DHT Sensor Library.
+ */
+
+#ifndef HOST_DHT_H
+#define HOST_DHT_H
+
+#define DHT11       (11)
+#define DHT22       (22)
+
+#endif /* HOST_DHT_H */
@@ -0,0 +1,40 @@
+/*
+ * Host stand-in for DHT_Unified. The temperature steps by a tenth of a
+ * degree every 10 s so observers see the value change.
+ */
+
+#ifndef HOST_DHT_U_H
+#define HOST_DHT_U_H
+
+#include <string.h>
+#include "Adafruit_Sensor.h"
+
+class DHT_Unified {
+public:
+    class Temperature {
+    public:
+        void getSensor(sensor_t *s)
+        {
+            memset(s, 0, sizeof(*s));
+            strcpy(s->name, "DHT11");
+            s->max_value = 50;
+            s->resolution = 2;
+        }
+        void getEvent(sensors_event_t *e)
+        {
+            e->temperature = 21.0 + (millis() / 10000 % 10) / 10.0;
+        }
+    };
+    class Humidity {
+    public:
+        void getSensor(sensor_t *s) { memset(s, 0, sizeof(*s)); }
+        void getEvent(sensors_event_t *e) { e->relative_humidity = 50; }
+    };
+
+    DHT_Unified(uint8_t pin, uint8_t type) { (void)pin; (void)type; }
+    void begin(void) {}
+    Temperature temperature(void) { return Temperature(); }
+    Humidity humidity(void) { return Humidity(); }
+};
+
+#endif /* HOST_DHT_U_H */
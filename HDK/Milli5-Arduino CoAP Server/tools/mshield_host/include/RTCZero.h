@@ -0,0 +1,30 @@
+/*
+ * Host stand-in for the RTCZero library, the RTC reads the host clock.
+ */
+
+#ifndef HOST_RTCZERO_H
+#define HOST_RTCZERO_H
+
+#include <arduino.h>
+
+class RTCZero {
+public:
+    RTCZero() : offset(0) {}
+    void begin(void) {}
+    void setTime(uint8_t h, uint8_t m, uint8_t s) { (void)h; (void)m; (void)s; }
+    void setDate(uint8_t d, uint8_t m, uint8_t y) { (void)d; (void)m; (void)y; }
+    uint32_t getEpoch(void) { return (uint32_t)time(NULL) + offset; }
+    void setEpoch(uint32_t ts) { offset = ts - (uint32_t)time(NULL); }
+    uint8_t getYear(void) { return tm()->tm_year - 100; }
+    uint8_t getMonth(void) { return tm()->tm_mon + 1; }
+    uint8_t getDay(void) { return tm()->tm_mday; }
+private:
+    struct tm *tm(void)
+    {
+        time_t t = getEpoch();
+        return gmtime(&t);
+    }
+    uint32_t offset;
+};
+
+#endif /* HOST_RTCZERO_H */
@@ -0,0 +1,132 @@
+#
+# Static RAM use from a GNU ld map file: the .data and .bss input sections
+# (and COMMON) by object, the largest symbols, and the total.
+#
+#   awk -f ram_report.awk mshield.ino.map | c++filt
+#
+# Build with -fdata-sections so every variable has its own section and
+# shows up by name. Without it, the variables of a .data/.bss section are
+# sized from the symbol addresses the map lists in it.
+#
+# .data.rel.ro is left out, it's read-only data a host build keeps in RAM.
+# The stack and the heap aren't in the map.
+#
+
+BEGIN {
+    top = (top ? top : 25)
+    inmap = 0
+    pend = ""
+    nsym = 0
+}
+
+/^Linker script and memory map/ { inmap = 1; next }
+!inmap { next }
+
+# Close the symbol list of the previous input section
+function flush(    i, sz) {
+    for (i = 1; i <= nsym; i++) {
+        sz = (i < nsym ? saddr[i + 1] : sec_end) - saddr[i]
+        if (sz > 0)
+            sym[sname[i] "\t" sec_obj] += sz
+    }
+    nsym = 0
+    sec_obj = ""
+}
+
+function hex(s,    n, i, c) {
+    n = 0
+    s = tolower(s)
+    sub(/^0x/, "", s)
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789abcdef", substr(s, i, 1))
+        n = n * 16 + c - 1
+    }
+    return n
+}
+
+function is_ram(name) {
+    if (name ~ /^\.data\.rel\.ro/)
+        return 0
+    return name ~ /^\.(data|bss|sdata|sbss|tdata|tbss)(\.|$)/ || name == "COMMON"
+}
+
+function object(s) {
+    # /path/to/core.a(wiring.c.o) -> core.a(wiring.c.o)
+    sub(/^.*\//, "", s)
+    return s
+}
+
+function input(name, addr, size, obj,    n) {
+    flush()
+    if (!is_ram(name) || size == 0)
+        return
+    obj = object(obj)
+    objsz[obj] += size
+    total += size
+    n = name
+    if (n !~ /^\.data\.rel/ && sub(/^\.(data|bss|sdata|sbss|tdata|tbss)\./, "", n)) {
+        # -fdata-sections: the section is the variable
+        sym[n "\t" obj] += size
+        return
+    }
+    # .data, .bss, COMMON: size the symbols listed after it
+    sec_obj = obj
+    sec_end = addr + size
+}
+
+# An input section on one line: " .bss.x  0xaddr  0xsize  object"
+/^ [.A-Z][^ ]* +0x[0-9a-fA-F]+ +0x[0-9a-fA-F]+ / {
+    pend = ""
+    input($1, hex($2), hex($3), $4)
+    next
+}
+
+# A name too long for its column, the rest is on the next line
+/^ [.A-Z][^ ]*$/ {
+    flush()
+    pend = $1
+    next
+}
+
+/^ +0x[0-9a-fA-F]+ +0x[0-9a-fA-F]+ / {
+    if (pend != "")
+        input(pend, hex($1), hex($2), $3)
+    pend = ""
+    next
+}
+
+# A symbol of the current input section: "   0xaddr   name"
+/^ +0x[0-9a-fA-F]+ +[A-Za-z_][A-Za-z0-9_.$]*$/ {
+    if (sec_obj != "" && NF == 2) {
+        nsym++
+        saddr[nsym] = hex($1)
+        sname[nsym] = $2
+    }
+    next
+}
+
+{
+    pend = ""
+    if ($0 !~ /^ +\[/)
+        flush()
+}
+
+END {
+    flush()
+
+    printf "%8s  %s\n", "bytes", "object"
+    cmd = "sort -rn"
+    for (o in objsz)
+        printf "%8d  %s\n", objsz[o], o | cmd
+    close(cmd)
+
+    printf "\n%8s  %-24s %s\n", "bytes", "object", "symbol"
+    cmd = "sort -rn | head -n " top
+    for (s in sym) {
+        split(s, f, "\t")
+        printf "%8d  %-24s %s\n", sym[s], f[2], f[1] | cmd
+    }
+    close(cmd)
+
+    printf "\n%8d  total .data + .bss\n", total
+}
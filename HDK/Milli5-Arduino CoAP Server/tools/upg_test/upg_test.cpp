@@ -0,0 +1,491 @@
+/*
+
+Copyright (c) Silver Spring Networks, Inc. 
+All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the ""Software""), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of 
+the Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED AS IS, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of Silver Spring Networks, Inc. 
+shall not be used in advertising or otherwise to promote the sale, use or other 
+dealings in this Software without prior written authorization from Silver Spring
+Networks, Inc.
+
+*/
+
+
+/*
+ * Firmware upgrade test.
+ *
+ * Runs a scripted upgrade against /system/upg through coap_s_proc(), with
+ * the staging flash simulated by upg_flash.bin in the current directory,
+ * which is removed first:
+ *
+ *   - Block1 upload in 128 byte blocks, a retransmitted block, a block
+ *     size too big (4.13) and a block past expected_offset (4.08)
+ *   - a link drop: ?st=init again, expected_offset from ?info=sts, and the
+ *     rest sent in 64 byte blocks
+ *   - ?st=verify, with the image compared to upg_flash.bin, then again
+ *     once a byte of the file is cleared (4.06)
+ *   - ?st=activate, 5.01 without UPG_HAVE_BOOTLOADER and no record written
+ *   - an image whose CRC doesn't match its info (4.06 on the last block)
+ *
+ *   make check
+ *   ./upg_test -v
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <arduino.h>
+#include "errors.h"
+#include "hbuf.h"
+#include "coapmsg.h"
+#include "coappdu.h"
+#include "coapextif.h"
+#include "coapsensor.h"
+#include "coapsensoruri.h"
+#include "coap_server.h"
+#include "coapupg.h"
+#include "crc_xmodem.h"
+#include "hdlc.h"
+#include "upg_flash.h"
+
+#define UPG_TEST_IMG_LEN        (1000)      /* not a whole page, or block */
+#define UPG_TEST_PDU_MAX        (MNIC_MAX_PAYLOAD_SIZE)
+#define UPG_TEST_TKL            (2)
+
+/* A response, as far as the test looks at it */
+struct upg_test_rsp {
+    uint8_t     code;
+    int32_t     block1;                 /* value, -1 if none */
+    uint8_t     payload[64];
+    int         plen;
+};
+
+static uint8_t              uimg[UPG_TEST_IMG_LEN];
+static uint16_t             umid;
+static int                  nstep;
+static int                  nfail;
+static int                  uverbose;
+
+/* /arduino needs a table, one sensor that is never read will do */
+static error_t
+upg_test_read(struct mbuf *m, uint8_t *len)
+{
+    (void)m;
+    *len = 0;
+    return ERR_OK;
+}
+
+static const struct coap_sensor_ops upg_test_ops =
+{
+    .read       = upg_test_read,
+    .get_cfg    = NULL,
+    .put_cfg    = NULL,
+    .disable    = NULL,
+    .sn         = NULL,
+    .cfg_gen    = NULL,
+    .cfg_type   = 0,
+    .get_tlv    = NULL,
+    .check_tlv  = NULL,
+    .set_tlv    = NULL,
+    .start      = NULL,
+    .poll       = NULL
+};
+
+static const struct coap_sensor sensors[] =
+{
+    COAP_SENSOR( "none", 0, "", &upg_test_ops ),
+};
+COAP_SENSOR_TABLE( sensors );
+
+
+/* Put an option header and value, returns its length */
+static int
+upg_test_opt(uint8_t *b, uint16_t prev, uint16_t num, const void *v, int len)
+{
+    uint16_t d = num - prev;
+    int i = 1;
+
+    b[0] = 0;
+    if (d < 13) {
+        b[0] |= d << 4;
+    } else {
+        b[0] |= 13 << 4;
+        b[i++] = d - 13;
+    }
+    b[0] |= len;        /* all shorter than 13 */
+    memcpy(b + i, v, len);
+    return i + len;
+}
+
+/* Value of option num of the response m, -1 if it has none */
+static int32_t
+upg_test_getopt(const uint8_t *m, int len, uint16_t num, int *pay)
+{
+    int32_t v = -1;
+    uint16_t on = 0;
+    int i, d, l, k;
+
+    *pay = len;
+    for (i = 4 + COAP_TKL(m[0]); i < len; i += l) {
+        if (m[i] == 0xFF) {
+            *pay = i + 1;
+            break;
+        }
+        d = m[i] >> 4;
+        l = m[i] & 0x0F;
+        i++;
+        if (d == 13) {
+            d = m[i++] + 13;
+        }
+        on += d;
+        if (on == num && l <= 3) {
+            for (v = 0, k = 0; k < l; k++) {
+                v = (v << 8) | m[i + k];
+            }
+        }
+    }
+    return v;
+}
+
+/*
+ * Send a CON request for /system/upg?<query>, with a Block1 option unless
+ * block1 is -1, and return the response in r.
+ */
+static void
+upg_test_req(uint8_t code, const char *query, int32_t block1,
+        const void *payload, int plen, struct upg_test_rsp *r)
+{
+    uint8_t b[UPG_TEST_PDU_MAX + 16], bv[3];
+    struct mbuf *m, *rm;
+    uint16_t prev = 0;
+    int i = 0, n, pay;
+
+    memset(r, 0, sizeof(*r));
+    r->block1 = -1;
+
+    b[i++] = COAP_VER | COAP_T_CONF | UPG_TEST_TKL;
+    b[i++] = code;
+    b[i++] = ++umid >> 8;
+    b[i++] = umid;
+    b[i++] = 0x75;
+    b[i++] = umid;
+    i += upg_test_opt(b + i, prev, COAP_OPTION_URI_PATH, "system", 6);
+    i += upg_test_opt(b + i, COAP_OPTION_URI_PATH, COAP_OPTION_URI_PATH,
+            "upg", 3);
+    prev = COAP_OPTION_URI_PATH;
+    if (query) {
+        i += upg_test_opt(b + i, prev, COAP_OPTION_URI_QUERY, query,
+                strlen(query));
+        prev = COAP_OPTION_URI_QUERY;
+    }
+    if (block1 >= 0) {
+        n = (block1 > 0xFFFF) ? 3 : (block1 > 0xFF) ? 2 : (block1 > 0);
+        bv[0] = block1 >> (8 * (n - 1));
+        bv[1] = block1 >> (8 * (n - 2));
+        bv[2] = block1;
+        i += upg_test_opt(b + i, prev, COAP_OPTION_BLOCK1, bv, n);
+    }
+    if (plen) {
+        b[i++] = 0xFF;
+        memcpy(b + i, payload, plen);
+        i += plen;
+    }
+
+    MGETHDR(m);
+    if (!m || !m_append(m, i)) {
+        printf("out of mbufs\n");
+        exit(1);
+    }
+    memcpy(mtod(m, uint8_t *), b, i);
+
+    rm = coap_s_proc(m);
+    if (!rm) {
+        return;
+    }
+    n = rm->len;
+    memcpy(b, mtod(rm, uint8_t *), n);
+    m_free(rm);
+
+    r->code = b[1];
+    r->block1 = upg_test_getopt(b, n, COAP_OPTION_BLOCK1, &pay);
+    r->plen = min(n - pay, (int)sizeof(r->payload));
+    memcpy(r->payload, b + pay, r->plen);
+}
+
+/* Check that what happened is what was wanted */
+static void
+upg_test_check(const char *what, int ok, const char *fmt, ...)
+{
+    va_list ap;
+
+    ++nstep;
+    if (ok && !uverbose) {
+        return;
+    }
+    printf("%s: ", what);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("%s\n", ok ? "" : ", FAILED");
+    if (!ok) {
+        ++nfail;
+    }
+}
+
+/* Response code as CoAP writes it, c.dd */
+static const char *
+upg_test_code(uint8_t code)
+{
+    static char s[8];
+
+    snprintf(s, sizeof(s), "%d.%02d", code >> 5, code & 0x1F);
+    return s;
+}
+
+/* A request and the code it should get */
+static void
+upg_test_put(const char *what, const char *query, int32_t block1,
+        const void *payload, int plen, uint8_t want, struct upg_test_rsp *r)
+{
+    struct upg_test_rsp rsp;
+    char got[8];
+
+    if (!r) {
+        r = &rsp;
+    }
+    upg_test_req(COAP_REQUEST_PUT, query, block1, payload, plen, r);
+    strcpy(got, upg_test_code(r->code));
+    upg_test_check(what, r->code == want, "%s, expected %s", got,
+            upg_test_code(want));
+}
+
+/* Block num of the image in blocks of 2^(szx+4) bytes, wanting code */
+static void
+upg_test_block(uint32_t num, uint8_t szx, uint8_t want)
+{
+    uint32_t size = 1 << (szx + 4), offs = num * size;
+    uint32_t n = min(size, (uint32_t)UPG_TEST_IMG_LEN - offs);
+    int32_t v = (num << 4) | (offs + n < UPG_TEST_IMG_LEN ? 0x08 : 0) | szx;
+    struct upg_test_rsp r;
+    char what[48];
+
+    snprintf(what, sizeof(what), "block %lu of %lu bytes",
+            (unsigned long)num, (unsigned long)size);
+    upg_test_put(what, NULL, v, uimg + offs, n, want, &r);
+    if (COAP_CLASS(want) == 2) {
+        upg_test_check(what, r.block1 == v, "Block1 %ld, sent %ld",
+                (long)r.block1, (long)v);
+    }
+}
+
+/* ?st=init for the test image, with its CRC off by crc_err */
+static void
+upg_test_init(const char *what, uint16_t crc_err)
+{
+    coap_sys_upg_img_info_t ii;
+
+    memset(&ii, 0, sizeof(ii));
+    ii.tl.u.rdt = crdt_upg_img_info_sys;
+    ii.tl.l = sizeof(ii) - sizeof(coap_sens_tl_t);
+    ii.ver.major = 1;
+    ii.ver.minor = 1;
+    ii.ver.revision = htons(0);
+    ii.img_crc = htons(crc_xmodem(crc_xmodem_init(), uimg, sizeof(uimg)) ^
+            crc_err);
+    ii.img_len = htonl(sizeof(uimg));
+    upg_test_put(what, "st=init", -1, &ii, sizeof(ii), COAP_RSP_204_CHANGED,
+            NULL);
+}
+
+/* GET ?info=sts, checking the state and expected_offset */
+static void
+upg_test_state(const char *what, coap_upgrade_state_t state, uint32_t off)
+{
+    struct upg_test_rsp r;
+    coap_sys_upg_state_t st;
+
+    upg_test_req(COAP_REQUEST_GET, "info=sts", -1, NULL, 0, &r);
+    if (r.code != COAP_RSP_205_CONTENT || r.plen != sizeof(st)) {
+        upg_test_check(what, 0, "?info=sts %s, %d bytes",
+                upg_test_code(r.code), r.plen);
+        return;
+    }
+    memcpy(&st, r.payload, sizeof(st));
+    upg_test_check(what, st.state == state && ntohl(st.expected_offset) == off,
+            "state %d at %lu, expected %d at %lu", st.state,
+            (unsigned long)ntohl(st.expected_offset), state,
+            (unsigned long)off);
+}
+
+/* Compare the staged image in upg_flash.bin to the one sent */
+static void
+upg_test_flash(const char *what)
+{
+    uint8_t b[UPG_TEST_IMG_LEN];
+    FILE *fp;
+    size_t n = 0;
+
+    if ((fp = fopen(UPG_FLASH_FILE, "rb"))) {
+        n = fread(b, 1, sizeof(b), fp);
+        fclose(fp);
+    }
+    upg_test_check(what, n == sizeof(b) && !memcmp(b, uimg, sizeof(b)),
+            "%lu bytes of %s %s the image", (unsigned long)n, UPG_FLASH_FILE,
+            n == sizeof(b) && !memcmp(b, uimg, sizeof(b)) ? "match" :
+            "don't match");
+}
+
+/*
+ * Clear bits of byte offs of the staged image, as a bad write would. Through
+ * upg_flash_write_page(), the file is kept open and buffered by upg_flash.cpp.
+ */
+static void
+upg_test_corrupt(uint32_t offs)
+{
+    uint8_t page[UPG_FLASH_PAGE_SIZE];
+
+    memset(page, 0xFF, sizeof(page));
+    page[offs & (UPG_FLASH_PAGE_SIZE - 1)] = 0x0F;
+    if (upg_flash_write_page(offs & ~(UPG_FLASH_PAGE_SIZE - 1), page) !=
+            ERR_OK) {
+        printf("Can't change %s\n", UPG_FLASH_FILE);
+        exit(1);
+    }
+}
+
+/* The activation record row is still erased, or not there at all */
+static void
+upg_test_no_rec(const char *what)
+{
+    uint8_t b[UPG_FLASH_ROW_SIZE];
+    FILE *fp;
+    size_t n = 0, i;
+
+    if ((fp = fopen(UPG_FLASH_FILE, "rb"))) {
+        if (!fseek(fp, UPG_FLASH_REC_OFFS, SEEK_SET)) {
+            n = fread(b, 1, sizeof(b), fp);
+        }
+        fclose(fp);
+    }
+    for (i = 0; i < n && b[i] == 0xFF; i++)
+        ;
+    upg_test_check(what, i == n, "activation record %s",
+            i == n ? "not written" : "written");
+}
+
+static void
+upg_test_run(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(uimg); i++) {
+        uimg[i] = (i * 7 + (i >> 8)) ^ 0x5A;
+    }
+
+    /* Block1 in 128 byte blocks, SZX 3 */
+    upg_test_init("init", 0);
+    upg_test_state("after init", cust_init_passed, 0);
+    upg_test_block(0, 3, COAP_RSP_231_CONTINUE);
+    upg_test_block(1, 3, COAP_RSP_231_CONTINUE);
+    upg_test_block(1, 3, COAP_RSP_231_CONTINUE);       /* retransmitted */
+    upg_test_block(2, 3, COAP_RSP_231_CONTINUE);
+    upg_test_put("block of 256 bytes", NULL, (3 << 4) | 0x08 | 4, uimg, 16,
+            COAP_RSP_413_REQ_TOO_LARGE, NULL);
+    upg_test_block(4, 3, COAP_RSP_408_REQ_INCOMPLETE); /* skips block 3 */
+    upg_test_state("after the gap", cust_init_passed, 384);
+
+    /* The link drops; the client starts over with the same image */
+    upg_test_init("init again", 0);
+    upg_test_state("resume", cust_init_passed, 384);
+
+    /* and sends the rest in 64 byte blocks, SZX 2, from block 384 / 64 */
+    for (i = 6; i * 64 < sizeof(uimg); i++) {
+        upg_test_block(i, 2, (i + 1) * 64 < sizeof(uimg) ?
+                COAP_RSP_231_CONTINUE : COAP_RSP_204_CHANGED);
+    }
+    upg_test_state("received", cust_txr_passed, sizeof(uimg));
+    upg_test_flash("staged");
+
+    upg_test_put("verify", "st=verify", -1, NULL, 0, COAP_RSP_204_CHANGED,
+            NULL);
+    upg_test_state("verified", cust_verify_passed, sizeof(uimg));
+
+#if defined(UPG_HAVE_BOOTLOADER)
+    upg_test_put("activate", "st=activate", -1, NULL, 0,
+            COAP_RSP_204_CHANGED, NULL);
+#else
+    upg_test_put("activate", "st=activate", -1, NULL, 0,
+            COAP_RSP_501_NOT_IMPLEMENTED, NULL);
+    upg_test_state("not activated", cust_verify_passed, sizeof(uimg));
+    upg_test_no_rec("not activated");
+
+    /* The flash no longer holds what was sent */
+    upg_test_corrupt(UPG_TEST_IMG_LEN / 2);
+    upg_test_put("verify a changed image", "st=verify", -1, NULL, 0,
+            COAP_RSP_406_NOT_ACCEPTABLE, NULL);
+    upg_test_state("verify failed", cust_verify_failed, sizeof(uimg));
+#endif
+
+    /* An image that doesn't match the CRC of its info */
+    upg_test_init("init, CRC off by one bit", 1);
+    upg_test_state("restarted", cust_init_passed, 0);
+    for (i = 0; i * 128 < sizeof(uimg); i++) {
+        upg_test_block(i, 3, (i + 1) * 128 < sizeof(uimg) ?
+                COAP_RSP_231_CONTINUE : COAP_RSP_406_NOT_ACCEPTABLE);
+    }
+    upg_test_state("CRC mismatch", cust_txr_failed, sizeof(uimg));
+    upg_test_put("verify the bad image", "st=verify", -1, NULL, 0,
+            COAP_RSP_412_PRE_FAILED, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v': uverbose = 1;                                 break;
+        default:
+            fprintf(stderr, "usage: upg_test [-v]\n");
+            return 2;
+        }
+    }
+
+    /* Start from erased flash */
+    if (unlink(UPG_FLASH_FILE) && errno != ENOENT) {
+        fprintf(stderr, "Can't remove %s: %s\n", UPG_FLASH_FILE,
+                strerror(errno));
+        return 1;
+    }
+    /* The server's console and log are stderr, only wanted with -v */
+    if (!uverbose && !freopen("/dev/null", "w", stderr)) {
+        return 1;
+    }
+
+    /* As hdlcs_open() and coap_s_init() would */
+    set_mbuf_data_size(MNIC_MAX_PAYLOAD_SIZE);
+    coap_registry_init();
+
+    upg_test_run();
+    printf("%d checks, %s\n", nstep, nfail ? "failed" : "passed");
+    return nfail ? 1 : 0;
+}